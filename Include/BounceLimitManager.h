@@ -7,11 +7,10 @@ class Scene; // forward declaration
 class BounceLimitManager {
 private:
     KeyEventObserver observer;
-    unsigned int& shaderProgramId;
     Scene& scene;
 
     void OnEvent(const KeyEvent& event);
 
 public:
-    BounceLimitManager(Scene& scene, unsigned int& shaderProgramId);
+    BounceLimitManager(Scene& scene);
 };
\ No newline at end of file
@@ -2,33 +2,102 @@
 
 #include "Math3D.h"
 #include "Tri.h"
+#include "ThreadPool.h"
 #include <vector>
 #include <algorithm>
 #include <limits.h>
 #include <cfloat>
 #include <chrono>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 
 class BoundingBox {
 public:
     Vector3f maxi;
     Vector3f mini;
+    int leftChildIndex;
     int rightChildIndex;
     int triangleStartIndex;  // start index of triangles for leaf nodes
     int triangleCount;       // number of triangles for leaf nodes
+    int splitAxis;           // axis the children of interior nodes were split on, the left child is on the lower side
 
     BoundingBox()
-    : maxi(Vector3f(0,0,0)), mini(Vector3f(0,0,0)), rightChildIndex(0), triangleStartIndex(0), triangleCount(0)
+    : maxi(Vector3f(0,0,0)), mini(Vector3f(0,0,0)), leftChildIndex(0), rightChildIndex(0), triangleStartIndex(0), triangleCount(0), splitAxis(-1)
     {}
 
     BoundingBox(Vector3f maxi, Vector3f mini, int rightChildIndex = -1, int triangleStartIndex = -1, int triangleCount = 0)
-    : maxi(maxi), mini(mini), rightChildIndex(rightChildIndex), triangleStartIndex(triangleStartIndex), triangleCount(triangleCount) {
+    : maxi(maxi), mini(mini), leftChildIndex(-1), rightChildIndex(rightChildIndex), triangleStartIndex(triangleStartIndex), triangleCount(triangleCount), splitAxis(-1) {
     }
 
     // Helper methods to check node type
     bool IsLeaf() const { return triangleCount > 0; }
 };
 
+// std430 layout of one node in the B_BoundingBoxes shader storage buffer (32 bytes, two nodes per cache line)
+struct FlatBoundingBox {
+    float maxi[3];
+    int triangleCount; // > 0 for leaves, -(split axis + 1) for interior nodes
+    float mini[3];
+    int index;         // leaf: first triangle, interior: left child, the right child is always index + 1
+};
+
+// memory order of the nodes handed out by BuildTree, siblings always sit next to each other
+enum class BvhLayout {
+    DEPTH_FIRST,   // sibling pairs in pre-order, left subtree first
+    HOT_FIRST,     // sibling pairs in pre-order, the subtree with the larger surface area (more likely hit) first
+    VAN_EMDE_BOAS  // sibling pairs in recursively blocked subtrees of half the height
+};
+
+// how BuildTree chooses the splits
+enum class BvhBuilder {
+    SAH,   // surface area heuristic over a set of candidate planes, slow to build and fast to trace
+    MORTON // cuts ranges of triangles sorted by the morton code of their centroid, builds in a fraction of the time
+};
+
+// parts of the tree an Insert or Remove changed, so only those are written to the GPU buffers again
+struct BvhUpdate {
+    bool rebuilt = false;                          // the tree was rebuilt from scratch and has to be uploaded whole
+    std::vector<int> nodes;                        // nodes whose contents or parent changed
+    std::vector<std::pair<int, int>> triangles;    // [first, last) ranges of triangles
+    std::vector<std::pair<int, int>> references;   // [first, last) ranges of triangle references
+};
+
+// quality measures of a tree, areas are relative to the surface area of the root box so different scenes compare
+struct BvhQualityReport {
+    std::string builder;
+    long long buildMilliseconds = 0;
+    int leafTriangles = 0;               // ranges of at most this many triangles always become leaves
+    bool sahTermination = false;
+    int nodeCount = 0;
+    int leafCount = 0;
+    int triangleCount = 0;
+    int referenceCount = 0;              // triangle slots over all leaves, more than triangleCount after pre-splitting
+    int maxDepth = 0;
+    float averageLeafDepth = 0;
+    float expectedNodeTests = 0;         // per random ray entering the root box
+    float expectedTriangleTests = 0;
+    float sahCost = 0;                   // SAH_TRAVERSAL_COST * expectedNodeTests + SAH_INTERSECTION_COST * expectedTriangleTests
+    float siblingOverlapArea = 0;        // summed surface area of the intersection of every pair of siblings
+    std::vector<int> leafSizeHistogram;  // [n] = number of leaves holding n triangles
+    std::vector<int> depthHistogram;     // [d] = number of leaves at depth d, the root is at depth 1
+
+    std::string ToJson() const;
+};
+
+#define SAH_TRAVERSAL_COST 1.0f
+#define SAH_INTERSECTION_COST 1.0f
 #define DEFAULT_LEAF_TRIANGLES 3
+#define MAX_SAH_LEAF_TRIANGLES 16 // SAH termination never makes a leaf with more triangles than this
+#define AUTO_TUNE_SAMPLE_TRIANGLES 50000
+#define MORTON_BITS_PER_AXIS 10
+#define MAX_PRESPLIT_DEPTH 6 // a triangle is split into at most 2^6 references
+#define PRESPLIT_MIN_LOOSENESS 4.0f // only split triangles whose box surface area is this many times their two sided area
+#define FREED_NODE -2
+#define FREED_TRIANGLE -1 // materialsIndex of the triangles Remove took out, until Insert puts another one in their place
+#define MAX_BVH_DEPTH 64 // every leaf is at most this deep (root = 1), the shader's MAX_STACK_SIZE relies on it
+#define PARALLEL_SAH_MIN_TRIANGLES 16384 // smaller sah builds stay on the calling thread, starting the pool costs more
+#define PARALLEL_SAH_TASKS_PER_THREAD 4 // subtrees per build thread, the sah splits are uneven so the pool has to balance them
 /**
  * bounding volume heirachy tree that takes in a list of vectors belonging to some object and outputs the 
  */
@@ -38,9 +107,13 @@ private:
     std::vector<BoundingBox> boundingBoxes;
     std::vector<Tri> triangles;
     int maxDepth;
-    int maxTrianglesPerLeaf; // configurable threshold for when to stop subdividing
     unsigned long int numberOfsplitsTotal;
     unsigned long int numberOfDegenerateSplits;
+    unsigned long int numberOfDepthLimitedSplits;
+    int maxTrianglesPerLeaf; // configurable threshold for when to stop subdividing
+    bool sahTermination;     // also stop above maxTrianglesPerLeaf when a leaf costs less than the split the builder picked
+    float traversalCost;
+    float intersectionCost;
 
     enum Dimension {
         x = 0,
@@ -52,13 +125,17 @@ private:
 
     std::pair<Dimension, float> SplitLongestDimension(const BoundingBox& box);
 
-    float SurfaceArea(const Vector3f& extent);
+    float SurfaceArea(const Vector3f& extent) const;
 
     float SurfaceAreaScoreOfSplit(std::vector<Tri>::iterator l, std::vector<Tri>::iterator r, std::vector<Tri>::iterator midIdx);
+
+    // the score of SurfaceAreaScoreOfSplit for the partition by splitValue, in one pass over the range that leaves it in place
+    float SurfaceAreaScoreOfPlane(std::vector<Tri>::iterator l, std::vector<Tri>::iterator r, Dimension splitDimension, float splitValue, long& countL);
     
-    std::pair<Dimension, float> SplitBest(std::vector<Tri>::iterator l, std::vector<Tri>::iterator r, const BoundingBox& box);
+    // pool scores the candidate planes on several threads, for the large ranges at the top of a parallel build
+    std::pair<Dimension, float> SplitBest(std::vector<Tri>::iterator l, std::vector<Tri>::iterator r, const BoundingBox& box, ThreadPool* pool = nullptr);
 
-    std::pair<Vector3f, Vector3f> GetBoundingBoxOfRange(std::vector<Tri>::iterator l, std::vector<Tri>::iterator r);
+    AABB GetBoundingBoxOfRange(std::vector<Tri>::iterator l, std::vector<Tri>::iterator r);
 
     std::vector<Tri>::iterator PartitionRange(std::vector<Tri>::iterator lIter, std::vector<Tri>::iterator rIter, Dimension splitDimension, float splitValue);
 
@@ -66,12 +143,126 @@ private:
     // returns the index of the box made in the boxes container, for the current level it is equal to the size - 1 before left and right have been explored (because they add more child boxes)
     unsigned int leafDepthSum;
     unsigned int leafNodescount;
+
+    // levels a subtree over triangleCount triangles needs when every split is an object median
+    int BalancedDepth(long triangleCount) const;
     
-    int MakeBox(std::vector<Tri>::iterator l, std::vector<Tri>::iterator r, int currDepth = 1);
+    // a range MakeBox left to MakeBoxParallel, its node is a placeholder for the root of the subtree built over it
+    struct DeferredRange {
+        int node;
+        std::vector<Tri>::iterator l;
+        std::vector<Tri>::iterator r;
+        int depth;
+    };
+
+    struct ParallelBuild {
+        ThreadPool& pool;
+        long grain; // ranges of at most this many triangles are deferred
+        std::vector<DeferredRange> deferred;
+    };
+
+    // with parallel set, ranges of at most its grain are only given a placeholder node and deferred
+    int MakeBox(std::vector<Tri>::iterator l, std::vector<Tri>::iterator r, int currDepth = 1, ParallelBuild* parallel = nullptr);
+
+    // MakeBox over all triangles where the pool of buildThreads threads scores the split planes at the top of the tree
+    // and then builds the subtrees below it, each over its own copy of its range, which are spliced into boundingBoxes.
+    // The splits only depend on the triangles so the tree is the same as the one MakeBox builds alone
+    void MakeBoxParallel();
+
+    void MakeLeaf(int index, std::vector<Tri>::iterator l, std::vector<Tri>::iterator r, int currDepth);
+
+    BvhLayout layout;
+    BvhBuilder builder;
+
+    // morton code of every triangle centroid, kept in the same order as triangles while the morton tree is built
+    std::vector<unsigned int> mortonCodes;
+
+    // sorts the triangles along the morton curve of the scene bounds
+    void SortByMortonCode();
+
+    // same contract as MakeBox for a morton sorted range [first, last), each node splits on the highest differing bit
+    int MakeMortonBox(int first, int last, int currDepth = 1);
+
+    // order in which the sibling pairs are stored, each pair is named by the index of its parent
+    void OrderPairsDepthFirst(int parent, bool hotFirst, std::vector<int>& pairOrder);
+
+    int PairHeight(int parent, std::vector<int>& heights);
+
+    void GatherPairsAtDepth(int parent, int depth, std::vector<int>& pairs);
+
+    void OrderPairsVanEmdeBoas(int parent, int height, std::vector<int>& heights, std::vector<int>& pairOrder);
+
+    // rewrites boundingBoxes and triangles from build order into the selected layout
+    void ApplyLayout();
+
+    float preSplitFraction;
+    unsigned long int numberOfSourceTriangles;
+    std::vector<int> triangleReferences;
+
+    // early split clipping: replaces triangles whose bounds exceed preSplitFraction of the scene surface area with
+    // several references clipped to halves of their bounds, each reference still names its source triangle
+    void PreSplit();
+
+    void SplitReference(const Tri& source, const std::vector<Vector3f>& polygon, float maxArea, int depthLeft, std::vector<Tri>& references);
+
+    // collapses the references back onto one copy of each triangle and records which triangle each leaf slot uses
+    void ResolveReferences();
+
+    long long lastBuildMilliseconds;
+
+    bool verbose; // print the build statistics
+
+    int depthLimit; // MAX_BVH_DEPTH unless the tree becomes a subtree of a deeper one
+
+    unsigned int buildThreads; // threads of the sah build, 0 for every hardware thread
+
+    // bookkeeping for Insert and Remove, filled by the first of them after a build
+    bool updatesPrepared;
+    std::vector<int> parentIndex;  // -1 for the root, FREED_NODE for nodes of pairs in freePairs
+    std::vector<int> nodeHeights;  // 1 for leaves
+    std::unordered_map<int, std::unordered_set<int>> leavesOfObject; // materials index -> leaves holding its triangles
+    std::vector<int> freePairs;    // first index of sibling pairs that were taken out of the tree
+    std::vector<std::pair<int, int>> freeSlots; // [first, last) ranges of leaf slots no leaf uses, sorted and disjoint
+    std::vector<int> freeTriangles; // with references, triangles no slot references any more
+
+    void PrepareForUpdates();
+
+    int ComputeHeight(int node);
+
+    // triangle stored in a leaf slot, slots are references when the tree was pre-split
+    int SlotTriangle(int slot) const {
+        return triangleReferences.empty() ? slot : triangleReferences[slot];
+    }
+
+    void SwapSlots(int a, int b);
+
+    int AllocatePair();
+
+    // first of count consecutive free slots, taken out of freeSlots, or -1 when no range is long enough
+    int AllocateSlots(int count);
+
+    void ReleaseSlots(int first, int last);
+
+    int FreeSlotCount() const;
+
+    // copies node from into the slot to, which keeps its parent
+    void MoveNode(int from, int to, BvhUpdate& update);
+
+    // recomputes bounds and heights from node up to the root
+    void Refit(int node, BvhUpdate& update);
+
+    // branch and bound search for the node that grows the tree's surface area the least when given box as a sibling,
+    // -1 when every placement would go deeper than the depth limit
+    int FindInsertionSibling(const BoundingBox& box, int height);
+
+    // triangles still reachable from the root, without the ones Remove left behind
+    std::vector<Tri> LiveTriangles();
+
+    void Rebuild(std::vector<Tri> newTriangles, BvhUpdate& update);
 
 public:
-    BvhTree() : maxDepth(0), numberOfsplitsTotal(0), numberOfDegenerateSplits(0), maxTrianglesPerLeaf(DEFAULT_LEAF_TRIANGLES) {}
-    BvhTree(std::vector<Tri> triangles, int maxTrianglesPerLeaf=DEFAULT_LEAF_TRIANGLES) : triangles(std::move(triangles)), maxDepth(0), numberOfsplitsTotal(0), numberOfDegenerateSplits(0), maxTrianglesPerLeaf(maxTrianglesPerLeaf) {}
+    BvhTree() : maxDepth(0), numberOfsplitsTotal(0), numberOfDegenerateSplits(0), numberOfDepthLimitedSplits(0), maxTrianglesPerLeaf(DEFAULT_LEAF_TRIANGLES), sahTermination(false), traversalCost(SAH_TRAVERSAL_COST), intersectionCost(SAH_INTERSECTION_COST), layout(BvhLayout::DEPTH_FIRST), builder(BvhBuilder::SAH), preSplitFraction(0), numberOfSourceTriangles(0), lastBuildMilliseconds(0), verbose(true), depthLimit(MAX_BVH_DEPTH), buildThreads(0), updatesPrepared(false) {}
+    BvhTree(std::vector<Tri> triangles, int maxTrianglesPerLeaf=DEFAULT_LEAF_TRIANGLES) : triangles(std::move(triangles)), maxDepth(0), numberOfsplitsTotal(0), numberOfDegenerateSplits(0), numberOfDepthLimitedSplits(0), maxTrianglesPerLeaf(maxTrianglesPerLeaf), sahTermination(false), traversalCost(SAH_TRAVERSAL_COST), intersectionCost(SAH_INTERSECTION_COST), layout(BvhLayout::DEPTH_FIRST), builder(BvhBuilder::SAH), preSplitFraction(0), numberOfSourceTriangles(0), lastBuildMilliseconds(0), verbose(true), depthLimit(MAX_BVH_DEPTH), buildThreads(0), updatesPrepared(false) {}
 
     void SetTriangles(std::vector<Tri> newTriangles);
 
@@ -79,5 +270,86 @@ public:
         return maxTrianglesPerLeaf;
     }
 
+    void SetMaxTrianglesPerLeaf(int triangleCount) {
+        maxTrianglesPerLeaf = std::max(triangleCount, 1);
+    }
+
+    void SetSahTermination(bool enabled) {
+        sahTermination = enabled;
+    }
+
+    // relative cost of testing a ray against a node and against a triangle, used by SAH termination and the reports
+    void SetCosts(float traversal, float intersection) {
+        traversalCost = traversal;
+        intersectionCost = intersection;
+    }
+
+    // builds trees over an evenly strided sample of the triangles for several leaf sizes, with and without SAH
+    // termination, and keeps the configuration whose tree has the lowest SAH cost
+    void AutoTune(int sampleSize = AUTO_TUNE_SAMPLE_TRIANGLES);
+
+    // depth of the deepest leaf of the last build, never more than the depth limit
+    int GetMaxDepth() const {
+        return maxDepth;
+    }
+
+    // for trees that are hung below other nodes, so the whole tree still fits MAX_BVH_DEPTH
+    void SetDepthLimit(int limit) {
+        depthLimit = std::clamp(limit, 1, MAX_BVH_DEPTH);
+    }
+
+    void SetVerbose(bool enabled) {
+        verbose = enabled;
+    }
+
+    // 0 uses every hardware thread, builds under PARALLEL_SAH_MIN_TRIANGLES always run on the calling thread
+    void SetBuildThreads(unsigned int threadCount) {
+        buildThreads = threadCount;
+    }
+
+    void SetLayout(BvhLayout newLayout) {
+        layout = newLayout;
+    }
+
+    void SetBuilder(BvhBuilder newBuilder) {
+        builder = newBuilder;
+    }
+
+    // 0 disables pre-splitting
+    void SetPreSplitFraction(float fraction) {
+        preSplitFraction = fraction;
+    }
+
+    // with pre-splitting the leaves index into these and each entry is an index into the triangles returned by BuildTree,
+    // empty when nothing was pre-split and the leaves index the triangles directly
+    const std::vector<int>& GetTriangleReferences() const {
+        return triangleReferences;
+    }
+
+    // measures the tree as it is now, including the changes of Insert and Remove
+    BvhQualityReport GetQualityReport() const;
+
+    const std::vector<BoundingBox>& GetBoundingBoxes() const {
+        return boundingBoxes;
+    }
+
+    const std::vector<Tri>& GetTriangles() const {
+        return triangles;
+    }
+
+    // parent of a node once Insert or Remove has been used, -1 for the root
+    int GetParentIndex(int node) const {
+        return parentIndex[node];
+    }
+
+    // adds the triangles of one object by building a tree over them and hanging it under the node where it adds the
+    // least surface area, only the nodes on the way to the root are refitted
+    BvhUpdate Insert(std::vector<Tri> newTriangles);
+
+    // takes the triangles with this materials index out of their leaves, empty leaves are replaced by their sibling.
+    // The slots and triangles they used are marked FREED_TRIANGLE and reused by the next Insert that fits
+    BvhUpdate Remove(int materialsIndex);
+
+    // the returned nodes hold the root at 0, an unused node at 1 and sibling pairs from 2 onwards so every pair shares a cache line
     std::pair<std::vector<BoundingBox>, std::vector<Tri>> BuildTree();
 };
\ No newline at end of file
@@ -63,5 +63,6 @@ public:
     
     void Tick(float cameraSpeed = 0.2, float rotationSpeed = 0.02f);
     
+    // writes the camera to the tracer now instead of at the next Scene::Tick
     void UploadInfo();
 };
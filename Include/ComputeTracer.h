@@ -0,0 +1,64 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#define TRACER_TILE_SIZE 8 // local size of the compute main of Fragment.glsl, every work group traces one tile
+#define TILE_SAMPLES_BINDING 6 // the gpu builder uses it too while it builds, so it is bound again before every dispatch
+#define ACCUMULATION_IMAGE_UNIT 0
+
+// pixels of the frame a dispatch traces, x and y count from the bottom left like GL
+struct TraceRect {
+    unsigned int x;
+    unsigned int y;
+    unsigned int width;
+    unsigned int height;
+};
+
+/**
+ * Fragment.glsl compiled as a compute shader with COMPUTE_TRACER. The frame is traced in TRACER_TILE_SIZE square tiles
+ * that load and store the accumulation texture as an rgba32f image, instead of drawing a quad into a framebuffer whose
+ * own texture the shader samples. That lets a dispatch cover only part of the frame and give every tile its own
+ * sample count: the image keeps the sample count of every pixel in alpha and blends new samples by it.
+ * The program takes the place of the fragment program, so the Scene sets the same uniforms on it
+ */
+class ComputeTracer {
+private:
+    GLuint program;
+    GLint traceRectLocation;
+    GLint tileSamplesLocation;
+    GLuint tileSamplesBuffer;
+    size_t tileSamplesCapacity; // counts the buffer holds
+    GLuint target;
+
+    void Dispatch(const TraceRect& rect, uint32_t samples);
+
+public:
+    // shaderDefines are the ones of RenderSettings::ShaderDefines, COMPUTE_TRACER is added to them
+    ComputeTracer(const std::string& tracerShaderPath, const std::vector<std::string>& shaderDefines);
+    ~ComputeTracer();
+
+    ComputeTracer(const ComputeTracer&) = delete;
+    ComputeTracer& operator=(const ComputeTracer&) = delete;
+
+    GLuint GetProgramId() const {
+        return program;
+    }
+
+    // the GL_RGBA32F texture the dispatches accumulate into
+    void SetTarget(GLuint texture);
+
+    // tiles along each side of rect
+    static unsigned int TilesAcross(unsigned int pixels) {
+        return (pixels + TRACER_TILE_SIZE - 1) / TRACER_TILE_SIZE;
+    }
+
+    // traces samples rays through every pixel of rect, at frame index 0 the pixels drop what they accumulated before
+    void Trace(const TraceRect& rect, uint32_t samples = 1);
+
+    // traces tileSamples[ty * TilesAcross(rect.width) + tx] rays through every pixel of each tile of rect, tiles
+    // counted from its bottom left. Tiles given 0 keep their pixels as they are
+    void Trace(const TraceRect& rect, const std::vector<uint32_t>& tileSamples);
+};
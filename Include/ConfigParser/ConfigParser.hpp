@@ -38,6 +38,7 @@ class ConfigParser {
     T aConfig(std::string section, std::string name, size_t pos = 0);
     template<typename T>
     std::vector<T> aConfigVec(std::string section, std::string name);
+    bool hasConfig(std::string section, std::string name) const;
 
   private:
 
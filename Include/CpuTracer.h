@@ -0,0 +1,149 @@
+#pragma once
+
+#include "Math3D.h"
+#include "Materials.h"
+#include "BvhTree.h"
+#include "RenderSettings.h"
+#include "ThreadPool.h"
+#include "WideBvh.h"
+#include "LightList.h"
+
+#include <vector>
+#include <array>
+#include <memory>
+#include <string>
+#include <cstdint>
+
+struct FrameConstants;
+
+// what the CPU tracer reads of the scene while a frame traces, all of it stays owned by the Scene
+struct CpuTracerScene {
+    const BvhTree& tree;
+    const BvhTree* proxyTree; // nullptr without proxies
+    const std::vector<float>& proxySkinDistances; // by object id, how far the proxy of each object may lie from it
+    const std::vector<std::unique_ptr<Material::Material>>& materials; // by object id, the materials index of every Tri
+    const std::vector<uint32_t>* objectVisibility; // RAY_* bits by object id, nullptr unless VisibilityMasks is on
+    const LightList& lights; // the emitting triangles of tree the diffuse and glossy bounces sample
+    uint64_t version; // changes whenever one of the trees or the visibility does
+};
+
+/**
+ * path tracer running RayColour of Fragment.glsl on the CPU over the tree BvhTree built, for machines without a GPU.
+ * The frame is cut into tiles that the threads of a work stealing pool trace, and every frame is blended into a float
+ * image the way the shader blends into u_Accumulation, so both converge to the same picture. Random numbers come from
+ * the same hashes and lookups into the u_RgbNoise texture, which is why the noise and skybox images are loaded here a
+ * second time. Unless CpuSimd is off the rays traverse eight wide copies of the trees, camera rays in packets of neighbouring pixels
+ */
+class CpuTracer {
+private:
+    struct Ray {
+        Vector3f origin;
+        Vector3f direction;
+        Vector3f invDirection;
+    };
+
+    struct HitRecord {
+        Vector3f hitPoint;
+        Vector3f normal;
+        float t;
+        bool frontFace;
+        bool hitAnything;
+        int index;
+        int objectId;
+    };
+
+    // an image as the shader samples it, texels in [0, 1] with rows in the order they were uploaded
+    struct Texture {
+        int width = 0;
+        int height = 0;
+        std::vector<float> rgb;
+
+        bool Load(const std::string& path);
+
+        Vector3f Texel(int x, int y) const;
+    };
+
+    RenderSettings settings;
+    ThreadPool pool;
+    SimdLevel simdLevel; // settings.cpuSimd lowered to what the CPU supports
+    WideBvh wideTree; // eight wide copies of the scene trees for the SIMD kernels
+    WideBvh wideProxyTree;
+    uint64_t wideVersion; // CpuTracerScene::version the wide trees were built from
+    unsigned int width;
+    unsigned int height;
+    std::vector<float> image; // RGBA, bottom row first like the accumulation texture
+    std::array<Texture, 6> skybox; // GL order: +x, -x, +y, -y, +z, -z
+    Texture noise; // u_RgbNoise, sampled like a GL_LINEAR texture with GL_REPEAT
+
+    static Ray MakeRay(const Vector3f& origin, const Vector3f& direction);
+
+    // whether the ray enters box before tLimit
+    static bool EntersBox(const BoundingBox& box, const Ray& ray, float tLimit);
+
+    // closest hit below the root of tree, iterations counts the node visits for the traversal cost view
+    bool HitHittableList(const CpuTracerScene& scene, const BvhTree& tree, const Ray& ray, uint32_t rayType, HitRecord& hitRecord, int& iterations) const;
+
+    void HitLeaf(const CpuTracerScene& scene, const BvhTree& tree, const BoundingBox& leaf, const Ray& ray, uint32_t rayType, HitRecord& hitRecord) const;
+
+    // fills hitRecord from the triangle index and distance the SIMD kernels report
+    static void CompleteHit(const BvhTree& tree, const Ray& ray, int index, float t, HitRecord& hitRecord);
+
+    // HitHittableList through the wide copy of tree
+    bool HitWide(const CpuTracerScene& scene, const BvhTree& tree, const Ray& ray, uint32_t rayType, HitRecord& hitRecord) const;
+
+    // any hit query of the scene tree for shadow rays, whether an object visible to them lies nearer than tMax
+    bool Occluded(const CpuTracerScene& scene, const Ray& ray, float tMax) const;
+
+    // next event estimation at a diffuse or glossy bounce as SampleDirectLight of the shader, false when the sample adds
+    // nothing
+    static bool SampleDirectLight(const CpuTracerScene& scene, const HitRecord& hitRecord, float roughness, const Vector3f& incoming, bool diffuse, uint32_t state, Ray& shadowRay, float& tMax, Vector3f& radiance);
+
+    // balance heuristic weight of a light the ray of a bounce found by itself, as EmissionWeight of the shader
+    static float EmissionWeight(const CpuTracerScene& scene, const BvhTree& tree, float lobePdf, const Ray& ray, const HitRecord& hitRecord);
+
+    // bilinear lookup of the cube map with GL's face selection and edge clamping
+    Vector3f SampleSkybox(const Vector3f& direction) const;
+
+    // texture(u_RgbNoise, uv), black while no noise texture is loaded as an incomplete GL texture would be
+    Vector3f SampleNoise(float u, float v) const;
+
+    // primaryHit, when given, is the hit of the camera ray a packet already traced
+    Vector3f RayColour(const CpuTracerScene& scene, const FrameConstants& frame, Ray ray, const HitRecord* primaryHit = nullptr) const;
+
+    void TraceTile(const CpuTracerScene& scene, const FrameConstants& frame, size_t tile);
+
+public:
+    CpuTracer(const RenderSettings& settings);
+
+    // clears the image when the resolution changes
+    void SetResolution(unsigned int newWidth, unsigned int newHeight);
+
+    // reads the six faces main's LoadSkybox uploads from directory, false if one is missing
+    bool LoadSkybox(const std::string& directory);
+
+    // reads the image main's LoadNoiseTexture uploads as u_RgbNoise
+    bool LoadNoise(const std::string& path);
+
+    // traces one sample per pixel for the camera, seed and frame index of frame and blends it into the image
+    void Trace(const CpuTracerScene& scene, const FrameConstants& frame);
+
+    const std::vector<float>& GetImage() const {
+        return image;
+    }
+
+    unsigned int GetWidth() const {
+        return width;
+    }
+
+    unsigned int GetHeight() const {
+        return height;
+    }
+
+    size_t GetThreadCount() const {
+        return pool.GetThreadCount();
+    }
+
+    SimdLevel GetSimdLevel() const {
+        return simdLevel;
+    }
+};
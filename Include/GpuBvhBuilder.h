@@ -0,0 +1,57 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <string>
+#include <vector>
+
+#define BVH_BUILD_SHADER_PATH "./src/shaders/BvhBuild.comp"
+#define BVH_BUILD_WORKGROUP_SIZE 256 // local_size_x of every kernel in BvhBuild.comp
+#define BVH_BUILD_RADIX_BITS 4
+#define BVH_BUILD_KEY_BITS 32
+
+/**
+ * builds a morton BVH over the triangles bound at binding 0 with compute shaders (BvhBuild.comp), so a mesh that
+ * changes every frame never goes through the CPU. The nodes, the stackless links and the triangle references the
+ * leaves point into are written straight into buffers bound at 1, 2 and 3, where Fragment.glsl reads them.
+ * Needs a current GL 4.3 context, software implementations such as llvmpipe included.
+ */
+class GpuBvhBuilder {
+private:
+    enum Kernel {
+        BOUNDS,
+        MORTON,
+        RADIX_COUNT,
+        RADIX_SCAN,
+        RADIX_SCATTER,
+        EMIT,
+        BOTTOM_UP,
+        KERNEL_COUNT
+    };
+
+    GLuint programs[KERNEL_COUNT];
+    GLint countLocations[KERNEL_COUNT]; // u_Count and u_Shift of every program, looked up once so rebuilds make no string lookups
+    GLint shiftLocations[KERNEL_COUNT];
+    GLuint nodes;
+    GLuint links;
+    GLuint keys[2];
+    GLuint values[2]; // values[0] ends up holding the references the leaves index
+    GLuint scratch;
+    unsigned int capacity; // triangles the buffers are sized for
+
+    // grows every buffer to hold triangleCount triangles
+    void Reserve(unsigned int triangleCount);
+
+    void Dispatch(Kernel kernel, unsigned int invocations, unsigned int triangleCount, unsigned int shift = 0);
+
+public:
+    // the defines must be the ones the tracer shader is compiled with so both read the triangles the same way
+    GpuBvhBuilder(const std::vector<std::string>& shaderDefines);
+    ~GpuBvhBuilder();
+
+    GpuBvhBuilder(const GpuBvhBuilder&) = delete;
+    GpuBvhBuilder& operator=(const GpuBvhBuilder&) = delete;
+
+    // rebuilds the tree over the first triangleCount triangles bound at binding 0 and returns the node count, the
+    // tracer may read the nodes once the caller issued glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT)
+    unsigned int Build(unsigned int triangleCount);
+};
@@ -9,6 +9,7 @@ public:
     InfoPrinter(const Camera& camera) : 
         lastFpsCheck(std::chrono::steady_clock::now()),
         secFrameCount(0),
+        lastFps(0),
         camera(camera)
     {
     };
@@ -19,6 +20,7 @@ public:
         if (std::chrono::duration_cast<std::chrono::milliseconds>(now - lastFpsCheck).count() > 1000) {
             lastFpsCheck = now;
             unsigned int fps = secFrameCount;
+            lastFps = fps;
             std::cout << "fps: " << fps << ", ";
             secFrameCount = 0;
             
@@ -29,8 +31,12 @@ public:
         }
     }
 
+    // frames counted over the last whole second
+    unsigned int GetFps() const { return lastFps; }
+
 private:
     std::chrono::time_point<std::chrono::steady_clock> lastFpsCheck;
     unsigned int secFrameCount;
+    unsigned int lastFps;
     const Camera& camera;
 };
\ No newline at end of file
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "Math3D.h"
+#include "Tri.h"
+#include "WideBvh.h"
+
+#define RAY_EPSILON 0.0001f // the margin hits have to keep from the ray origin, as in the shader
+
+// axis order and shear that turn a ray into +z for the watertight triangle test, as MakeRay of Fragment.glsl sets them
+struct WatertightShear {
+    int kx, ky, kz;
+    float x, y, z;
+};
+
+WatertightShear MakeWatertightShear(const Vector3f& direction);
+
+// the ray tests of Fragment.glsl for one Tri of any Primitive, t and the normal facing away from the primitive are
+// only written on a hit. Triangles take the watertight test of that layout when watertight is set
+bool HitPrimitive(const Tri& primitive, const Vector3f& origin, const Vector3f& direction, const Vector3f& invDirection, float& t, Vector3f& outwardNormal,
+                  bool watertight = false);
+
+// the analytic primitives in the leaves of a WideBvh
+float DistanceToPrimitive(const Tri& primitive, const SimdRay& ray);
+
+// normal at the hit of a ray the SIMD kernels only reported the distance of, analytic primitives are hit again
+Vector3f OutwardNormalAt(const Tri& primitive, const Vector3f& origin, const Vector3f& direction, const Vector3f& invDirection);
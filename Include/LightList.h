@@ -0,0 +1,55 @@
+#pragma once
+
+#include "Math3D.h"
+#include "Tri.h"
+
+#include <vector>
+#include <functional>
+
+#define LIGHT_TEXELS 3 // RGBA32F texels of one light in u_Lights
+
+// one triangle of an emitting object, the vertices as a corner and the two edges leaving it
+struct EmissiveTriangle {
+    Vector3f v0;
+    Vector3f e1;
+    Vector3f e2;
+    int objectId;
+};
+
+/**
+ * the triangles of the objects that emit light, for next event estimation: a light is picked with a probability
+ * proportional to its area and a point uniformly on it, so every point of the emitting surface is equally likely and
+ * the pdf of a sample is one over the total area. Analytic primitives are left out, rays only find them by bouncing
+ */
+class LightList {
+private:
+    std::vector<EmissiveTriangle> triangles;
+    std::vector<float> cumulativeAreas; // area of the triangles up to and including each one
+    float area = 0.0f;
+
+public:
+    // keeps the triangles of sceneTriangles whose object emits light by emits, primitives and degenerate ones are skipped
+    void Build(const std::vector<Tri>& sceneTriangles, const std::function<bool(int objectId)>& emits);
+
+    bool Empty() const {
+        return triangles.empty();
+    }
+
+    size_t Size() const {
+        return triangles.size();
+    }
+
+    float GetArea() const {
+        return area;
+    }
+
+    const std::vector<EmissiveTriangle>& GetTriangles() const {
+        return triangles;
+    }
+
+    // the light u in [0, 1) lands on when the lights are laid end to end by area, the list must not be empty
+    const EmissiveTriangle& Pick(float u) const;
+
+    // LIGHT_TEXELS texels per light for u_Lights: (v0, cumulative area), (e1, object id), (e2, 0)
+    std::vector<float> Flatten() const;
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cmath>
+#include <cfloat>
 #include <iostream>
 
 struct Vector2f {
@@ -13,13 +14,10 @@ struct Vector2f {
         float g;
     };
 
-    Vector2f() {
-        x = 0.0f; y = 0.0f;
+    constexpr Vector2f() : x(0.0f), y(0.0f) {
     };
 
-    Vector2f(float _x, float _y) {
-        x = _x;
-        y = _y;
+    constexpr Vector2f(float _x, float _y) : x(_x), y(_y) {
     };
 };
 
@@ -37,14 +35,10 @@ struct Vector3f {
         float b;
     };
 
-    Vector3f() {
-        x = 0.0f; y = 0.0f; z = 0.0f;
+    constexpr Vector3f() : x(0.0f), y(0.0f), z(0.0f) {
     };
 
-    Vector3f(float _x, float _y, float _z) {
-        x = _x;
-        y = _y;
-        z = _z;
+    constexpr Vector3f(float _x, float _y, float _z) : x(_x), y(_y), z(_z) {
     };
 
     Vector3f Normalize() {
@@ -56,7 +50,7 @@ struct Vector3f {
         };
     };
 
-    Vector3f Cross(const Vector3f& v) const {
+    constexpr Vector3f Cross(const Vector3f& v) const {
         return Vector3f(
             y * v.z - z * v.y,
             z * v.x - x * v.z,
@@ -64,7 +58,7 @@ struct Vector3f {
         );
     };
 
-    Vector3f operator*(float f) const {
+    constexpr Vector3f operator*(float f) const {
         return Vector3f(
             x * f,
             y * f,
@@ -72,7 +66,7 @@ struct Vector3f {
         );
     };
 
-    Vector3f operator*(Vector3f v) const {
+    constexpr Vector3f operator*(Vector3f v) const {
         return Vector3f(
             x * v.x,
             y * v.y,
@@ -80,7 +74,7 @@ struct Vector3f {
         );
     };
 
-    Vector3f operator/(float div) const {
+    constexpr Vector3f operator/(float div) const {
         return Vector3f(
             x / div,
             y / div,
@@ -88,7 +82,7 @@ struct Vector3f {
         );
     };
 
-    Vector3f operator+(const Vector3f& v) const {
+    constexpr Vector3f operator+(const Vector3f& v) const {
         return Vector3f(
             x + v.x,
             y + v.y,
@@ -96,7 +90,7 @@ struct Vector3f {
         );
     };
 
-    Vector3f operator-(const Vector3f& v) const {
+    constexpr Vector3f operator-(const Vector3f& v) const {
         return Vector3f(
             x - v.x,
             y - v.y,
@@ -104,19 +98,29 @@ struct Vector3f {
         );
     };
 
-    float& operator[](int index) {
-        if(index == 0) return x;
-        if(index == 1) return y;
-        if(index == 2) return z;
-        std::cout << "illegal access of Vector3f at index " << index << std::endl;
-        std::abort();
+    // axis by number for the axis loops of the BVH builder, out of range indices give z. The switch compiles to
+    // selects or a jump table, indexing past &x would not be defined
+    constexpr float& operator[](int index) {
+        switch(index) {
+            case 0: return x;
+            case 1: return y;
+            default: return z;
+        }
+    }
+
+    constexpr const float& operator[](int index) const {
+        switch(index) {
+            case 0: return x;
+            case 1: return y;
+            default: return z;
+        }
     }
 
     float len() const {
         return sqrt(x*x + y*y + z*z);
     }
 
-    float Dot(const Vector3f& v) const {
+    constexpr float Dot(const Vector3f& v) const {
         return x*v.x + y*v.y + z*v.z;
     }
 
@@ -124,8 +128,101 @@ struct Vector3f {
         std::cout << "{" << x << ", " << y << ", " << z << "}" << std::endl;
     }
 
-    bool operator==(const Vector3f& v) const {
+    constexpr bool operator==(const Vector3f& v) const {
         return x==v.x && y==v.y && z==v.z;
     }
 };
 
+// four floats in one SSE or NEON register through the GCC vector extension, xyz of a point with w carried along unused
+struct alignas(16) Vec4 {
+    typedef float Lanes __attribute__((vector_size(4 * sizeof(float))));
+
+    Lanes v;
+
+    constexpr Vec4() : v{0.0f, 0.0f, 0.0f, 0.0f} {
+    }
+
+    constexpr Vec4(float x, float y, float z, float w = 0.0f) : v{x, y, z, w} {
+    }
+
+    constexpr explicit Vec4(const Vector3f& p, float w = 0.0f) : v{p.x, p.y, p.z, w} {
+    }
+
+    constexpr explicit Vec4(Lanes lanes) : v(lanes) {
+    }
+
+    constexpr float operator[](int index) const {
+        return v[index];
+    }
+
+    constexpr Vector3f ToVector3f() const {
+        return Vector3f(v[0], v[1], v[2]);
+    }
+
+    constexpr Vec4 operator+(const Vec4& o) const {
+        return Vec4(v + o.v);
+    }
+
+    constexpr Vec4 operator-(const Vec4& o) const {
+        return Vec4(v - o.v);
+    }
+
+    constexpr Vec4 operator*(const Vec4& o) const {
+        return Vec4(v * o.v);
+    }
+
+    constexpr Vec4 operator*(float f) const {
+        return Vec4(v * f);
+    }
+
+    constexpr Vec4 operator/(float f) const {
+        return Vec4(v / f);
+    }
+
+    static Vec4 Min(const Vec4& a, const Vec4& b) {
+        return Vec4(a.v < b.v ? a.v : b.v);
+    }
+
+    static Vec4 Max(const Vec4& a, const Vec4& b) {
+        return Vec4(a.v > b.v ? a.v : b.v);
+    }
+};
+
+// axis aligned box on Vec4 lanes, a default one is empty with inverted bounds so the first Grow takes the other bounds
+struct AABB {
+    Vec4 mini;
+    Vec4 maxi;
+
+    constexpr AABB() : mini(FLT_MAX, FLT_MAX, FLT_MAX, FLT_MAX), maxi(-FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX) {
+    }
+
+    constexpr AABB(const Vec4& mini, const Vec4& maxi) : mini(mini), maxi(maxi) {
+    }
+
+    constexpr AABB(const Vector3f& mini, const Vector3f& maxi) : mini(mini), maxi(maxi) {
+    }
+
+    void Grow(const Vec4& point) {
+        mini = Vec4::Min(mini, point);
+        maxi = Vec4::Max(maxi, point);
+    }
+
+    void Grow(const AABB& box) {
+        mini = Vec4::Min(mini, box.mini);
+        maxi = Vec4::Max(maxi, box.maxi);
+    }
+
+    constexpr Vec4 Extent() const {
+        return maxi - mini;
+    }
+
+    constexpr Vec4 Center() const {
+        return (mini + maxi) * 0.5f;
+    }
+
+    // of an empty box this is garbage, callers only ask boxes that hold something
+    constexpr float SurfaceArea() const {
+        Vec4 extent = Extent();
+        return 2.0f * (extent[0] * extent[1] + extent[0] * extent[2] + extent[1] * extent[2]);
+    }
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "Math3D.h"
+#include "Tri.h"
+
+#include <vector>
+#include <array>
+#include <cstdint>
+
+#define PROXY_MIN_TRIANGLES 256 // objects with fewer triangles go into the proxies whole
+#define DECIMATION_BOUNDARY_WEIGHT 1000.0 // weight of the planes that keep open borders in place
+#define DECIMATION_MIN_NORMAL_COS 0.2f // collapses that turn a face further than this away from its normal are skipped
+
+// simplified stand-in of one object for the rays that trace the proxies
+struct ProxyMesh {
+    std::vector<Tri> triangles;
+    float maxError = 0.0f; // estimated distance the proxy surface lies from the object at most
+};
+
+/**
+ * quadric error decimation (Garland and Heckbert 1997): vertices shared by the triangles are welded, then the edge
+ * whose collapse adds the least summed squared distance to the planes of the faces around it is collapsed until
+ * few enough triangles remain. The materials index of the first triangle is given to every triangle left
+ */
+class MeshDecimator {
+private:
+    // symmetric 4x4 matrix of the summed plane equations, the squared distance of v to the planes is v^T Q v
+    struct Quadric {
+        std::array<double, 10> q{}; // aa, ab, ac, ad, bb, bc, bd, cc, cd, dd
+
+        void AddPlane(double a, double b, double c, double d, double weight);
+        double Evaluate(const Vector3f& v) const;
+        Quadric& operator+=(const Quadric& other);
+    };
+
+    struct Collapse {
+        double cost;
+        int keep;
+        int drop;
+        uint32_t keepVersion; // the collapse is stale once either vertex changed after it was queued
+        uint32_t dropVersion;
+        Vector3f position;
+
+        bool operator>(const Collapse& other) const {
+            return cost > other.cost;
+        }
+    };
+
+    std::vector<Vector3f> vertices;
+    std::vector<Quadric> quadrics;      // faces and boundary planes, they choose the collapses
+    std::vector<Quadric> faceQuadrics;  // faces only, they estimate the error
+    std::vector<uint32_t> versions;
+    std::vector<bool> vertexRemoved;
+    std::vector<std::array<int, 3>> faces;
+    std::vector<bool> faceRemoved;
+    std::vector<std::vector<int>> facesOfVertex;
+    size_t liveFaces;
+    int materialsIndex;
+    float maxError;
+
+    Collapse Evaluate(int keep, int drop) const;
+
+    // a collapse that flips or degenerates one of the faces that survive it would fold the surface
+    bool FoldsSurface(int keep, int drop, const Vector3f& position) const;
+
+    void Apply(const Collapse& collapse);
+
+public:
+    MeshDecimator(const std::vector<Tri>& triangles);
+
+    // collapses edges until at most targetTriangles remain or no collapse is left that keeps the surface unfolded
+    std::vector<Tri> Decimate(size_t targetTriangles);
+
+    float GetMaxError() const {
+        return maxError;
+    }
+};
+
+// the proxy of one object keeping about detail of its triangles, small objects are kept whole
+ProxyMesh MakeProxyMesh(const std::vector<Tri>& triangles, float detail);
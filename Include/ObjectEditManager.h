@@ -0,0 +1,24 @@
+#pragma once
+
+#include "KeyEventObserver.h"
+
+#include <vector>
+#include <string>
+
+class Scene; // forward declaration
+
+// Insert adds the next of the [Objects] EditFilenames to the running scene, Delete removes the newest object still in it
+class ObjectEditManager {
+private:
+    KeyEventObserver observer;
+    Scene& scene;
+    std::vector<std::string> objectPaths;
+    size_t nextObject;
+    std::vector<int> objectIds; // in the scene, oldest first
+
+    void OnEvent(const KeyEvent& event);
+
+public:
+    // the scene's objects have to be loaded already
+    ObjectEditManager(Scene& scene, std::vector<std::string> objectPaths);
+};
@@ -3,11 +3,23 @@
 #include <vector>
 #include <fstream>
 #include <optional>
+#include <functional>
+#include <cctype>
+#include <sstream>
+#include <cstdint>
+#include <memory>
 
 #include "Tri.h"
 #include "Materials.h"
 #include "Math3D.h"
 
+// ray types an object can be visible to, the same RAY_* bits as in the tracer shader
+#define RAY_CAMERA 1u
+#define RAY_REFLECTION 2u // specular bounces and refraction
+#define RAY_DIFFUSE 4u
+#define RAY_SHADOW 8u
+#define RAY_ALL 15u
+
 class ObjectLoader
 {
 protected:
@@ -20,6 +32,7 @@ protected:
     Vector3f position;
     std::fstream vtxStream;
     std::string format;
+    uint32_t visibility;
 
     bool handlePositionArg() {
         if(!(vtxStream >> position.x >> position.z >> position.y)) {
@@ -47,14 +60,87 @@ protected:
         return true;
     }
 
+    // a comma separated list of the ray types the object is visible to, e.g. diffuse,shadow
+    bool handleVisibilityArg() {
+        std::string rayTypes;
+        if(!(vtxStream >> rayTypes)) {
+            return false;
+        }
+        visibility = 0;
+        std::stringstream list(rayTypes);
+        std::string rayType;
+        while(std::getline(list, rayType, ',')) {
+            if(rayType == "camera") {
+                visibility |= RAY_CAMERA;
+            } else if(rayType == "reflection") {
+                visibility |= RAY_REFLECTION;
+            } else if(rayType == "diffuse") {
+                visibility |= RAY_DIFFUSE;
+            } else if(rayType == "shadow") {
+                visibility |= RAY_SHADOW;
+            } else {
+                std::cout << "visibility must list camera | reflection | diffuse | shadow" << std::endl;
+                visibility = RAY_ALL;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // a point of the file moved into the scene by the scale and position of the object, in one Vec4 multiply add
+    Vector3f Place(const Vector3f& point) const {
+        return (Vec4(point) * scale + Vec4(position)).ToVector3f();
+    }
+
+    bool ReadPoint(Vector3f& point, bool isDirection = false) {
+        if(!(vtxStream >> point.x >> point.y >> point.z)) {
+            return false;
+        }
+        if(format == "xzy") {
+            std::swap(point.y, point.z);
+        }
+        if(!isDirection) {
+            point = Place(point);
+        }
+        return true;
+    }
+
+    // sphere <center> <radius> | box <corner> <opposite corner> | disc <center> <normal> <radius>
+    bool ReadPrimitive(const std::string& primitive, const std::function<void(const Tri&)>& consume) {
+        Vector3f a;
+        Vector3f b;
+        float radius;
+        bool status;
+        if(primitive == "sphere") {
+            status = ReadPoint(a) && vtxStream >> radius;
+            if(status) consume(Tri::Sphere(a, radius * scale, myMaterialIndex));
+        } else if(primitive == "box") {
+            status = ReadPoint(a) && ReadPoint(b);
+            if(status) consume(Tri::Box(a, b, myMaterialIndex));
+        } else if(primitive == "disc") {
+            status = ReadPoint(a) && ReadPoint(b, true) && vtxStream >> radius;
+            if(status) consume(Tri::Disc(a, b, radius * scale, myMaterialIndex));
+        } else {
+            std::cout << "unknown primitive: " << primitive << " in " << targetFilePath << std::endl;
+            return false;
+        }
+        if(!status) {
+            std::cout << "failed to read " << primitive << " in " << targetFilePath << std::endl;
+        }
+        return status;
+    }
+
 public:
-    ObjectLoader() : position(Vector3f(0,0,0)), scale(1), format("xyz") {
+    ObjectLoader() : position(Vector3f(0,0,0)), scale(1), format("xyz"), visibility(RAY_ALL) {
     }
 
+    virtual ~ObjectLoader() = default;
+
     bool TargetFile(const std::string& filePath) {
         targetFilePath = filePath;
         position = Vector3f(0,0,0);
         scale = 1;
+        visibility = RAY_ALL;
         myMaterialIndex = -1;
         vtxStream.close();
         vtxStream.open(targetFilePath);
@@ -82,6 +168,10 @@ public:
                 if(!handleFormatArg()) {
                     std::cout << "failed to read <format> argument of file: " << targetFilePath << std::endl;
                 }
+            } else if (arg == "visibility") {
+                if(!handleVisibilityArg()) {
+                    std::cout << "failed to read <visibility> argument of file: " << targetFilePath << std::endl;
+                }
             } else {
                 materialType = arg;
                 break;
@@ -130,29 +220,53 @@ public:
         return {*material};
     };
 
-    virtual std::optional<std::vector<Tri>> ExtractTriangles() {
-        Vector3f x1;
-        Vector3f x2;
-        Vector3f x3;
-        int n;
-        vtxStream >> n;
-        for(int i=0; i<n; ++i) {
-            if(vtxStream >> x1.x >> x1.y >> x1.z >> x2.x >> x2.y >> x2.z >> x3.x >> x3.y >> x3.z) {
-                if(format == "xzy") {
-                    std::swap(x1.y, x1.z);
-                    std::swap(x2.y, x2.z);
-                    std::swap(x3.y, x3.z);
+    // RAY_* bits of the ray types the object is visible to, every type unless the file says otherwise
+    uint32_t GetVisibility() const {
+        return visibility;
+    }
+
+    std::optional<std::vector<Tri>> ExtractTriangles() {
+        if(!StreamTriangles([this](const Tri& triangle) { triangles.push_back(triangle); })) {
+            return {};
+        }
+        return {triangles};
+    };
+
+    // hands every triangle to consume as soon as it is read instead of collecting them, for scenes larger than memory
+    virtual bool StreamTriangles(const std::function<void(const Tri&)>& consume) {
+        // blocks of <count> followed by count triangles, mixed with primitive lines
+        while(vtxStream >> std::ws && !vtxStream.eof()) {
+            if(!std::isdigit(vtxStream.peek())) {
+                std::string primitive;
+                vtxStream >> primitive;
+                if(!ReadPrimitive(primitive, consume)) {
+                    return false;
+                }
+                continue;
+            }
+            Vector3f x1;
+            Vector3f x2;
+            Vector3f x3;
+            int n;
+            vtxStream >> n;
+            for(int i=0; i<n; ++i) {
+                if(vtxStream >> x1.x >> x1.y >> x1.z >> x2.x >> x2.y >> x2.z >> x3.x >> x3.y >> x3.z) {
+                    if(format == "xzy") {
+                        std::swap(x1.y, x1.z);
+                        std::swap(x2.y, x2.z);
+                        std::swap(x3.y, x3.z);
+                    }
+                    x1 = Place(x1);
+                    x2 = Place(x2);
+                    x3 = Place(x3);
+                    consume(Tri(x1, x2, x3, myMaterialIndex));
+                } else {
+                    std::cout << "failed to read " << targetFilePath << " on vertex " << i + 1 << std::endl;
+                    return false;
                 }
-                x1 = x1*scale + position; 
-                x2 = x2*scale + position; 
-                x3 = x3*scale + position;
-                triangles.push_back(Tri(x1, x2, x3, myMaterialIndex));
-            } else {
-                std::cout << "failed to read " << targetFilePath << " on vertex " << i + 1 << std::endl;
-                return {};
             }
         }
-        return {triangles};
+        return true;
     };
 };
 
@@ -161,7 +275,7 @@ class OFFLoader : public ObjectLoader
 private:
     std::vector<Vector3f> vertices;
 public:
-    virtual std::optional<std::vector<Tri>> ExtractTriangles() override {
+    virtual bool StreamTriangles(const std::function<void(const Tri&)>& consume) override {
         Vector3f x1;
         Vector3f x2;
         Vector3f x3;
@@ -173,27 +287,27 @@ public:
         int verticesCount, facesCount, edgesCount;
         if(!(vtxStream >> verticesCount >> facesCount >> edgesCount)) {
             std::cout << "failed to get <vertices count> <faces count> <edges count> in .off file: " << targetFilePath << std::endl;
-            return {};
+            return false;
         }
         for(int i=0; i<verticesCount; ++i) {
             Vector3f vertex;
             if(!(vtxStream >> vertex.x >> vertex.y >> vertex.z)) {
                 std::cout << "failed to read vertex on line " << i + 1 << " of .off file: " << targetFilePath << std::endl;
-                return {};
+                return false;
             }
             if(format == "xzy") {
                 std::swap(vertex.y, vertex.z);
             }
-            vertices.push_back(vertex*scale + position);
+            vertices.push_back(Place(vertex));
         }
         if(facesCount != 0) {
             for(int i=0; i<facesCount; ++i) {
                 int n,a,b,c;
                 if(!(vtxStream >> n >> a >> b >> c)) {
                     std::cout << "failed to read face on line " << i + 1 << " of .off file: " << targetFilePath << std::endl;
-                    return {};
+                    return false;
                 }
-                triangles.push_back(Tri(vertices[a], vertices[b], vertices[c], myMaterialIndex));
+                consume(Tri(vertices[a], vertices[b], vertices[c], myMaterialIndex));
             }
         } else {
             // For each vertex, create a small triangular prism (as 2 triangles forming a tiny tetrahedron)
@@ -211,20 +325,23 @@ public:
                 corners[5] = center + Vector3f( h, -h,  h);
                 corners[6] = center + Vector3f( h,  h,  h);
                 corners[7] = center + Vector3f(-h,  h,  h);
-                triangles.push_back(Tri(corners[0], corners[1], corners[2], myMaterialIndex));
-                triangles.push_back(Tri(corners[0], corners[2], corners[3], myMaterialIndex));
-                triangles.push_back(Tri(corners[4], corners[5], corners[6], myMaterialIndex));
-                triangles.push_back(Tri(corners[4], corners[6], corners[7], myMaterialIndex));
-                triangles.push_back(Tri(corners[0], corners[1], corners[5], myMaterialIndex));
-                triangles.push_back(Tri(corners[0], corners[5], corners[4], myMaterialIndex));
-                triangles.push_back(Tri(corners[3], corners[2], corners[6], myMaterialIndex));
-                triangles.push_back(Tri(corners[3], corners[6], corners[7], myMaterialIndex));
-                triangles.push_back(Tri(corners[0], corners[3], corners[7], myMaterialIndex));
-                triangles.push_back(Tri(corners[0], corners[7], corners[4], myMaterialIndex));
-                triangles.push_back(Tri(corners[1], corners[2], corners[6], myMaterialIndex));
-                triangles.push_back(Tri(corners[1], corners[6], corners[5], myMaterialIndex));
+                consume(Tri(corners[0], corners[1], corners[2], myMaterialIndex));
+                consume(Tri(corners[0], corners[2], corners[3], myMaterialIndex));
+                consume(Tri(corners[4], corners[5], corners[6], myMaterialIndex));
+                consume(Tri(corners[4], corners[6], corners[7], myMaterialIndex));
+                consume(Tri(corners[0], corners[1], corners[5], myMaterialIndex));
+                consume(Tri(corners[0], corners[5], corners[4], myMaterialIndex));
+                consume(Tri(corners[3], corners[2], corners[6], myMaterialIndex));
+                consume(Tri(corners[3], corners[6], corners[7], myMaterialIndex));
+                consume(Tri(corners[0], corners[3], corners[7], myMaterialIndex));
+                consume(Tri(corners[0], corners[7], corners[4], myMaterialIndex));
+                consume(Tri(corners[1], corners[2], corners[6], myMaterialIndex));
+                consume(Tri(corners[1], corners[6], corners[5], myMaterialIndex));
             }
         }
-        return {triangles};
+        return true;
     };
-};
\ No newline at end of file
+};
+
+// the loader for the format of filePath, OFFLoader for .off files and ObjectLoader for the primitive lists
+std::unique_ptr<ObjectLoader> MakeObjectLoader(const std::string& filePath);
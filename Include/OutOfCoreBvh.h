@@ -0,0 +1,190 @@
+#pragma once
+
+#include "BvhTree.h"
+#include "RenderSettings.h"
+#include "Tri.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+#include <optional>
+
+#define BVH_FILE_MAGIC "RTBVH03"
+#define IN_CORE_BYTES_PER_TRIANGLE 256 // peak memory of an in-memory BvhTree build per triangle, triangles included (about 180 measured)
+#define MAPPED_WINDOW_BYTES (4 << 20) // how much of a file is mapped at once when it is read
+#define PARTITION_SAMPLE_TRIANGLES 65536 // centroids the split planes of a partition pass are chosen from
+#define MAX_PARTITION_DEPTH 24 // levels of partition nodes above the in-memory subtrees, the subtrees get the rest of MAX_BVH_DEPTH
+
+// one triangle or primitive as it is spilled to disk and stored in BVH files (44 bytes instead of the 112 of a Tri)
+struct PackedTriangle {
+    float vertices[9];
+    int materialsIndex;
+    int primitive;
+
+    static PackedTriangle FromTri(const Tri& tri);
+
+    Tri ToTri() const {
+        return Tri(Primitive(primitive), {vertices[0], vertices[1], vertices[2]}, {vertices[3], vertices[4], vertices[5]}, {vertices[6], vertices[7], vertices[8]}, materialsIndex);
+    }
+};
+
+// the settings that shape a BVH file's tree, a file built with different ones is rebuilt instead of loaded
+struct BvhFileSettings {
+    int32_t layout;
+    int32_t builder;
+    int32_t leafTriangles;
+    int32_t autoTune;
+    int32_t sahTermination;
+    int32_t depthLimit;
+    float preSplitFraction; // 0 so far, references cannot be merged across partitions
+    float traversalCost;
+    float intersectionCost;
+    uint64_t memoryBudgetBytes; // decides where the partitions end
+
+    // the settings an OutOfCoreBvhBuilder builds with for settings
+    static BvhFileSettings From(const RenderSettings& settings);
+
+    bool operator==(const BvhFileSettings&) const = default;
+};
+
+// a BVH file holds this header, triangleCount PackedTriangles and nodeCount FlatBoundingBoxes in that order. The
+// nodes follow the usual layout (root at 0, unused node at 1, sibling pairs from 2) and the leaves index the triangles
+struct BvhFileHeader {
+    char magic[8];
+    uint64_t triangleCount;
+    uint64_t nodeCount;
+    uint64_t objectCount; // object files the BVH was built from, their materials are still read from them
+    BvhFileSettings settings;
+
+    uint64_t TrianglesOffset() const {
+        return sizeof(BvhFileHeader);
+    }
+
+    uint64_t NodesOffset() const {
+        return TrianglesOffset() + triangleCount * sizeof(PackedTriangle);
+    }
+};
+
+/**
+ * reads a file through a memory-mapped window of MAPPED_WINDOW_BYTES that moves along the file, so only the window
+ * counts towards the resident memory of the process
+ */
+class MappedFileReader {
+private:
+    int fd;
+    size_t size;
+
+    // maps at least bytes from offset, data points at offset within the mapping
+    void* Map(size_t offset, size_t bytes, const void*& data) const;
+
+    void Unmap(void* mapping, size_t offset, size_t bytes) const;
+
+public:
+    MappedFileReader(const std::string& path);
+    ~MappedFileReader();
+
+    MappedFileReader(const MappedFileReader&) = delete;
+    MappedFileReader& operator=(const MappedFileReader&) = delete;
+
+    bool IsOpen() const {
+        return fd >= 0;
+    }
+
+    size_t Size() const {
+        return size;
+    }
+
+    // calls consume(records, recordCount) for consecutive windows of the count records of T stored from offset on
+    template<typename T, typename Consume>
+    void ForEachChunk(size_t offset, size_t count, Consume consume) const {
+        size_t recordsPerWindow = std::max<size_t>(MAPPED_WINDOW_BYTES / sizeof(T), 1);
+        for(size_t first = 0; first < count; first += recordsPerWindow) {
+            size_t records = std::min(recordsPerWindow, count - first);
+            const void* data;
+            void* mapping = Map(offset + first * sizeof(T), records * sizeof(T), data);
+            if(mapping == nullptr) {
+                return;
+            }
+            consume(static_cast<const T*>(data), records);
+            Unmap(mapping, offset + first * sizeof(T), records * sizeof(T));
+        }
+    }
+};
+
+// the header of a BVH file, if it is one and holds as many bytes as its header announces
+std::optional<BvhFileHeader> ReadBvhFileHeader(const MappedFileReader& file);
+
+class SpillWriter;
+
+/**
+ * builds a BVH over more triangles than fit in memory into a BVH file. Add spills every triangle to disk, Build then
+ * splits them into partitions along planes chosen from a sample of their centroids until each partition fits the
+ * memory budget, builds every partition with BvhTree and hangs it below the partition nodes in the file
+ */
+class OutOfCoreBvhBuilder {
+private:
+    // node of the split planes chosen from one sample, leaves name the partition the triangles on that side go to
+    struct PartitionNode {
+        int axis;
+        float position; // centroids below go left
+        int left;
+        int right;
+        int partition; // -1 for interior nodes
+    };
+
+    std::string outputPath;
+    std::string partialPath; // the file is written here and renamed to outputPath once it is complete
+    size_t memoryBudget;
+    BvhBuilder builder;
+    RenderSettings settings;
+    std::unique_ptr<SpillWriter> input;
+    int outputFd;
+    BvhFileHeader header;
+    uint64_t trianglesWritten;
+    int spillFilesCreated;
+    bool failed;
+
+    std::string NextSpillPath();
+
+    // triangles a partition may hold to be built in memory within the budget
+    size_t InCoreCapacity() const;
+
+    // builds the subtree over the count triangles spilled to path, writes its root into slot and returns the root,
+    // the file is deleted once it has been read
+    FlatBoundingBox BuildRange(const std::string& path, size_t count, uint64_t slot, int depth);
+
+    FlatBoundingBox BuildInCore(const std::string& path, size_t count, uint64_t slot, int depth);
+
+    FlatBoundingBox BuildPartitioned(const std::string& path, size_t count, uint64_t slot, int depth);
+
+    int MakePartitionNodes(std::vector<Vector3f>& sample, int first, int last, int partitions, int& nextPartition, std::vector<PartitionNode>& nodes);
+
+    FlatBoundingBox EmitPartitionNode(const std::vector<PartitionNode>& nodes, int node, const std::vector<std::string>& paths, const std::vector<size_t>& counts,
+                                      uint64_t slot, int depth);
+
+    // number of triangles below a partition node
+    size_t CountBelow(const std::vector<PartitionNode>& nodes, int node, const std::vector<size_t>& counts) const;
+
+    void WriteNode(uint64_t slot, const FlatBoundingBox& node);
+
+    void WriteAt(uint64_t offset, const void* data, size_t bytes);
+
+    uint64_t AllocatePair() {
+        header.nodeCount += 2;
+        return header.nodeCount - 2;
+    }
+
+public:
+    OutOfCoreBvhBuilder(const std::string& outputPath, size_t memoryBudgetBytes, const RenderSettings& settings);
+    ~OutOfCoreBvhBuilder();
+
+    OutOfCoreBvhBuilder(const OutOfCoreBvhBuilder&) = delete;
+    OutOfCoreBvhBuilder& operator=(const OutOfCoreBvhBuilder&) = delete;
+
+    void Add(const Tri& triangle);
+
+    // builds the tree over every triangle added and writes the BVH file, false if it could not be written
+    bool Build(uint64_t objectCount);
+};
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "Math3D.h"
+#include "BvhTree.h"
+#include "ThreadPool.h"
+#include "WideBvh.h"
+#include "ObjectLoader.h"
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+
+#define RAY_QUERY_CHUNK 256 // rays one task of the pool traces, enough to hide the cost of taking an index
+
+struct QueryRay {
+    Vector3f origin;
+    Vector3f direction; // does not need to be normalised, t is measured in multiples of it
+    float tMax = INFINITY;
+    uint32_t rayType = RAY_ALL; // RAY_* bits the hit objects have to be visible to
+};
+
+struct QueryHit {
+    float t;        // INFINITY on a miss
+    int triangle;   // index into the BvhTree triangles, -1 on a miss
+    int objectId;   // materialsIndex of the triangle, -1 on a miss
+    Vector3f normal; // geometric normal facing away from the primitive, not towards the ray
+};
+
+/**
+ * batched ray queries against a BvhTree for callers other than the renderer, such as the benchmark and tools. The
+ * tree is copied into a WideBvh and the batches are cut into chunks of RAY_QUERY_CHUNK rays that the threads of a work
+ * stealing pool trace with the single ray kernels, rays of an arbitrary batch are not coherent enough for packets.
+ * The tree has to outlive the queries and Rebuild has to run after it changes
+ */
+class RayQuery {
+private:
+    const BvhTree& tree;
+    const std::vector<uint32_t>* objectVisibility;
+    WideBvh wide;
+    SimdLevel simdLevel;
+    ThreadPool pool;
+
+    static SimdRay MakeSimdRay(const QueryRay& ray);
+
+public:
+    // 0 threads uses every hardware thread, objectVisibility holds the RAY_* bits by object id and may be nullptr
+    RayQuery(const BvhTree& tree, unsigned int threadCount = 0, const std::vector<uint32_t>* objectVisibility = nullptr, SimdLevel level = DetectSimdLevel());
+
+    RayQuery(const RayQuery&) = delete;
+    RayQuery& operator=(const RayQuery&) = delete;
+
+    // copies the tree into the wide layout again
+    void Rebuild();
+
+    // nearest hit within (RAY_EPSILON, tMax) of each of count rays
+    void ClosestHit(const QueryRay* rays, size_t count, QueryHit* hits);
+
+    // whether each of count rays hits anything within (RAY_EPSILON, tMax), 1 when it does
+    void AnyHit(const QueryRay* rays, size_t count, uint8_t* occluded);
+
+    std::vector<QueryHit> ClosestHit(const std::vector<QueryRay>& rays);
+
+    std::vector<uint8_t> AnyHit(const std::vector<QueryRay>& rays);
+
+    SimdLevel GetSimdLevel() const {
+        return simdLevel;
+    }
+
+    size_t GetThreadCount() const {
+        return pool.GetThreadCount();
+    }
+};
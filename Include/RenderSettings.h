@@ -0,0 +1,92 @@
+#pragma once
+
+#include "ConfigParser.hpp"
+#include "BvhTree.h"
+#include "WideBvh.h"
+
+#include <string>
+#include <vector>
+
+// how each triangle is packed into the 12 floats (3 x vec4) it occupies in B_Triangles
+enum class TriangleLayout {
+    VERTICES,   // v0, v1, v2 (padding unused)
+    EDGES,      // v0, e1 = v1 - v0, e2 = v2 - v0, unit normal in the padding
+    WATERTIGHT  // v0, v1, v2, unit normal in the padding, intersected with the watertight test
+};
+
+enum class BvhTraversal {
+    STACK,     // per-fragment stack of MAX_STACK_SIZE nodes
+    STACKLESS  // parent and sibling links, no stack
+};
+
+enum class BvhBuild {
+    SAH,            // surface area heuristic tree, the first frame waits for it
+    MORTON,         // morton tree only
+    MORTON_THEN_SAH, // start on a morton tree and swap in the sah tree once a background thread has built it
+    GPU              // morton tree built by compute shaders straight into the node buffer, for meshes that change every frame
+};
+
+// what traces the frames
+enum class TracerBackend {
+    GL,        // the fragment shader
+    COMPUTE,   // the same shader as a compute shader in tiles, see ComputeTracer
+    WAVEFRONT, // the same shader split into one compute kernel per stage of a bounce, see WavefrontTracer
+    CPU        // CpuTracer on a pool of threads, the image is uploaded into the accumulation texture
+};
+
+/**
+ * tracer options read from the [Tracer] section of RayTracer.ini, keys that are left out keep the defaults below
+ */
+struct RenderSettings {
+    TriangleLayout triangleLayout = TriangleLayout::VERTICES;
+    BvhLayout bvhLayout = BvhLayout::DEPTH_FIRST;
+    BvhTraversal bvhTraversal = BvhTraversal::STACK;
+    BvhBuild bvhBuild = BvhBuild::SAH;
+    std::string bvhReportPath; // the quality report of every BVH the tracer uploads is written here as JSON, empty disables
+    int leafTriangles = DEFAULT_LEAF_TRIANGLES;
+    bool sahTermination = false;
+    bool autoTuneBvh = false; // pick leafTriangles and sahTermination per scene from sampled builds
+    float traversalCost = SAH_TRAVERSAL_COST;
+    float intersectionCost = SAH_INTERSECTION_COST;
+    float preSplitFraction = 0.0f; // triangles with bounds above this fraction of the scene surface area are pre-split, 0 disables
+    std::string bvhFilePath; // out-of-core BVH file, built when missing or older than the objects and loaded instead of building in memory
+    size_t bvhMemoryBudgetMegabytes = 1024; // peak memory the out-of-core build may use
+    float proxyDetail = 0.0f; // fraction of its triangles the proxy of every object keeps for secondary diffuse rays, 0 disables
+    int proxyBounce = 2; // bounce from which every diffuse ray traces the proxies, primary rays never do
+    float proxyRoughness = 0.5f; // roughness from which the rays a surface scatters diffusely trace the proxies before proxyBounce
+    int rouletteDepth = 3; // bounce from which Russian roulette may end paths, the bounce limit stays the hard cap
+    float rouletteMinSurvival = 0.05f; // lowest survival probability of the roulette, bounds the weight of survivors
+    bool visibilityMasks = false; // honour the visibility object files declare, costs a mask fetch per node visit
+    TracerBackend backend = TracerBackend::GL;
+    unsigned int cpuThreads = 0; // threads of the CPU backend, 0 for every hardware thread
+    unsigned int cpuTileSize = 16; // edge of the square tiles the CPU backend hands to its threads
+    SimdLevel cpuSimd = SimdLevel::AVX2; // widest traversal kernels the CPU backend may use, lowered to what the CPU supports
+
+    static RenderSettings FromConfig(ConfigParser& parser);
+
+    // BvhBuild = gpu keeps the triangles in memory, so it ignores BvhFile
+    bool UsesBvhFile() const {
+        return !bvhFilePath.empty() && bvhBuild != BvhBuild::GPU;
+    }
+
+    // the gpu builder binds its own buffers where the proxies go and BvhFile scenes never hold their triangles
+    bool UsesProxies() const {
+        return proxyDetail > 0 && bvhBuild != BvhBuild::GPU && !UsesBvhFile();
+    }
+
+    // the masks are computed from the tree on the CPU, which neither the gpu builder nor BvhFile scenes keep
+    bool UsesVisibilityMasks() const {
+        return visibilityMasks && bvhBuild != BvhBuild::GPU && !UsesBvhFile();
+    }
+
+    // the CPU backend traces the tree in memory, which neither the gpu builder nor BvhFile scenes keep
+    bool UsesCpuBackend() const {
+        return backend == TracerBackend::CPU && bvhBuild != BvhBuild::GPU && !UsesBvhFile();
+    }
+
+    // applies the layout, pre-splitting, leaf size, termination and costs to a tree before BuildTree
+    void Configure(BvhTree& tree) const;
+
+    // #define lines the tracer shader is compiled with so it agrees with the buffers the scene uploads
+    std::vector<std::string> ShaderDefines() const;
+};
@@ -9,6 +9,12 @@
 #include "Camera.h"
 #include "Renderer.h"
 #include "BounceLimitManager.h"
+#include "RenderSettings.h"
+#include "GpuBvhBuilder.h"
+#include "OutOfCoreBvh.h"
+#include "MeshDecimator.h"
+#include "CpuTracer.h"
+#include "TraversalCheck.h"
 
 #include <iostream>
 #include <memory>
@@ -18,12 +24,45 @@
 #include <cmath>
 #include <cfloat>
 #include <limits.h>
+#include <future>
+#include <chrono>
+#include <map>
+#include <unordered_map>
+#include <cstdint>
 
 #define TRACER_ID 0
+#define MATERIALS_BINDING 5 // the gpu builder borrows the binding while it builds and gives it back after
+#define FRAME_CONSTANTS_BINDING 0 // uniform block binding
+
+// std140 layout of the FrameConstants uniform block of the tracer shader (80 bytes), written once per frame
+struct FrameConstants {
+    float cameraPosition[3];
+    float cameraFov;
+    float cameraFacing[3];
+    float cameraViewportWidth;
+    float cameraViewportDistance;
+    float padding0[3]; // std140 rounds the Camera struct up to 48 bytes
+    float randSeed[3];
+    uint32_t frameIndex;
+    uint32_t bounceLimit;
+    uint32_t padding1[3];
+};
+
+// std430 layout of one material in the B_Materials shader storage buffer (48 bytes), every object brings one
+struct FlatMaterial {
+    float colour[3];
+    float roughness;
+    float specularColour[3];
+    float metallic;
+    float transparency;
+    float refractionIndex;
+    int isLight;
+    uint32_t visibility; // RAY_* bits of the object the material belongs to
+};
 
 class Scene {
     public:
-        Scene(std::vector<unsigned int> shaderProgramIds);
+        Scene(std::vector<unsigned int> shaderProgramIds, const RenderSettings& settings = RenderSettings());
         
         void ResetFrameIndex() { frameIndex = 0; }
         
@@ -32,10 +71,38 @@ class Scene {
         void Tick();
         
         void SetCurrentFps(uint32_t fps) { currentfps = fps; }
+
+        // takes effect at the next Tick
+        void SetBounceLimit(uint32_t bounceLimit) { frameConstants.bounceLimit = bounceLimit; }
+
+        uint32_t GetBounceLimit() const { return frameConstants.bounceLimit; }
+
+        // goes up whenever the Scene sets a uniform of the tracer program, the wavefront kernels copy them on a change
+        uint64_t GetUniformRevision() const { return uniformRevision; }
+
+        // writes the camera, frame index, seed and bounce limit to the FrameConstants uniform block in one go
+        void UploadFrameConstants();
         
         bool GetInBoxHitView() const { return inBoxHitView; }
         
         void LoadObjects(const std::vector<std::string>& objectFilePaths);
+
+        // adds one object to the running scene and returns its id, -1 if it could not be loaded. The id and material
+        // slot of a removed object are taken first
+        int AddObject(const std::string& objectFilePath);
+
+        // takes an object added by LoadObjects or AddObject out of the running scene
+        void RemoveObject(int objectId);
+
+        // ids of the objects in the scene, in the order they were given out
+        std::vector<int> GetObjectIds() const;
+
+        // replaces the material of one object, only its entry of the materials buffer is written
+        void SetMaterial(int objectId, const Material::Material& material);
+
+        // with BvhBuild = gpu, rebuilds the tree over the triangle buffer after its vertices were rewritten in place,
+        // e.g. by a deforming mesh every frame, and returns the node count
+        unsigned int RebuildBvhOnGpu();
         
         const Camera& GetCamera() const { return camera; };
         
@@ -43,14 +110,24 @@ class Scene {
 
         const std::vector<unsigned int>& GetShaderProgramIds() { return shaderProgramIds; };
 
+        // with Backend = cpu every Tick traces the frame with it, nullptr otherwise
+        CpuTracer* GetCpuTracer() { return cpuTracer.get(); };
+
     private:
+        // everything the GPU needs from one BVH build
+        struct BuiltBvh {
+            BvhTree tree;
+            long long buildMilliseconds;
+        };
+
         int objectsIndex; // Changed from int to unsigned int
         unsigned int shaderProgramId;
         unsigned int frameIndex;
+        RenderSettings settings;
         BounceLimitManager bounceLimitManager;
         Camera camera;
 
-        std::vector<Tri> triangles;
+        BvhTree bvhTree;
         std::vector<std::unique_ptr<Material::Material>> materials;
         bool inFpsTest;
         float fpsTestAngle;
@@ -60,11 +137,92 @@ class Scene {
         float denoiseOptionValues[3] = {1.0f, 1.0f, 0.05f};
         std::fstream fpsTestOut; 
 
+        std::map<int, GLuint> shaderStorageBuffers; // by binding, so a rebuilt BVH overwrites the buffers it replaces
+        std::map<std::string, GLuint> textureBuffers; // by uniform name
+        std::unordered_map<std::string, GLint> uniformLocations; // of the tracer program, by uniform name
+        uint64_t uniformRevision = 0;
+        FrameConstants frameConstants;
+        GLuint frameConstantsBuffer;
+        std::future<BuiltBvh> refinedBvh; // sah build running in the background for BvhBuild = morton-then-sah
+        long long fastBvhBuildMilliseconds;
+        bool fpsAfterSwapPending;
+        std::chrono::steady_clock::time_point swapTime;
+
+        std::map<GLuint, size_t> bufferCapacities; // bytes allocated for each buffer
+        std::unique_ptr<GpuBvhBuilder> gpuBvhBuilder; // only with BvhBuild = gpu, bvhTree then holds the triangles but no nodes
+        std::map<int, ProxyMesh> proxyMeshes; // by object id, only with ProxyDetail
+        BvhTree proxyTree; // over every proxy mesh, traced by the secondary rays the shader picks for it
+        std::vector<float> proxySkinDistances; // by object id, the largest error of its proxy, 0 for objects without one
+        std::vector<uint32_t> objectVisibility; // RAY_* bits by object id
+        std::vector<int> freeObjectIds; // of removed objects, AddObject gives them and their material slot out again
+        std::unique_ptr<CpuTracer> cpuTracer; // only with Backend = cpu
+        LightList lights; // emitting triangles of bvhTree visible to shadow rays, empty for BvhFile scenes
+        uint64_t bvhVersion; // counts the changes to bvhTree and proxyTree, the CPU tracer rebuilds its wide copies on it
+
+        // opens one object file and stores its material as object objectId, a new one at the end for -1. The triangles
+        // are left to be read from the loader
+        std::unique_ptr<ObjectLoader> OpenObjectFile(const std::string& objectFilePath, int objectId = -1);
+
+        // reads the material and triangles of one object file as object objectId, a new one at the end for -1
+        std::optional<std::vector<Tri>> LoadObjectFile(const std::string& objectFilePath, int objectId = -1);
+
+        // with BvhFile set, builds the BVH file out of core unless it is newer than every object file, and uploads it
+        void LoadObjectsThroughBvhFile(const std::vector<std::string>& objectFilePaths);
+
+        // uploads the triangles and nodes of a BVH file without reading it into memory at once
+        void UploadBvhFile(const std::string& bvhFilePath);
+
+        // (re)allocates the storage buffer bound at bufferUnit with bytes of undefined contents
+        GLuint AllocateSSBO(int bufferUnit, size_t bytes);
+
+        static BuiltBvh BuildBvh(std::vector<Tri> sourceTriangles, BvhBuilder builder, RenderSettings settings);
+
+        // replaces the triangle, material index and node buffers with the ones of bvhTree
+        void UploadBvh();
+
+        // replaces only the triangle and material index buffers
+        void UploadTriangles();
+
+        // rebuilds proxyTree from proxyMeshes
+        void BuildProxies();
+
+        // writes proxyTree into the triangle, material index, node, link and reference buffers behind the scene, so
+        // the shader traces it by starting at another root. Every upload of the scene tree has to be followed by it
+        void AppendProxies();
+
+        // writes the quality report of the uploaded tree to settings.bvhReportPath
+        void WriteBvhReport() const;
+
+        // rewrites only the nodes, triangles and references an Insert or Remove touched
+        void UploadBvhUpdate(const BvhUpdate& update);
+
+        // grows a buffer to hold at least bytes, keeping its contents and its id so existing bindings stay valid
+        void ReserveBuffer(GLuint bufferId, size_t bytes);
+
+        template<typename T>
+        void WriteBuffer(GLuint bufferId, size_t firstElement, const std::vector<T>& data) {
+            GLCALL(glBindBuffer(GL_COPY_WRITE_BUFFER, bufferId));
+            GLCALL(glBufferSubData(GL_COPY_WRITE_BUFFER, firstElement * sizeof(T), data.size() * sizeof(T), data.data()));
+            glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        }
+
+        // called every tick, uploads the background sah build once it is done and restarts accumulation
+        void SwapInRefinedBvh();
+
         std::vector<int> FlattenTrianglesMatIdx(const std::vector<Tri>& reorderedTris);
 
         std::vector<float> FlattenTrianglesVertices(const std::vector<Tri>& reorderedTris);
 
-        std::vector<float> FlattenBoundingBoxes(const std::vector<BoundingBox>& boundingBoxes);
+        std::vector<FlatBoundingBox> FlattenBoundingBoxes(const std::vector<BoundingBox>& boundingBoxes);
+
+        std::vector<FlatMaterial> FlattenMaterials(size_t first, size_t last);
+
+        // (parent, sibling) of every node for the stackless traversal, -1 where there is none
+        std::vector<int> FlattenBoundingBoxLinks(const std::vector<BoundingBox>& boundingBoxes);
+
+        // RAY_* bits of every node of tree, the ray types some object below it is visible to in bits 0-7 and the ones
+        // every object below it is visible to in bits 8-15. Nodes the root does not reach stay 0
+        std::vector<uint32_t> FlattenBoundingBoxMasks(const BvhTree& tree);
         
         template<typename T>
         void SendDataAsSSBO(const std::vector<T>& data, const int bufferUnit, const GLenum usageType) {
@@ -73,25 +231,39 @@ class Scene {
                 return;
             }
 
-            GLuint ssbo;
-            glGenBuffers(1, &ssbo);
+            GLuint& ssbo = shaderStorageBuffers[bufferUnit];
+            if(ssbo == 0) {
+                glGenBuffers(1, &ssbo);
+            }
             glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
             glBufferData(GL_SHADER_STORAGE_BUFFER, data.size() * sizeof(T), data.data(), usageType);
+            bufferCapacities[ssbo] = data.size() * sizeof(T);
             glBindBufferBase(GL_SHADER_STORAGE_BUFFER, bufferUnit, ssbo);
             glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
         }
 
         template<typename T>
-        void SendDataAsTextureBuffer(const std::vector<T>& data, const int count, const std::string& uniformName, const int textureUnit, const unsigned int format) {
+        void SendDataAsTextureBuffer(const std::vector<T>& data, const int count, const std::string& uniformName, const unsigned int format) {
             if (data.empty()) {
                 std::cerr << "Warning: Empty data vector for " << uniformName << std::endl;
                 return;
             }
+            if(textureBuffers.contains(uniformName)) { // the texture still points at the buffer, only its contents change
+                GLCALL(glBindBuffer(GL_TEXTURE_BUFFER, textureBuffers[uniformName]));
+                GLCALL(glBufferData(GL_TEXTURE_BUFFER, data.size() * sizeof(T), data.data(), GL_STATIC_DRAW));
+                bufferCapacities[textureBuffers[uniformName]] = data.size() * sizeof(T);
+                GLCALL(glUniform1ui(GetUniformLocation(uniformName + "Count"), count));
+                glBindBuffer(GL_TEXTURE_BUFFER, 0);
+                return;
+            }
+            int textureUnit = TextureUnitManager::getNewTextureUnit();
             // create a new buffer and bind the texture buffer to
             GLuint bufferId;
             GLCALL(glGenBuffers(1, &bufferId));
+            textureBuffers[uniformName] = bufferId;
             GLCALL(glBindBuffer(GL_TEXTURE_BUFFER, bufferId));
             GLCALL(glBufferData(GL_TEXTURE_BUFFER, data.size() * sizeof(T), data.data(), GL_STATIC_DRAW));
+            bufferCapacities[bufferId] = data.size() * sizeof(T);
 
             GLuint textureId;
             GLCALL(glGenTextures(1, &textureId));
@@ -99,14 +271,18 @@ class Scene {
             GLCALL(glBindTexture(GL_TEXTURE_BUFFER, textureId)); // associate the texture object with the buffer  
             GLCALL(glTexBuffer(GL_TEXTURE_BUFFER, format, bufferId));
 
-            GLCALL(glUniform1i(glGetUniformLocation(shaderProgramId, uniformName.c_str()), textureUnit));
-            GLCALL(glUniform1ui(glGetUniformLocation(shaderProgramId, (uniformName + "Count").c_str()), count));
+            GLCALL(glUniform1i(GetUniformLocation(uniformName), textureUnit));
+            GLCALL(glUniform1ui(GetUniformLocation(uniformName + "Count"), count));
             glBindBuffer(GL_TEXTURE_BUFFER, 0);
         }
 
-        void SendSceneMaterials();
+        // rebuilds the light list from bvhTree and the materials and uploads it to u_Lights, after every change to either
+        void UploadLights();
 
-        unsigned int GetUniformLocation(std::string uname);
+        // writes the materials [first, last) of the scene into the materials buffer, growing it when needed
+        void SendSceneMaterials(size_t first = 0, size_t last = SIZE_MAX);
 
-        unsigned int GetUniformLocationIdx(std::string uname, unsigned int index, std::vector<std::string> attributes);
+        // location of a uniform of the tracer program, asked of the driver only the first time. Every uniform the Scene
+        // sets is looked up here, so it also counts the uniformRevision
+        GLint GetUniformLocation(const std::string& uname);
 };
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 #include <string>
+#include <vector>
 
 struct ShaderProgramSource
 {
@@ -9,6 +10,13 @@ struct ShaderProgramSource
 
 ShaderProgramSource ParseShader(const std::string& , const std::string&);
 
+std::string ParseComputeShader(const std::string& computeShaderPath);
+
+// inserts a #define line for every entry of defines just after the #version line of source
+std::string InjectShaderDefines(const std::string& source, const std::vector<std::string>& defines);
+
 unsigned int CompileShader(unsigned int type, const std::string& source);
 
-unsigned int CreateShaderProgram(const std::string& vertexShader, const std::string& fragmentShader);
\ No newline at end of file
+unsigned int CreateShaderProgram(const std::string& vertexShader, const std::string& fragmentShader);
+
+unsigned int CreateComputeProgram(const std::string& computeShader);
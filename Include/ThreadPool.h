@@ -0,0 +1,55 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <cstdint>
+
+/**
+ * fixed set of worker threads that run the indices of a ParallelFor. Every worker has its own queue of indices, pops
+ * from its back and steals from the front of the others once it runs dry, so uneven work such as tiles of glass next
+ * to tiles of sky evens out without a shared queue every index has to go through
+ */
+class ThreadPool {
+private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<size_t> indices;
+    };
+
+    std::vector<std::unique_ptr<WorkQueue>> queues; // one per worker
+    std::vector<std::thread> workers;
+    std::mutex mutex; // guards generation and stopping
+    std::condition_variable wake;
+    std::condition_variable finished;
+    // read after taking an index, a worker may still be looking for work when the next ParallelFor fills the queues
+    std::atomic<const std::function<void(size_t)>*> job;
+    uint64_t generation; // bumped by every ParallelFor so sleeping workers know there is work
+    std::atomic<size_t> remaining;
+    bool stopping;
+
+    void WorkerLoop(size_t worker);
+
+    // next index for worker, its own newest first, then the oldest of another worker
+    bool TakeIndex(size_t worker, size_t& index);
+
+public:
+    // 0 threads uses every hardware thread
+    ThreadPool(unsigned int threadCount = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t GetThreadCount() const {
+        return workers.size();
+    }
+
+    // runs task(i) for every i in [0, count) on the workers and returns once all of them have run
+    void ParallelFor(size_t count, const std::function<void(size_t)>& task);
+};
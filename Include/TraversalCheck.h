@@ -0,0 +1,31 @@
+#pragma once
+
+#include "BvhTree.h"
+#include "RayQuery.h"
+
+#include <vector>
+#include <cstddef>
+
+#define TRAVERSAL_CHECK_EXAMPLES 8 // mismatching rays a report keeps for printing
+
+// (parent, sibling) of every node for the stackless traversal, -1 where there is none, the contents of B_BoundingBoxLinks
+std::vector<int> ParentSiblingLinks(const std::vector<BoundingBox>& boundingBoxes);
+
+struct TraversalMismatch {
+    size_t ray;
+    QueryHit stack;
+    QueryHit stackless;
+};
+
+struct TraversalCheckReport {
+    size_t rays = 0;
+    size_t mismatches = 0;              // rays whose nearest triangle or distance differ between the two walks
+    long long stackNodeTests = 0;
+    long long stacklessNodeTests = 0;   // the same as stackNodeTests when both walks enter the same subtrees
+    std::vector<TraversalMismatch> examples;
+};
+
+// traces every ray through the binary tree with both traversals of Fragment.glsl, the stack and the parent and sibling
+// links of BVH_STACKLESS, on the CPU with the same slab and primitive tests and compares the nearest hits. Both walks
+// enter the near child first so their hits agree exactly, ties included
+TraversalCheckReport CompareTraversals(const BvhTree& tree, const std::vector<QueryRay>& rays);
@@ -5,28 +5,67 @@
 #include <string>
 #include <memory>
 
+#define PRIMITIVE_TAG_BASE 1.0f // B_Triangles tags analytic primitives with this + Primitive in the first w, above any unit normal component
+
+// what a Tri holds, analytic primitives sit in the BVH leaves next to the triangles with their parameters in pos1 to pos3
+enum class Primitive {
+    TRIANGLE, // pos1, pos2, pos3 are the vertices
+    SPHERE,   // pos1 center, pos2.x radius
+    BOX,      // pos1 min corner, pos2 max corner, axis aligned
+    DISC      // pos1 center, pos2 unit normal, pos3.x radius
+};
+
 class Tri {
 public:
     Vector3f pos1;
     Vector3f pos2;
     Vector3f pos3;
-    Vector3f maxi; // precompute maxi and mini
-    Vector3f mini; // precompute maxi and mini
-    Vector3f centroid; // precompute centroid
+    AABB bounds; // precomputed, w is 0
+    Vec4 centroid; // precomputed, w is 0
     int materialsIndex;
+    int sourceIndex; // for pre-split references: index of the triangle the clipped bounds belong to
+    Primitive primitive;
+
+    Tri(Vector3f pos1, Vector3f pos2, Vector3f pos3, int materialsIndex = 0) : Tri(Primitive::TRIANGLE, pos1, pos2, pos3, materialsIndex) {
+    }
+
+    Tri(Primitive primitive, Vector3f pos1, Vector3f pos2, Vector3f pos3, int materialsIndex)
+    : pos1(pos1), pos2(pos2), pos3(pos3), materialsIndex(materialsIndex), sourceIndex(-1), primitive(primitive) {
+        if(primitive == Primitive::TRIANGLE) {
+            Vec4 a(pos1), b(pos2), c(pos3);
+            bounds = AABB(Vec4::Min(a, Vec4::Min(b, c)), Vec4::Max(a, Vec4::Max(b, c)));
+            centroid = (a + b + c) / 3.0f;
+            return;
+        }
+        Vector3f extent;
+        if(primitive == Primitive::SPHERE) {
+            extent = Vector3f(pos2.x, pos2.x, pos2.x);
+        } else if(primitive == Primitive::DISC) { // the rim reaches radius * sin of the angle between the normal and each axis
+            extent = Vector3f(sqrt(std::max(0.0f, 1 - pos2.x * pos2.x)), sqrt(std::max(0.0f, 1 - pos2.y * pos2.y)), sqrt(std::max(0.0f, 1 - pos2.z * pos2.z))) * pos3.x;
+        }
+        bounds = primitive == Primitive::BOX ? AABB(pos1, pos2) : AABB(Vec4(pos1) - Vec4(extent), Vec4(pos1) + Vec4(extent));
+        centroid = bounds.Center();
+    }
 
-    Tri(Vector3f pos1, Vector3f pos2, Vector3f pos3, int materialsIndex = 0)
-    : pos1(pos1), pos2(pos2), pos3(pos3), materialsIndex(materialsIndex) {
-        maxi = Vector3f(std::max(pos1.x, std::max(pos2.x, pos3.x)),
-                    std::max(pos1.y, std::max(pos2.y, pos3.y)),
-                    std::max(pos1.z, std::max(pos2.z, pos3.z)));
-        mini = Vector3f(std::min(pos1.x, std::min(pos2.x, pos3.x)),
-                    std::min(pos1.y, std::min(pos2.y, pos3.y)),
-                    std::min(pos1.z, std::min(pos2.z, pos3.z)));
-        centroid = (pos1 + pos2 + pos3) / 3;
+    static Tri Sphere(Vector3f center, float radius, int materialsIndex) {
+        return Tri(Primitive::SPHERE, center, Vector3f(radius, 0, 0), Vector3f(), materialsIndex);
     }
 
-    Vector3f Centroid() const{
+    static Tri Box(Vector3f corner, Vector3f oppositeCorner, int materialsIndex) {
+        Vector3f mini = Vec4::Min(Vec4(corner), Vec4(oppositeCorner)).ToVector3f();
+        Vector3f maxi = Vec4::Max(Vec4(corner), Vec4(oppositeCorner)).ToVector3f();
+        return Tri(Primitive::BOX, mini, maxi, Vector3f(), materialsIndex);
+    }
+
+    static Tri Disc(Vector3f center, Vector3f normal, float radius, int materialsIndex) {
+        return Tri(Primitive::DISC, center, normal.Normalize(), Vector3f(radius, 0, 0), materialsIndex);
+    }
+
+    const Vec4& Centroid() const {
         return centroid;
     }
+
+    const AABB& Bounds() const {
+        return bounds;
+    }
 };
\ No newline at end of file
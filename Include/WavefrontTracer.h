@@ -0,0 +1,103 @@
+#pragma once
+
+#include "ComputeTracer.h"
+
+#include <GL/glew.h>
+#include <string>
+#include <vector>
+#include <optional>
+#include <cstdint>
+
+#define WAVEFRONT_GROUP_SIZE 64 // local_size_x of the WAVEFRONT kernels of Fragment.glsl, one tile of paths
+#define WAVEFRONT_PATH_SIZE 144 // bytes of the std430 Path struct of Fragment.glsl
+#define PATHS_BINDING 6
+#define QUEUES_BINDING 7 // both are borrowed by the gpu builder too, so they are bound again before every frame
+// QUEUE_* of Fragment.glsl, passes alternate between the two extend queues
+#define QUEUE_EXTEND 0
+#define QUEUE_SHADE_OPAQUE 2
+#define QUEUE_SHADE_TRANSPARENT 3
+#define QUEUE_SHADOW 4
+#define QUEUE_COUNT 5
+#define QUEUE_HEADER_SIZE 16 // the indirect dispatch and the length of a queue, a uvec4
+#define WAVEFRONT_MAX_PASSES 256 // paths still running after this many extend passes end black, glass can keep them going
+
+/**
+ * the path tracer of Fragment.glsl split into one compute kernel per stage of a bounce, compiled with WAVEFRONT and a
+ * KERNEL_* define each. The state of every path lives in a buffer between the kernels and each pass only runs the
+ * paths that still need the stage, which queues of path indices hand from kernel to kernel:
+ *  - generate writes the camera ray of every pixel and queues it for extend
+ *  - extend traces the queued rays, ends the paths that leave the scene or find a light and sorts the others into
+ *    one shade queue per kind of scattering
+ *  - the shade kernels scatter their queue and queue the next bounce for the extend of the next pass, the opaque one
+ *    also samples a light at diffuse and glossy bounces and queues the shadow ray
+ *  - shadow traces the shadow rays with an any hit traversal and adds the light of the ones that reach their light
+ *  - accumulate blends the radiance of every path into the image like the compute tracer does
+ * The kernels launch through glDispatchComputeIndirect with the group counts the queues keep, so the CPU only learns
+ * how many paths are left when it asks, once the bounce limit made most of them end
+ */
+class WavefrontTracer {
+private:
+    enum Kernel {
+        GENERATE,
+        EXTEND,
+        SHADE_OPAQUE,
+        SHADE_TRANSPARENT,
+        SHADOW,
+        ACCUMULATE,
+        KERNEL_COUNT
+    };
+
+    // a uniform the Scene sets on the megakernel program and where every kernel program has it, -1 where it does not
+    struct SharedUniform {
+        GLenum type;
+        GLint source;
+        GLint locations[KERNEL_COUNT];
+    };
+
+    ComputeTracer megakernel; // the Scene sets its uniforms on this program, never dispatched
+    GLuint programs[KERNEL_COUNT];
+    GLint traceRectLocations[KERNEL_COUNT];
+    GLint pathCountLocations[KERNEL_COUNT];
+    GLint extendQueueLocations[KERNEL_COUNT];
+    std::vector<SharedUniform> sharedUniforms;
+    std::optional<uint64_t> copiedRevision; // the uniform revision of the Scene the kernels were last given
+    GLuint paths;
+    GLuint queues;
+    unsigned int capacity; // paths the buffers are sized for
+    GLuint target;
+
+    void FindSharedUniforms();
+
+    // copies the values the Scene set on the megakernel program into the kernel programs, reading them back from the
+    // driver, so only when they changed
+    void CopySharedUniforms();
+
+    void Reserve(unsigned int pathCount);
+
+    // empties the queue so the kernels of the next dispatch can push to it
+    void ResetQueue(unsigned int queue);
+
+    void Dispatch(Kernel kernel, unsigned int groups);
+
+    void DispatchIndirect(Kernel kernel, unsigned int queue);
+
+public:
+    // shaderDefines are the ones of RenderSettings::ShaderDefines, WAVEFRONT and the kernel are added to them
+    WavefrontTracer(const std::string& tracerShaderPath, const std::vector<std::string>& shaderDefines);
+    ~WavefrontTracer();
+
+    WavefrontTracer(const WavefrontTracer&) = delete;
+    WavefrontTracer& operator=(const WavefrontTracer&) = delete;
+
+    // the program the Scene sets its uniforms on, the current program whenever Trace returns
+    GLuint GetProgramId() const {
+        return megakernel.GetProgramId();
+    }
+
+    // the GL_RGBA32F texture the accumulate kernel blends into
+    void SetTarget(GLuint texture);
+
+    // traces one path through every pixel of rect, bounceLimit has to be the u_BounceLimit of the frame and
+    // uniformRevision the Scene::GetUniformRevision, the uniforms are copied into the kernels when it moved
+    void Trace(const TraceRect& rect, uint32_t bounceLimit, uint64_t uniformRevision);
+};
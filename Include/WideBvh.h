@@ -0,0 +1,114 @@
+#pragma once
+
+#include "Math3D.h"
+#include "Tri.h"
+#include "BvhTree.h"
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+
+#define WIDE_BVH_WIDTH 8 // children per node, one AVX2 register or two SSE registers of slab tests
+#define TRIANGLE_BLOCK_WIDTH 8 // triangles a leaf block intersects at once, subtrees this small become one leaf
+#define MAX_PACKET_WIDTH 8 // rays of an AVX2 packet
+#define EMPTY_CHILD INT32_MIN
+
+// vector extensions the traversal kernels are compiled for, the widest one the CPU supports is picked at runtime
+enum class SimdLevel {
+    NONE,  // the scalar binary traversal of CpuTracer
+    SSE2,  // 2 x 4 lanes per node, packets of 4 rays
+    AVX2   // 8 lanes per node, packets of 8 rays, also on CPUs with AVX-512 since 16 ray packets diverged too much to pay off
+};
+
+SimdLevel DetectSimdLevel();
+
+const char* SimdLevelName(SimdLevel level);
+
+// rays of a packet, the lane count the level packs
+int PacketWidth(SimdLevel level);
+
+// eight children in structure of arrays form so one slab test covers all of them, unused slots are the last ones
+struct alignas(64) WideBvhNode {
+    float minX[WIDE_BVH_WIDTH];
+    float minY[WIDE_BVH_WIDTH];
+    float minZ[WIDE_BVH_WIDTH];
+    float maxX[WIDE_BVH_WIDTH];
+    float maxY[WIDE_BVH_WIDTH];
+    float maxZ[WIDE_BVH_WIDTH];
+    int32_t child[WIDE_BVH_WIDTH]; // node index, ~leaf index for leaves, EMPTY_CHILD for unused slots
+};
+
+// up to eight mesh triangles of one leaf laid out to test all of them at once. second and third hold the edges from
+// v0 for the Moller-Trumbore test, or the other two vertices for the watertight test, which needs them exactly
+struct alignas(64) TriangleBlock {
+    float v0[3][TRIANGLE_BLOCK_WIDTH];
+    float second[3][TRIANGLE_BLOCK_WIDTH];
+    float third[3][TRIANGLE_BLOCK_WIDTH];
+    int32_t triangle[TRIANGLE_BLOCK_WIDTH];    // index into the BvhTree triangles, -1 pads the last block of a leaf
+    uint32_t visibility[TRIANGLE_BLOCK_WIDTH]; // RAY_* bits of the object, 0 on pads
+};
+
+struct WideLeaf {
+    int firstBlock;
+    int blockCount;
+    int firstPrimitive; // analytic primitives are tested one at a time
+    int primitiveCount;
+};
+
+struct SimdRay {
+    Vector3f origin;
+    Vector3f direction;
+    Vector3f invDirection;
+    uint32_t rayType;
+};
+
+// distance to an analytic primitive along the ray, INFINITY when it is missed
+using PrimitiveDistance = float (*)(const Tri& primitive, const SimdRay& ray);
+
+/**
+ * eight wide copy of a BvhTree for the SIMD kernels of the CPU tracer: the binary tree is collapsed by repeatedly
+ * opening the child with the largest surface area until a node holds eight children, and subtrees of at most
+ * TRIANGLE_BLOCK_WIDTH triangles become one leaf whose triangles sit in a block. Hits are reported by the index of
+ * the triangle in the BvhTree, the caller computes the normal
+ */
+class WideBvh {
+private:
+    friend struct WideBvhKernels; // the traversal compiled once per SimdLevel
+
+    std::vector<WideBvhNode> nodes;
+    std::vector<WideLeaf> leaves;
+    std::vector<TriangleBlock> blocks;
+    std::vector<int> primitives; // triangle indices of the analytic primitives of every leaf
+    std::vector<uint32_t> primitiveVisibility;
+    const std::vector<Tri>* triangles;
+    bool watertight; // triangles take the watertight test of TriangleLayout::WATERTIGHT instead of Moller-Trumbore
+
+    // triangles below every node of the binary tree
+    int CountTriangles(const std::vector<BoundingBox>& boxes, int node, std::vector<int>& counts) const;
+
+    int BuildNode(const BvhTree& tree, const std::vector<int>& counts, int binaryNode, const std::vector<uint32_t>* objectVisibility);
+
+    int BuildLeaf(const BvhTree& tree, int binaryNode, const std::vector<uint32_t>* objectVisibility);
+
+    void GatherTriangles(const BvhTree& tree, int binaryNode, std::vector<int>& gathered) const;
+
+public:
+    WideBvh() : triangles(nullptr), watertight(false) {}
+
+    // objectVisibility holds the RAY_* bits by object id, nullptr makes every object visible to every ray
+    void Build(const BvhTree& tree, const std::vector<uint32_t>* objectVisibility, bool watertight = false);
+
+    bool Empty() const {
+        return nodes.empty();
+    }
+
+    // closest hit of one ray nearer than tMax, returns the triangle index and sets t, or -1
+    int Intersect(SimdLevel level, const SimdRay& ray, float& t, PrimitiveDistance primitiveDistance, float tMax = INFINITY) const;
+
+    // whether anything the ray can see lies nearer than tMax, stops at the first hit for shadow rays
+    bool Occluded(SimdLevel level, const SimdRay& ray, float tMax, PrimitiveDistance primitiveDistance) const;
+
+    // closest hits of count rays, traced together in packets of PacketWidth(level). A packet visits every node one of
+    // its rays enters, so the rays should be coherent like the camera rays of a block
+    void IntersectPacket(SimdLevel level, const SimdRay* rays, int count, float* t, int* hits, PrimitiveDistance primitiveDistance) const;
+};
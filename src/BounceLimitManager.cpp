@@ -5,9 +5,8 @@
 #include "Scene.h"
 #include "Renderer.h"
 
-BounceLimitManager::BounceLimitManager(Scene& scene, unsigned int& shaderProgramId) :
+BounceLimitManager::BounceLimitManager(Scene& scene) :
     scene(scene),
-    shaderProgramId(shaderProgramId), 
     observer([this](const KeyEvent& event) { this->OnEvent(event); })
 {}
 
@@ -17,31 +16,31 @@ void BounceLimitManager::OnEvent(const KeyEvent& event) {
     }
     switch(event.key) {
     case GLFW_KEY_GRAVE_ACCENT:
-        glUniform1ui(glGetUniformLocation(shaderProgramId, "u_BounceLimit"), 0); // view boxes
+        scene.SetBounceLimit(0); // view boxes
         scene.ResetFrameIndex();
         break;
     case GLFW_KEY_1:
-        glUniform1ui(glGetUniformLocation(shaderProgramId, "u_BounceLimit"), 1); // view normals
+        scene.SetBounceLimit(1); // view normals
         scene.ResetFrameIndex();
         return;
     case GLFW_KEY_2:
-        glUniform1ui(glGetUniformLocation(shaderProgramId, "u_BounceLimit"), 2);
+        scene.SetBounceLimit(2);
         scene.ResetFrameIndex();
         return;
     case GLFW_KEY_3:
-        glUniform1ui(glGetUniformLocation(shaderProgramId, "u_BounceLimit"), 4);
+        scene.SetBounceLimit(4);
         scene.ResetFrameIndex();
         return;
     case GLFW_KEY_4:
-        glUniform1ui(glGetUniformLocation(shaderProgramId, "u_BounceLimit"), 8);
+        scene.SetBounceLimit(8);
         scene.ResetFrameIndex();
         return;
     case GLFW_KEY_5:
-        glUniform1ui(glGetUniformLocation(shaderProgramId, "u_BounceLimit"), 16);
+        scene.SetBounceLimit(16);
         scene.ResetFrameIndex();
         return;
     case GLFW_KEY_6:
-        glUniform1ui(glGetUniformLocation(shaderProgramId, "u_BounceLimit"), 32);
+        scene.SetBounceLimit(32);
         scene.ResetFrameIndex();
         return;
     }
@@ -1,4 +1,10 @@
 #include "BvhTree.h"
+#include "ThreadPool.h"
+
+#include <bit>
+#include <queue>
+#include <tuple>
+#include <sstream>
 
 const std::vector<float> BvhTree::splitRatios = {
     0.05f, 0.10f, 0.15f, 0.20f, 0.25f, 0.30f, 0.35f, 0.40f, 0.45f, 0.50f,
@@ -16,26 +22,33 @@ std::pair<BvhTree::Dimension, float> BvhTree::SplitLongestDimension(const Boundi
     return {BvhTree::Dimension::z, box.mini.z + diff.z*0.5}; // split the z
 }
 
-float BvhTree::SurfaceArea(const Vector3f& extent) {
+float BvhTree::SurfaceArea(const Vector3f& extent) const {
     return 2.0f * (extent.x * extent.y + extent.x * extent.z + extent.y * extent.z);
 }
 
 float BvhTree::SurfaceAreaScoreOfSplit(std::vector<Tri>::iterator l, std::vector<Tri>::iterator r, std::vector<Tri>::iterator midIdx) {
-    auto [miniL, maxiL] = GetBoundingBoxOfRange(l, midIdx);
-    auto [miniR, maxiR] = GetBoundingBoxOfRange(midIdx, r);
-    Vector3f extentL = maxiL - miniL;
-    Vector3f extentR = maxiR - miniR;
-
-    float areaL = SurfaceArea(extentL);
-    float areaR = SurfaceArea(extentR);
+    AABB boundsL = GetBoundingBoxOfRange(l, midIdx);
+    AABB boundsR = GetBoundingBoxOfRange(midIdx, r);
 
     unsigned int countL = midIdx - l;
     unsigned int countR = r - midIdx;
 
-    return areaL * countL + areaR * countR;
+    return boundsL.SurfaceArea() * countL + boundsR.SurfaceArea() * countR;
 }
 
-std::pair<BvhTree::Dimension, float> BvhTree::SplitBest(std::vector<Tri>::iterator l, std::vector<Tri>::iterator r, const BoundingBox& box) {
+float BvhTree::SurfaceAreaScoreOfPlane(std::vector<Tri>::iterator l, std::vector<Tri>::iterator r, Dimension splitDimension, float splitValue, long& countL) {
+    AABB boundsL;
+    AABB boundsR;
+    countL = 0;
+    for(auto iter = l; iter != r; iter++) {
+        bool left = iter->centroid[splitDimension] < splitValue;
+        (left ? boundsL : boundsR).Grow(iter->Bounds());
+        countL += left;
+    }
+    return boundsL.SurfaceArea() * countL + boundsR.SurfaceArea() * ((r - l) - countL);
+}
+
+std::pair<BvhTree::Dimension, float> BvhTree::SplitBest(std::vector<Tri>::iterator l, std::vector<Tri>::iterator r, const BoundingBox& box, ThreadPool* pool) {
     std::vector<Vector3f> splitTestValues;
     std::vector<std::tuple<float, float, Dimension>> splitTrialResults;
     splitTestValues.reserve(splitRatios.size() * 3);
@@ -43,16 +56,28 @@ std::pair<BvhTree::Dimension, float> BvhTree::SplitBest(std::vector<Tri>::iterat
     for(const float& splitRatio : splitRatios) {
         splitTestValues.push_back(box.mini * (1 - splitRatio) + box.maxi * splitRatio);
     }
-    // Loop through every dimension (x, y, z)
-    for (int i = 0; i < 3; ++i) {
-        Dimension dim = static_cast<Dimension>(i);
-        for (auto& splitValue : splitTestValues) {
-            auto midIter = PartitionRange(l, r, dim, splitValue[i]);
-            if (midIter == l || midIter == r) continue;
-            float score = SurfaceAreaScoreOfSplit(l, r, midIter);
-            splitTrialResults.emplace_back(score, splitValue[i], dim);
+    // every dimension (x, y, z) for every ratio, the candidates are scored without reordering the range, MakeBox
+    // partitions it once by the winner
+    size_t candidates = splitTestValues.size() * 3;
+    std::vector<std::pair<float, long>> scores(candidates); // (score, triangles left of the plane)
+    auto scoreCandidate = [&](size_t candidate) {
+        Dimension dim = static_cast<Dimension>(candidate / splitTestValues.size());
+        float splitValue = splitTestValues[candidate % splitTestValues.size()][dim];
+        scores[candidate].first = SurfaceAreaScoreOfPlane(l, r, dim, splitValue, scores[candidate].second);
+    };
+    if(pool != nullptr) {
+        pool->ParallelFor(candidates, scoreCandidate);
+    } else {
+        for(size_t candidate = 0; candidate < candidates; ++candidate) {
+            scoreCandidate(candidate);
         }
     }
+    for(size_t candidate = 0; candidate < candidates; ++candidate) {
+        auto [score, countL] = scores[candidate];
+        if (countL == 0 || countL == r - l) continue;
+        Dimension dim = static_cast<Dimension>(candidate / splitTestValues.size());
+        splitTrialResults.emplace_back(score, splitTestValues[candidate % splitTestValues.size()][dim], dim);
+    }
     // Choose the best split (lowest score)
     if (!splitTrialResults.empty()) {
         auto bestSplit = *std::min_element(splitTrialResults.begin(), splitTrialResults.end());
@@ -61,47 +86,62 @@ std::pair<BvhTree::Dimension, float> BvhTree::SplitBest(std::vector<Tri>::iterat
     return SplitLongestDimension(box);
 }
 
-std::pair<Vector3f, Vector3f> BvhTree::GetBoundingBoxOfRange(std::vector<Tri>::iterator l, std::vector<Tri>::iterator r) {
-    Vector3f miniBounds(FLT_MAX, FLT_MAX, FLT_MAX);
-    Vector3f maxiBounds(-FLT_MAX, -FLT_MAX, -FLT_MAX); // Fixed: use -FLT_MAX instead of FLT_MIN
+AABB BvhTree::GetBoundingBoxOfRange(std::vector<Tri>::iterator l, std::vector<Tri>::iterator r) {
+    AABB bounds;
     for(auto iter = l; iter != r; iter++) {
-        miniBounds.x = std::min(miniBounds.x, iter->mini.x);
-        miniBounds.y = std::min(miniBounds.y, iter->mini.y);
-        miniBounds.z = std::min(miniBounds.z, iter->mini.z);
-        maxiBounds.x = std::max(maxiBounds.x, iter->maxi.x);
-        maxiBounds.y = std::max(maxiBounds.y, iter->maxi.y);
-        maxiBounds.z = std::max(maxiBounds.z, iter->maxi.z);
+        bounds.Grow(iter->Bounds());
     }
-    return {miniBounds, maxiBounds};
+    return bounds;
 }
 
 std::vector<Tri>::iterator BvhTree::PartitionRange(std::vector<Tri>::iterator lIter, std::vector<Tri>::iterator rIter, Dimension splitDimension, float splitValue) {
         auto partitionPoint = std::partition(lIter, rIter, [&](const Tri& triangle) {
-            Vector3f centroid = triangle.Centroid();
-            if (splitDimension == Dimension::x) {
-                return centroid.x < splitValue;
-            } else if (splitDimension == Dimension::y) {
-                return centroid.y < splitValue;
-            } else { // Dimension::z
-                return centroid.z < splitValue;
-            }
+            return triangle.centroid[splitDimension] < splitValue;
         });
         return partitionPoint;
     }
 
-int BvhTree::MakeBox(std::vector<Tri>::iterator l, std::vector<Tri>::iterator r, int currDepth) {
+int BvhTree::BalancedDepth(long triangleCount) const {
+    long leaves = (triangleCount + maxTrianglesPerLeaf - 1) / maxTrianglesPerLeaf;
+    int depth = 1;
+    while((1L << (depth - 1)) < leaves) {
+        depth++;
+    }
+    return depth;
+}
+
+int BvhTree::MakeBox(std::vector<Tri>::iterator l, std::vector<Tri>::iterator r, int currDepth, ParallelBuild* parallel) {
     // Base case: empty range
     if (l == r) {
         std::cout << "Warning: empty range" << std::endl;
         return -1;
     }
+    if(parallel != nullptr && r - l <= parallel->grain) {
+        boundingBoxes.emplace_back();
+        parallel->deferred.push_back({int(boundingBoxes.size()) - 1, l, r, currDepth});
+        return boundingBoxes.size() - 1;
+    }
     // create a new bounding box for all triangles in current box [l,r)
-    auto[mini, maxi] = GetBoundingBoxOfRange(l, r);
-    BoundingBox newBox = boundingBoxes.emplace_back(maxi, mini); // add to bounding boxes container and get the index
+    AABB bounds = GetBoundingBoxOfRange(l, r);
+    BoundingBox newBox = boundingBoxes.emplace_back(bounds.maxi.ToVector3f(), bounds.mini.ToVector3f()); // add to bounding boxes container and get the index
     int myIndex = boundingBoxes.size() - 1;
     if(r - l > maxTrianglesPerLeaf) {
-        maxDepth = std::max(maxDepth, currDepth);
-        auto[splitDimension, splitValue] = SplitBest(l, r, newBox);
+        if(currDepth + BalancedDepth(r - l) - 1 >= depthLimit) {
+            // out of depth budget, an object median split halves the range so the leaves land exactly on the limit
+            Dimension splitDimension = SplitLongestDimension(newBox).first;
+            boundingBoxes[myIndex].splitAxis = splitDimension;
+            auto midIter = l + (r - l) / 2;
+            std::nth_element(l, midIter, r, [&](const Tri& a, const Tri& b) {
+                return a.Centroid()[splitDimension] < b.Centroid()[splitDimension];
+            });
+            numberOfDepthLimitedSplits++;
+            numberOfsplitsTotal++;
+            boundingBoxes[myIndex].leftChildIndex = MakeBox(l, midIter, currDepth + 1, parallel);
+            boundingBoxes[myIndex].rightChildIndex = MakeBox(midIter, r, currDepth + 1, parallel);
+            return myIndex;
+        }
+        auto[splitDimension, splitValue] = SplitBest(l, r, newBox, parallel != nullptr ? &parallel->pool : nullptr);
+        boundingBoxes[myIndex].splitAxis = splitDimension;
         auto midIter = PartitionRange(l, r, splitDimension, splitValue);
         // prevent degenerate
         if(midIter == l || midIter == r) {
@@ -109,43 +149,926 @@ int BvhTree::MakeBox(std::vector<Tri>::iterator l, std::vector<Tri>::iterator r,
             std::advance(midIter, std::distance(l, r) * 0.5);
             numberOfDegenerateSplits++;
         }
-        MakeBox(l, midIter, currDepth + 1); // left child index is myindex + 1
-        boundingBoxes[myIndex].rightChildIndex = MakeBox(midIter, r, currDepth + 1);
+        if(sahTermination && r - l <= MAX_SAH_LEAF_TRIANGLES) {
+            // a leaf costs a test of every triangle, a split one node test plus the tests of the children it is expected to enter
+            float parentArea = bounds.SurfaceArea();
+            if(parentArea > 0 && intersectionCost * (r - l) <= traversalCost + intersectionCost * SurfaceAreaScoreOfSplit(l, r, midIter) / parentArea) {
+                MakeLeaf(myIndex, l, r, currDepth);
+                return myIndex;
+            }
+        }
+        boundingBoxes[myIndex].leftChildIndex = MakeBox(l, midIter, currDepth + 1, parallel); // left child index is myindex + 1
+        boundingBoxes[myIndex].rightChildIndex = MakeBox(midIter, r, currDepth + 1, parallel);
         numberOfsplitsTotal++;
     } else {
-        boundingBoxes[myIndex].triangleStartIndex = std::distance(triangles.begin(), l);
-        boundingBoxes[myIndex].triangleCount = std::distance(l, r);
-        leafDepthSum += currDepth;
-        leafNodescount++;
+        MakeLeaf(myIndex, l, r, currDepth);
     }
     return myIndex;
 };
 
+void BvhTree::MakeBoxParallel() {
+    unsigned int threads = buildThreads > 0 ? buildThreads : std::thread::hardware_concurrency();
+    if(threads < 2 || triangles.size() < PARALLEL_SAH_MIN_TRIANGLES) {
+        MakeBox(triangles.begin(), triangles.end());
+        return;
+    }
+    ThreadPool pool(threads);
+    ParallelBuild parallel{pool, std::max<long>(triangles.size() / (threads * PARALLEL_SAH_TASKS_PER_THREAD), maxTrianglesPerLeaf), {}};
+    MakeBox(triangles.begin(), triangles.end(), 1, &parallel);
+    const std::vector<DeferredRange>& deferred = parallel.deferred;
+
+    // the ranges are disjoint, so every task reorders only its own part of triangles
+    std::vector<BvhTree> subtrees(deferred.size());
+    pool.ParallelFor(deferred.size(), [&](size_t i) {
+        const DeferredRange& range = deferred[i];
+        BvhTree& subtree = subtrees[i];
+        subtree.triangles.assign(range.l, range.r);
+        subtree.maxTrianglesPerLeaf = maxTrianglesPerLeaf;
+        subtree.sahTermination = sahTermination;
+        subtree.traversalCost = traversalCost;
+        subtree.intersectionCost = intersectionCost;
+        subtree.depthLimit = depthLimit;
+        subtree.leafDepthSum = 0;
+        subtree.leafNodescount = 0;
+        subtree.boundingBoxes.reserve(subtree.triangles.size() * 2);
+        subtree.MakeBox(subtree.triangles.begin(), subtree.triangles.end(), range.depth);
+        std::move(subtree.triangles.begin(), subtree.triangles.end(), range.l);
+    });
+
+    // the root of each subtree takes the place of its placeholder and the other nodes are appended
+    for(size_t i = 0; i < deferred.size(); ++i) {
+        const BvhTree& subtree = subtrees[i];
+        int nodeOffset = boundingBoxes.size() - 1;
+        int triangleOffset = deferred[i].l - triangles.begin();
+        for(size_t j = 0; j < subtree.boundingBoxes.size(); ++j) {
+            BoundingBox box = subtree.boundingBoxes[j];
+            if(box.IsLeaf()) {
+                box.triangleStartIndex += triangleOffset;
+            } else {
+                box.leftChildIndex += nodeOffset;
+                box.rightChildIndex += nodeOffset;
+            }
+            if(j == 0) {
+                boundingBoxes[deferred[i].node] = box;
+            } else {
+                boundingBoxes.push_back(box);
+            }
+        }
+        maxDepth = std::max(maxDepth, subtree.maxDepth);
+        leafDepthSum += subtree.leafDepthSum;
+        leafNodescount += subtree.leafNodescount;
+        numberOfsplitsTotal += subtree.numberOfsplitsTotal;
+        numberOfDegenerateSplits += subtree.numberOfDegenerateSplits;
+        numberOfDepthLimitedSplits += subtree.numberOfDepthLimitedSplits;
+    }
+}
+
+void BvhTree::MakeLeaf(int index, std::vector<Tri>::iterator l, std::vector<Tri>::iterator r, int currDepth) {
+    boundingBoxes[index].triangleStartIndex = std::distance(triangles.begin(), l);
+    boundingBoxes[index].triangleCount = std::distance(l, r);
+    boundingBoxes[index].splitAxis = -1;
+    maxDepth = std::max(maxDepth, currDepth);
+    leafDepthSum += currDepth;
+    leafNodescount++;
+}
+
+void BvhTree::OrderPairsDepthFirst(int parent, bool hotFirst, std::vector<int>& pairOrder) {
+    const BoundingBox& box = boundingBoxes[parent];
+    if(box.IsLeaf()) {
+        return;
+    }
+    pairOrder.push_back(parent);
+    int first = box.leftChildIndex;
+    int second = box.rightChildIndex;
+    if(hotFirst) {
+        const BoundingBox& left = boundingBoxes[first];
+        const BoundingBox& right = boundingBoxes[second];
+        if(SurfaceArea(right.maxi - right.mini) > SurfaceArea(left.maxi - left.mini)) {
+            std::swap(first, second);
+        }
+    }
+    OrderPairsDepthFirst(first, hotFirst, pairOrder);
+    OrderPairsDepthFirst(second, hotFirst, pairOrder);
+}
+
+int BvhTree::PairHeight(int parent, std::vector<int>& heights) {
+    const BoundingBox& box = boundingBoxes[parent];
+    if(box.IsLeaf()) {
+        return 0;
+    }
+    heights[parent] = 1 + std::max(PairHeight(box.leftChildIndex, heights), PairHeight(box.rightChildIndex, heights));
+    return heights[parent];
+}
+
+void BvhTree::GatherPairsAtDepth(int parent, int depth, std::vector<int>& pairs) {
+    const BoundingBox& box = boundingBoxes[parent];
+    if(box.IsLeaf()) {
+        return;
+    }
+    if(depth == 0) {
+        pairs.push_back(parent);
+        return;
+    }
+    GatherPairsAtDepth(box.leftChildIndex, depth - 1, pairs);
+    GatherPairsAtDepth(box.rightChildIndex, depth - 1, pairs);
+}
+
+void BvhTree::OrderPairsVanEmdeBoas(int parent, int height, std::vector<int>& heights, std::vector<int>& pairOrder) {
+    height = std::min(height, heights[parent]);
+    if(height <= 1) {
+        pairOrder.push_back(parent);
+        return;
+    }
+    // lay out the top half of the levels as one block, then every subtree hanging below it as its own block
+    int topHeight = height / 2;
+    OrderPairsVanEmdeBoas(parent, topHeight, heights, pairOrder);
+    std::vector<int> bottomPairs;
+    GatherPairsAtDepth(parent, topHeight, bottomPairs);
+    for(int bottomPair : bottomPairs) {
+        OrderPairsVanEmdeBoas(bottomPair, height - topHeight, heights, pairOrder);
+    }
+}
+
+void BvhTree::ApplyLayout() {
+    std::vector<int> pairOrder;
+    pairOrder.reserve(boundingBoxes.size() / 2);
+    if(layout == BvhLayout::VAN_EMDE_BOAS) {
+        std::vector<int> heights(boundingBoxes.size(), 0);
+        int height = PairHeight(0, heights);
+        if(height > 0) {
+            OrderPairsVanEmdeBoas(0, height, heights, pairOrder);
+        }
+    } else {
+        OrderPairsDepthFirst(0, layout == BvhLayout::HOT_FIRST, pairOrder);
+    }
+
+    // the children of parent pairOrder[k] move to 2 + 2k and 3 + 2k, index 1 stays unused so pairs are 64 byte aligned
+    std::vector<int> newIndex(boundingBoxes.size(), 0);
+    for(size_t k = 0; k < pairOrder.size(); ++k) {
+        newIndex[boundingBoxes[pairOrder[k]].leftChildIndex] = 2 + 2 * k;
+        newIndex[boundingBoxes[pairOrder[k]].rightChildIndex] = 3 + 2 * k;
+    }
+    std::vector<BoundingBox> orderedBoxes(2 + 2 * pairOrder.size());
+    orderedBoxes[0] = boundingBoxes[0];
+    orderedBoxes[1] = BoundingBox(Vector3f(-FLT_MAX, -FLT_MAX, -FLT_MAX), Vector3f(FLT_MAX, FLT_MAX, FLT_MAX));
+    for(size_t i = 1; i < boundingBoxes.size(); ++i) {
+        orderedBoxes[newIndex[i]] = boundingBoxes[i];
+    }
+
+    // remap the children and store the triangles of each leaf in the order the leaves now appear
+    std::vector<Tri> orderedTriangles;
+    orderedTriangles.reserve(triangles.size());
+    for(auto& box : orderedBoxes) {
+        if(box.IsLeaf()) {
+            int start = orderedTriangles.size();
+            orderedTriangles.insert(orderedTriangles.end(), triangles.begin() + box.triangleStartIndex, triangles.begin() + box.triangleStartIndex + box.triangleCount);
+            box.triangleStartIndex = start;
+        } else if(box.leftChildIndex > 0) {
+            box.leftChildIndex = newIndex[box.leftChildIndex];
+            box.rightChildIndex = newIndex[box.rightChildIndex];
+        }
+    }
+    boundingBoxes = std::move(orderedBoxes);
+    triangles = std::move(orderedTriangles);
+}
+
+// splits a convex polygon by the plane where the axis coordinate equals value
+static void ClipPolygon(const std::vector<Vector3f>& polygon, int axis, float value, std::vector<Vector3f>& below, std::vector<Vector3f>& above) {
+    for(size_t i = 0; i < polygon.size(); ++i) {
+        Vector3f a = polygon[i];
+        Vector3f b = polygon[(i + 1) % polygon.size()];
+        float da = a[axis] - value;
+        float db = b[axis] - value;
+        if(da <= 0) below.push_back(a);
+        if(da >= 0) above.push_back(a);
+        if((da < 0 && db > 0) || (da > 0 && db < 0)) {
+            Vector3f crossing = a + (b - a) * (da / (da - db));
+            crossing[axis] = value;
+            below.push_back(crossing);
+            above.push_back(crossing);
+        }
+    }
+}
+
+void BvhTree::SplitReference(const Tri& source, const std::vector<Vector3f>& polygon, float maxArea, int depthLeft, std::vector<Tri>& references) {
+    AABB bounds;
+    for(const Vector3f& point : polygon) {
+        bounds.Grow(Vec4(point));
+    }
+    Vector3f mini = bounds.mini.ToVector3f();
+    Vector3f maxi = bounds.maxi.ToVector3f();
+    Vector3f extent = maxi - mini;
+    if(depthLeft == 0 || SurfaceArea(extent) <= maxArea) {
+        Tri reference = source;
+        reference.bounds = bounds;
+        reference.centroid = bounds.Center();
+        references.push_back(reference);
+        return;
+    }
+    int axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z ? 1 : 2);
+    std::vector<Vector3f> below, above;
+    ClipPolygon(polygon, axis, mini[axis] + extent[axis] * 0.5f, below, above);
+    if(below.size() >= 3) SplitReference(source, below, maxArea, depthLeft - 1, references);
+    if(above.size() >= 3) SplitReference(source, above, maxArea, depthLeft - 1, references);
+}
+
+void BvhTree::PreSplit() {
+    float maxArea = preSplitFraction * GetBoundingBoxOfRange(triangles.begin(), triangles.end()).SurfaceArea();
+    numberOfSourceTriangles = triangles.size();
+    std::vector<Tri> references;
+    references.reserve(triangles.size());
+    for(size_t i = 0; i < triangles.size(); ++i) {
+        Tri source = triangles[i];
+        source.sourceIndex = i;
+        // a box that already hugs its triangle (e.g. axis aligned quads) gains nothing from being split, nor do primitives
+        float boxArea = source.bounds.SurfaceArea();
+        Vector3f normal = (source.pos2 - source.pos1).Cross(source.pos3 - source.pos1);
+        float triangleArea = sqrt(normal.x * normal.x + normal.y * normal.y + normal.z * normal.z) * 0.5f;
+        if(source.primitive != Primitive::TRIANGLE || boxArea <= maxArea || boxArea <= PRESPLIT_MIN_LOOSENESS * 2.0f * triangleArea) {
+            references.push_back(source);
+            continue;
+        }
+        SplitReference(source, {source.pos1, source.pos2, source.pos3}, maxArea, MAX_PRESPLIT_DEPTH, references);
+    }
+    triangles = std::move(references);
+}
+
+void BvhTree::ResolveReferences() {
+    std::vector<int> uniqueIndex(numberOfSourceTriangles, -1);
+    std::vector<Tri> uniqueTriangles;
+    uniqueTriangles.reserve(numberOfSourceTriangles);
+    triangleReferences.clear();
+    triangleReferences.reserve(triangles.size());
+    for(const auto& reference : triangles) {
+        int& index = uniqueIndex[reference.sourceIndex];
+        if(index < 0) { // first use, keeps the triangles in the order their leaves are stored
+            index = uniqueTriangles.size();
+            uniqueTriangles.emplace_back(reference.primitive, reference.pos1, reference.pos2, reference.pos3, reference.materialsIndex);
+        }
+        triangleReferences.push_back(index);
+    }
+    triangles = std::move(uniqueTriangles);
+}
+
+BvhQualityReport BvhTree::GetQualityReport() const {
+    BvhQualityReport report;
+    report.builder = builder == BvhBuilder::MORTON ? "morton" : "sah";
+    report.leafTriangles = maxTrianglesPerLeaf;
+    report.sahTermination = sahTermination;
+    report.buildMilliseconds = lastBuildMilliseconds;
+    report.triangleCount = triangles.size();
+    if(boundingBoxes.empty()) {
+        return report;
+    }
+    float rootArea = SurfaceArea(boundingBoxes[0].maxi - boundingBoxes[0].mini);
+    float areaScale = rootArea > 0 ? 1.0f / rootArea : 0.0f;
+    // a node is tested whenever its parent was entered, and a box is entered with probability area / root area
+    report.expectedNodeTests = 1.0f;
+    long leafDepthSum = 0;
+    std::vector<std::pair<int, int>> stack = {{0, 1}}; // (node, depth)
+    while(!stack.empty()) {
+        auto [node, depth] = stack.back();
+        stack.pop_back();
+        const BoundingBox& box = boundingBoxes[node];
+        float entered = rootArea > 0 ? SurfaceArea(box.maxi - box.mini) * areaScale : 1.0f;
+        report.nodeCount++;
+        if(box.IsLeaf()) {
+            report.leafCount++;
+            report.referenceCount += box.triangleCount;
+            report.expectedTriangleTests += entered * box.triangleCount;
+            report.maxDepth = std::max(report.maxDepth, depth);
+            leafDepthSum += depth;
+            if(report.leafSizeHistogram.size() <= size_t(box.triangleCount)) {
+                report.leafSizeHistogram.resize(box.triangleCount + 1, 0);
+            }
+            report.leafSizeHistogram[box.triangleCount]++;
+            if(report.depthHistogram.size() <= size_t(depth)) {
+                report.depthHistogram.resize(depth + 1, 0);
+            }
+            report.depthHistogram[depth]++;
+            continue;
+        }
+        report.expectedNodeTests += 2.0f * entered;
+        const BoundingBox& left = boundingBoxes[box.leftChildIndex];
+        const BoundingBox& right = boundingBoxes[box.rightChildIndex];
+        Vector3f overlap(std::min(left.maxi.x, right.maxi.x) - std::max(left.mini.x, right.mini.x),
+                         std::min(left.maxi.y, right.maxi.y) - std::max(left.mini.y, right.mini.y),
+                         std::min(left.maxi.z, right.maxi.z) - std::max(left.mini.z, right.mini.z));
+        if(overlap.x >= 0 && overlap.y >= 0 && overlap.z >= 0) {
+            report.siblingOverlapArea += SurfaceArea(overlap) * areaScale;
+        }
+        stack.emplace_back(box.leftChildIndex, depth + 1);
+        stack.emplace_back(box.rightChildIndex, depth + 1);
+    }
+    report.averageLeafDepth = float(leafDepthSum) / report.leafCount;
+    report.sahCost = traversalCost * report.expectedNodeTests + intersectionCost * report.expectedTriangleTests;
+    return report;
+}
+
+static std::string JsonArray(const std::vector<int>& values) {
+    std::string json = "[";
+    for(size_t i = 0; i < values.size(); ++i) {
+        json += (i > 0 ? ", " : "") + std::to_string(values[i]);
+    }
+    return json + "]";
+}
+
+std::string BvhQualityReport::ToJson() const {
+    std::ostringstream json;
+    json << "{\n"
+         << "  \"builder\": \"" << builder << "\",\n"
+         << "  \"buildMilliseconds\": " << buildMilliseconds << ",\n"
+         << "  \"leafTriangles\": " << leafTriangles << ",\n"
+         << "  \"sahTermination\": " << (sahTermination ? "true" : "false") << ",\n"
+         << "  \"nodeCount\": " << nodeCount << ",\n"
+         << "  \"leafCount\": " << leafCount << ",\n"
+         << "  \"triangleCount\": " << triangleCount << ",\n"
+         << "  \"referenceCount\": " << referenceCount << ",\n"
+         << "  \"maxDepth\": " << maxDepth << ",\n"
+         << "  \"averageLeafDepth\": " << averageLeafDepth << ",\n"
+         << "  \"expectedNodeTests\": " << expectedNodeTests << ",\n"
+         << "  \"expectedTriangleTests\": " << expectedTriangleTests << ",\n"
+         << "  \"sahCost\": " << sahCost << ",\n"
+         << "  \"siblingOverlapArea\": " << siblingOverlapArea << ",\n"
+         << "  \"leafSizeHistogram\": " << JsonArray(leafSizeHistogram) << ",\n"
+         << "  \"depthHistogram\": " << JsonArray(depthHistogram) << "\n"
+         << "}\n";
+    return json.str();
+}
+
 void BvhTree::SetTriangles(std::vector<Tri> newTriangles) {
     triangles = newTriangles;
     boundingBoxes.clear(); // Clear previous tree when setting new triangles
 }
 
+// spreads the low 10 bits of v out so there are two zero bits between each of them
+static unsigned int ExpandBits(unsigned int v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+void BvhTree::SortByMortonCode() {
+    AABB scene = GetBoundingBoxOfRange(triangles.begin(), triangles.end());
+    Vector3f sceneMini = scene.mini.ToVector3f();
+    Vector3f extent = scene.Extent().ToVector3f();
+    const float cells = float(1 << MORTON_BITS_PER_AXIS);
+    std::vector<std::pair<unsigned int, int>> order(triangles.size());
+    for(size_t i = 0; i < triangles.size(); ++i) {
+        const Vec4& centroid = triangles[i].Centroid();
+        unsigned int cell[3];
+        for(int axis = 0; axis < 3; ++axis) {
+            float t = extent[axis] > 0 ? (centroid[axis] - sceneMini[axis]) / extent[axis] : 0.0f;
+            cell[axis] = std::min((unsigned int)std::max(t * cells, 0.0f), (unsigned int)cells - 1);
+        }
+        // x owns the highest bit of every group of three, then y, then z
+        order[i] = {(ExpandBits(cell[0]) << 2) | (ExpandBits(cell[1]) << 1) | ExpandBits(cell[2]), int(i)};
+    }
+    std::sort(order.begin(), order.end());
+    std::vector<Tri> sorted;
+    sorted.reserve(triangles.size());
+    mortonCodes.resize(triangles.size());
+    for(size_t i = 0; i < order.size(); ++i) {
+        sorted.push_back(triangles[order[i].second]);
+        mortonCodes[i] = order[i].first;
+    }
+    triangles = std::move(sorted);
+}
+
+int BvhTree::MakeMortonBox(int first, int last, int currDepth) {
+    auto l = triangles.begin() + first;
+    auto r = triangles.begin() + last;
+    AABB bounds = GetBoundingBoxOfRange(l, r);
+    boundingBoxes.emplace_back(bounds.maxi.ToVector3f(), bounds.mini.ToVector3f());
+    int myIndex = boundingBoxes.size() - 1;
+    if(last - first <= maxTrianglesPerLeaf) {
+        boundingBoxes[myIndex].triangleStartIndex = first;
+        boundingBoxes[myIndex].triangleCount = last - first;
+        maxDepth = std::max(maxDepth, currDepth);
+        leafDepthSum += currDepth;
+        leafNodescount++;
+        return myIndex;
+    }
+    unsigned int differingBits = mortonCodes[first] ^ mortonCodes[last - 1];
+    int mid = first + (last - first) / 2;
+    if(differingBits == 0 || currDepth + BalancedDepth(last - first) - 1 >= depthLimit) {
+        // identical codes or out of depth budget, the range is already in curve order so halving it keeps both sides compact
+        boundingBoxes[myIndex].splitAxis = SplitLongestDimension(boundingBoxes[myIndex]).first;
+        if(differingBits != 0) {
+            numberOfDepthLimitedSplits++;
+        }
+    } else {
+        // codes in the range share every bit above the highest differing one, so the lower side is the prefix where it is 0
+        int bit = 31 - std::countl_zero(differingBits);
+        boundingBoxes[myIndex].splitAxis = 2 - bit % 3;
+        mid = std::partition_point(mortonCodes.begin() + first, mortonCodes.begin() + last, [bit](unsigned int code) {
+            return ((code >> bit) & 1) == 0;
+        }) - mortonCodes.begin();
+    }
+    if(sahTermination && last - first <= MAX_SAH_LEAF_TRIANGLES) {
+        // the same leaf or split decision as MakeBox, with the split the curve picked
+        float parentArea = bounds.SurfaceArea();
+        if(parentArea > 0 && intersectionCost * (last - first) <= traversalCost + intersectionCost * SurfaceAreaScoreOfSplit(l, r, triangles.begin() + mid) / parentArea) {
+            MakeLeaf(myIndex, l, r, currDepth);
+            return myIndex;
+        }
+    }
+    numberOfsplitsTotal++;
+    boundingBoxes[myIndex].leftChildIndex = MakeMortonBox(first, mid, currDepth + 1);
+    boundingBoxes[myIndex].rightChildIndex = MakeMortonBox(mid, last, currDepth + 1);
+    return myIndex;
+}
+
 std::pair<std::vector<BoundingBox>, std::vector<Tri>> BvhTree::BuildTree() {
+    // every build logs and reports its own counts, not the sum over the rebuilds and auto-tune candidates before it
     leafDepthSum = 0;
     leafNodescount = 0;
+    maxDepth = 0;
+    numberOfsplitsTotal = 0;
+    numberOfDegenerateSplits = 0;
+    numberOfDepthLimitedSplits = 0;
+    updatesPrepared = false;
     if (triangles.empty()) {
         std::cout << "Warning: no triangles to build tree from" << std::endl;
     } else {
         auto begin = std::chrono::steady_clock::now();
         
         boundingBoxes.clear(); // Clear previous tree
+        triangleReferences.clear();
+        if(preSplitFraction > 0) {
+            PreSplit();
+        }
         boundingBoxes.reserve(triangles.size() * 2); // Reserve space for bounding boxes
         
-        MakeBox(triangles.begin(), triangles.end());
+        if(builder == BvhBuilder::MORTON) {
+            SortByMortonCode();
+            MakeMortonBox(0, triangles.size());
+            mortonCodes.clear();
+        } else {
+            MakeBoxParallel();
+        }
+        ApplyLayout();
+        if(preSplitFraction > 0) {
+            ResolveReferences();
+        }
 
         auto end = std::chrono::steady_clock::now();
-        std::cout << "constructing BVH structure took: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << "ms" << std::endl;
-        std::cout << "number of bounding boxes: " << boundingBoxes.size() + 1 << std::endl;
+        lastBuildMilliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+        if(!verbose) {
+            return {boundingBoxes, triangles};
+        }
+        std::cout << "constructing " << (builder == BvhBuilder::MORTON ? "morton" : "sah") << " BVH structure took: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << "ms" << std::endl;
+        std::cout << "number of bounding boxes: " << boundingBoxes.size() - 1 << std::endl;
         std::cout << "number of total splits: " << numberOfsplitsTotal << std::endl;
         std::cout << "number of degenerate splits: " << numberOfDegenerateSplits << ", as a percentage of total: " << float(numberOfDegenerateSplits)/numberOfsplitsTotal << std::endl;
         std::cout << "number of leaf nodes: " << leafNodescount << std::endl;
-        std::cout << "maximum depth of leaf nodes " << maxDepth << ", average depth: " << float(leafDepthSum)/leafNodescount << std::endl;
+        std::cout << "maximum depth of leaf nodes " << maxDepth << " (limit " << depthLimit << "), average depth: " << float(leafDepthSum)/leafNodescount << std::endl;
+        std::cout << "number of depth limited median splits: " << numberOfDepthLimitedSplits << std::endl;
+        if(preSplitFraction > 0) {
+            std::cout << "number of pre-split references: " << triangleReferences.size() << " from " << triangles.size() << " triangles" << std::endl;
+        }
+        BvhQualityReport report = GetQualityReport();
+        std::cout << "expected node visits per ray: " << report.expectedNodeTests << ", triangle tests per ray: " << report.expectedTriangleTests << std::endl;
+        std::cout << "SAH cost: " << report.sahCost << ", sibling overlap area: " << report.siblingOverlapArea << std::endl;
     }
     return {boundingBoxes, triangles};
-};
\ No newline at end of file
+};
+
+static void Enclose(Vector3f& mini, Vector3f& maxi, const Vector3f& otherMini, const Vector3f& otherMaxi) {
+    AABB bounds(mini, maxi);
+    bounds.Grow(AABB(otherMini, otherMaxi));
+    mini = bounds.mini.ToVector3f();
+    maxi = bounds.maxi.ToVector3f();
+}
+
+int BvhTree::ComputeHeight(int node) {
+    const BoundingBox& box = boundingBoxes[node];
+    if(box.IsLeaf()) {
+        for(int slot = box.triangleStartIndex; slot < box.triangleStartIndex + box.triangleCount; ++slot) {
+            leavesOfObject[triangles[SlotTriangle(slot)].materialsIndex].insert(node);
+        }
+        nodeHeights[node] = 1;
+        return 1;
+    }
+    parentIndex[box.leftChildIndex] = node;
+    parentIndex[box.rightChildIndex] = node;
+    nodeHeights[node] = 1 + std::max(ComputeHeight(box.leftChildIndex), ComputeHeight(box.rightChildIndex));
+    return nodeHeights[node];
+}
+
+void BvhTree::PrepareForUpdates() {
+    if(updatesPrepared) {
+        return;
+    }
+    parentIndex.assign(boundingBoxes.size(), -1);
+    nodeHeights.assign(boundingBoxes.size(), 0);
+    leavesOfObject.clear();
+    freePairs.clear();
+    freeSlots.clear();
+    freeTriangles.clear();
+    ComputeHeight(0);
+    updatesPrepared = true;
+}
+
+void BvhTree::SwapSlots(int a, int b) {
+    if(triangleReferences.empty()) {
+        std::swap(triangles[a], triangles[b]);
+    } else {
+        std::swap(triangleReferences[a], triangleReferences[b]);
+    }
+}
+
+int BvhTree::AllocatePair() {
+    if(!freePairs.empty()) {
+        int pair = freePairs.back();
+        freePairs.pop_back();
+        return pair;
+    }
+    int pair = boundingBoxes.size();
+    boundingBoxes.resize(pair + 2);
+    parentIndex.resize(pair + 2, -1);
+    nodeHeights.resize(pair + 2, 0);
+    return pair;
+}
+
+int BvhTree::AllocateSlots(int count) {
+    for(auto range = freeSlots.begin(); range != freeSlots.end(); ++range) {
+        if(range->second - range->first < count) {
+            continue;
+        }
+        int first = range->first;
+        range->first += count;
+        if(range->first == range->second) {
+            freeSlots.erase(range);
+        }
+        return first;
+    }
+    return -1;
+}
+
+void BvhTree::ReleaseSlots(int first, int last) {
+    if(first == last) {
+        return;
+    }
+    // ranges that touch the released one are merged with it so a whole object comes back as one range
+    auto next = std::lower_bound(freeSlots.begin(), freeSlots.end(), std::make_pair(first, last));
+    if(next != freeSlots.end() && next->first == last) {
+        last = next->second;
+        next = freeSlots.erase(next);
+    }
+    if(next != freeSlots.begin() && std::prev(next)->second == first) {
+        std::prev(next)->second = last;
+        return;
+    }
+    freeSlots.insert(next, {first, last});
+}
+
+int BvhTree::FreeSlotCount() const {
+    int count = 0;
+    for(auto [first, last] : freeSlots) {
+        count += last - first;
+    }
+    return count;
+}
+
+// merges sorted indices into [first, last) runs
+static void AppendRuns(std::vector<int> indices, std::vector<std::pair<int, int>>& runs) {
+    std::sort(indices.begin(), indices.end());
+    for(int index : indices) {
+        if(!runs.empty() && runs.back().second == index) {
+            runs.back().second++;
+        } else {
+            runs.emplace_back(index, index + 1);
+        }
+    }
+}
+
+void BvhTree::MoveNode(int from, int to, BvhUpdate& update) {
+    const BoundingBox moved = boundingBoxes[from];
+    boundingBoxes[to] = moved;
+    nodeHeights[to] = nodeHeights[from];
+    if(moved.IsLeaf()) {
+        for(int slot = moved.triangleStartIndex; slot < moved.triangleStartIndex + moved.triangleCount; ++slot) {
+            auto& leaves = leavesOfObject[triangles[SlotTriangle(slot)].materialsIndex];
+            leaves.erase(from);
+            leaves.insert(to);
+        }
+    } else { // the children stay where they are, only their parent link changes
+        parentIndex[moved.leftChildIndex] = to;
+        parentIndex[moved.rightChildIndex] = to;
+        update.nodes.push_back(moved.leftChildIndex);
+        update.nodes.push_back(moved.rightChildIndex);
+    }
+    update.nodes.push_back(to);
+}
+
+void BvhTree::Refit(int node, BvhUpdate& update) {
+    if(parentIndex[node] == FREED_NODE) {
+        return;
+    }
+    for(; node >= 0; node = parentIndex[node]) {
+        BoundingBox& box = boundingBoxes[node];
+        AABB bounds;
+        if(box.IsLeaf()) {
+            for(int slot = box.triangleStartIndex; slot < box.triangleStartIndex + box.triangleCount; ++slot) {
+                bounds.Grow(triangles[SlotTriangle(slot)].bounds);
+            }
+            nodeHeights[node] = 1;
+        } else {
+            const BoundingBox& left = boundingBoxes[box.leftChildIndex];
+            const BoundingBox& right = boundingBoxes[box.rightChildIndex];
+            bounds.Grow(AABB(left.mini, left.maxi));
+            bounds.Grow(AABB(right.mini, right.maxi));
+            nodeHeights[node] = 1 + std::max(nodeHeights[box.leftChildIndex], nodeHeights[box.rightChildIndex]);
+        }
+        box.mini = bounds.mini.ToVector3f();
+        box.maxi = bounds.maxi.ToVector3f();
+        update.nodes.push_back(node);
+    }
+    maxDepth = nodeHeights[0];
+}
+
+int BvhTree::FindInsertionSibling(const BoundingBox& box, int height) {
+    // a sibling costs the area of the new parent plus how much every ancestor grows, the growth so far is a lower
+    // bound for everything below a node so whole subtrees are skipped once it passes the best cost found
+    using Candidate = std::tuple<float, int, int>; // (growth of the ancestors, node, depth)
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> candidates;
+    candidates.emplace(0.0f, 0, 1);
+    float boxArea = SurfaceArea(box.maxi - box.mini);
+    float bestCost = FLT_MAX;
+    int best = -1;
+    while(!candidates.empty()) {
+        auto [growth, node, depth] = candidates.top();
+        candidates.pop();
+        if(growth + boxArea >= bestCost) {
+            break;
+        }
+        const BoundingBox& candidate = boundingBoxes[node];
+        Vector3f mini = candidate.mini;
+        Vector3f maxi = candidate.maxi;
+        Enclose(mini, maxi, box.mini, box.maxi);
+        float unionArea = SurfaceArea(maxi - mini);
+        if(growth + unionArea < bestCost && depth + std::max(nodeHeights[node], height) <= depthLimit) {
+            bestCost = growth + unionArea;
+            best = node;
+        }
+        if(!candidate.IsLeaf()) {
+            float childGrowth = growth + unionArea - SurfaceArea(candidate.maxi - candidate.mini);
+            if(childGrowth + boxArea < bestCost) {
+                candidates.emplace(childGrowth, candidate.leftChildIndex, depth + 1);
+                candidates.emplace(childGrowth, candidate.rightChildIndex, depth + 1);
+            }
+        }
+    }
+    return best;
+}
+
+std::vector<Tri> BvhTree::LiveTriangles() {
+    std::vector<Tri> live;
+    std::vector<bool> taken(triangles.size(), false);
+    std::vector<int> stack = {0};
+    while(!stack.empty()) {
+        const BoundingBox& box = boundingBoxes[stack.back()];
+        stack.pop_back();
+        if(!box.IsLeaf()) {
+            stack.push_back(box.leftChildIndex);
+            stack.push_back(box.rightChildIndex);
+            continue;
+        }
+        for(int slot = box.triangleStartIndex; slot < box.triangleStartIndex + box.triangleCount; ++slot) {
+            int triangle = SlotTriangle(slot);
+            if(!taken[triangle]) {
+                taken[triangle] = true;
+                live.push_back(triangles[triangle]);
+            }
+        }
+    }
+    return live;
+}
+
+void BvhTree::Rebuild(std::vector<Tri> newTriangles, BvhUpdate& update) {
+    SetTriangles(std::move(newTriangles));
+    if(!triangles.empty()) {
+        BuildTree();
+    }
+    update.rebuilt = true;
+}
+
+BvhUpdate BvhTree::Insert(std::vector<Tri> newTriangles) {
+    BvhUpdate update;
+    if(newTriangles.empty()) {
+        return update;
+    }
+    if(boundingBoxes.empty()) {
+        Rebuild(std::move(newTriangles), update);
+        return update;
+    }
+    PrepareForUpdates();
+
+    BvhTree subtree(std::move(newTriangles), maxTrianglesPerLeaf);
+    subtree.verbose = false;
+    subtree.sahTermination = sahTermination;
+    subtree.SetCosts(traversalCost, intersectionCost);
+    subtree.SetLayout(layout);
+    subtree.BuildTree();
+    int sibling = FindInsertionSibling(subtree.boundingBoxes[0], subtree.maxDepth);
+    if(sibling < 0) { // the tree is too deep to take it anywhere, start over with everything
+        std::vector<Tri> all = LiveTriangles();
+        all.insert(all.end(), subtree.triangles.begin(), subtree.triangles.end());
+        Rebuild(std::move(all), update);
+        return update;
+    }
+
+    // the leaves of the subtree need consecutive slots, the ones a removed object left are reused when they are long
+    // enough. Once the holes outnumber the used slots the tree is rebuilt without them, so edits cannot grow the buffers
+    // without bound
+    int count = subtree.triangles.size();
+    int slotBase = AllocateSlots(count);
+    int slotCount = triangleReferences.empty() ? triangles.size() : triangleReferences.size();
+    if(slotBase < 0 && FreeSlotCount() * 2 > slotCount) {
+        std::vector<Tri> all = LiveTriangles();
+        all.insert(all.end(), subtree.triangles.begin(), subtree.triangles.end());
+        Rebuild(std::move(all), update);
+        return update;
+    }
+    if(slotBase < 0) {
+        slotBase = slotCount;
+    }
+    if(triangleReferences.empty()) {
+        if(size_t(slotBase) == triangles.size()) {
+            triangles.insert(triangles.end(), subtree.triangles.begin(), subtree.triangles.end());
+        } else { // a hole of a removed object that is long enough
+            std::copy(subtree.triangles.begin(), subtree.triangles.end(), triangles.begin() + slotBase);
+        }
+        update.triangles.emplace_back(slotBase, slotBase + count);
+    } else { // each reference may point anywhere, so single freed triangles are filled as well
+        triangleReferences.resize(std::max<size_t>(triangleReferences.size(), slotBase + count));
+        std::vector<int> written;
+        for(int i = 0; i < count; ++i) {
+            int triangle = triangles.size();
+            if(!freeTriangles.empty()) {
+                triangle = freeTriangles.back();
+                freeTriangles.pop_back();
+                triangles[triangle] = subtree.triangles[i];
+            } else {
+                triangles.push_back(subtree.triangles[i]);
+            }
+            triangleReferences[slotBase + i] = triangle;
+            written.push_back(triangle);
+        }
+        AppendRuns(std::move(written), update.triangles);
+        update.references.emplace_back(slotBase, slotBase + count);
+    }
+
+    // the sibling moves down into a new pair next to the sub tree's root and a new parent takes its place
+    int pair = AllocatePair();
+    std::vector<int> newIndex(subtree.boundingBoxes.size(), -1);
+    for(size_t i = 2; i < subtree.boundingBoxes.size(); i += 2) {
+        int subtreePair = AllocatePair();
+        newIndex[i] = subtreePair;
+        newIndex[i + 1] = subtreePair + 1;
+    }
+    const BoundingBox& subtreeRoot = subtree.boundingBoxes[0];
+    BoundingBox parent = boundingBoxes[sibling];
+    Enclose(parent.mini, parent.maxi, subtreeRoot.mini, subtreeRoot.maxi);
+    Vector3f siblingCenter = (boundingBoxes[sibling].mini + boundingBoxes[sibling].maxi) * 0.5f;
+    Vector3f subtreeCenter = (subtreeRoot.mini + subtreeRoot.maxi) * 0.5f;
+    Vector3f offset = subtreeCenter - siblingCenter;
+    int axis = 0;
+    for(int i = 1; i < 3; ++i) {
+        if(std::abs(offset[i]) > std::abs(offset[axis])) {
+            axis = i;
+        }
+    }
+    bool subtreeFirst = offset[axis] < 0; // the left child is on the lower side of the split axis
+    newIndex[0] = subtreeFirst ? pair : pair + 1;
+    MoveNode(sibling, subtreeFirst ? pair + 1 : pair, update);
+    parentIndex[pair] = sibling;
+    parentIndex[pair + 1] = sibling;
+    parent.leftChildIndex = pair;
+    parent.rightChildIndex = pair + 1;
+    parent.triangleStartIndex = 0;
+    parent.triangleCount = 0;
+    parent.splitAxis = axis;
+    boundingBoxes[sibling] = parent;
+
+    for(size_t i = 0; i < subtree.boundingBoxes.size(); ++i) {
+        if(newIndex[i] < 0) {
+            continue;
+        }
+        BoundingBox box = subtree.boundingBoxes[i];
+        if(box.IsLeaf()) {
+            box.triangleStartIndex += slotBase;
+        } else {
+            box.leftChildIndex = newIndex[box.leftChildIndex];
+            box.rightChildIndex = newIndex[box.rightChildIndex];
+        }
+        boundingBoxes[newIndex[i]] = box;
+        update.nodes.push_back(newIndex[i]);
+    }
+    ComputeHeight(newIndex[0]);
+    Refit(sibling, update);
+    return update;
+}
+
+BvhUpdate BvhTree::Remove(int materialsIndex) {
+    BvhUpdate update;
+    if(boundingBoxes.empty()) {
+        return update;
+    }
+    PrepareForUpdates();
+    auto found = leavesOfObject.find(materialsIndex);
+    if(found == leavesOfObject.end()) {
+        return update;
+    }
+    std::unordered_set<int>& leaves = found->second;
+    std::vector<int> refitFrom;
+    while(!leaves.empty()) {
+        int leaf = *leaves.begin();
+        leaves.erase(leaves.begin());
+        int start = boundingBoxes[leaf].triangleStartIndex;
+        int count = boundingBoxes[leaf].triangleCount;
+        // the slots of other objects move to the front of the leaf
+        int kept = 0;
+        for(int slot = start; slot < start + count; ++slot) {
+            if(triangles[SlotTriangle(slot)].materialsIndex != materialsIndex) {
+                SwapSlots(start + kept, slot);
+                kept++;
+            }
+        }
+        (triangleReferences.empty() ? update.triangles : update.references).emplace_back(start, start + count);
+        boundingBoxes[leaf].triangleCount = kept;
+        ReleaseSlots(start + kept, start + count);
+        for(int slot = start + kept; slot < start + count; ++slot) {
+            Tri& triangle = triangles[SlotTriangle(slot)];
+            if(triangle.materialsIndex == FREED_TRIANGLE) { // pre-split triangles have several references
+                continue;
+            }
+            triangle.materialsIndex = FREED_TRIANGLE;
+            if(!triangleReferences.empty()) {
+                freeTriangles.push_back(SlotTriangle(slot));
+            }
+        }
+        if(kept > 0) {
+            refitFrom.push_back(leaf);
+            continue;
+        }
+        if(leaf == 0) { // that was the only leaf
+            Rebuild({}, update);
+            return update;
+        }
+        // the emptied leaf's sibling takes the place of their parent
+        int parent = parentIndex[leaf];
+        MoveNode(leaf ^ 1, parent, update);
+        parentIndex[leaf & ~1] = FREED_NODE;
+        parentIndex[leaf | 1] = FREED_NODE;
+        freePairs.push_back(leaf & ~1);
+        refitFrom.push_back(parent);
+    }
+    leavesOfObject.erase(found);
+    for(int node : refitFrom) {
+        Refit(node, update);
+    }
+    return update;
+}
+
+void BvhTree::AutoTune(int sampleSize) {
+    if(triangles.empty()) {
+        return;
+    }
+    auto begin = std::chrono::steady_clock::now();
+    int stride = std::max<int>(1, (triangles.size() + sampleSize - 1) / sampleSize);
+    std::vector<Tri> sample;
+    sample.reserve(triangles.size() / stride + 1);
+    for(size_t i = 0; i < triangles.size(); i += stride) {
+        sample.push_back(triangles[i]);
+    }
+    const std::vector<int> leafSizes = {1, 2, 3, 4, 6, 8};
+    float bestCost = FLT_MAX;
+    for(int leafSize : leafSizes) {
+        for(bool termination : {false, true}) {
+            BvhTree candidate(sample, leafSize);
+            candidate.verbose = false;
+            candidate.builder = builder;
+            candidate.sahTermination = termination;
+            candidate.SetCosts(traversalCost, intersectionCost);
+            candidate.BuildTree();
+            float cost = candidate.GetQualityReport().sahCost;
+            if(verbose) {
+                std::cout << "auto tune: leaf triangles " << leafSize << (termination ? " with" : " without") << " SAH termination, SAH cost " << cost << std::endl;
+            }
+            if(cost < bestCost) {
+                bestCost = cost;
+                maxTrianglesPerLeaf = leafSize;
+                sahTermination = termination;
+            }
+        }
+    }
+    if(verbose) {
+        auto end = std::chrono::steady_clock::now();
+        std::cout << "auto tune picked leaf triangles " << maxTrianglesPerLeaf << (sahTermination ? " with" : " without") << " SAH termination on " << sample.size()
+                  << " sampled triangles in " << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << "ms" << std::endl;
+    }
+}
@@ -120,18 +120,13 @@ void Camera::Tick(float cameraSpeed, float rotationSpeed) {
         SetFOV(DEFAULT_FOV_DEGREES);
 
     bool cameraMoved = !(cameraInitialFacing == facing) || !(cameraInitialPosition == position) || !(cameraInitialFOV == fov);
-    if(cameraMoved) {
-        UploadInfo();
+    if(cameraMoved) { // Scene::Tick uploads the camera with the rest of the frame constants
         scene.ResetFrameIndex();
     }
 }
 
 void Camera::UploadInfo() {
-    unsigned int programId = scene.GetShaderProgramIds()[TRACER_ID];
-    glUniform3f(glGetUniformLocation(programId, "u_Camera.position"), position.x, position.y, position.z);
-    glUniform3f(glGetUniformLocation(programId, "u_Camera.facing"), facing.x, facing.y, facing.z);
-    glUniform1f(glGetUniformLocation(programId, "u_Camera.fov"), fov);
-    glUniform1f(glGetUniformLocation(programId, "u_Camera.viewportWidth"), viewportWidth);
+    scene.UploadFrameConstants();
 }
 
 void Camera::OnEvent(const KeyEvent& keyEvent) {
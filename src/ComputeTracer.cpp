@@ -0,0 +1,68 @@
+#include "ComputeTracer.h"
+#include "Shader.h"
+#include "Renderer.h"
+
+#include <iostream>
+
+ComputeTracer::ComputeTracer(const std::string& tracerShaderPath, const std::vector<std::string>& shaderDefines)
+    : tileSamplesCapacity(0), target(0) {
+    std::vector<std::string> defines = shaderDefines;
+    defines.push_back("COMPUTE_TRACER");
+    program = CreateComputeProgram(InjectShaderDefines(ParseComputeShader(tracerShaderPath), defines));
+    traceRectLocation = glGetUniformLocation(program, "u_TraceRect");
+    tileSamplesLocation = glGetUniformLocation(program, "u_TileSamples");
+    GLCALL(glGenBuffers(1, &tileSamplesBuffer));
+}
+
+ComputeTracer::~ComputeTracer() {
+    glDeleteProgram(program);
+    glDeleteBuffers(1, &tileSamplesBuffer);
+}
+
+void ComputeTracer::SetTarget(GLuint texture) {
+    target = texture;
+}
+
+void ComputeTracer::Dispatch(const TraceRect& rect, uint32_t samples) {
+    if(rect.width == 0 || rect.height == 0) {
+        return;
+    }
+    if(tileSamplesCapacity == 0) { // B_TileSamples is declared whether or not it is read, so something is always bound
+        uint32_t none = 0;
+        GLCALL(glBindBuffer(GL_SHADER_STORAGE_BUFFER, tileSamplesBuffer));
+        GLCALL(glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(none), &none, GL_DYNAMIC_DRAW));
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        tileSamplesCapacity = 1;
+    }
+    GLCALL(glUseProgram(program));
+    GLCALL(glBindImageTexture(ACCUMULATION_IMAGE_UNIT, target, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F));
+    GLCALL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, TILE_SAMPLES_BINDING, tileSamplesBuffer));
+    GLCALL(glUniform4ui(traceRectLocation, rect.x, rect.y, rect.width, rect.height));
+    GLCALL(glUniform1ui(tileSamplesLocation, samples));
+    GLCALL(glDispatchCompute(TilesAcross(rect.width), TilesAcross(rect.height), 1));
+    // the next dispatch loads the pixels again, the bloom passes sample them and the blits read the framebuffer
+    GLCALL(glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT));
+}
+
+void ComputeTracer::Trace(const TraceRect& rect, uint32_t samples) {
+    if(samples > 0) {
+        Dispatch(rect, samples);
+    }
+}
+
+void ComputeTracer::Trace(const TraceRect& rect, const std::vector<uint32_t>& tileSamples) {
+    size_t tileCount = size_t(TilesAcross(rect.width)) * TilesAcross(rect.height);
+    if(tileSamples.size() != tileCount) {
+        std::cerr << "expected " << tileCount << " tile sample counts for a " << rect.width << "x" << rect.height << " rectangle, got " << tileSamples.size() << std::endl;
+        return;
+    }
+    GLCALL(glBindBuffer(GL_SHADER_STORAGE_BUFFER, tileSamplesBuffer));
+    if(tileCount > tileSamplesCapacity) {
+        GLCALL(glBufferData(GL_SHADER_STORAGE_BUFFER, tileCount * sizeof(uint32_t), tileSamples.data(), GL_DYNAMIC_DRAW));
+        tileSamplesCapacity = tileCount;
+    } else {
+        GLCALL(glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, tileCount * sizeof(uint32_t), tileSamples.data()));
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    Dispatch(rect, 0);
+}
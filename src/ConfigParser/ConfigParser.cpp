@@ -85,6 +85,12 @@ ConfigParser::ConfigParser(string path) : mPathToConfig(path) {
   }
 } 
 
+bool ConfigParser::hasConfig(std::string section, std::string configName) const {
+
+  auto config = mConfigurations.find(section + " - " + configName);
+  return config != mConfigurations.end() && !config->second.empty();
+}
+
 template <>
 bool ConfigParser::aConfig<bool>(std::string section, std::string configName, size_t pos) {
 
@@ -0,0 +1,585 @@
+#include "CpuTracer.h"
+#include "Scene.h"
+#include "ObjectLoader.h"
+#include "Intersection.h"
+#include "stb_image.h"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+
+#define AIR_REFRACT 1.0003f
+
+// the hashes of Fragment.glsl, the noise lookups are seeded with them
+static uint32_t Hash(uint32_t x) {
+    x ^= x >> 17;
+    x *= 0xed5ad4bbU;
+    x ^= x >> 11;
+    x *= 0xac4c1b51U;
+    x ^= x >> 15;
+    x *= 0x31848babU;
+    x ^= x >> 14;
+    return x;
+}
+
+static uint32_t Hashf(float x) {
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    return Hash(bits);
+}
+
+// UniformRandom of Fragment.glsl, uniform in [0, 1) for the roulette and the light samples
+static float UniformRandom(uint32_t state, uint32_t salt) {
+    return float(Hash(state + salt) >> 8) / 16777216.0f;
+}
+
+static Vector3f UniformSphere(uint32_t state) {
+    float z = 1.0f - 2.0f * UniformRandom(state, 1);
+    float phi = 6.2831853f * UniformRandom(state, 2);
+    float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+    return Vector3f(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+// solid angle pdf of the diffuse lobe, normalize(normal + roughness * s) with s uniform on the unit sphere
+static float DiffusePdf(const Vector3f& normal, float roughness, const Vector3f& direction) {
+    float c = normal.Dot(direction);
+    float discriminant = c * c - 1.0f + roughness * roughness;
+    if(c <= 0.0f || discriminant <= 0.0f || roughness <= 0.0f) {
+        return 0.0f;
+    }
+    return (4.0f * c * c - 2.0f * (1.0f - roughness * roughness)) / (4.0f * 3.14159265f * roughness * std::sqrt(discriminant));
+}
+
+static Vector3f Normalized(const Vector3f& v) {
+    return v / v.len();
+}
+
+// solid angle pdf of the specular lobe, (1 - roughness) * reflected + roughness * d with d from the diffuse lobe, as
+// GlossyPdf of the shader
+static float GlossyPdf(const Vector3f& normal, float roughness, const Vector3f& reflected, const Vector3f& direction) {
+    Vector3f centre = reflected * (1.0f - roughness);
+    float b = centre.Dot(direction);
+    float discriminant = b * b - centre.Dot(centre) + roughness * roughness;
+    if(discriminant <= 0.0f || roughness <= 0.0f) {
+        return 0.0f;
+    }
+    float root = std::sqrt(discriminant);
+    float pdf = 0.0f;
+    for(float t : {b - root, b + root}) {
+        if(t > 0.0f) {
+            pdf += DiffusePdf(normal, roughness, (direction * t - centre) / roughness) * t * t / (roughness * root);
+        }
+    }
+    return pdf;
+}
+
+static Vector3f Mix(const Vector3f& a, const Vector3f& b, float t) {
+    return a * (1.0f - t) + b * t;
+}
+
+static Vector3f Reflect(const Vector3f& direction, const Vector3f& normal) {
+    return direction - normal * (2.0f * normal.Dot(direction));
+}
+
+// solid angle pdf of the lobe the bounce picked sending a ray that came in along incoming towards direction, as LobePdf
+static float LobePdf(const Vector3f& normal, float roughness, const Vector3f& incoming, bool diffuse, const Vector3f& direction) {
+    Vector3f unit = Normalized(direction); // the specular directions are not normalized
+    if(diffuse) {
+        return DiffusePdf(normal, roughness, unit);
+    }
+    return GlossyPdf(normal, roughness, Reflect(incoming, normal), unit);
+}
+
+// GLSL refract, the zero vector on total internal reflection
+static Vector3f Refract(const Vector3f& direction, const Vector3f& normal, float eta) {
+    float cosine = normal.Dot(direction);
+    float k = 1.0f - eta * eta * (1.0f - cosine * cosine);
+    if(k < 0.0f) {
+        return Vector3f();
+    }
+    return direction * eta - normal * (eta * cosine + std::sqrt(k));
+}
+
+static Vector3f RotateAroundAxis(const Vector3f& v, const Vector3f& k, float a) {
+    float cosA = std::cos(a);
+    float sinA = std::sin(a);
+    return v * cosA + k.Cross(v) * sinA + k * k.Dot(v) * (1 - cosA);
+}
+
+static void SetFaceNormal(const Vector3f& direction, const Vector3f& outwardNormal, bool& frontFace, Vector3f& normal) {
+    frontFace = direction.Dot(outwardNormal) < 0;
+    normal = frontFace ? outwardNormal : outwardNormal * -1.0f;
+}
+
+bool CpuTracer::Texture::Load(const std::string& path) {
+    int channels;
+    unsigned char* data = stbi_load(path.c_str(), &width, &height, &channels, STBI_rgb);
+    if(data == nullptr) {
+        width = height = 0;
+        rgb.clear();
+        return false;
+    }
+    rgb.resize(size_t(width) * height * 3);
+    for(size_t i = 0; i < rgb.size(); ++i) {
+        rgb[i] = data[i] / 255.0f;
+    }
+    stbi_image_free(data);
+    return true;
+}
+
+Vector3f CpuTracer::Texture::Texel(int x, int y) const {
+    const float* texel = &rgb[(size_t(y) * width + x) * 3];
+    return Vector3f(texel[0], texel[1], texel[2]);
+}
+
+CpuTracer::CpuTracer(const RenderSettings& settings)
+: settings(settings), pool(settings.cpuThreads), simdLevel(std::min(settings.cpuSimd, DetectSimdLevel())), wideVersion(0), width(0), height(0) {
+}
+
+void CpuTracer::SetResolution(unsigned int newWidth, unsigned int newHeight) {
+    if(newWidth == width && newHeight == height) {
+        return;
+    }
+    width = newWidth;
+    height = newHeight;
+    image.assign(size_t(width) * height * 4, 0.0f);
+}
+
+bool CpuTracer::LoadSkybox(const std::string& directory) {
+    const char* faces[6] = {"right.png", "left.png", "top.png", "bottom.png", "front.png", "back.png"};
+    bool loaded = true;
+    for(int face = 0; face < 6; ++face) {
+        loaded = skybox[face].Load(directory + "/" + faces[face]) && loaded;
+    }
+    return loaded;
+}
+
+bool CpuTracer::LoadNoise(const std::string& path) {
+    return noise.Load(path);
+}
+
+Vector3f CpuTracer::SampleNoise(float u, float v) const {
+    if(noise.rgb.empty()) {
+        return Vector3f();
+    }
+    float x = u * noise.width - 0.5f;
+    float y = v * noise.height - 0.5f;
+    float x0 = std::floor(x);
+    float y0 = std::floor(y);
+    float fx = x - x0;
+    float fy = y - y0;
+    auto wrap = [](long i, int size) { return int(((i % size) + size) % size); };
+    int xa = wrap(long(x0), noise.width), xb = wrap(long(x0) + 1, noise.width);
+    int ya = wrap(long(y0), noise.height), yb = wrap(long(y0) + 1, noise.height);
+    return Mix(Mix(noise.Texel(xa, ya), noise.Texel(xb, ya), fx), Mix(noise.Texel(xa, yb), noise.Texel(xb, yb), fx), fy);
+}
+
+Vector3f CpuTracer::SampleSkybox(const Vector3f& direction) const {
+    // major axis face selection and (sc, tc) of the GL cube map table
+    float ax = std::abs(direction.x), ay = std::abs(direction.y), az = std::abs(direction.z);
+    int face;
+    float sc, tc, ma;
+    if(ax >= ay && ax >= az) {
+        face = direction.x >= 0 ? 0 : 1;
+        sc = direction.x >= 0 ? -direction.z : direction.z;
+        tc = -direction.y;
+        ma = ax;
+    } else if(ay >= az) {
+        face = direction.y >= 0 ? 2 : 3;
+        sc = direction.x;
+        tc = direction.y >= 0 ? direction.z : -direction.z;
+        ma = ay;
+    } else {
+        face = direction.z >= 0 ? 4 : 5;
+        sc = direction.z >= 0 ? direction.x : -direction.x;
+        tc = -direction.y;
+        ma = az;
+    }
+    const Texture& texture = skybox[face];
+    if(texture.rgb.empty() || ma == 0.0f) {
+        return Vector3f();
+    }
+    float x = (sc / ma + 1.0f) * 0.5f * texture.width - 0.5f;
+    float y = (tc / ma + 1.0f) * 0.5f * texture.height - 0.5f;
+    float x0 = std::floor(x);
+    float y0 = std::floor(y);
+    float fx = x - x0;
+    float fy = y - y0;
+    int xa = std::clamp(int(x0), 0, texture.width - 1), xb = std::clamp(int(x0) + 1, 0, texture.width - 1);
+    int ya = std::clamp(int(y0), 0, texture.height - 1), yb = std::clamp(int(y0) + 1, 0, texture.height - 1);
+    return Mix(Mix(texture.Texel(xa, ya), texture.Texel(xb, ya), fx), Mix(texture.Texel(xa, yb), texture.Texel(xb, yb), fx), fy);
+}
+
+CpuTracer::Ray CpuTracer::MakeRay(const Vector3f& origin, const Vector3f& direction) {
+    return {origin, direction, Vector3f(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z)};
+}
+
+// RAY_* bits of the rays an object is visible to, all of them when the masks are off or the object has no entry
+static uint32_t ObjectVisibility(const CpuTracerScene& scene, int objectId) {
+    const std::vector<uint32_t>* visibility = scene.objectVisibility;
+    return visibility != nullptr && size_t(objectId) < visibility->size() ? (*visibility)[objectId] : RAY_ALL;
+}
+
+void CpuTracer::HitLeaf(const CpuTracerScene& scene, const BvhTree& tree, const BoundingBox& leaf, const Ray& ray, uint32_t rayType, HitRecord& hitRecord) const {
+    const std::vector<Tri>& triangles = tree.GetTriangles();
+    const std::vector<int>& references = tree.GetTriangleReferences();
+    for(int slot = leaf.triangleStartIndex; slot < leaf.triangleStartIndex + leaf.triangleCount; ++slot) {
+        int triangleIndex = references.empty() ? slot : references[slot];
+        const Tri& triangle = triangles[triangleIndex];
+        if((ObjectVisibility(scene, triangle.materialsIndex) & rayType) == 0) {
+            continue;
+        }
+        float t;
+        Vector3f outwardNormal;
+        bool hit = HitPrimitive(triangle, ray.origin, ray.direction, ray.invDirection, t, outwardNormal, settings.triangleLayout == TriangleLayout::WATERTIGHT);
+        if(hit && hitRecord.t > t) {
+            hitRecord.t = t;
+            hitRecord.hitPoint = ray.origin + ray.direction * t;
+            SetFaceNormal(ray.direction, outwardNormal, hitRecord.frontFace, hitRecord.normal);
+            hitRecord.index = triangleIndex;
+            hitRecord.objectId = triangle.materialsIndex;
+            hitRecord.hitAnything = true;
+        }
+    }
+}
+
+bool CpuTracer::EntersBox(const BoundingBox& box, const Ray& ray, float tLimit) {
+    float tmin = -INFINITY;
+    float tmax = INFINITY;
+    for(int axis = 0; axis < 3; ++axis) {
+        float t0 = (box.mini[axis] - ray.origin[axis]) * ray.invDirection[axis];
+        float t1 = (box.maxi[axis] - ray.origin[axis]) * ray.invDirection[axis];
+        tmin = std::max(tmin, std::min(t0, t1));
+        tmax = std::min(tmax, std::max(t0, t1));
+    }
+    return tmax >= std::max(tmin, 0.0f) && tmin < tLimit;
+}
+
+bool CpuTracer::HitHittableList(const CpuTracerScene& scene, const BvhTree& tree, const Ray& ray, uint32_t rayType, HitRecord& hitRecord, int& iterations) const {
+    hitRecord.t = INFINITY;
+    hitRecord.hitAnything = false;
+    hitRecord.index = -1;
+    hitRecord.objectId = -1;
+
+    const std::vector<BoundingBox>& boxes = tree.GetBoundingBoxes();
+    int stack[MAX_BVH_DEPTH + 1];
+    int stackptr = 0;
+    if(!boxes.empty()) {
+        stack[stackptr++] = 0;
+    }
+    while(stackptr > 0) {
+        const BoundingBox& box = boxes[stack[--stackptr]];
+        iterations++;
+        if(!EntersBox(box, ray, hitRecord.t)) {
+            continue;
+        }
+        if(box.triangleCount > 0 && box.triangleStartIndex >= 0) {
+            HitLeaf(scene, tree, box, ray, rayType, hitRecord);
+            continue;
+        }
+        // far child first so the near one is popped next, the left child holds the centroids below the split
+        bool leftNear = ray.direction[std::max(box.splitAxis, 0)] >= 0.0f;
+        stack[stackptr++] = leftNear ? box.rightChildIndex : box.leftChildIndex;
+        stack[stackptr++] = leftNear ? box.leftChildIndex : box.rightChildIndex;
+    }
+    return hitRecord.hitAnything;
+}
+
+void CpuTracer::CompleteHit(const BvhTree& tree, const Ray& ray, int index, float t, HitRecord& hitRecord) {
+    hitRecord.hitAnything = index >= 0;
+    hitRecord.index = index;
+    if(index < 0) {
+        hitRecord.t = INFINITY;
+        hitRecord.objectId = -1;
+        return;
+    }
+    const Tri& triangle = tree.GetTriangles()[index];
+    Vector3f outwardNormal = OutwardNormalAt(triangle, ray.origin, ray.direction, ray.invDirection);
+    hitRecord.t = t;
+    hitRecord.hitPoint = ray.origin + ray.direction * t;
+    SetFaceNormal(ray.direction, outwardNormal, hitRecord.frontFace, hitRecord.normal);
+    hitRecord.objectId = triangle.materialsIndex;
+}
+
+bool CpuTracer::HitWide(const CpuTracerScene& scene, const BvhTree& tree, const Ray& ray, uint32_t rayType, HitRecord& hitRecord) const {
+    const WideBvh& wide = &tree == scene.proxyTree ? wideProxyTree : wideTree;
+    float t;
+    int index = wide.Intersect(simdLevel, {ray.origin, ray.direction, ray.invDirection, rayType}, t, DistanceToPrimitive);
+    CompleteHit(tree, ray, index, t, hitRecord);
+    return hitRecord.hitAnything;
+}
+
+bool CpuTracer::Occluded(const CpuTracerScene& scene, const Ray& ray, float tMax) const {
+    if(simdLevel != SimdLevel::NONE) {
+        return wideTree.Occluded(simdLevel, {ray.origin, ray.direction, ray.invDirection, RAY_SHADOW}, tMax, DistanceToPrimitive);
+    }
+    const std::vector<BoundingBox>& boxes = scene.tree.GetBoundingBoxes();
+    const std::vector<Tri>& triangles = scene.tree.GetTriangles();
+    const std::vector<int>& references = scene.tree.GetTriangleReferences();
+    int stack[MAX_BVH_DEPTH + 1];
+    int stackptr = 0;
+    if(!boxes.empty()) {
+        stack[stackptr++] = 0;
+    }
+    while(stackptr > 0) {
+        const BoundingBox& box = boxes[stack[--stackptr]];
+        if(!EntersBox(box, ray, tMax)) {
+            continue;
+        }
+        if(box.triangleCount > 0 && box.triangleStartIndex >= 0) {
+            for(int slot = box.triangleStartIndex; slot < box.triangleStartIndex + box.triangleCount; ++slot) {
+                const Tri& triangle = triangles[references.empty() ? slot : references[slot]];
+                if((ObjectVisibility(scene, triangle.materialsIndex) & RAY_SHADOW) == 0) {
+                    continue;
+                }
+                float t;
+                Vector3f outwardNormal;
+                if(HitPrimitive(triangle, ray.origin, ray.direction, ray.invDirection, t, outwardNormal, settings.triangleLayout == TriangleLayout::WATERTIGHT)
+                   && t < tMax) {
+                    return true;
+                }
+            }
+            continue;
+        }
+        stack[stackptr++] = box.rightChildIndex;
+        stack[stackptr++] = box.leftChildIndex;
+    }
+    return false;
+}
+
+bool CpuTracer::SampleDirectLight(const CpuTracerScene& scene, const HitRecord& hitRecord, float roughness, const Vector3f& incoming, bool diffuse, uint32_t state, Ray& shadowRay, float& tMax, Vector3f& radiance) {
+    const LightList& lights = scene.lights;
+    if(lights.Empty()) {
+        return false;
+    }
+    const EmissiveTriangle& light = lights.Pick(UniformRandom(state, 3));
+    float u = UniformRandom(state, 4);
+    float v = UniformRandom(state, 5);
+    if(u + v > 1.0f) { // folded back into the triangle
+        u = 1.0f - u;
+        v = 1.0f - v;
+    }
+    Vector3f toLight = light.v0 + light.e1 * u + light.e2 * v - hitRecord.hitPoint;
+    float distanceSquared = toLight.Dot(toLight);
+    float distance = std::sqrt(distanceSquared);
+    Vector3f direction = toLight / distance;
+    Vector3f lightNormal = light.e1.Cross(light.e2);
+    float cosLight = std::abs(lightNormal.Dot(direction)) / lightNormal.len(); // lights emit from both faces
+    if(cosLight < 1e-6f) {
+        return false;
+    }
+    float lightPdf = distanceSquared / (cosLight * lights.GetArea());
+    float lobePdf = LobePdf(hitRecord.normal, roughness, incoming, diffuse, direction);
+    if(lobePdf == 0.0f) {
+        return false;
+    }
+    const Material::Material& material = *scene.materials[light.objectId];
+    shadowRay = MakeRay(hitRecord.hitPoint + direction * 1e-4f, direction);
+    tMax = (distance - 1e-4f) * 0.999f; // short of the light itself
+    radiance = material.colour * (material.transparency * lobePdf / (lobePdf + lightPdf));
+    return true;
+}
+
+float CpuTracer::EmissionWeight(const CpuTracerScene& scene, const BvhTree& tree, float lobePdf, const Ray& ray, const HitRecord& hitRecord) {
+    if(lobePdf == 0.0f || scene.lights.Empty() || tree.GetTriangles()[hitRecord.index].primitive != Primitive::TRIANGLE) {
+        return 1.0f;
+    }
+    if((ObjectVisibility(scene, hitRecord.objectId) & RAY_SHADOW) == 0) {
+        return 1.0f;
+    }
+    float distance = hitRecord.t * ray.direction.len(); // t is in lengths of the direction, which glossy rays do not normalize
+    float lightPdf = distance * distance / (std::abs(hitRecord.normal.Dot(Normalized(ray.direction))) * scene.lights.GetArea());
+    return lobePdf / (lobePdf + lightPdf);
+}
+
+// FOG_DENSITY is 0 in Fragment.glsl so VolumetricScatter never scatters, it is left out here
+Vector3f CpuTracer::RayColour(const CpuTracerScene& scene, const FrameConstants& frame, Ray ray, const HitRecord* primaryHit) const {
+    HitRecord hitRecord;
+    Vector3f rayColour(1.0f, 1.0f, 1.0f);
+    Vector2f noiseResolution(noise.width, noise.height);
+    int bounceLimit = frame.bounceLimit;
+    const BvhTree* tree = &scene.tree; // the tree the next ray traces
+    uint32_t rayType = RAY_CAMERA;
+    Vector3f radiance; // of the lights the bounces sampled so far
+    float lobePdf = 0.0f; // of the opaque bounce the ray left, 0 after mirrors and glass
+    bool wide = simdLevel != SimdLevel::NONE && bounceLimit != 0; // the traversal cost view counts binary node visits
+    for(int i = 0; i <= bounceLimit; ++i) {
+        int iterations = 0;
+        bool hitAnything;
+        if(primaryHit != nullptr) {
+            hitRecord = *primaryHit;
+            hitAnything = hitRecord.hitAnything;
+            primaryHit = nullptr;
+        } else {
+            hitAnything = wide ? HitWide(scene, *tree, ray, rayType, hitRecord) : HitHittableList(scene, *tree, ray, rayType, hitRecord, iterations);
+        }
+        if(bounceLimit == 0) { // traversal cost view, as ShowTraversalCost
+            const int threshold1 = 64;
+            const int threshold2 = 128;
+            if(iterations < threshold1) {
+                return Vector3f(1, 1, 1) * (float(iterations) / threshold1);
+            } else if(iterations < threshold2) {
+                return Vector3f(1, 1, 1) - Vector3f(0, 1, 1) * (float(iterations - threshold1) / threshold1);
+            }
+            return Vector3f(1, 0, 0) - Vector3f(1, 0, 0) * (float(iterations - threshold2) / (threshold2 - threshold1));
+        }
+        if(bounceLimit == 1) {
+            return Vector3f(std::abs(hitRecord.normal.x), std::abs(hitRecord.normal.y), std::abs(hitRecord.normal.z));
+        }
+
+        uint32_t stateX = Hashf(ray.origin.x + ray.direction.y) + Hash(i) + Hash(0) + Hash(frame.frameIndex) + Hashf(frame.randSeed[0] * bounceLimit);
+        uint32_t stateY = Hashf(ray.origin.y + ray.direction.z) + Hash(i + 69) + Hash(0) + Hashf(frame.randSeed[1] * bounceLimit);
+        uint32_t state = Hash(stateX ^ Hash(stateY)); // BounceHash
+        float seedX = float(stateX);
+        float seedY = float(stateY);
+        float seedU = (seedX - noiseResolution.x * std::floor(seedX / noiseResolution.x)) / noiseResolution.x;
+        float seedV = (seedY - noiseResolution.y * std::floor(seedY / noiseResolution.y)) / noiseResolution.y;
+
+        if(!hitAnything) {
+            return radiance + rayColour * SampleSkybox(RotateAroundAxis(ray.direction, Vector3f(1, 0, 0), -3.1415f / 2));
+        }
+        const Material::Material& material = *scene.materials[hitRecord.objectId];
+        if(material.isLight) {
+            float luminance = material.transparency;
+            return radiance + rayColour * material.colour * luminance * EmissionWeight(scene, *tree, lobePdf, ray, hitRecord);
+        }
+        Vector3f nextDirection;
+        bool diffuse = false; // refracted rays count as reflection rays
+        float transparencyRng = SampleNoise(seedU + 0.01534f, seedV + 0.183f).x;
+        bool opaque = transparencyRng >= material.transparency;
+        if(!opaque) {
+            float ri = hitRecord.frontFace ? AIR_REFRACT / material.refractionIndex : material.refractionIndex / AIR_REFRACT;
+            float cosTheta = std::min((ray.direction * -1.0f).Dot(hitRecord.normal), 1.0f);
+            float sinTheta = std::sqrt(1.0f - cosTheta * cosTheta);
+            nextDirection = ri * sinTheta <= 1.0f ? Refract(ray.direction, hitRecord.normal, ri) : Reflect(ray.direction, hitRecord.normal);
+            if(transparencyRng < 0.5f) {
+                i--;
+            }
+        } else {
+            Vector3f diffuseDir = Normalized(hitRecord.normal + UniformSphere(state) * material.roughness);
+            Vector3f specularDir = Reflect(ray.direction, hitRecord.normal);
+            bool isSpecular = SampleNoise(seedU, seedV).y < (1 - material.roughness);
+            specularDir = Mix(specularDir, diffuseDir, material.roughness);
+            nextDirection = isSpecular ? specularDir : diffuseDir;
+            diffuse = !isSpecular;
+            rayColour = rayColour * (isSpecular ? Mix(material.specularColour, material.colour, material.metallic) : material.colour);
+        }
+        lobePdf = 0.0f;
+        if(opaque && material.roughness > 0.0f) { // a mirror reflects into one direction no light sample can pick
+            Ray shadowRay;
+            float tMax;
+            Vector3f direct;
+            // the ray of the last bounce is never traced, so its light is not sampled either
+            if(i < bounceLimit && SampleDirectLight(scene, hitRecord, material.roughness, ray.direction, diffuse, state, shadowRay, tMax, direct) && !Occluded(scene, shadowRay, tMax)) {
+                radiance = radiance + rayColour * direct;
+            }
+            lobePdf = LobePdf(hitRecord.normal, material.roughness, ray.direction, diffuse, nextDirection);
+        }
+        ray = MakeRay(hitRecord.hitPoint + nextDirection * 1e-4f, nextDirection);
+        rayType = diffuse ? RAY_DIFFUSE : RAY_REFLECTION;
+        if(scene.proxyTree != nullptr) {
+            // rough diffuse bounces blur away the detail the proxies drop, primary and mirror-like rays keep the full meshes
+            bool proxyRay = diffuse && (i + 1 >= settings.proxyBounce || material.roughness >= settings.proxyRoughness) && !scene.proxyTree->GetBoundingBoxes().empty();
+            tree = proxyRay ? scene.proxyTree : &scene.tree;
+            if(proxyRay && size_t(hitRecord.objectId) < scene.proxySkinDistances.size()) {
+                ray.origin = ray.origin + nextDirection * scene.proxySkinDistances[hitRecord.objectId];
+            }
+        }
+
+        // Russian roulette, as SurvivesRoulette
+        if(i + 1 >= settings.rouletteDepth) {
+            float survival = std::clamp(std::max(rayColour.x, std::max(rayColour.y, rayColour.z)), settings.rouletteMinSurvival, 1.0f);
+            if(UniformRandom(state, 6) >= survival) {
+                return radiance;
+            }
+            rayColour = rayColour / survival;
+        }
+    }
+    return radiance;
+}
+
+void CpuTracer::TraceTile(const CpuTracerScene& scene, const FrameConstants& frame, size_t tile) {
+    unsigned int tileSize = settings.cpuTileSize;
+    unsigned int tilesX = (width + tileSize - 1) / tileSize;
+    unsigned int x0 = (tile % tilesX) * tileSize;
+    unsigned int y0 = (tile / tilesX) * tileSize;
+
+    Vector3f position(frame.cameraPosition[0], frame.cameraPosition[1], frame.cameraPosition[2]);
+    Vector3f facing(frame.cameraFacing[0], frame.cameraFacing[1], frame.cameraFacing[2]);
+    float viewportWidth = frame.cameraViewportWidth;
+    float viewportHeight = viewportWidth * (float(height) / width);
+    Vector3f viewportUdir = Normalized(facing.Cross(Vector3f(0, 0, 1)));
+    Vector3f viewportVdir = Normalized(viewportUdir.Cross(facing));
+    // every pixel of a frame shares the jitter, as in the shader
+    Vector3f randOffset = SampleNoise(frame.randSeed[1], frame.randSeed[2]);
+    float blend = 1.0f / float(frame.frameIndex + 1);
+
+    // camera rays of neighbouring pixels are traced together, 2x2 or 4x2 of them as the packets are wide
+    bool packets = simdLevel != SimdLevel::NONE && frame.bounceLimit != 0;
+    unsigned int packetWidth = packets ? PacketWidth(simdLevel) : 1;
+    unsigned int blockWidth = packetWidth >= 8 ? 4 : (packetWidth >= 4 ? 2 : 1);
+    unsigned int blockHeight = packetWidth / blockWidth;
+    unsigned int x1 = std::min(x0 + tileSize, width);
+    unsigned int y1 = std::min(y0 + tileSize, height);
+    for(unsigned int by = y0; by < y1; by += blockHeight) {
+        for(unsigned int bx = x0; bx < x1; bx += blockWidth) {
+            unsigned int pixels[MAX_PACKET_WIDTH][2];
+            Ray rays[MAX_PACKET_WIDTH];
+            int count = 0;
+            for(unsigned int y = by; y < std::min(by + blockHeight, y1); ++y) {
+                for(unsigned int x = bx; x < std::min(bx + blockWidth, x1); ++x) {
+                    Vector3f target = position + facing * frame.cameraViewportDistance
+                        + viewportUdir * (viewportWidth * (-0.5f + (x + randOffset.x) / width))
+                        + viewportVdir * (viewportHeight * (-0.5f + (y + randOffset.y) / height));
+                    pixels[count][0] = x;
+                    pixels[count][1] = y;
+                    rays[count++] = MakeRay(position, Normalized(target - position));
+                }
+            }
+            HitRecord hits[MAX_PACKET_WIDTH];
+            if(packets) {
+                SimdRay simdRays[MAX_PACKET_WIDTH];
+                float t[MAX_PACKET_WIDTH];
+                int indices[MAX_PACKET_WIDTH];
+                for(int i = 0; i < count; ++i) {
+                    simdRays[i] = {rays[i].origin, rays[i].direction, rays[i].invDirection, RAY_CAMERA};
+                }
+                wideTree.IntersectPacket(simdLevel, simdRays, count, t, indices, DistanceToPrimitive);
+                for(int i = 0; i < count; ++i) {
+                    CompleteHit(scene.tree, rays[i], indices[i], t[i], hits[i]);
+                }
+            }
+            for(int i = 0; i < count; ++i) {
+                float* pixel = &image[(size_t(pixels[i][1]) * width + pixels[i][0]) * 4];
+                Vector3f previous(pixel[0], pixel[1], pixel[2]);
+                Vector3f rgb = RayColour(scene, frame, rays[i], packets ? &hits[i] : nullptr);
+                Vector3f blended = Mix(previous, rgb, blend);
+                pixel[0] = blended.x;
+                pixel[1] = blended.y;
+                pixel[2] = blended.z;
+                pixel[3] = 1.0f;
+            }
+        }
+    }
+}
+
+void CpuTracer::Trace(const CpuTracerScene& scene, const FrameConstants& frame) {
+    if(width == 0 || height == 0) {
+        return;
+    }
+    if(simdLevel != SimdLevel::NONE && scene.version != wideVersion) {
+        bool watertight = settings.triangleLayout == TriangleLayout::WATERTIGHT;
+        wideTree.Build(scene.tree, scene.objectVisibility, watertight);
+        if(scene.proxyTree != nullptr) {
+            wideProxyTree.Build(*scene.proxyTree, scene.objectVisibility, watertight);
+        } else {
+            wideProxyTree = WideBvh();
+        }
+        wideVersion = scene.version;
+    }
+    unsigned int tileSize = settings.cpuTileSize;
+    size_t tiles = size_t((width + tileSize - 1) / tileSize) * ((height + tileSize - 1) / tileSize);
+    std::function<void(size_t)> traceTile = [&](size_t tile) { TraceTile(scene, frame, tile); };
+    pool.ParallelFor(tiles, traceTile);
+}
@@ -0,0 +1,117 @@
+#include "GpuBvhBuilder.h"
+#include "Shader.h"
+#include "Renderer.h"
+#include "BvhTree.h"
+
+#include <algorithm>
+
+static const char* KERNEL_DEFINES[] = {
+    "KERNEL_BOUNDS",
+    "KERNEL_MORTON",
+    "KERNEL_RADIX_COUNT",
+    "KERNEL_RADIX_SCAN",
+    "KERNEL_RADIX_SCATTER",
+    "KERNEL_EMIT",
+    "KERNEL_BOTTOM_UP"
+};
+
+GpuBvhBuilder::GpuBvhBuilder(const std::vector<std::string>& shaderDefines) : capacity(0) {
+    std::string source = ParseComputeShader(BVH_BUILD_SHADER_PATH);
+    for(int kernel = 0; kernel < KERNEL_COUNT; ++kernel) {
+        std::vector<std::string> defines = shaderDefines;
+        defines.push_back(KERNEL_DEFINES[kernel]);
+        programs[kernel] = CreateComputeProgram(InjectShaderDefines(source, defines));
+        countLocations[kernel] = glGetUniformLocation(programs[kernel], "u_Count");
+        shiftLocations[kernel] = glGetUniformLocation(programs[kernel], "u_Shift");
+    }
+    GLCALL(glGenBuffers(1, &nodes));
+    GLCALL(glGenBuffers(1, &links));
+    GLCALL(glGenBuffers(2, keys));
+    GLCALL(glGenBuffers(2, values));
+    GLCALL(glGenBuffers(1, &scratch));
+}
+
+GpuBvhBuilder::~GpuBvhBuilder() {
+    for(GLuint program : programs) {
+        glDeleteProgram(program);
+    }
+    glDeleteBuffers(1, &nodes);
+    glDeleteBuffers(1, &links);
+    glDeleteBuffers(2, keys);
+    glDeleteBuffers(2, values);
+    glDeleteBuffers(1, &scratch);
+}
+
+void GpuBvhBuilder::Reserve(unsigned int triangleCount) {
+    if(triangleCount <= capacity) {
+        return;
+    }
+    capacity = std::max(triangleCount, capacity + capacity / 2); // meshes that grow every frame reallocate rarely
+    size_t blockCount = (capacity + BVH_BUILD_WORKGROUP_SIZE - 1) / BVH_BUILD_WORKGROUP_SIZE;
+    // the layout of scratch is described in BvhBuild.comp
+    size_t scratchEntries = 8 + (1 << BVH_BUILD_RADIX_BITS) * blockCount + 6 * size_t(capacity);
+    auto allocate = [](GLuint buffer, size_t bytes) {
+        GLCALL(glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer));
+        GLCALL(glBufferData(GL_SHADER_STORAGE_BUFFER, bytes, nullptr, GL_DYNAMIC_COPY));
+    };
+    allocate(nodes, 2 * size_t(capacity) * sizeof(FlatBoundingBox));
+    allocate(links, 2 * size_t(capacity) * 2 * sizeof(int));
+    for(int i = 0; i < 2; ++i) {
+        allocate(keys[i], capacity * sizeof(unsigned int));
+        allocate(values[i], capacity * sizeof(unsigned int));
+    }
+    allocate(scratch, scratchEntries * sizeof(unsigned int));
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void GpuBvhBuilder::Dispatch(Kernel kernel, unsigned int invocations, unsigned int triangleCount, unsigned int shift) {
+    GLCALL(glUseProgram(programs[kernel]));
+    GLCALL(glUniform1ui(countLocations[kernel], triangleCount));
+    GLCALL(glUniform1ui(shiftLocations[kernel], shift));
+    GLCALL(glDispatchCompute((invocations + BVH_BUILD_WORKGROUP_SIZE - 1) / BVH_BUILD_WORKGROUP_SIZE, 1, 1));
+    GLCALL(glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT));
+}
+
+unsigned int GpuBvhBuilder::Build(unsigned int triangleCount) {
+    if(triangleCount == 0) {
+        return 0;
+    }
+    Reserve(triangleCount);
+    GLint tracerProgram;
+    glGetIntegerv(GL_CURRENT_PROGRAM, &tracerProgram);
+
+    GLCALL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, nodes));
+    GLCALL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, links));
+    GLCALL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, scratch));
+    const unsigned int emptyBounds[6] = {0xFFFFFFFFu, 0xFFFFFFFFu, 0xFFFFFFFFu, 0, 0, 0};
+    GLCALL(glBindBuffer(GL_SHADER_STORAGE_BUFFER, scratch));
+    GLCALL(glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(emptyBounds), emptyBounds));
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    Dispatch(BOUNDS, triangleCount, triangleCount);
+
+    GLCALL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, values[0]));
+    GLCALL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, keys[0]));
+    Dispatch(MORTON, triangleCount, triangleCount);
+
+    // ping-pong between the two key and value buffers, an even number of passes leaves the result in keys[0] and values[0]
+    for(int shift = 0, pass = 0; shift < BVH_BUILD_KEY_BITS; shift += BVH_BUILD_RADIX_BITS, ++pass) {
+        int in = pass % 2;
+        GLCALL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, values[in]));
+        GLCALL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, keys[in]));
+        GLCALL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, keys[1 - in]));
+        GLCALL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, values[1 - in]));
+        Dispatch(RADIX_COUNT, triangleCount, triangleCount, shift);
+        Dispatch(RADIX_SCAN, BVH_BUILD_WORKGROUP_SIZE, triangleCount);
+        Dispatch(RADIX_SCATTER, triangleCount, triangleCount, shift);
+    }
+    GLCALL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, values[0]));
+    GLCALL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, keys[0]));
+
+    if(triangleCount > 1) {
+        Dispatch(EMIT, triangleCount - 1, triangleCount);
+    }
+    Dispatch(BOTTOM_UP, triangleCount, triangleCount);
+
+    GLCALL(glUseProgram(tracerProgram));
+    return triangleCount == 1 ? 1 : 2 * triangleCount; // the root, the unused node and a pair per internal node
+}
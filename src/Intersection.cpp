@@ -0,0 +1,176 @@
+#include "Intersection.h"
+
+#include <cmath>
+#include <algorithm>
+
+static Vector3f Normalized(const Vector3f& v) {
+    return v / v.len();
+}
+
+static bool HitSphere(const Tri& sphere, const Vector3f& origin, const Vector3f& direction, float& t, Vector3f& outwardNormal) {
+    float radius = sphere.pos2.x;
+    Vector3f oc = sphere.pos1 - origin;
+    float a = direction.Dot(direction);
+    float b = -2.0f * direction.Dot(oc);
+    float c = oc.Dot(oc) - radius * radius;
+    float discriminant = b * b - 4 * a * c;
+    if(discriminant < 0) {
+        return false;
+    }
+    float root = (-b - std::sqrt(discriminant)) / (2.0f * a);
+    if(root < RAY_EPSILON) {
+        root = (-b + std::sqrt(discriminant)) / (2.0f * a);
+        if(root < RAY_EPSILON) {
+            return false;
+        }
+    }
+    t = root;
+    outwardNormal = (origin + direction * t - sphere.pos1) / radius;
+    return true;
+}
+
+static bool HitBox(const Tri& box, const Vector3f& origin, const Vector3f& direction, const Vector3f& invDirection, float& t, Vector3f& outwardNormal) {
+    float tsmaller[3], tbigger[3];
+    for(int axis = 0; axis < 3; ++axis) {
+        float t0 = (box.pos1[axis] - origin[axis]) * invDirection[axis];
+        float t1 = (box.pos2[axis] - origin[axis]) * invDirection[axis];
+        tsmaller[axis] = std::min(t0, t1);
+        tbigger[axis] = std::max(t0, t1);
+    }
+    float tmin = std::max(std::max(tsmaller[0], tsmaller[1]), tsmaller[2]);
+    float tmax = std::min(std::min(tbigger[0], tbigger[1]), tbigger[2]);
+    if(tmax < std::max(tmin, RAY_EPSILON)) {
+        return false;
+    }
+    // from inside the box the ray leaves through the far face
+    bool inside = tmin < RAY_EPSILON;
+    t = inside ? tmax : tmin;
+    float normal[3];
+    for(int axis = 0; axis < 3; ++axis) {
+        float face = (inside ? tbigger[axis] : tsmaller[axis]) == t ? 1.0f : 0.0f;
+        float sign = direction[axis] > 0.0f ? 1.0f : (direction[axis] < 0.0f ? -1.0f : 0.0f);
+        normal[axis] = face * (inside ? sign : -sign);
+    }
+    outwardNormal = Normalized(Vector3f(normal[0], normal[1], normal[2]));
+    return true;
+}
+
+static bool HitDisc(const Tri& disc, const Vector3f& origin, const Vector3f& direction, float& t, Vector3f& outwardNormal) {
+    float radius = disc.pos3.x;
+    float denominator = disc.pos2.Dot(direction);
+    if(std::abs(denominator) < 1e-8f) {
+        return false;
+    }
+    t = (disc.pos1 - origin).Dot(disc.pos2) / denominator;
+    if(t < RAY_EPSILON) {
+        return false;
+    }
+    Vector3f offset = origin + direction * t - disc.pos1;
+    if(offset.Dot(offset) > radius * radius) {
+        return false;
+    }
+    outwardNormal = disc.pos2;
+    return true;
+}
+
+// the Moller-Trumbore test of the vertices and edges layouts
+static bool HitTriangle(const Tri& triangle, const Vector3f& origin, const Vector3f& direction, float& t, Vector3f& outwardNormal) {
+    Vector3f e1 = triangle.pos2 - triangle.pos1;
+    Vector3f e2 = triangle.pos3 - triangle.pos1;
+    Vector3f h = direction.Cross(e2);
+    float det = e1.Dot(h);
+    if(std::abs(det) < 1e-8f) {
+        return false;
+    }
+    float invDet = 1.0f / det;
+    Vector3f s = origin - triangle.pos1;
+    float u = invDet * s.Dot(h);
+    if(u < 0.0f || u > 1.0f) {
+        return false;
+    }
+    Vector3f q = s.Cross(e1);
+    float v = invDet * direction.Dot(q);
+    if(v < 0.0f || u + v > 1.0f) {
+        return false;
+    }
+    t = invDet * e2.Dot(q);
+    if(t < RAY_EPSILON) {
+        return false;
+    }
+    outwardNormal = Normalized(e1.Cross(e2));
+    return true;
+}
+
+WatertightShear MakeWatertightShear(const Vector3f& direction) {
+    Vector3f absDirection(std::abs(direction.x), std::abs(direction.y), std::abs(direction.z));
+    int kz = absDirection.x > absDirection.y ? (absDirection.x > absDirection.z ? 0 : 2) : (absDirection.y > absDirection.z ? 1 : 2);
+    int kx = (kz + 1) % 3;
+    int ky = (kx + 1) % 3;
+    if(direction[kz] < 0.0f) { // keep the winding of the projected triangle
+        std::swap(kx, ky);
+    }
+    return {kx, ky, kz, direction[kx] / direction[kz], direction[ky] / direction[kz], 1.0f / direction[kz]};
+}
+
+// the watertight test of the watertight layout (Woop, Benthin, Wald 2013), a ray through a shared edge hits one of
+// the two triangles instead of slipping between them
+static bool HitTriangleWatertight(const Tri& triangle, const Vector3f& origin, const Vector3f& direction, float& t, Vector3f& outwardNormal) {
+    WatertightShear shear = MakeWatertightShear(direction);
+    Vector3f a = triangle.pos1 - origin;
+    Vector3f b = triangle.pos2 - origin;
+    Vector3f c = triangle.pos3 - origin;
+
+    float az = a[shear.kz];
+    float bz = b[shear.kz];
+    float cz = c[shear.kz];
+    float ax = a[shear.kx] - shear.x * az;
+    float ay = a[shear.ky] - shear.y * az;
+    float bx = b[shear.kx] - shear.x * bz;
+    float by = b[shear.ky] - shear.y * bz;
+    float cx = c[shear.kx] - shear.x * cz;
+    float cy = c[shear.ky] - shear.y * cz;
+
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float w = bx * ay - by * ax;
+    if((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f)) {
+        return false;
+    }
+    float det = u + v + w;
+    if(det == 0.0f) {
+        return false;
+    }
+    t = (u * az + v * bz + w * cz) * shear.z / det;
+    if(t < RAY_EPSILON) {
+        return false;
+    }
+    outwardNormal = Normalized((triangle.pos2 - triangle.pos1).Cross(triangle.pos3 - triangle.pos1));
+    return true;
+}
+
+bool HitPrimitive(const Tri& primitive, const Vector3f& origin, const Vector3f& direction, const Vector3f& invDirection, float& t, Vector3f& outwardNormal,
+                  bool watertight) {
+    switch(primitive.primitive) {
+        case Primitive::SPHERE: return HitSphere(primitive, origin, direction, t, outwardNormal);
+        case Primitive::BOX: return HitBox(primitive, origin, direction, invDirection, t, outwardNormal);
+        case Primitive::DISC: return HitDisc(primitive, origin, direction, t, outwardNormal);
+        default:
+            return watertight ? HitTriangleWatertight(primitive, origin, direction, t, outwardNormal) : HitTriangle(primitive, origin, direction, t, outwardNormal);
+    }
+}
+
+float DistanceToPrimitive(const Tri& primitive, const SimdRay& ray) {
+    float t;
+    Vector3f outwardNormal;
+    return HitPrimitive(primitive, ray.origin, ray.direction, ray.invDirection, t, outwardNormal) ? t : INFINITY;
+}
+
+Vector3f OutwardNormalAt(const Tri& primitive, const Vector3f& origin, const Vector3f& direction, const Vector3f& invDirection) {
+    if(primitive.primitive == Primitive::TRIANGLE) {
+        return Normalized((primitive.pos2 - primitive.pos1).Cross(primitive.pos3 - primitive.pos1));
+    }
+    float t;
+    Vector3f outwardNormal;
+    HitPrimitive(primitive, origin, direction, invDirection, t, outwardNormal);
+    return outwardNormal;
+}
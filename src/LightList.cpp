@@ -0,0 +1,41 @@
+#include "LightList.h"
+
+#include <algorithm>
+
+void LightList::Build(const std::vector<Tri>& sceneTriangles, const std::function<bool(int objectId)>& emits) {
+    triangles.clear();
+    cumulativeAreas.clear();
+    area = 0.0f;
+    for(const Tri& triangle : sceneTriangles) {
+        if(triangle.primitive != Primitive::TRIANGLE || !emits(triangle.materialsIndex)) {
+            continue;
+        }
+        EmissiveTriangle light{triangle.pos1, triangle.pos2 - triangle.pos1, triangle.pos3 - triangle.pos1, triangle.materialsIndex};
+        float triangleArea = 0.5f * light.e1.Cross(light.e2).len();
+        if(!(triangleArea > 0.0f)) { // degenerate triangles could be picked but never hit
+            continue;
+        }
+        area += triangleArea;
+        triangles.push_back(light);
+        cumulativeAreas.push_back(area);
+    }
+}
+
+const EmissiveTriangle& LightList::Pick(float u) const {
+    size_t index = std::lower_bound(cumulativeAreas.begin(), cumulativeAreas.end(), u * area, [](float cumulative, float target) {
+        return cumulative <= target;
+    }) - cumulativeAreas.begin();
+    return triangles[std::min(index, triangles.size() - 1)];
+}
+
+std::vector<float> LightList::Flatten() const {
+    std::vector<float> flattened;
+    flattened.reserve(triangles.size() * LIGHT_TEXELS * 4);
+    for(size_t i = 0; i < triangles.size(); ++i) {
+        const EmissiveTriangle& light = triangles[i];
+        flattened.insert(flattened.end(), {light.v0.x, light.v0.y, light.v0.z, cumulativeAreas[i],
+                                           light.e1.x, light.e1.y, light.e1.z, float(light.objectId),
+                                           light.e2.x, light.e2.y, light.e2.z, 0.0f});
+    }
+    return flattened;
+}
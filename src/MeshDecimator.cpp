@@ -0,0 +1,248 @@
+#include "MeshDecimator.h"
+
+#include <cmath>
+#include <cstring>
+#include <queue>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+
+void MeshDecimator::Quadric::AddPlane(double a, double b, double c, double d, double weight) {
+    q[0] += weight * a * a; q[1] += weight * a * b; q[2] += weight * a * c; q[3] += weight * a * d;
+    q[4] += weight * b * b; q[5] += weight * b * c; q[6] += weight * b * d;
+    q[7] += weight * c * c; q[8] += weight * c * d;
+    q[9] += weight * d * d;
+}
+
+double MeshDecimator::Quadric::Evaluate(const Vector3f& v) const {
+    double x = v.x, y = v.y, z = v.z;
+    return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x
+         + q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y
+         + q[7] * z * z + 2 * q[8] * z
+         + q[9];
+}
+
+MeshDecimator::Quadric& MeshDecimator::Quadric::operator+=(const Quadric& other) {
+    for(int i = 0; i < 10; ++i) {
+        q[i] += other.q[i];
+    }
+    return *this;
+}
+
+static uint64_t EdgeKey(int a, int b) {
+    return (uint64_t(std::min(a, b)) << 32) | uint32_t(std::max(a, b));
+}
+
+MeshDecimator::MeshDecimator(const std::vector<Tri>& triangles)
+    : liveFaces(0), materialsIndex(triangles.empty() ? 0 : triangles[0].materialsIndex), maxError(0.0f) {
+    // weld the corners by their exact position, the loaders repeat shared vertices bit for bit
+    struct PositionHash {
+        size_t operator()(const std::array<float, 3>& p) const {
+            uint32_t bits[3];
+            std::memcpy(bits, p.data(), sizeof(bits));
+            return (size_t(bits[0]) * 73856093u) ^ (size_t(bits[1]) * 19349663u) ^ (size_t(bits[2]) * 83492791u);
+        }
+    };
+    std::unordered_map<std::array<float, 3>, int, PositionHash> welded;
+    auto weld = [&](const Vector3f& p) {
+        auto [it, inserted] = welded.try_emplace({p.x, p.y, p.z}, vertices.size());
+        if(inserted) {
+            vertices.push_back(p);
+        }
+        return it->second;
+    };
+    for(const Tri& tri : triangles) {
+        std::array<int, 3> face = {weld(tri.pos1), weld(tri.pos2), weld(tri.pos3)};
+        if(face[0] != face[1] && face[1] != face[2] && face[0] != face[2]) {
+            faces.push_back(face);
+        }
+    }
+    liveFaces = faces.size();
+    faceRemoved.assign(faces.size(), false);
+    quadrics.resize(vertices.size());
+    faceQuadrics.resize(vertices.size());
+    versions.assign(vertices.size(), 0);
+    vertexRemoved.assign(vertices.size(), false);
+    facesOfVertex.resize(vertices.size());
+
+    std::unordered_map<uint64_t, int> edgeFaces; // faces on each edge, 1 on open borders
+    for(size_t f = 0; f < faces.size(); ++f) {
+        const auto& face = faces[f];
+        Vector3f normal = (vertices[face[1]] - vertices[face[0]]).Cross(vertices[face[2]] - vertices[face[0]]);
+        float length = normal.len();
+        if(length > 0.0f) {
+            normal = normal / length;
+            Quadric plane;
+            plane.AddPlane(normal.x, normal.y, normal.z, -normal.Dot(vertices[face[0]]), 1.0);
+            for(int corner : face) {
+                quadrics[corner] += plane;
+                faceQuadrics[corner] += plane;
+            }
+        }
+        for(int corner = 0; corner < 3; ++corner) {
+            facesOfVertex[face[corner]].push_back(f);
+            edgeFaces[EdgeKey(face[corner], face[(corner + 1) % 3])]++;
+        }
+    }
+    // a plane through every border edge, perpendicular to its face, holds the border against collapses across it
+    for(const auto& face : faces) {
+        Vector3f normal = (vertices[face[1]] - vertices[face[0]]).Cross(vertices[face[2]] - vertices[face[0]]);
+        for(int corner = 0; corner < 3; ++corner) {
+            int a = face[corner];
+            int b = face[(corner + 1) % 3];
+            if(edgeFaces[EdgeKey(a, b)] != 1) {
+                continue;
+            }
+            Vector3f edge = vertices[b] - vertices[a];
+            Vector3f border = edge.Cross(normal);
+            float length = border.len();
+            if(length == 0.0f) {
+                continue;
+            }
+            border = border / length;
+            Quadric plane;
+            plane.AddPlane(border.x, border.y, border.z, -border.Dot(vertices[a]), DECIMATION_BOUNDARY_WEIGHT);
+            quadrics[a] += plane;
+            quadrics[b] += plane;
+        }
+    }
+}
+
+MeshDecimator::Collapse MeshDecimator::Evaluate(int keep, int drop) const {
+    Quadric quadric = quadrics[keep];
+    quadric += quadrics[drop];
+    const auto& q = quadric.q;
+    // the position minimising the error solves A x = -b with A the upper 3x3 of the quadric, the endpoints and
+    // the midpoint stand in when A is (nearly) singular, as on flat or straight patches
+    double det = q[0] * (q[4] * q[7] - q[5] * q[5]) - q[1] * (q[1] * q[7] - q[5] * q[2]) + q[2] * (q[1] * q[5] - q[4] * q[2]);
+    Collapse best{INFINITY, keep, drop, versions[keep], versions[drop], vertices[keep]};
+    if(std::abs(det) > 1e-12) {
+        double bx = -q[3], by = -q[6], bz = -q[8];
+        double x = (bx * (q[4] * q[7] - q[5] * q[5]) - q[1] * (by * q[7] - q[5] * bz) + q[2] * (by * q[5] - q[4] * bz)) / det;
+        double y = (q[0] * (by * q[7] - q[5] * bz) - bx * (q[1] * q[7] - q[5] * q[2]) + q[2] * (q[1] * bz - by * q[2])) / det;
+        double z = (q[0] * (q[4] * bz - by * q[5]) - q[1] * (q[1] * bz - by * q[2]) + bx * (q[1] * q[5] - q[4] * q[2])) / det;
+        Vector3f optimum(x, y, z);
+        best.position = optimum;
+        best.cost = quadric.Evaluate(optimum);
+    }
+    for(const Vector3f& candidate : {vertices[keep], vertices[drop], (vertices[keep] + vertices[drop]) / 2}) {
+        double cost = quadric.Evaluate(candidate);
+        if(cost < best.cost) {
+            best.cost = cost;
+            best.position = candidate;
+        }
+    }
+    best.cost = std::max(best.cost, 0.0);
+    return best;
+}
+
+bool MeshDecimator::FoldsSurface(int keep, int drop, const Vector3f& position) const {
+    for(int moved : {keep, drop}) {
+        for(int f : facesOfVertex[moved]) {
+            const auto& face = faces[f];
+            if(faceRemoved[f] || (std::find(face.begin(), face.end(), keep) != face.end() && std::find(face.begin(), face.end(), drop) != face.end())) {
+                continue; // the faces on the collapsed edge disappear
+            }
+            Vector3f corners[3];
+            Vector3f moves[3];
+            for(int corner = 0; corner < 3; ++corner) {
+                corners[corner] = vertices[face[corner]];
+                moves[corner] = face[corner] == moved ? position : corners[corner];
+            }
+            Vector3f before = (corners[1] - corners[0]).Cross(corners[2] - corners[0]);
+            Vector3f after = (moves[1] - moves[0]).Cross(moves[2] - moves[0]);
+            float lengths = before.len() * after.len();
+            if(lengths == 0.0f || before.Dot(after) < DECIMATION_MIN_NORMAL_COS * lengths) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void MeshDecimator::Apply(const Collapse& collapse) {
+    int keep = collapse.keep;
+    int drop = collapse.drop;
+    vertices[keep] = collapse.position;
+    quadrics[keep] += quadrics[drop];
+    faceQuadrics[keep] += faceQuadrics[drop];
+    maxError = std::max(maxError, float(std::sqrt(std::max(faceQuadrics[keep].Evaluate(collapse.position), 0.0))));
+    vertexRemoved[drop] = true;
+    versions[keep]++;
+    for(int f : facesOfVertex[drop]) {
+        if(faceRemoved[f]) {
+            continue;
+        }
+        auto& face = faces[f];
+        if(std::find(face.begin(), face.end(), keep) != face.end()) {
+            faceRemoved[f] = true;
+            liveFaces--;
+            continue;
+        }
+        std::replace(face.begin(), face.end(), drop, keep);
+        facesOfVertex[keep].push_back(f);
+    }
+    facesOfVertex[drop].clear();
+    std::erase_if(facesOfVertex[keep], [this](int f) { return faceRemoved[f]; });
+}
+
+std::vector<Tri> MeshDecimator::Decimate(size_t targetTriangles) {
+    std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> queue;
+    std::unordered_set<uint64_t> queued;
+    for(const auto& face : faces) {
+        for(int corner = 0; corner < 3; ++corner) {
+            int a = face[corner];
+            int b = face[(corner + 1) % 3];
+            if(queued.insert(EdgeKey(a, b)).second) {
+                queue.push(Evaluate(a, b));
+            }
+        }
+    }
+    while(liveFaces > targetTriangles && !queue.empty()) {
+        Collapse collapse = queue.top();
+        queue.pop();
+        if(vertexRemoved[collapse.keep] || vertexRemoved[collapse.drop] || versions[collapse.keep] != collapse.keepVersion
+           || versions[collapse.drop] != collapse.dropVersion || FoldsSurface(collapse.keep, collapse.drop, collapse.position)) {
+            continue;
+        }
+        Apply(collapse);
+        // every edge of the moved vertex changed its cost
+        std::unordered_set<int> neighbours;
+        for(int f : facesOfVertex[collapse.keep]) {
+            for(int corner : faces[f]) {
+                if(corner != collapse.keep) {
+                    neighbours.insert(corner);
+                }
+            }
+        }
+        for(int neighbour : neighbours) {
+            queue.push(Evaluate(collapse.keep, neighbour));
+        }
+    }
+
+    std::vector<Tri> decimated;
+    decimated.reserve(liveFaces);
+    for(size_t f = 0; f < faces.size(); ++f) {
+        if(!faceRemoved[f]) {
+            decimated.emplace_back(vertices[faces[f][0]], vertices[faces[f][1]], vertices[faces[f][2]], materialsIndex);
+        }
+    }
+    return decimated;
+}
+
+ProxyMesh MakeProxyMesh(const std::vector<Tri>& triangles, float detail) {
+    // analytic primitives already cost one test each, they go into the proxy as they are
+    std::vector<Tri> meshTriangles;
+    std::vector<Tri> primitives;
+    for(const Tri& tri : triangles) {
+        (tri.primitive == Primitive::TRIANGLE ? meshTriangles : primitives).push_back(tri);
+    }
+    if(meshTriangles.size() < PROXY_MIN_TRIANGLES || detail >= 1.0f) {
+        return {triangles, 0.0f};
+    }
+    MeshDecimator decimator(meshTriangles);
+    std::vector<Tri> decimated = decimator.Decimate(std::max<size_t>(std::ceil(meshTriangles.size() * detail), 1));
+    decimated.insert(decimated.end(), primitives.begin(), primitives.end());
+    return {std::move(decimated), decimator.GetMaxError()};
+}
@@ -0,0 +1,42 @@
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include "ObjectEditManager.h"
+#include "Scene.h"
+
+#include <iostream>
+
+ObjectEditManager::ObjectEditManager(Scene& scene, std::vector<std::string> objectPaths) :
+    observer([this](const KeyEvent& event) { this->OnEvent(event); }),
+    scene(scene),
+    objectPaths(std::move(objectPaths)),
+    nextObject(0),
+    objectIds(scene.GetObjectIds())
+{}
+
+void ObjectEditManager::OnEvent(const KeyEvent& event) {
+    if(event.action != GLFW_PRESS) {
+        return;
+    }
+    switch(event.key) {
+    case GLFW_KEY_INSERT: {
+        if(objectPaths.empty()) {
+            std::cout << "no [Objects] EditFilenames to add" << std::endl;
+            return;
+        }
+        int objectId = scene.AddObject(objectPaths[nextObject]);
+        nextObject = (nextObject + 1) % objectPaths.size();
+        if(objectId >= 0) {
+            objectIds.push_back(objectId);
+        }
+        return;
+    }
+    case GLFW_KEY_DELETE:
+        if(objectIds.empty()) {
+            return;
+        }
+        scene.RemoveObject(objectIds.back());
+        objectIds.pop_back();
+        return;
+    }
+}
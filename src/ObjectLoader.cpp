@@ -1,4 +1,11 @@
 #include "ObjectLoader.h"
 
 
-int ObjectLoader::materialsLoaded = 0;
\ No newline at end of file
+int ObjectLoader::materialsLoaded = 0;
+
+std::unique_ptr<ObjectLoader> MakeObjectLoader(const std::string& filePath) {
+    if(filePath.find(".off") != std::string::npos || filePath.find(".OFF") != std::string::npos) {
+        return std::make_unique<OFFLoader>();
+    }
+    return std::make_unique<ObjectLoader>();
+}
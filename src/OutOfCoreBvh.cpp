@@ -0,0 +1,463 @@
+#include "OutOfCoreBvh.h"
+
+#include <iostream>
+#include <cstring>
+#include <cmath>
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+static size_t PageSize() {
+    static const size_t pageSize = sysconf(_SC_PAGESIZE);
+    return pageSize;
+}
+
+PackedTriangle PackedTriangle::FromTri(const Tri& tri) {
+    return {{tri.pos1.x, tri.pos1.y, tri.pos1.z, tri.pos2.x, tri.pos2.y, tri.pos2.z, tri.pos3.x, tri.pos3.y, tri.pos3.z}, tri.materialsIndex, int(tri.primitive)};
+}
+
+BvhFileSettings BvhFileSettings::From(const RenderSettings& settings) {
+    return {int32_t(settings.bvhLayout), settings.bvhBuild == BvhBuild::MORTON ? int32_t(BvhBuilder::MORTON) : int32_t(BvhBuilder::SAH), settings.leafTriangles,
+            settings.autoTuneBvh, settings.sahTermination, MAX_BVH_DEPTH, 0.0f, settings.traversalCost, settings.intersectionCost,
+            uint64_t(settings.bvhMemoryBudgetMegabytes) << 20};
+}
+
+// the most memory the process had resident at once so far, in megabytes
+static long PeakResidentMegabytes() {
+    rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0) {
+        return -1;
+    }
+    return usage.ru_maxrss / 1024; // kilobytes on Linux
+}
+
+MappedFileReader::MappedFileReader(const std::string& path) : fd(open(path.c_str(), O_RDONLY)), size(0) {
+    if(fd >= 0) {
+        size = lseek(fd, 0, SEEK_END);
+    }
+}
+
+MappedFileReader::~MappedFileReader() {
+    if(fd >= 0) {
+        close(fd);
+    }
+}
+
+void* MappedFileReader::Map(size_t offset, size_t bytes, const void*& data) const {
+    size_t alignedOffset = offset - offset % PageSize();
+    size_t length = bytes + (offset - alignedOffset);
+    void* mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, alignedOffset);
+    if(mapping == MAP_FAILED) {
+        std::cout << "unable to map " << bytes << " bytes at " << offset << ": " << std::strerror(errno) << std::endl;
+        return nullptr;
+    }
+    madvise(mapping, length, MADV_SEQUENTIAL);
+    data = static_cast<const char*>(mapping) + (offset - alignedOffset);
+    return mapping;
+}
+
+void MappedFileReader::Unmap(void* mapping, size_t offset, size_t bytes) const {
+    munmap(mapping, bytes + offset % PageSize());
+}
+
+/**
+ * appends PackedTriangles to a file through a memory-mapped window, the file grows one window at a time
+ */
+class SpillWriter {
+private:
+    int fd;
+    size_t count;
+    PackedTriangle* window;
+    size_t windowFirst;
+    size_t windowRecords; // a page worth of records so every window starts on a page boundary
+
+    void Unmap() {
+        if(window != nullptr) {
+            munmap(window, windowRecords * sizeof(PackedTriangle));
+            window = nullptr;
+        }
+    }
+
+public:
+    SpillWriter(const std::string& path)
+    : fd(open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)), count(0), window(nullptr), windowFirst(0), windowRecords(PageSize()) {
+        if(fd < 0) {
+            std::cout << "unable to create spill file " << path << ": " << std::strerror(errno) << std::endl;
+        }
+    }
+
+    ~SpillWriter() {
+        Close();
+    }
+
+    bool IsOpen() const {
+        return fd >= 0;
+    }
+
+    size_t Count() const {
+        return count;
+    }
+
+    bool Append(const PackedTriangle& triangle) {
+        if(window == nullptr || count == windowFirst + windowRecords) {
+            Unmap();
+            windowFirst = count;
+            size_t end = (windowFirst + windowRecords) * sizeof(PackedTriangle);
+            if(fd < 0 || ftruncate(fd, end) != 0) {
+                return false;
+            }
+            void* mapping = mmap(nullptr, windowRecords * sizeof(PackedTriangle), PROT_READ | PROT_WRITE, MAP_SHARED, fd, windowFirst * sizeof(PackedTriangle));
+            if(mapping == MAP_FAILED) {
+                return false;
+            }
+            window = static_cast<PackedTriangle*>(mapping);
+        }
+        window[count++ - windowFirst] = triangle;
+        return true;
+    }
+
+    // cuts the last window down to the records written
+    void Close() {
+        if(fd < 0) {
+            return;
+        }
+        Unmap();
+        if(ftruncate(fd, count * sizeof(PackedTriangle)) != 0) {
+            std::cout << "unable to truncate spill file: " << std::strerror(errno) << std::endl;
+        }
+        close(fd);
+        fd = -1;
+    }
+};
+
+std::optional<BvhFileHeader> ReadBvhFileHeader(const MappedFileReader& file) {
+    if(!file.IsOpen() || file.Size() < sizeof(BvhFileHeader)) {
+        return std::nullopt;
+    }
+    BvhFileHeader header;
+    file.ForEachChunk<BvhFileHeader>(0, 1, [&header](const BvhFileHeader* records, size_t) { header = records[0]; });
+    if(std::strncmp(header.magic, BVH_FILE_MAGIC, sizeof(header.magic)) != 0
+       || file.Size() != header.NodesOffset() + header.nodeCount * sizeof(FlatBoundingBox)) {
+        return std::nullopt;
+    }
+    return header;
+}
+
+OutOfCoreBvhBuilder::OutOfCoreBvhBuilder(const std::string& outputPath, size_t memoryBudgetBytes, const RenderSettings& settings)
+: outputPath(outputPath), partialPath(outputPath + ".partial"), memoryBudget(memoryBudgetBytes), settings(settings), outputFd(-1),
+  header{}, trianglesWritten(0), spillFilesCreated(0), failed(false) {
+    header.settings = BvhFileSettings::From(settings);
+    builder = BvhBuilder(header.settings.builder);
+    this->settings.preSplitFraction = header.settings.preSplitFraction; // references would have to be merged across partitions
+    input = std::make_unique<SpillWriter>(NextSpillPath());
+    failed = !input->IsOpen();
+}
+
+OutOfCoreBvhBuilder::~OutOfCoreBvhBuilder() {
+    input.reset();
+    if(outputFd >= 0) {
+        close(outputFd);
+    }
+    for(int i = 0; i < spillFilesCreated; ++i) { // left over when a build failed half way
+        std::filesystem::remove(outputPath + ".spill" + std::to_string(i));
+    }
+    std::filesystem::remove(partialPath);
+}
+
+std::string OutOfCoreBvhBuilder::NextSpillPath() {
+    return outputPath + ".spill" + std::to_string(spillFilesCreated++);
+}
+
+size_t OutOfCoreBvhBuilder::InCoreCapacity() const {
+    return std::max<size_t>(memoryBudget / IN_CORE_BYTES_PER_TRIANGLE, 1);
+}
+
+void OutOfCoreBvhBuilder::Add(const Tri& triangle) {
+    if(!failed && !input->Append(PackedTriangle::FromTri(triangle))) {
+        std::cout << "unable to spill triangles to disk: " << std::strerror(errno) << std::endl;
+        failed = true;
+    }
+}
+
+bool OutOfCoreBvhBuilder::Build(uint64_t objectCount) {
+    if(failed) {
+        return false;
+    }
+    auto begin = std::chrono::steady_clock::now();
+    size_t count = input->Count();
+    input->Close();
+    input.reset();
+    if(count == 0) {
+        std::cout << "Warning: no triangles to build tree from" << std::endl;
+        return false;
+    }
+
+    outputFd = open(partialPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(outputFd < 0) {
+        std::cout << "unable to create " << partialPath << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    std::memcpy(header.magic, BVH_FILE_MAGIC, sizeof(header.magic));
+    header.triangleCount = count;
+    header.nodeCount = 2; // the root and the unused node
+    header.objectCount = objectCount;
+    BuildRange(outputPath + ".spill0", count, 0, 0);
+    WriteAt(0, &header, sizeof(header));
+    // the unused node is never written and ends the file when the root is a leaf
+    if(ftruncate(outputFd, header.NodesOffset() + header.nodeCount * sizeof(FlatBoundingBox)) != 0) {
+        failed = true;
+    }
+    close(outputFd);
+    outputFd = -1;
+    if(failed) {
+        return false;
+    }
+    std::filesystem::rename(partialPath, outputPath);
+
+    auto end = std::chrono::steady_clock::now();
+    std::cout << "constructing out-of-core BVH over " << count << " triangles took: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count()
+              << "ms, " << header.nodeCount << " nodes written to " << outputPath << ", peak resident memory " << PeakResidentMegabytes() << "MB of a "
+              << (memoryBudget >> 20) << "MB budget" << std::endl;
+    return true;
+}
+
+void OutOfCoreBvhBuilder::WriteAt(uint64_t offset, const void* data, size_t bytes) {
+    const char* bytesLeft = static_cast<const char*>(data);
+    while(bytes > 0 && !failed) {
+        ssize_t written = pwrite(outputFd, bytesLeft, bytes, offset);
+        if(written <= 0) {
+            std::cout << "unable to write " << partialPath << ": " << std::strerror(errno) << std::endl;
+            failed = true;
+            return;
+        }
+        bytesLeft += written;
+        offset += written;
+        bytes -= written;
+    }
+}
+
+void OutOfCoreBvhBuilder::WriteNode(uint64_t slot, const FlatBoundingBox& node) {
+    WriteAt(header.NodesOffset() + slot * sizeof(FlatBoundingBox), &node, sizeof(node));
+}
+
+FlatBoundingBox OutOfCoreBvhBuilder::BuildRange(const std::string& path, size_t count, uint64_t slot, int depth) {
+    int partitionLevels = std::ceil(std::log2(double(count) / InCoreCapacity())) + 1;
+    if(count <= InCoreCapacity() || depth + partitionLevels > MAX_PARTITION_DEPTH) {
+        if(count > InCoreCapacity()) {
+            std::cout << "Warning: the out-of-core BVH ran out of partition levels, building " << count << " triangles in memory" << std::endl;
+        }
+        return BuildInCore(path, count, slot, depth);
+    }
+    return BuildPartitioned(path, count, slot, depth);
+}
+
+FlatBoundingBox OutOfCoreBvhBuilder::BuildInCore(const std::string& path, size_t count, uint64_t slot, int depth) {
+    std::vector<Tri> triangles;
+    triangles.reserve(count);
+    {
+        MappedFileReader reader(path);
+        reader.ForEachChunk<PackedTriangle>(0, count, [&](const PackedTriangle* records, size_t recordCount) {
+            for(size_t i = 0; i < recordCount; ++i) {
+                triangles.push_back(records[i].ToTri());
+            }
+        });
+    }
+    std::filesystem::remove(path);
+
+    BvhTree tree(std::move(triangles));
+    tree.SetVerbose(false);
+    tree.SetBuilder(builder);
+    tree.SetDepthLimit(MAX_BVH_DEPTH - depth);
+    settings.Configure(tree);
+    tree.BuildTree();
+    const std::vector<BoundingBox>& boxes = tree.GetBoundingBoxes();
+    const std::vector<Tri>& built = tree.GetTriangles();
+
+    uint64_t firstTriangle = trianglesWritten;
+    std::vector<PackedTriangle> packed;
+    size_t batch = MAPPED_WINDOW_BYTES / sizeof(PackedTriangle);
+    for(size_t first = 0; first < built.size(); first += batch) {
+        packed.clear();
+        for(size_t i = first; i < std::min(first + batch, built.size()); ++i) {
+            packed.push_back(PackedTriangle::FromTri(built[i]));
+        }
+        WriteAt(header.TrianglesOffset() + (firstTriangle + first) * sizeof(PackedTriangle), packed.data(), packed.size() * sizeof(PackedTriangle));
+    }
+    trianglesWritten += built.size();
+
+    // the root goes into slot, the pairs from 2 onwards are appended after the nodes written so far
+    uint64_t firstNode = header.nodeCount;
+    if(boxes.size() > 2) {
+        header.nodeCount += boxes.size() - 2;
+    }
+    auto nodeSlot = [&](int index) { return index == 0 ? slot : firstNode + index - 2; };
+    std::vector<FlatBoundingBox> flat;
+    FlatBoundingBox root{};
+    for(size_t i = 0; i < boxes.size(); ++i) {
+        if(i == 1) {
+            continue;
+        }
+        const BoundingBox& box = boxes[i];
+        FlatBoundingBox node{{box.maxi.x, box.maxi.y, box.maxi.z}, 0, {box.mini.x, box.mini.y, box.mini.z}, 0};
+        if(box.IsLeaf()) {
+            node.triangleCount = box.triangleCount;
+            node.index = firstTriangle + box.triangleStartIndex;
+        } else {
+            node.triangleCount = -(std::max(box.splitAxis, 0) + 1);
+            node.index = nodeSlot(box.leftChildIndex);
+        }
+        if(i == 0) {
+            root = node;
+            WriteNode(slot, node);
+        } else {
+            flat.push_back(node);
+        }
+    }
+    if(!flat.empty()) {
+        WriteAt(header.NodesOffset() + firstNode * sizeof(FlatBoundingBox), flat.data(), flat.size() * sizeof(FlatBoundingBox));
+    }
+    return root;
+}
+
+int OutOfCoreBvhBuilder::MakePartitionNodes(std::vector<Vector3f>& sample, int first, int last, int partitions, int& nextPartition, std::vector<PartitionNode>& nodes) {
+    int node = nodes.size();
+    nodes.push_back({0, 0.0f, -1, -1, -1});
+    if(partitions == 1 || last - first < 2) {
+        nodes[node].partition = nextPartition++;
+        return node;
+    }
+    Vector3f mini(FLT_MAX, FLT_MAX, FLT_MAX);
+    Vector3f maxi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    for(int i = first; i < last; ++i) {
+        mini = Vector3f(std::min(mini.x, sample[i].x), std::min(mini.y, sample[i].y), std::min(mini.z, sample[i].z));
+        maxi = Vector3f(std::max(maxi.x, sample[i].x), std::max(maxi.y, sample[i].y), std::max(maxi.z, sample[i].z));
+    }
+    Vector3f extent = maxi - mini;
+    int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+    // split where the sample divides in proportion to the partitions on each side
+    int leftPartitions = partitions / 2;
+    int mid = first + int((long long)(last - first) * leftPartitions / partitions);
+    std::nth_element(sample.begin() + first, sample.begin() + mid, sample.begin() + last, [axis](Vector3f& a, Vector3f& b) {
+        return a[axis] < b[axis];
+    });
+    nodes[node].axis = axis;
+    nodes[node].position = sample[mid][axis];
+    int left = MakePartitionNodes(sample, first, mid, leftPartitions, nextPartition, nodes);
+    int right = MakePartitionNodes(sample, mid, last, partitions - leftPartitions, nextPartition, nodes);
+    nodes[node].left = left;
+    nodes[node].right = right;
+    return node;
+}
+
+FlatBoundingBox OutOfCoreBvhBuilder::BuildPartitioned(const std::string& path, size_t count, uint64_t slot, int depth) {
+    // half the capacity per partition leaves room for planes that split the sample better than the whole range,
+    // and every partition keeps a window mapped while the range is distributed
+    size_t targetCount = std::max<size_t>(InCoreCapacity() / 2, 1);
+    size_t maxPartitions = std::max<size_t>(memoryBudget / 4 / (PageSize() * sizeof(PackedTriangle)), 2);
+    int partitions = std::clamp<size_t>((count + targetCount - 1) / targetCount, 2, std::min<size_t>(maxPartitions, PARTITION_SAMPLE_TRIANGLES));
+
+    std::vector<Vector3f> sample;
+    size_t stride = std::max<size_t>(count / PARTITION_SAMPLE_TRIANGLES, 1);
+    MappedFileReader reader(path);
+    reader.ForEachChunk<PackedTriangle>(0, count, [&, index = size_t(0)](const PackedTriangle* records, size_t recordCount) mutable {
+        for(size_t i = 0; i < recordCount; ++i, ++index) {
+            if(index % stride == 0) {
+                sample.push_back(records[i].ToTri().Centroid().ToVector3f());
+            }
+        }
+    });
+    std::vector<PartitionNode> nodes;
+    int nextPartition = 0;
+    MakePartitionNodes(sample, 0, sample.size(), partitions, nextPartition, nodes);
+    partitions = nextPartition;
+    sample = std::vector<Vector3f>();
+
+    std::vector<std::string> paths;
+    std::vector<std::unique_ptr<SpillWriter>> writers;
+    for(int i = 0; i < partitions; ++i) {
+        paths.push_back(NextSpillPath());
+        writers.push_back(std::make_unique<SpillWriter>(paths.back()));
+    }
+    reader.ForEachChunk<PackedTriangle>(0, count, [&](const PackedTriangle* records, size_t recordCount) {
+        for(size_t i = 0; i < recordCount; ++i) {
+            const Vec4 centroid = records[i].ToTri().Centroid();
+            int node = 0;
+            while(nodes[node].partition < 0) {
+                node = centroid[nodes[node].axis] < nodes[node].position ? nodes[node].left : nodes[node].right;
+            }
+            if(!writers[nodes[node].partition]->Append(records[i])) {
+                failed = true;
+            }
+        }
+    });
+    std::vector<size_t> counts;
+    for(auto& writer : writers) {
+        counts.push_back(writer->Count());
+        writer->Close();
+    }
+    writers.clear();
+    std::filesystem::remove(path);
+    if(failed) {
+        std::cout << "unable to spill triangles to disk: " << std::strerror(errno) << std::endl;
+        return {};
+    }
+    if(*std::max_element(counts.begin(), counts.end()) == count) {
+        // every centroid fell on the same side of every plane (all of them at one point), the range is too big for
+        // memory so it is built from arbitrary halves instead
+        std::cout << "Warning: the out-of-core BVH could not split " << count << " triangles by position, splitting them by order" << std::endl;
+        int full = std::max_element(counts.begin(), counts.end()) - counts.begin();
+        std::string halves[2] = {NextSpillPath(), NextSpillPath()};
+        {
+            SpillWriter firstHalf(halves[0]);
+            SpillWriter secondHalf(halves[1]);
+            MappedFileReader fullReader(paths[full]);
+            fullReader.ForEachChunk<PackedTriangle>(0, count, [&](const PackedTriangle* records, size_t recordCount) {
+                for(size_t i = 0; i < recordCount; ++i) {
+                    (firstHalf.Count() < count / 2 ? firstHalf : secondHalf).Append(records[i]);
+                }
+            });
+        }
+        for(const std::string& partitionPath : paths) {
+            std::filesystem::remove(partitionPath);
+        }
+        uint64_t pair = AllocatePair();
+        FlatBoundingBox left = BuildRange(halves[0], count / 2, pair, depth + 1);
+        FlatBoundingBox right = BuildRange(halves[1], count - count / 2, pair + 1, depth + 1);
+        FlatBoundingBox node{{std::max(left.maxi[0], right.maxi[0]), std::max(left.maxi[1], right.maxi[1]), std::max(left.maxi[2], right.maxi[2])}, -1,
+                             {std::min(left.mini[0], right.mini[0]), std::min(left.mini[1], right.mini[1]), std::min(left.mini[2], right.mini[2])}, int(pair)};
+        WriteNode(slot, node);
+        return node;
+    }
+    return EmitPartitionNode(nodes, 0, paths, counts, slot, depth);
+}
+
+size_t OutOfCoreBvhBuilder::CountBelow(const std::vector<PartitionNode>& nodes, int node, const std::vector<size_t>& counts) const {
+    if(nodes[node].partition >= 0) {
+        return counts[nodes[node].partition];
+    }
+    return CountBelow(nodes, nodes[node].left, counts) + CountBelow(nodes, nodes[node].right, counts);
+}
+
+FlatBoundingBox OutOfCoreBvhBuilder::EmitPartitionNode(const std::vector<PartitionNode>& nodes, int node, const std::vector<std::string>& paths,
+                                                       const std::vector<size_t>& counts, uint64_t slot, int depth) {
+    const PartitionNode& partitionNode = nodes[node];
+    if(partitionNode.partition >= 0) {
+        return BuildRange(paths[partitionNode.partition], counts[partitionNode.partition], slot, depth);
+    }
+    // a side the sample put no triangles on has no node, its sibling takes the slot
+    if(CountBelow(nodes, partitionNode.left, counts) == 0) {
+        return EmitPartitionNode(nodes, partitionNode.right, paths, counts, slot, depth);
+    }
+    if(CountBelow(nodes, partitionNode.right, counts) == 0) {
+        return EmitPartitionNode(nodes, partitionNode.left, paths, counts, slot, depth);
+    }
+    uint64_t pair = AllocatePair();
+    FlatBoundingBox left = EmitPartitionNode(nodes, partitionNode.left, paths, counts, pair, depth + 1);
+    FlatBoundingBox right = EmitPartitionNode(nodes, partitionNode.right, paths, counts, pair + 1, depth + 1);
+    FlatBoundingBox flat{{std::max(left.maxi[0], right.maxi[0]), std::max(left.maxi[1], right.maxi[1]), std::max(left.maxi[2], right.maxi[2])}, -(partitionNode.axis + 1),
+                         {std::min(left.mini[0], right.mini[0]), std::min(left.mini[1], right.mini[1]), std::min(left.mini[2], right.mini[2])}, int(pair)};
+    WriteNode(slot, flat);
+    return flat;
+}
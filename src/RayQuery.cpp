@@ -0,0 +1,61 @@
+#include "RayQuery.h"
+#include "Intersection.h"
+
+#include <algorithm>
+
+RayQuery::RayQuery(const BvhTree& tree, unsigned int threadCount, const std::vector<uint32_t>* objectVisibility, SimdLevel level)
+    : tree(tree), objectVisibility(objectVisibility), simdLevel(std::min(level, DetectSimdLevel())), pool(threadCount) {
+    Rebuild();
+}
+
+void RayQuery::Rebuild() {
+    wide.Build(tree, objectVisibility);
+}
+
+SimdRay RayQuery::MakeSimdRay(const QueryRay& ray) {
+    Vector3f invDirection(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    return {ray.origin, ray.direction, invDirection, ray.rayType};
+}
+
+void RayQuery::ClosestHit(const QueryRay* rays, size_t count, QueryHit* hits) {
+    size_t chunks = (count + RAY_QUERY_CHUNK - 1) / RAY_QUERY_CHUNK;
+    pool.ParallelFor(chunks, [&](size_t chunk) {
+        size_t end = std::min(count, (chunk + 1) * RAY_QUERY_CHUNK);
+        for(size_t i = chunk * RAY_QUERY_CHUNK; i < end; ++i) {
+            SimdRay ray = MakeSimdRay(rays[i]);
+            QueryHit& hit = hits[i];
+            hit.triangle = wide.Intersect(simdLevel, ray, hit.t, DistanceToPrimitive, rays[i].tMax);
+            if(hit.triangle < 0) {
+                hit.t = INFINITY;
+                hit.objectId = -1;
+                hit.normal = Vector3f(0, 0, 0);
+                continue;
+            }
+            const Tri& triangle = tree.GetTriangles()[hit.triangle];
+            hit.objectId = triangle.materialsIndex;
+            hit.normal = OutwardNormalAt(triangle, ray.origin, ray.direction, ray.invDirection);
+        }
+    });
+}
+
+void RayQuery::AnyHit(const QueryRay* rays, size_t count, uint8_t* occluded) {
+    size_t chunks = (count + RAY_QUERY_CHUNK - 1) / RAY_QUERY_CHUNK;
+    pool.ParallelFor(chunks, [&](size_t chunk) {
+        size_t end = std::min(count, (chunk + 1) * RAY_QUERY_CHUNK);
+        for(size_t i = chunk * RAY_QUERY_CHUNK; i < end; ++i) {
+            occluded[i] = wide.Occluded(simdLevel, MakeSimdRay(rays[i]), rays[i].tMax, DistanceToPrimitive) ? 1 : 0;
+        }
+    });
+}
+
+std::vector<QueryHit> RayQuery::ClosestHit(const std::vector<QueryRay>& rays) {
+    std::vector<QueryHit> hits(rays.size());
+    ClosestHit(rays.data(), rays.size(), hits.data());
+    return hits;
+}
+
+std::vector<uint8_t> RayQuery::AnyHit(const std::vector<QueryRay>& rays) {
+    std::vector<uint8_t> occluded(rays.size());
+    AnyHit(rays.data(), rays.size(), occluded.data());
+    return occluded;
+}
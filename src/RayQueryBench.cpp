@@ -0,0 +1,277 @@
+#include "RayQuery.h"
+#include "TraversalCheck.h"
+#include "BvhTree.h"
+#include "ObjectLoader.h"
+#include "ConfigParser.hpp"
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+
+#define BENCH_DEFAULT_RAYS (1u << 20)
+#define BENCH_REPEATS 3 // the fastest run of the batch is reported, the first ones warm the caches
+#define BENCH_SEED 1234u
+#define BENCH_FOV_DEGREES 60.0f
+#define CHECK_PRESPLIT_FRACTION 0.001f // loose enough that some triangles of most meshes become several references
+
+struct BenchOptions {
+    std::string configPath = "RayTracer.ini";
+    unsigned int rays = BENCH_DEFAULT_RAYS;
+    unsigned int threads = 0;
+    bool checkTraversal = false; // compare the stack and stackless traversals instead of timing the queries
+};
+
+struct BenchScene {
+    std::string name;
+    std::vector<Tri> triangles;
+};
+
+static void PrintUsage(const char* program) {
+    std::cerr << "usage: " << program << " [--config path.ini] [--rays N] [--threads N] [--check-traversal]\n"
+              << "       traces batches of camera, random and shadow rays through the [Objects] of the config,\n"
+              << "       --check-traversal compares the hits of the stack and stackless BVH walks instead" << std::endl;
+}
+
+static bool ParseBenchOptions(int argc, char** argv, BenchOptions& options) {
+    for(int i = 1; i < argc; ++i) {
+        std::string flag = argv[i];
+        if(flag == "--check-traversal") {
+            options.checkTraversal = true;
+            continue;
+        }
+        if(i + 1 == argc) {
+            return false;
+        }
+        std::string value = argv[++i];
+        char trailing;
+        unsigned int number;
+        if(flag == "--config") {
+            options.configPath = value;
+        } else if(flag == "--rays" || flag == "--threads") {
+            if(std::sscanf(value.c_str(), "%u%c", &number, &trailing) != 1) {
+                return false;
+            }
+            if(flag == "--rays") {
+                if(number == 0) {
+                    return false;
+                }
+                options.rays = number;
+            } else {
+                options.threads = number;
+            }
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool LoadScene(const std::string& path, std::vector<Tri>& triangles) {
+    std::unique_ptr<ObjectLoader> objectLoader = MakeObjectLoader(path);
+    if(!objectLoader->TargetFile(path) || !objectLoader->ExtractMaterial().has_value()) {
+        return false;
+    }
+    std::optional<std::vector<Tri>> objTris = objectLoader->ExtractTriangles();
+    if(!objTris.has_value() || objTris.value().empty()) {
+        return false;
+    }
+    triangles = std::move(objTris.value());
+    return true;
+}
+
+static Vector3f Normalized(const Vector3f& v) {
+    return v / v.len();
+}
+
+// a pinhole camera outside the bounds looking at their centre, neighbouring rays take neighbouring paths
+static std::vector<QueryRay> CameraRays(const BoundingBox& bounds, unsigned int count) {
+    Vector3f center = (bounds.maxi + bounds.mini) * 0.5f;
+    Vector3f extent = bounds.maxi - bounds.mini;
+    Vector3f position = center + Vector3f(0.3f, 0.4f, 1.0f) * extent.len();
+    Vector3f facing = Normalized(center - position);
+    Vector3f right = Normalized(facing.Cross(Vector3f(0, 1, 0)));
+    Vector3f up = right.Cross(facing);
+    unsigned int side = std::max(1u, static_cast<unsigned int>(std::sqrt(static_cast<double>(count))));
+    float halfWidth = std::tan(BENCH_FOV_DEGREES * 0.5f * static_cast<float>(M_PI) / 180.0f);
+    std::vector<QueryRay> rays(count);
+    for(unsigned int i = 0; i < count; ++i) {
+        float u = ((i % side) + 0.5f) / side * 2.0f - 1.0f;
+        float v = ((i / side % side) + 0.5f) / side * 2.0f - 1.0f;
+        rays[i].origin = position;
+        rays[i].direction = Normalized(facing + right * (u * halfWidth) + up * (v * halfWidth));
+        rays[i].rayType = RAY_CAMERA;
+    }
+    return rays;
+}
+
+static Vector3f RandomPoint(const BoundingBox& bounds, std::mt19937& random) {
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    Vector3f extent = bounds.maxi - bounds.mini;
+    return bounds.mini + Vector3f(unit(random) * extent.x, unit(random) * extent.y, unit(random) * extent.z);
+}
+
+// origins inside the bounds and directions uniform on the sphere, as incoherent as diffuse bounces get
+static std::vector<QueryRay> RandomRays(const BoundingBox& bounds, unsigned int count) {
+    std::mt19937 random(BENCH_SEED);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::vector<QueryRay> rays(count);
+    for(auto& ray : rays) {
+        ray.origin = RandomPoint(bounds, random);
+        float z = unit(random) * 2.0f - 1.0f;
+        float phi = unit(random) * 2.0f * static_cast<float>(M_PI);
+        float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+        ray.direction = Vector3f(r * std::cos(phi), r * std::sin(phi), z);
+        ray.rayType = RAY_DIFFUSE;
+    }
+    return rays;
+}
+
+// segments between two random points of the bounds, tMax stops them at the far end like a shadow ray at its light
+static std::vector<QueryRay> ShadowRays(const BoundingBox& bounds, unsigned int count) {
+    std::mt19937 random(BENCH_SEED + 1);
+    std::vector<QueryRay> rays(count);
+    for(auto& ray : rays) {
+        ray.origin = RandomPoint(bounds, random);
+        ray.direction = RandomPoint(bounds, random) - ray.origin;
+        ray.tMax = 1.0f;
+        ray.rayType = RAY_SHADOW;
+    }
+    return rays;
+}
+
+// seconds of the fastest of BENCH_REPEATS runs of query
+template<typename Query>
+static double BestSeconds(Query query) {
+    double best = INFINITY;
+    for(int repeat = 0; repeat < BENCH_REPEATS; ++repeat) {
+        auto begin = std::chrono::steady_clock::now();
+        query();
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+    }
+    return best;
+}
+
+static void PrintResult(const std::string& scene, const std::string& query, size_t rays, double seconds, size_t hits) {
+    std::cout << std::left << std::setw(20) << scene << std::setw(16) << query << std::right << std::fixed
+              << std::setw(10) << std::setprecision(2) << rays / seconds * 1e-6 << " Mrays/s"
+              << std::setw(9) << std::setprecision(1) << 100.0 * hits / rays << "% hit" << std::endl;
+}
+
+static void RunBench(const BenchScene& scene, const BenchOptions& options) {
+    BvhTree tree(scene.triangles);
+    tree.SetVerbose(false);
+    auto buildBegin = std::chrono::steady_clock::now();
+    tree.BuildTree();
+    double buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - buildBegin).count();
+    RayQuery query(tree, options.threads);
+    const BoundingBox& bounds = tree.GetBoundingBoxes()[0];
+    std::cout << scene.name << ": " << scene.triangles.size() << " triangles, tree built in " << std::fixed << std::setprecision(3) << buildSeconds
+              << " s, " << options.rays << " rays per batch on " << query.GetThreadCount() << " threads with the " << SimdLevelName(query.GetSimdLevel()) << " kernels" << std::endl;
+
+    std::vector<QueryHit> hits(options.rays);
+    std::vector<uint8_t> occluded(options.rays);
+    auto countHits = [&]() {
+        return static_cast<size_t>(std::count_if(hits.begin(), hits.end(), [](const QueryHit& hit) { return hit.triangle >= 0; }));
+    };
+    std::vector<QueryRay> rays = CameraRays(bounds, options.rays);
+    double seconds = BestSeconds([&]() { query.ClosestHit(rays.data(), rays.size(), hits.data()); });
+    PrintResult(scene.name, "closest camera", rays.size(), seconds, countHits());
+
+    rays = RandomRays(bounds, options.rays);
+    seconds = BestSeconds([&]() { query.ClosestHit(rays.data(), rays.size(), hits.data()); });
+    PrintResult(scene.name, "closest random", rays.size(), seconds, countHits());
+
+    seconds = BestSeconds([&]() { query.AnyHit(rays.data(), rays.size(), occluded.data()); });
+    PrintResult(scene.name, "any random", rays.size(), seconds, std::count(occluded.begin(), occluded.end(), 1));
+
+    rays = ShadowRays(bounds, options.rays);
+    seconds = BestSeconds([&]() { query.AnyHit(rays.data(), rays.size(), occluded.data()); });
+    PrintResult(scene.name, "any shadow", rays.size(), seconds, std::count(occluded.begin(), occluded.end(), 1));
+}
+
+static const char* LayoutName(BvhLayout layout) {
+    switch(layout) {
+        case BvhLayout::HOT_FIRST: return "hot-first";
+        case BvhLayout::VAN_EMDE_BOAS: return "veb";
+        default: return "depth-first";
+    }
+}
+
+// the stackless walk relies on the sibling links of every layout and on the references of pre-split trees, so each
+// combination is built and checked, false when any ray found a different hit
+static bool RunTraversalCheck(const BenchScene& scene, const BenchOptions& options) {
+    bool passed = true;
+    for(BvhLayout layout : {BvhLayout::DEPTH_FIRST, BvhLayout::HOT_FIRST, BvhLayout::VAN_EMDE_BOAS}) {
+        for(float preSplitFraction : {0.0f, CHECK_PRESPLIT_FRACTION}) {
+            BvhTree tree(scene.triangles);
+            tree.SetVerbose(false);
+            tree.SetLayout(layout);
+            tree.SetPreSplitFraction(preSplitFraction);
+            tree.BuildTree();
+            const BoundingBox& bounds = tree.GetBoundingBoxes()[0];
+            std::vector<QueryRay> rays = CameraRays(bounds, options.rays);
+            std::vector<QueryRay> randomRays = RandomRays(bounds, options.rays);
+            rays.insert(rays.end(), randomRays.begin(), randomRays.end());
+            TraversalCheckReport report = CompareTraversals(tree, rays);
+            std::cout << std::left << std::setw(20) << scene.name << std::setw(12) << LayoutName(layout)
+                      << (preSplitFraction > 0 ? "pre-split   " : "            ") << std::right << report.rays << " rays, "
+                      << report.mismatches << " mismatches, " << report.stackNodeTests << " / " << report.stacklessNodeTests
+                      << " node tests stack / stackless" << std::endl;
+            for(const TraversalMismatch& mismatch : report.examples) {
+                std::cout << "  ray " << mismatch.ray << ": stack triangle " << mismatch.stack.triangle << " at " << mismatch.stack.t
+                          << ", stackless triangle " << mismatch.stackless.triangle << " at " << mismatch.stackless.t << std::endl;
+            }
+            passed = passed && report.mismatches == 0;
+        }
+    }
+    return passed;
+}
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+    if(!ParseBenchOptions(argc, argv, options)) {
+        PrintUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    ConfigParser parser = ConfigParser(options.configPath);
+    std::string objectDir = parser.aConfig<std::string>("Objects", "DirectoryPath");
+    std::vector<std::string> objects = parser.aConfigVec<std::string>("Objects", "Filenames");
+
+    // every object on its own and then all of them together as the renderer would trace them
+    std::vector<BenchScene> scenes;
+    BenchScene all{"scene", {}};
+    for(const auto& object : objects) {
+        BenchScene scene{object, {}};
+        if(!LoadScene(objectDir + "/" + object, scene.triangles)) {
+            std::cout << "skipping " << object << ", it did not load" << std::endl;
+            continue;
+        }
+        all.triangles.insert(all.triangles.end(), scene.triangles.begin(), scene.triangles.end());
+        scenes.push_back(std::move(scene));
+    }
+    if(scenes.empty()) {
+        std::cerr << "no objects of " << options.configPath << " loaded" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if(scenes.size() > 1) {
+        scenes.push_back(std::move(all));
+    }
+
+    if(options.checkTraversal) {
+        bool passed = true;
+        for(const auto& scene : scenes) {
+            passed = RunTraversalCheck(scene, options) && passed;
+        }
+        return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    for(const auto& scene : scenes) {
+        RunBench(scene, options);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,180 @@
+#include "RenderSettings.h"
+
+#include <iostream>
+#include <algorithm>
+
+RenderSettings RenderSettings::FromConfig(ConfigParser& parser) {
+    RenderSettings settings;
+    if(parser.hasConfig("Tracer", "TriangleLayout")) {
+        std::string layout = parser.aConfig<std::string>("Tracer", "TriangleLayout");
+        if(layout == "vertices") {
+            settings.triangleLayout = TriangleLayout::VERTICES;
+        } else if(layout == "edges") {
+            settings.triangleLayout = TriangleLayout::EDGES;
+        } else if(layout == "watertight") {
+            settings.triangleLayout = TriangleLayout::WATERTIGHT;
+        } else {
+            std::cout << "TriangleLayout must be vertices | edges | watertight, using vertices" << std::endl;
+        }
+    }
+    if(parser.hasConfig("Tracer", "BvhLayout")) {
+        std::string layout = parser.aConfig<std::string>("Tracer", "BvhLayout");
+        if(layout == "depth-first") {
+            settings.bvhLayout = BvhLayout::DEPTH_FIRST;
+        } else if(layout == "hot-first") {
+            settings.bvhLayout = BvhLayout::HOT_FIRST;
+        } else if(layout == "veb") {
+            settings.bvhLayout = BvhLayout::VAN_EMDE_BOAS;
+        } else {
+            std::cout << "BvhLayout must be depth-first | hot-first | veb, using depth-first" << std::endl;
+        }
+    }
+    if(parser.hasConfig("Tracer", "BvhTraversal")) {
+        std::string traversal = parser.aConfig<std::string>("Tracer", "BvhTraversal");
+        if(traversal == "stack") {
+            settings.bvhTraversal = BvhTraversal::STACK;
+        } else if(traversal == "stackless") {
+            settings.bvhTraversal = BvhTraversal::STACKLESS;
+        } else {
+            std::cout << "BvhTraversal must be stack | stackless, using stack" << std::endl;
+        }
+    }
+    if(parser.hasConfig("Tracer", "BvhBuild")) {
+        std::string build = parser.aConfig<std::string>("Tracer", "BvhBuild");
+        if(build == "sah") {
+            settings.bvhBuild = BvhBuild::SAH;
+        } else if(build == "morton") {
+            settings.bvhBuild = BvhBuild::MORTON;
+        } else if(build == "morton-then-sah") {
+            settings.bvhBuild = BvhBuild::MORTON_THEN_SAH;
+        } else if(build == "gpu") {
+            settings.bvhBuild = BvhBuild::GPU;
+        } else {
+            std::cout << "BvhBuild must be sah | morton | morton-then-sah | gpu, using sah" << std::endl;
+        }
+    }
+    if(parser.hasConfig("Tracer", "LeafTriangles")) {
+        std::string leafTriangles = parser.aConfig<std::string>("Tracer", "LeafTriangles");
+        if(leafTriangles == "auto") {
+            settings.autoTuneBvh = true;
+        } else {
+            settings.leafTriangles = std::max(1, parser.aConfig<int>("Tracer", "LeafTriangles"));
+        }
+    }
+    if(parser.hasConfig("Tracer", "SahTermination")) {
+        std::string termination = parser.aConfig<std::string>("Tracer", "SahTermination");
+        if(termination == "on") {
+            settings.sahTermination = true;
+        } else if(termination != "off") {
+            std::cout << "SahTermination must be on | off, using off" << std::endl;
+        }
+    }
+    if(parser.hasConfig("Tracer", "TraversalCost")) {
+        settings.traversalCost = std::max(0.0f, parser.aConfig<float>("Tracer", "TraversalCost"));
+    }
+    if(parser.hasConfig("Tracer", "IntersectionCost")) {
+        settings.intersectionCost = std::max(0.0f, parser.aConfig<float>("Tracer", "IntersectionCost"));
+    }
+    if(parser.hasConfig("Tracer", "BvhReport")) {
+        settings.bvhReportPath = parser.aConfig<std::string>("Tracer", "BvhReport");
+    }
+    if(parser.hasConfig("Tracer", "PreSplitFraction")) {
+        settings.preSplitFraction = std::max(0.0f, parser.aConfig<float>("Tracer", "PreSplitFraction"));
+    }
+    if(parser.hasConfig("Tracer", "BvhFile")) {
+        settings.bvhFilePath = parser.aConfig<std::string>("Tracer", "BvhFile");
+    }
+    if(parser.hasConfig("Tracer", "BvhMemoryBudget")) {
+        settings.bvhMemoryBudgetMegabytes = std::max(1, parser.aConfig<int>("Tracer", "BvhMemoryBudget"));
+    }
+    if(parser.hasConfig("Tracer", "ProxyDetail")) {
+        settings.proxyDetail = std::clamp(parser.aConfig<float>("Tracer", "ProxyDetail"), 0.0f, 1.0f);
+    }
+    if(parser.hasConfig("Tracer", "ProxyBounce")) {
+        settings.proxyBounce = std::max(1, parser.aConfig<int>("Tracer", "ProxyBounce"));
+    }
+    if(parser.hasConfig("Tracer", "ProxyRoughness")) {
+        settings.proxyRoughness = std::clamp(parser.aConfig<float>("Tracer", "ProxyRoughness"), 0.0f, 1.0f);
+    }
+    if(parser.hasConfig("Tracer", "RouletteDepth")) {
+        settings.rouletteDepth = std::max(1, parser.aConfig<int>("Tracer", "RouletteDepth"));
+    }
+    if(parser.hasConfig("Tracer", "RouletteMinSurvival")) {
+        settings.rouletteMinSurvival = std::clamp(parser.aConfig<float>("Tracer", "RouletteMinSurvival"), 0.01f, 1.0f);
+    }
+    if(parser.hasConfig("Tracer", "VisibilityMasks")) {
+        std::string masks = parser.aConfig<std::string>("Tracer", "VisibilityMasks");
+        if(masks == "on") {
+            settings.visibilityMasks = true;
+        } else if(masks != "off") {
+            std::cout << "VisibilityMasks must be on | off, using off" << std::endl;
+        }
+    }
+    if(parser.hasConfig("Tracer", "Backend")) {
+        std::string backend = parser.aConfig<std::string>("Tracer", "Backend");
+        if(backend == "gl") {
+            settings.backend = TracerBackend::GL;
+        } else if(backend == "compute") {
+            settings.backend = TracerBackend::COMPUTE;
+        } else if(backend == "wavefront") {
+            settings.backend = TracerBackend::WAVEFRONT;
+        } else if(backend == "cpu") {
+            settings.backend = TracerBackend::CPU;
+        } else {
+            std::cout << "Backend must be gl | compute | wavefront | cpu, using gl" << std::endl;
+        }
+    }
+    if(parser.hasConfig("Tracer", "CpuThreads")) {
+        settings.cpuThreads = std::max(0, parser.aConfig<int>("Tracer", "CpuThreads"));
+    }
+    if(parser.hasConfig("Tracer", "CpuTileSize")) {
+        settings.cpuTileSize = std::max(1, parser.aConfig<int>("Tracer", "CpuTileSize"));
+    }
+    if(parser.hasConfig("Tracer", "CpuSimd")) {
+        std::string simd = parser.aConfig<std::string>("Tracer", "CpuSimd");
+        if(simd == "auto" || simd == "avx2") {
+            settings.cpuSimd = SimdLevel::AVX2;
+        } else if(simd == "sse2") {
+            settings.cpuSimd = SimdLevel::SSE2;
+        } else if(simd == "off") {
+            settings.cpuSimd = SimdLevel::NONE;
+        } else {
+            std::cout << "CpuSimd must be auto | avx2 | sse2 | off, using auto" << std::endl;
+        }
+    }
+    return settings;
+}
+
+std::vector<std::string> RenderSettings::ShaderDefines() const {
+    std::vector<std::string> defines;
+    if(triangleLayout == TriangleLayout::EDGES) {
+        defines.push_back("TRIANGLE_LAYOUT_EDGES");
+    } else if(triangleLayout == TriangleLayout::WATERTIGHT) {
+        defines.push_back("TRIANGLE_LAYOUT_WATERTIGHT");
+    }
+    if(bvhTraversal == BvhTraversal::STACKLESS) {
+        defines.push_back("BVH_STACKLESS");
+    }
+    // the gpu builder sorts references, not the triangles, and out-of-core builds never pre-split
+    if((preSplitFraction > 0 && !UsesBvhFile()) || bvhBuild == BvhBuild::GPU) {
+        defines.push_back("TRIANGLE_REFERENCES");
+    }
+    if(UsesProxies()) {
+        defines.push_back("LOD_PROXIES");
+    }
+    if(UsesVisibilityMasks()) {
+        defines.push_back("VISIBILITY_MASKS");
+    }
+    return defines;
+}
+
+void RenderSettings::Configure(BvhTree& tree) const {
+    tree.SetLayout(bvhLayout);
+    tree.SetPreSplitFraction(preSplitFraction);
+    tree.SetMaxTrianglesPerLeaf(leafTriangles);
+    tree.SetSahTermination(sahTermination);
+    tree.SetCosts(traversalCost, intersectionCost);
+    if(autoTuneBvh) {
+        tree.AutoTune();
+    }
+}
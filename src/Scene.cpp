@@ -1,34 +1,80 @@
 #include "Scene.h"
 
-Scene::Scene(std::vector<unsigned int> shaderProgramIds) : 
+#include <filesystem>
+
+Scene::Scene(std::vector<unsigned int> shaderProgramIds, const RenderSettings& settings) : 
     shaderProgramIds(shaderProgramIds), 
     shaderProgramId(shaderProgramIds[TRACER_ID]),
     frameIndex(0), 
+    settings(settings),
     objectsIndex(0), 
     inFpsTest(false), 
     fpsTestAngle(0),
     inBoxHitView(false), 
+    currentfps(0),
+    fastBvhBuildMilliseconds(0),
+    bvhVersion(0),
+    fpsAfterSwapPending(false),
     camera(*this),
-    bounceLimitManager(*this, shaderProgramId)
+    bounceLimitManager(*this),
+    frameConstants{}
 {
     if(shaderProgramIds.size() < 2) {
         std::cerr << "Error: At least two shader program IDs are required." << std::endl;
         throw std::runtime_error("Insufficient shader program IDs");
     }
+    if(settings.UsesCpuBackend()) {
+        cpuTracer = std::make_unique<CpuTracer>(settings);
+        std::cout << "tracing on the CPU with " << cpuTracer->GetThreadCount() << " threads, simd " << SimdLevelName(cpuTracer->GetSimdLevel()) << std::endl;
+    } else if(settings.backend == TracerBackend::CPU) {
+        std::cout << "Backend = cpu needs a tree built on the CPU, not BvhBuild = gpu or BvhFile, using gl" << std::endl;
+    }
+    GLCALL(glGenBuffers(1, &frameConstantsBuffer));
+    GLCALL(glBindBuffer(GL_UNIFORM_BUFFER, frameConstantsBuffer));
+    GLCALL(glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameConstants), nullptr, GL_DYNAMIC_DRAW));
+    GLCALL(glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_CONSTANTS_BINDING, frameConstantsBuffer));
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
     // set the default values
-    GLCALL(glUniform1ui(glGetUniformLocation(shaderProgramId, "u_BounceLimit"), 4));
-    GLCALL(glUniform1f(GetUniformLocation("u_Camera.viewportWidth"), camera.GetViewportWidth()));
-    GLCALL(glUniform1f(GetUniformLocation("u_Camera.viewportDistance"), camera.GetViewportDistance()));
-    GLCALL(glUniform1f(GetUniformLocation("u_Camera.fov"), camera.GetFov()));
+    frameConstants.bounceLimit = 4;
+    UploadFrameConstants();
+    GLCALL(glUniform1ui(GetUniformLocation("u_RouletteDepth"), settings.rouletteDepth));
+    GLCALL(glUniform1f(GetUniformLocation("u_RouletteMinSurvival"), settings.rouletteMinSurvival));
 }
 
 void Scene::Tick() {    
+    SwapInRefinedBvh();
+
     // tick the camera and upload
     camera.Tick();
 
     // other scene stuff
-    GLCALL(glUniform1ui(glGetUniformLocation(shaderProgramId, "u_FrameIndex"), frameIndex++));
-    GLCALL(glUniform3f(glGetUniformLocation(shaderProgramId, "u_RandSeed"), float(std::rand()) / RAND_MAX, float(std::rand()) / RAND_MAX, float(std::rand()) / RAND_MAX));
+    frameConstants.frameIndex = frameIndex++;
+    frameConstants.randSeed[0] = float(std::rand()) / RAND_MAX;
+    frameConstants.randSeed[1] = float(std::rand()) / RAND_MAX;
+    frameConstants.randSeed[2] = float(std::rand()) / RAND_MAX;
+    UploadFrameConstants();
+
+    if(cpuTracer) {
+        cpuTracer->Trace({bvhTree, settings.UsesProxies() ? &proxyTree : nullptr, proxySkinDistances, materials,
+                          settings.UsesVisibilityMasks() ? &objectVisibility : nullptr, lights, bvhVersion}, frameConstants);
+    }
+}
+
+void Scene::UploadFrameConstants() {
+    Vector3f position = camera.GetPosition();
+    Vector3f facing = camera.GetFacing();
+    frameConstants.cameraPosition[0] = position.x;
+    frameConstants.cameraPosition[1] = position.y;
+    frameConstants.cameraPosition[2] = position.z;
+    frameConstants.cameraFacing[0] = facing.x;
+    frameConstants.cameraFacing[1] = facing.y;
+    frameConstants.cameraFacing[2] = facing.z;
+    frameConstants.cameraFov = camera.GetFov();
+    frameConstants.cameraViewportWidth = camera.GetViewportWidth();
+    frameConstants.cameraViewportDistance = camera.GetViewportDistance();
+    GLCALL(glBindBuffer(GL_UNIFORM_BUFFER, frameConstantsBuffer));
+    GLCALL(glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameConstants), &frameConstants));
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
 }
 
 std::vector<int> Scene::FlattenTrianglesMatIdx(const std::vector<Tri>& reorderedTris) {
@@ -44,129 +90,729 @@ std::vector<float> Scene::FlattenTrianglesVertices(const std::vector<Tri>& reord
     std::vector<float> flattened;
     flattened.reserve(reorderedTris.size() * 12);
     for (const auto& tri : reorderedTris) {
-        // pos1
+        if(tri.primitive != Primitive::TRIANGLE) { // the parameters whatever the layout, the tag tells the shader which test to run
+            flattened.insert(flattened.end(), {tri.pos1.x, tri.pos1.y, tri.pos1.z, PRIMITIVE_TAG_BASE + int(tri.primitive),
+                                               tri.pos2.x, tri.pos2.y, tri.pos2.z, 0,
+                                               tri.pos3.x, tri.pos3.y, tri.pos3.z, 0});
+            continue;
+        }
+        if(settings.triangleLayout == TriangleLayout::VERTICES) {
+            // pos1
+            flattened.push_back(tri.pos1.x);
+            flattened.push_back(tri.pos1.y);
+            flattened.push_back(tri.pos1.z);
+            flattened.push_back(0); // padding
+            // pos2
+            flattened.push_back(tri.pos2.x);
+            flattened.push_back(tri.pos2.y);
+            flattened.push_back(tri.pos2.z);
+            flattened.push_back(0); // padding
+            // pos3
+            flattened.push_back(tri.pos3.x);
+            flattened.push_back(tri.pos3.y);
+            flattened.push_back(tri.pos3.z);
+            flattened.push_back(0); // padding
+            continue;
+        }
+        // precomputed layouts keep the unit normal in the padding so a hit no longer needs a cross and normalize
+        Vector3f e1 = tri.pos2 - tri.pos1;
+        Vector3f e2 = tri.pos3 - tri.pos1;
+        Vector3f normal = e1.Cross(e2);
+        if(normal.len() > 0) {
+            normal = normal.Normalize();
+        }
+        bool edges = settings.triangleLayout == TriangleLayout::EDGES;
+        Vector3f second = edges ? e1 : tri.pos2;
+        Vector3f third = edges ? e2 : tri.pos3;
         flattened.push_back(tri.pos1.x);
         flattened.push_back(tri.pos1.y);
         flattened.push_back(tri.pos1.z);
-        flattened.push_back(0); // padding
-        // pos2
-        flattened.push_back(tri.pos2.x);
-        flattened.push_back(tri.pos2.y);
-        flattened.push_back(tri.pos2.z);
-        flattened.push_back(0); // padding
-        // pos3
-        flattened.push_back(tri.pos3.x);
-        flattened.push_back(tri.pos3.y);
-        flattened.push_back(tri.pos3.z);
-        flattened.push_back(0); // padding
+        flattened.push_back(normal.x);
+        flattened.push_back(second.x);
+        flattened.push_back(second.y);
+        flattened.push_back(second.z);
+        flattened.push_back(normal.y);
+        flattened.push_back(third.x);
+        flattened.push_back(third.y);
+        flattened.push_back(third.z);
+        flattened.push_back(normal.z);
     }
     return flattened;
 }
 
-std::vector<float> Scene::FlattenBoundingBoxes(const std::vector<BoundingBox>& boundingBoxes) {
-    std::vector<float> flattened;
-    flattened.reserve(boundingBoxes.size() * 9);
+std::vector<FlatBoundingBox> Scene::FlattenBoundingBoxes(const std::vector<BoundingBox>& boundingBoxes) {
+    std::vector<FlatBoundingBox> flattened;
+    flattened.reserve(boundingBoxes.size());
     for (const auto& box : boundingBoxes) {
-        // Use 'mini' and 'maxi' as per the BoundingBox definition
-        flattened.push_back(box.maxi.x);
-        flattened.push_back(box.maxi.y);
-        flattened.push_back(box.maxi.z);
-        flattened.push_back(box.mini.x);
-        flattened.push_back(box.mini.y);
-        flattened.push_back(box.mini.z);
-        flattened.push_back(static_cast<float>(box.triangleCount));
-        if(box.triangleCount == 0) { //if leaf node then
-            flattened.push_back(static_cast<float>(box.rightChildIndex));
+        FlatBoundingBox flat;
+        flat.maxi[0] = box.maxi.x;
+        flat.maxi[1] = box.maxi.y;
+        flat.maxi[2] = box.maxi.z;
+        flat.mini[0] = box.mini.x;
+        flat.mini[1] = box.mini.y;
+        flat.mini[2] = box.mini.z;
+        if(box.IsLeaf()) {
+            flat.triangleCount = box.triangleCount;
+            flat.index = box.triangleStartIndex;
+        } else { // siblings are stored as pairs so only the left child is needed
+            flat.triangleCount = -(std::max(box.splitAxis, 0) + 1);
+            flat.index = box.leftChildIndex;
+        }
+        flattened.push_back(flat);
+    }
+    return flattened;
+}
+
+std::vector<int> Scene::FlattenBoundingBoxLinks(const std::vector<BoundingBox>& boundingBoxes) {
+    return ParentSiblingLinks(boundingBoxes);
+}
+
+std::vector<FlatMaterial> Scene::FlattenMaterials(size_t first, size_t last) {
+    std::vector<FlatMaterial> flattened;
+    flattened.reserve(last - first);
+    for(size_t i = first; i < last; ++i) {
+        const Material::Material& material = *materials[i];
+        flattened.push_back({{material.colour.x, material.colour.y, material.colour.z}, material.roughness,
+                             {material.specularColour.x, material.specularColour.y, material.specularColour.z}, material.metallic,
+                             material.transparency, material.refractionIndex, material.isLight != 0.0f, objectVisibility[i]});
+    }
+    return flattened;
+}
+
+std::vector<uint32_t> Scene::FlattenBoundingBoxMasks(const BvhTree& tree) {
+    const std::vector<BoundingBox>& boundingBoxes = tree.GetBoundingBoxes();
+    const std::vector<Tri>& triangles = tree.GetTriangles();
+    const std::vector<int>& references = tree.GetTriangleReferences();
+    std::vector<uint32_t> flattened(boundingBoxes.size(), 0);
+    if(boundingBoxes.empty()) {
+        return flattened;
+    }
+    // children before their parents, whatever order Insert left the nodes in
+    std::vector<std::pair<int, bool>> stack = {{0, false}};
+    while(!stack.empty()) {
+        auto [node, childrenDone] = stack.back();
+        stack.pop_back();
+        const BoundingBox& box = boundingBoxes[node];
+        if(box.IsLeaf()) {
+            uint32_t some = 0;
+            uint32_t every = RAY_ALL;
+            for(int slot = box.triangleStartIndex; slot < box.triangleStartIndex + box.triangleCount; ++slot) {
+                uint32_t visibility = objectVisibility[triangles[references.empty() ? slot : references[slot]].materialsIndex];
+                some |= visibility;
+                every &= visibility;
+            }
+            flattened[node] = some | (every << 8);
+        } else if(childrenDone) {
+            uint32_t left = flattened[box.leftChildIndex];
+            uint32_t right = flattened[box.rightChildIndex];
+            flattened[node] = ((left | right) & 0xff) | (left & right & 0xff00);
         } else {
-            flattened.push_back(static_cast<float>(box.triangleStartIndex));
+            stack.push_back({node, true});
+            stack.push_back({box.leftChildIndex, false});
+            stack.push_back({box.rightChildIndex, false});
         }
     }
     return flattened;
 }
 
+std::unique_ptr<ObjectLoader> Scene::OpenObjectFile(const std::string& objectFilePath, int objectId) {
+    std::unique_ptr<ObjectLoader> objectLoader = MakeObjectLoader(objectFilePath);
+    if(!objectLoader->TargetFile(objectFilePath)) {
+        std::cout << "unable to read from: " << objectFilePath << std::endl;
+        return nullptr;
+    }
+    std::optional<Material::Material> material = objectLoader->ExtractMaterial();
+    if(!material.has_value()) {
+        std::cout << "unable to read material from: " << objectFilePath << std::endl;
+        return nullptr;
+    }
+    if(objectId < 0 || objectId >= materials.size()) {
+        materials.push_back(std::make_unique<Material::Material>(material.value()));
+        objectVisibility.push_back(objectLoader->GetVisibility());
+    } else {
+        *materials[objectId] = material.value();
+        objectVisibility[objectId] = objectLoader->GetVisibility();
+    }
+    if(objectLoader->GetVisibility() != RAY_ALL && !settings.UsesVisibilityMasks()) {
+        std::cout << "the visibility of " << objectFilePath << " is ignored, it needs VisibilityMasks = on and a tree built on the CPU" << std::endl;
+    }
+    return objectLoader;
+}
+
+std::optional<std::vector<Tri>> Scene::LoadObjectFile(const std::string& objectFilePath, int objectId) {
+    bool appended = objectId < 0 || objectId >= materials.size();
+    if(appended) {
+        objectId = materials.size();
+    }
+    std::unique_ptr<ObjectLoader> objectLoader = OpenObjectFile(objectFilePath, objectId);
+    if(!objectLoader) {
+        return std::nullopt;
+    }
+    std::optional<std::vector<Tri>> objTris = objectLoader->ExtractTriangles();
+    if(!objTris.has_value()) {
+        std::cout << "unable to read triangles from: " << objectFilePath << std::endl;
+        if(appended) { // a material nothing uses would only take up a slot
+            materials.pop_back();
+            objectVisibility.pop_back();
+        }
+        return objTris;
+    }
+    // the loaders number the materials they read themselves, the scene decides which slot the object takes
+    for(Tri& triangle : objTris.value()) {
+        triangle.materialsIndex = objectId;
+    }
+    return objTris;
+}
+
+std::vector<int> Scene::GetObjectIds() const {
+    std::vector<int> objectIds;
+    for(int objectId = 0; objectId < materials.size(); ++objectId) {
+        if(std::find(freeObjectIds.begin(), freeObjectIds.end(), objectId) == freeObjectIds.end()) {
+            objectIds.push_back(objectId);
+        }
+    }
+    return objectIds;
+}
+
 void Scene::LoadObjects(const std::vector<std::string>& objectFilePaths) {
-    int numberOfFiles = objectFilePaths.size();
-    std::unique_ptr<ObjectLoader> objectLoader;
-    for(int i=0; i<numberOfFiles; ++i) {
-        if(objectFilePaths[i].find(".off") != std::string::npos || objectFilePaths[i].find(".OFF") != std::string::npos) {
-            objectLoader = std::make_unique<OFFLoader>();
-        } else {
-            objectLoader = std::make_unique<ObjectLoader>();
+    if(settings.UsesBvhFile()) {
+        LoadObjectsThroughBvhFile(objectFilePaths);
+        UploadLights(); // bvhTree holds none of the triangles of the file, so nothing is sampled
+        return;
+    }
+    std::vector<Tri> triangles;
+    std::vector<std::pair<int, std::future<ProxyMesh>>> decimations; // one worker per object, they run during the BVH build
+    auto decimationBegin = std::chrono::steady_clock::now();
+    for(const auto& objectFilePath : objectFilePaths) {
+        std::optional<std::vector<Tri>> objTris = LoadObjectFile(objectFilePath);
+        if(objTris.has_value()) {
+            triangles.insert(triangles.end(), objTris.value().begin(), objTris.value().end());
+            if(settings.UsesProxies()) {
+                decimations.emplace_back(materials.size() - 1, std::async(std::launch::async, MakeProxyMesh, std::move(objTris.value()), settings.proxyDetail));
+            }
         }
+    }
 
-        if(!objectLoader->TargetFile(objectFilePaths[i])) {
-            std::cout << "unable to read from: " << objectFilePaths[i] << std::endl;
-            continue;
+    if(settings.bvhBuild == BvhBuild::GPU) {
+        bvhTree.SetTriangles(std::move(triangles));
+        UploadTriangles();
+        gpuBvhBuilder = std::make_unique<GpuBvhBuilder>(settings.ShaderDefines());
+        auto begin = std::chrono::steady_clock::now();
+        RebuildBvhOnGpu();
+        glFinish(); // only to time the build, per frame rebuilds do not wait for it
+        auto end = std::chrono::steady_clock::now();
+        std::cout << "constructing gpu BVH structure took: " << std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() << "us" << std::endl;
+        WriteBvhReport();
+        SendSceneMaterials();
+    } else {
+        // create the Bvh tree, with morton-then-sah the first frames trace the morton tree while the sah tree is built
+        BuiltBvh bvh = BuildBvh(triangles, settings.bvhBuild == BvhBuild::SAH ? BvhBuilder::SAH : BvhBuilder::MORTON, settings);
+        if(settings.bvhBuild == BvhBuild::MORTON_THEN_SAH) {
+            fastBvhBuildMilliseconds = bvh.buildMilliseconds;
+            refinedBvh = std::async(std::launch::async, BuildBvh, std::move(triangles), BvhBuilder::SAH, settings);
         }
-        std::optional<Material::Material> material = objectLoader->ExtractMaterial();
-        if(!material.has_value()) {
-            std::cout << "unable to read material from: " << objectFilePaths[i] << std::endl;
-            continue;
+        bvhTree = std::move(bvh.tree);
+        UploadBvh();
+        WriteBvhReport();
+        SendSceneMaterials();
+        if(settings.UsesProxies()) {
+            for(auto& [objectId, decimation] : decimations) {
+                proxyMeshes[objectId] = decimation.get();
+            }
+            auto decimationEnd = std::chrono::steady_clock::now();
+            std::cout << "decimating the proxies took: " << std::chrono::duration_cast<std::chrono::milliseconds>(decimationEnd - decimationBegin).count() << "ms" << std::endl;
+            BuildProxies();
+            AppendProxies();
         }
-        materials.push_back(std::make_unique<Material::Material>(material.value()));
-        std::optional<std::vector<Tri>> objTris = objectLoader->ExtractTriangles();
-        if(!objTris.has_value()) {
-            std::cout << "unable to read triangles from: " << objectFilePaths[i] << std::endl;
-            continue;
+    }
+    UploadLights();
+    
+    std::cout << "triangles count: " << bvhTree.GetTriangles().size() << std::endl;
+    std::cout << "floats count: " << bvhTree.GetTriangles().size() * 12 << std::endl;
+}
+
+void Scene::LoadObjectsThroughBvhFile(const std::vector<std::string>& objectFilePaths) {
+    const std::string& bvhFilePath = settings.bvhFilePath;
+    std::optional<BvhFileHeader> header = ReadBvhFileHeader(MappedFileReader(bvhFilePath));
+    bool upToDate = header.has_value() && header->objectCount == objectFilePaths.size();
+    if(upToDate && !(header->settings == BvhFileSettings::From(settings))) {
+        std::cout << bvhFilePath << " was built with other BVH settings, rebuilding it" << std::endl;
+        upToDate = false;
+    }
+    for(const auto& objectFilePath : objectFilePaths) {
+        upToDate = upToDate && std::filesystem::last_write_time(objectFilePath) <= std::filesystem::last_write_time(bvhFilePath);
+    }
+    if(upToDate) {
+        for(const auto& objectFilePath : objectFilePaths) {
+            OpenObjectFile(objectFilePath); // only the materials, the triangles are in the BVH file
+        }
+    } else {
+        // the triangles go straight from the object files to disk so the scene never has to fit in memory at once
+        OutOfCoreBvhBuilder builder(bvhFilePath, settings.bvhMemoryBudgetMegabytes << 20, settings);
+        for(const auto& objectFilePath : objectFilePaths) {
+            std::unique_ptr<ObjectLoader> objectLoader = OpenObjectFile(objectFilePath);
+            if(objectLoader && !objectLoader->StreamTriangles([&builder](const Tri& triangle) { builder.Add(triangle); })) {
+                std::cout << "unable to read triangles from: " << objectFilePath << std::endl;
+            }
+        }
+        if(!builder.Build(objectFilePaths.size())) {
+            std::cout << "unable to write " << bvhFilePath << std::endl;
+            return;
         }
+    }
+    UploadBvhFile(bvhFilePath);
+    SendSceneMaterials();
+}
+
+void Scene::UploadBvhFile(const std::string& bvhFilePath) {
+    MappedFileReader file(bvhFilePath);
+    std::optional<BvhFileHeader> header = ReadBvhFileHeader(file);
+    if(!header.has_value()) {
+        std::cout << bvhFilePath << " is not a BVH file" << std::endl;
+        return;
+    }
+    auto begin = std::chrono::steady_clock::now();
+    // triangles and nodes are converted and uploaded a window at a time, only the material indices and the links
+    // are held whole
+    GLuint triangleBuffer = AllocateSSBO(0, header->triangleCount * 12 * sizeof(float));
+    std::vector<int> trianglesMatIdxData;
+    trianglesMatIdxData.reserve(header->triangleCount);
+    file.ForEachChunk<PackedTriangle>(header->TrianglesOffset(), header->triangleCount, [&](const PackedTriangle* records, size_t count) {
+        std::vector<Tri> chunk;
+        chunk.reserve(count);
+        for(size_t i = 0; i < count; ++i) {
+            chunk.push_back(records[i].ToTri());
+            trianglesMatIdxData.push_back(records[i].materialsIndex);
+        }
+        WriteBuffer(triangleBuffer, (trianglesMatIdxData.size() - count) * 12, FlattenTrianglesVertices(chunk));
+    });
+    SendDataAsTextureBuffer(trianglesMatIdxData, header->triangleCount, "u_MaterialsIndex", GL_R32I);
+
+    GLuint nodeBuffer = AllocateSSBO(1, header->nodeCount * sizeof(FlatBoundingBox));
+    std::vector<int> links;
+    if(settings.bvhTraversal == BvhTraversal::STACKLESS) {
+        links.assign(header->nodeCount * 2, -1);
+    }
+    size_t nodesUploaded = 0;
+    file.ForEachChunk<FlatBoundingBox>(header->NodesOffset(), header->nodeCount, [&](const FlatBoundingBox* records, size_t count) {
+        WriteBuffer(nodeBuffer, nodesUploaded, std::vector<FlatBoundingBox>(records, records + count));
+        for(size_t i = 0; i < count && !links.empty(); ++i) {
+            int node = nodesUploaded + i;
+            int left = records[i].index;
+            if(records[i].triangleCount < 0 && left > 0) { // interior node, the same links as FlattenBoundingBoxLinks
+                links[left * 2] = node;
+                links[left * 2 + 1] = left + 1;
+                links[(left + 1) * 2] = node;
+                links[(left + 1) * 2 + 1] = left;
+            }
+        }
+        nodesUploaded += count;
+    });
+    if(!links.empty()) {
+        SendDataAsSSBO(links, 2, GL_STATIC_DRAW);
+    }
+    GLCALL(glUniform1ui(GetUniformLocation("u_BoundingBoxesCount"), header->nodeCount));
+    auto end = std::chrono::steady_clock::now();
+    std::cout << "uploaded " << header->triangleCount << " triangles and " << header->nodeCount << " nodes from " << bvhFilePath << " in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << "ms" << std::endl;
+}
+
+GLuint Scene::AllocateSSBO(int bufferUnit, size_t bytes) {
+    GLuint& ssbo = shaderStorageBuffers[bufferUnit];
+    if(ssbo == 0) {
+        glGenBuffers(1, &ssbo);
+    }
+    GLCALL(glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo));
+    GLCALL(glBufferData(GL_SHADER_STORAGE_BUFFER, bytes, nullptr, GL_STATIC_DRAW));
+    bufferCapacities[ssbo] = bytes;
+    GLCALL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, bufferUnit, ssbo));
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    return ssbo;
+}
+
+int Scene::AddObject(const std::string& objectFilePath) {
+    if(settings.UsesBvhFile()) {
+        std::cout << "unable to add " << objectFilePath << ", a scene loaded through " << settings.bvhFilePath << " is fixed" << std::endl;
+        return -1;
+    }
+    if(refinedBvh.valid()) { // edits go to the sah tree, so wait for it rather than lose them at the swap
+        refinedBvh.wait();
+        SwapInRefinedBvh();
+    }
+    int objectId = freeObjectIds.empty() ? materials.size() : freeObjectIds.back();
+    std::optional<std::vector<Tri>> objTris = LoadObjectFile(objectFilePath, objectId);
+    if(!objTris.has_value()) {
+        return -1;
+    }
+    if(!freeObjectIds.empty() && freeObjectIds.back() == objectId) {
+        freeObjectIds.pop_back();
+    }
+    auto begin = std::chrono::steady_clock::now();
+    size_t nodesWritten;
+    if(gpuBvhBuilder) { // the whole tree is rebuilt on the GPU, which is cheaper than keeping a CPU copy up to date
+        std::vector<Tri> triangles = bvhTree.GetTriangles();
         triangles.insert(triangles.end(), objTris.value().begin(), objTris.value().end());
+        bvhTree.SetTriangles(std::move(triangles));
+        UploadTriangles();
+        nodesWritten = RebuildBvhOnGpu();
+    } else {
+        if(settings.UsesProxies()) {
+            proxyMeshes[objectId] = MakeProxyMesh(objTris.value(), settings.proxyDetail);
+        }
+        BvhUpdate update = bvhTree.Insert(std::move(objTris.value()));
+        UploadBvhUpdate(update);
+        nodesWritten = update.nodes.size();
+        if(settings.UsesProxies()) { // the scene may have grown into the buffers behind it
+            BuildProxies();
+            AppendProxies();
+        }
     }
+    SendSceneMaterials(objectId, objectId + 1);
+    UploadLights();
+    ResetFrameIndex();
+    auto end = std::chrono::steady_clock::now();
+    std::cout << "added " << objectFilePath << " as object " << objectId << " in " << std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() << "us, "
+              << nodesWritten << " nodes written, " << bvhTree.GetTriangles().size() << " triangles and " << materials.size() << " materials in the buffers" << std::endl;
+    return objectId;
+}
+
+void Scene::RemoveObject(int objectId) {
+    if(settings.UsesBvhFile()) {
+        std::cout << "unable to remove object " << objectId << ", a scene loaded through " << settings.bvhFilePath << " is fixed" << std::endl;
+        return;
+    }
+    if(objectId < 0 || objectId >= materials.size() || std::find(freeObjectIds.begin(), freeObjectIds.end(), objectId) != freeObjectIds.end()) {
+        std::cout << "unable to remove object " << objectId << ", there is no such object" << std::endl;
+        return;
+    }
+    if(refinedBvh.valid()) {
+        refinedBvh.wait();
+        SwapInRefinedBvh();
+    }
+    auto begin = std::chrono::steady_clock::now();
+    size_t nodesWritten;
+    if(gpuBvhBuilder) {
+        std::vector<Tri> triangles = bvhTree.GetTriangles();
+        std::erase_if(triangles, [objectId](const Tri& tri) { return tri.materialsIndex == objectId; });
+        bvhTree.SetTriangles(std::move(triangles));
+        UploadTriangles();
+        nodesWritten = RebuildBvhOnGpu();
+    } else {
+        BvhUpdate update = bvhTree.Remove(objectId);
+        UploadBvhUpdate(update);
+        nodesWritten = update.nodes.size();
+        if(proxyMeshes.erase(objectId) > 0) {
+            BuildProxies();
+            AppendProxies();
+        }
+    }
+    freeObjectIds.push_back(objectId);
+    UploadLights();
+    ResetFrameIndex();
+    auto end = std::chrono::steady_clock::now();
+    std::cout << "removed object " << objectId << " in " << std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() << "us, "
+              << nodesWritten << " nodes written" << std::endl;
+}
+
+unsigned int Scene::RebuildBvhOnGpu() {
+    if(!gpuBvhBuilder) {
+        std::cout << "RebuildBvhOnGpu needs BvhBuild = gpu" << std::endl;
+        return 0;
+    }
+    unsigned int nodeCount = gpuBvhBuilder->Build(bvhTree.GetTriangles().size());
+    if(shaderStorageBuffers.contains(MATERIALS_BINDING)) { // the sort used the binding for its keys
+        GLCALL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MATERIALS_BINDING, shaderStorageBuffers[MATERIALS_BINDING]));
+    }
+    GLCALL(glUniform1ui(GetUniformLocation("u_BoundingBoxesCount"), nodeCount));
+    GLCALL(glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT)); // the tracer reads the nodes the build just wrote
+    return nodeCount;
+}
 
-    // create the Bvh tree
-    BvhTree bvhtree(triangles);
-    auto [boundingBoxes, reorderedTriangles] = bvhtree.BuildTree();
-    triangles = reorderedTriangles;
+Scene::BuiltBvh Scene::BuildBvh(std::vector<Tri> sourceTriangles, BvhBuilder builder, RenderSettings settings) {
+    auto begin = std::chrono::steady_clock::now();
+    BvhTree bvhtree(std::move(sourceTriangles));
+    bvhtree.SetBuilder(builder);
+    settings.Configure(bvhtree);
+    bvhtree.BuildTree();
+    auto end = std::chrono::steady_clock::now();
+    return {std::move(bvhtree), std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count()};
+}
+
+void Scene::UploadTriangles() {
+    const std::vector<Tri>& triangles = bvhTree.GetTriangles();
     // Flatten all triangles into a single vector
     std::vector<float> trianglesVertexData = FlattenTrianglesVertices(triangles);
     std::vector<int> trianglesMatIdxData = FlattenTrianglesMatIdx(triangles);
-    std::vector<float> boundingBoxesData = FlattenBoundingBoxes(boundingBoxes);
-    // SendDataAsTextureBuffer(trianglesVertexData, triangles.size(), "u_Triangles", TextureUnitManager::getNewTextureUnit(), GL_RGB32F);
+    // SendDataAsTextureBuffer(trianglesVertexData, triangles.size(), "u_Triangles", GL_RGB32F);
     SendDataAsSSBO(trianglesVertexData, 0, GL_STATIC_DRAW);
-    SendDataAsTextureBuffer(trianglesMatIdxData, triangles.size(), "u_MaterialsIndex", TextureUnitManager::getNewTextureUnit(), GL_R32I);
-    SendDataAsTextureBuffer(boundingBoxesData, boundingBoxes.size(), "u_BoundingBoxes", TextureUnitManager::getNewTextureUnit(), GL_RGBA32F);
-    SendSceneMaterials();
-    
-    std::cout << "triangles count: " << triangles.size() << std::endl;
-    std::cout << "floats count: " << trianglesVertexData.size() << std::endl;
-}
-
-void Scene::SendSceneMaterials() {
-    for(int i=0; i<materials.size(); ++i)
-    {
-        const auto& material = *materials[i];
-        auto colourLoc = GetUniformLocationIdx("u_Materials", i, {{"colour"}});
-        auto specularcolourLoc = GetUniformLocationIdx("u_Materials", i, {{"specularColour"}});
-        auto roughnessLoc = GetUniformLocationIdx("u_Materials", i, {{"roughness"}});
-        auto metallicLoc = GetUniformLocationIdx("u_Materials", i, {{"metallic"}});
-        auto transparencyLoc = GetUniformLocationIdx("u_Materials", i, {{"transparency"}});
-        auto refractionIdxLoc = GetUniformLocationIdx("u_Materials", i, {{"refractionIndex"}});
-        auto isLightLoc = GetUniformLocationIdx("u_Materials", i, {{"isLight"}});
-        glUniform3f(colourLoc, material.colour.x, material.colour.y, material.colour.z);
-        glUniform3f(specularcolourLoc, material.specularColour.x, material.specularColour.y, material.specularColour.z);
-        glUniform1f(roughnessLoc, material.roughness);
-        glUniform1f(metallicLoc, material.metallic);
-        glUniform1f(transparencyLoc, material.transparency);
-        glUniform1f(refractionIdxLoc, material.refractionIndex);
-        glUniform1i(isLightLoc, material.isLight ? 1 : 0);
-    }
-    glUniform1i(glGetUniformLocation(shaderProgramId, "u_MaterialsCount"), materials.size()); 
-}
-
-unsigned int Scene::GetUniformLocation(std::string uname) {
-    std::string query = uname;
-    unsigned int result;
-    GLCALL(result = glGetUniformLocation(shaderProgramId, query.c_str()));
-    return result;
-}
-
-unsigned int Scene::GetUniformLocationIdx(std::string uname, unsigned int index, std::vector<std::string> attributes) {
-    std::string indexStr = std::to_string(index);
-    std::string query = uname + "[" + indexStr +"]";
-    for(auto attribute : attributes) {
-        query += "." + attribute;
-    }
-    unsigned int result;
-    GLCALL(result = glGetUniformLocation(shaderProgramId, query.c_str()));
-    return result;
-};
+    SendDataAsTextureBuffer(trianglesMatIdxData, triangles.size(), "u_MaterialsIndex", GL_R32I);
+}
+
+void Scene::UploadBvh() {
+    bvhVersion++;
+    UploadTriangles();
+    std::vector<FlatBoundingBox> boundingBoxesData = FlattenBoundingBoxes(bvhTree.GetBoundingBoxes());
+    SendDataAsSSBO(boundingBoxesData, 1, GL_STATIC_DRAW);
+    GLCALL(glUniform1ui(GetUniformLocation("u_BoundingBoxesCount"), boundingBoxesData.size()));
+    if(!bvhTree.GetTriangleReferences().empty()) {
+        SendDataAsSSBO(bvhTree.GetTriangleReferences(), 3, GL_STATIC_DRAW);
+    }
+    if(settings.bvhTraversal == BvhTraversal::STACKLESS) {
+        SendDataAsSSBO(FlattenBoundingBoxLinks(bvhTree.GetBoundingBoxes()), 2, GL_STATIC_DRAW);
+    }
+    if(settings.UsesVisibilityMasks()) {
+        SendDataAsSSBO(FlattenBoundingBoxMasks(bvhTree), 4, GL_STATIC_DRAW);
+    }
+    if(settings.UsesProxies()) {
+        AppendProxies();
+    }
+}
+
+void Scene::BuildProxies() {
+    bvhVersion++;
+    std::vector<Tri> triangles;
+    proxySkinDistances.assign(materials.size(), 0.0f);
+    for(const auto& [objectId, proxy] : proxyMeshes) {
+        triangles.insert(triangles.end(), proxy.triangles.begin(), proxy.triangles.end());
+        proxySkinDistances[objectId] = proxy.maxError;
+    }
+    if(triangles.empty()) {
+        proxyTree = BvhTree();
+        return;
+    }
+    // the proxies are small next to the scene, so they are rebuilt whole with sah whatever BvhBuild says
+    RenderSettings proxySettings = settings;
+    proxySettings.preSplitFraction = 0.0f;
+    BuiltBvh proxies = BuildBvh(std::move(triangles), BvhBuilder::SAH, proxySettings);
+    proxyTree = std::move(proxies.tree);
+    std::cout << "proxies: " << proxyTree.GetTriangles().size() << " triangles, " << proxyTree.GetBoundingBoxes().size() << " nodes built in "
+              << proxies.buildMilliseconds << "ms, skin distance up to " << *std::max_element(proxySkinDistances.begin(), proxySkinDistances.end()) << std::endl;
+}
+
+void Scene::AppendProxies() {
+    const std::vector<Tri>& triangles = proxyTree.GetTriangles();
+    const std::vector<BoundingBox>& boundingBoxes = proxyTree.GetBoundingBoxes();
+    GLCALL(glUniform1ui(GetUniformLocation("u_ProxyBoundingBoxesCount"), boundingBoxes.size()));
+    // bound even without proxies so the sampler does not share a unit with another type
+    SendDataAsTextureBuffer(proxySkinDistances.empty() ? std::vector<float>{0.0f} : proxySkinDistances, proxySkinDistances.size(), "u_ProxySkinDistances", GL_R32F);
+    if(boundingBoxes.empty()) {
+        return;
+    }
+    size_t triangleBase = bvhTree.GetTriangles().size();
+    size_t nodeBase = bvhTree.GetBoundingBoxes().size();
+    size_t referenceBase = bvhTree.GetTriangleReferences().size();
+    // the proxy leaves go through references of their own when the scene's do, so they index like every other leaf
+    bool references = referenceBase > 0;
+    size_t leafBase = references ? referenceBase : triangleBase;
+
+    std::vector<FlatBoundingBox> nodes = FlattenBoundingBoxes(boundingBoxes);
+    for(FlatBoundingBox& node : nodes) {
+        node.index += node.triangleCount > 0 ? leafBase : nodeBase;
+    }
+    ReserveBuffer(shaderStorageBuffers[1], (nodeBase + nodes.size()) * sizeof(FlatBoundingBox));
+    WriteBuffer(shaderStorageBuffers[1], nodeBase, nodes);
+    if(settings.bvhTraversal == BvhTraversal::STACKLESS) {
+        std::vector<int> links = FlattenBoundingBoxLinks(boundingBoxes);
+        for(int& link : links) {
+            link += link >= 0 ? nodeBase : 0;
+        }
+        ReserveBuffer(shaderStorageBuffers[2], (nodeBase + boundingBoxes.size()) * 2 * sizeof(int));
+        WriteBuffer(shaderStorageBuffers[2], nodeBase * 2, links);
+    }
+    if(settings.UsesVisibilityMasks()) {
+        ReserveBuffer(shaderStorageBuffers[4], (nodeBase + boundingBoxes.size()) * sizeof(uint32_t));
+        WriteBuffer(shaderStorageBuffers[4], nodeBase, FlattenBoundingBoxMasks(proxyTree));
+    }
+    if(references) {
+        std::vector<int> identity(triangles.size());
+        for(size_t i = 0; i < identity.size(); ++i) {
+            identity[i] = triangleBase + i;
+        }
+        ReserveBuffer(shaderStorageBuffers[3], (referenceBase + identity.size()) * sizeof(int));
+        WriteBuffer(shaderStorageBuffers[3], referenceBase, identity);
+    }
+    GLuint materialsIndexBuffer = textureBuffers["u_MaterialsIndex"];
+    ReserveBuffer(shaderStorageBuffers[0], (triangleBase + triangles.size()) * 12 * sizeof(float));
+    ReserveBuffer(materialsIndexBuffer, (triangleBase + triangles.size()) * sizeof(int));
+    WriteBuffer(shaderStorageBuffers[0], triangleBase * 12, FlattenTrianglesVertices(triangles));
+    WriteBuffer(materialsIndexBuffer, triangleBase, FlattenTrianglesMatIdx(triangles));
+
+    GLCALL(glUniform1i(GetUniformLocation("u_ProxyRoot"), nodeBase));
+    GLCALL(glUniform1ui(GetUniformLocation("u_ProxyBounce"), settings.proxyBounce));
+    GLCALL(glUniform1f(GetUniformLocation("u_ProxyRoughness"), settings.proxyRoughness));
+}
+
+void Scene::WriteBvhReport() const {
+    if(settings.bvhReportPath.empty()) {
+        return;
+    }
+    if(gpuBvhBuilder) {
+        std::cout << "the BVH report only covers trees built on the CPU, BvhBuild = gpu writes none" << std::endl;
+        return;
+    }
+    std::ofstream out(settings.bvhReportPath);
+    if(!out) {
+        std::cout << "unable to write the BVH report to: " << settings.bvhReportPath << std::endl;
+        return;
+    }
+    out << bvhTree.GetQualityReport().ToJson();
+}
+
+void Scene::ReserveBuffer(GLuint bufferId, size_t bytes) {
+    size_t& capacity = bufferCapacities[bufferId];
+    if(bytes <= capacity) {
+        return;
+    }
+    size_t newCapacity = std::max(bytes, capacity + capacity / 2); // grow geometrically so repeated inserts copy rarely
+    GLuint scratch;
+    GLCALL(glGenBuffers(1, &scratch));
+    GLCALL(glBindBuffer(GL_COPY_READ_BUFFER, bufferId));
+    GLCALL(glBindBuffer(GL_COPY_WRITE_BUFFER, scratch));
+    GLCALL(glBufferData(GL_COPY_WRITE_BUFFER, capacity, nullptr, GL_STREAM_COPY));
+    GLCALL(glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, capacity));
+    GLCALL(glBufferData(GL_COPY_READ_BUFFER, newCapacity, nullptr, GL_STATIC_DRAW));
+    GLCALL(glCopyBufferSubData(GL_COPY_WRITE_BUFFER, GL_COPY_READ_BUFFER, 0, 0, capacity));
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    GLCALL(glDeleteBuffers(1, &scratch));
+    capacity = newCapacity;
+}
+
+void Scene::UploadBvhUpdate(const BvhUpdate& update) {
+    bvhVersion++;
+    if(update.rebuilt) {
+        if(bvhTree.GetBoundingBoxes().empty()) { // nothing left to trace
+            GLCALL(glUniform1ui(GetUniformLocation("u_BoundingBoxesCount"), 0));
+            return;
+        }
+        UploadBvh();
+        return;
+    }
+    const std::vector<BoundingBox>& boundingBoxes = bvhTree.GetBoundingBoxes();
+    const std::vector<Tri>& triangles = bvhTree.GetTriangles();
 
+    // nodes and their links, written in runs of consecutive indices
+    std::vector<int> nodes = update.nodes;
+    std::sort(nodes.begin(), nodes.end());
+    nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+    bool stackless = settings.bvhTraversal == BvhTraversal::STACKLESS;
+    ReserveBuffer(shaderStorageBuffers[1], boundingBoxes.size() * sizeof(FlatBoundingBox));
+    if(stackless) {
+        ReserveBuffer(shaderStorageBuffers[2], boundingBoxes.size() * 2 * sizeof(int));
+    }
+    std::vector<uint32_t> masks; // a pass over the nodes is cheap next to the upload, the touched ones are written
+    if(settings.UsesVisibilityMasks()) {
+        masks = FlattenBoundingBoxMasks(bvhTree);
+        ReserveBuffer(shaderStorageBuffers[4], masks.size() * sizeof(uint32_t));
+    }
+    for(int i = 0; i < nodes.size();) {
+        int first = nodes[i];
+        int last = first;
+        while(i < nodes.size() && nodes[i] == last) {
+            last++;
+            i++;
+        }
+        std::vector<BoundingBox> run(boundingBoxes.begin() + first, boundingBoxes.begin() + last);
+        WriteBuffer(shaderStorageBuffers[1], first, FlattenBoundingBoxes(run));
+        if(stackless) {
+            std::vector<int> links;
+            for(int node = first; node < last; ++node) {
+                int parent = bvhTree.GetParentIndex(node);
+                links.push_back(parent >= 0 ? parent : -1);
+                links.push_back(parent >= 0 ? (node ^ 1) : -1);
+            }
+            WriteBuffer(shaderStorageBuffers[2], first * 2, links);
+        }
+        if(!masks.empty()) {
+            WriteBuffer(shaderStorageBuffers[4], first, std::vector<uint32_t>(masks.begin() + first, masks.begin() + last));
+        }
+    }
+    GLCALL(glUniform1ui(GetUniformLocation("u_BoundingBoxesCount"), boundingBoxes.size()));
+
+    GLuint materialsIndexBuffer = textureBuffers["u_MaterialsIndex"];
+    ReserveBuffer(shaderStorageBuffers[0], triangles.size() * 12 * sizeof(float));
+    ReserveBuffer(materialsIndexBuffer, triangles.size() * sizeof(int));
+    for(auto [first, last] : update.triangles) {
+        std::vector<Tri> run(triangles.begin() + first, triangles.begin() + last);
+        WriteBuffer(shaderStorageBuffers[0], first * 12, FlattenTrianglesVertices(run));
+        WriteBuffer(materialsIndexBuffer, first, FlattenTrianglesMatIdx(run));
+    }
+    GLCALL(glUniform1ui(GetUniformLocation("u_MaterialsIndexCount"), triangles.size()));
+
+    const std::vector<int>& references = bvhTree.GetTriangleReferences();
+    if(!update.references.empty()) {
+        ReserveBuffer(shaderStorageBuffers[3], references.size() * sizeof(int));
+    }
+    for(auto [first, last] : update.references) {
+        WriteBuffer(shaderStorageBuffers[3], first, std::vector<int>(references.begin() + first, references.begin() + last));
+    }
+}
+
+void Scene::SwapInRefinedBvh() {
+    auto now = std::chrono::steady_clock::now();
+    if(fpsAfterSwapPending && now - swapTime > std::chrono::milliseconds(2500)) { // a whole fps measurement after the swap
+        std::cout << "fps with the sah BVH: " << currentfps << std::endl;
+        fpsAfterSwapPending = false;
+    }
+    if(!refinedBvh.valid() || refinedBvh.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        return;
+    }
+    BuiltBvh bvh = refinedBvh.get();
+    bvhTree = std::move(bvh.tree);
+    UploadBvh();
+    WriteBvhReport();
+    ResetFrameIndex();
+    std::cout << "swapped in the sah BVH, morton build: " << fastBvhBuildMilliseconds << "ms, sah build: " << bvh.buildMilliseconds << "ms" << std::endl;
+    std::cout << "fps with the morton BVH: " << currentfps << std::endl;
+    fpsAfterSwapPending = true;
+    swapTime = now;
+}
+
+void Scene::SetMaterial(int objectId, const Material::Material& material) {
+    if(objectId < 0 || objectId >= materials.size()) {
+        std::cout << "unable to set the material of object " << objectId << ", there is no such object" << std::endl;
+        return;
+    }
+    *materials[objectId] = material;
+    SendSceneMaterials(objectId, objectId + 1);
+    UploadLights();
+    ResetFrameIndex();
+}
+
+void Scene::SendSceneMaterials(size_t first, size_t last) {
+    last = std::min(last, materials.size());
+    if(first >= last) {
+        return;
+    }
+    GLuint& ssbo = shaderStorageBuffers[MATERIALS_BINDING];
+    if(ssbo == 0) {
+        GLCALL(glGenBuffers(1, &ssbo));
+        GLCALL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MATERIALS_BINDING, ssbo));
+    }
+    ReserveBuffer(ssbo, materials.size() * sizeof(FlatMaterial));
+    WriteBuffer(ssbo, first, FlattenMaterials(first, last));
+    GLCALL(glUniform1ui(GetUniformLocation("u_MaterialsCount"), materials.size()));
+}
+
+void Scene::UploadLights() {
+    // objects hidden from shadow rays are not sampled either, the bounces that find them take all of their light
+    lights.Build(bvhTree.GetTriangles(), [this](int objectId) {
+        return objectId >= 0 && objectId < materials.size() && materials[objectId]->isLight != 0.0f
+               && (!settings.UsesVisibilityMasks() || (objectVisibility[objectId] & RAY_SHADOW) != 0);
+    });
+    std::vector<float> flattened = lights.Flatten();
+    if(flattened.empty()) { // a texture has to stay bound so the sampler does not share a unit with another type
+        flattened.assign(LIGHT_TEXELS * 4, 0.0f);
+    }
+    SendDataAsTextureBuffer(flattened, lights.Size(), "u_Lights", GL_RGBA32F);
+    GLCALL(glUniform1f(GetUniformLocation("u_LightArea"), lights.GetArea()));
+}
+
+GLint Scene::GetUniformLocation(const std::string& uname) {
+    uniformRevision++;
+    auto [location, inserted] = uniformLocations.try_emplace(uname, -1);
+    if(inserted) {
+        GLCALL(location->second = glGetUniformLocation(shaderProgramId, uname.c_str()));
+    }
+    return location->second;
+}
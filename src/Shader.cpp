@@ -19,6 +19,25 @@ ShaderProgramSource ParseShader(const std::string& vertexShaderPath, const std::
     return {ss[0].str(), ss[1].str()};
 }
 
+std::string ParseComputeShader(const std::string& computeShaderPath) {
+    std::ifstream computeShaderStream(computeShaderPath);
+    std::stringstream ss;
+    ss << computeShaderStream.rdbuf();
+    return ss.str();
+}
+
+std::string InjectShaderDefines(const std::string& source, const std::vector<std::string>& defines) {
+    size_t versionEnd = source.find('\n');
+    if(versionEnd == std::string::npos || defines.empty()) {
+        return source;
+    }
+    std::string defineLines;
+    for(const auto& define : defines) {
+        defineLines += "#define " + define + "\n";
+    }
+    return source.substr(0, versionEnd + 1) + defineLines + source.substr(versionEnd + 1);
+}
+
 unsigned int CompileShader(unsigned int type, const std::string& source) {
     GLCALL(unsigned int id = glCreateShader(type));
     const char* src = source.c_str();
@@ -34,7 +53,7 @@ unsigned int CompileShader(unsigned int type, const std::string& source) {
         char* message = (char*)alloca(length * sizeof(char));
         GLCALL(glGetShaderInfoLog(id, length, &length, message));
         std::cout << "Failed to compile shader of type " << 
-            (type == GL_VERTEX_SHADER ? "vertex" : "fragment")
+            (type == GL_VERTEX_SHADER ? "vertex" : type == GL_COMPUTE_SHADER ? "compute" : "fragment")
             << std::endl;
         std::cout << message << std::endl;
         GLCALL(glDeleteShader(id));
@@ -56,4 +75,14 @@ unsigned int CreateShaderProgram(const std::string& vertexShader, const std::str
     GLCALL(glDeleteShader(fs));
     GLCALL(glDeleteShader(vs));
     return program;  
-}
\ No newline at end of file
+}
+
+unsigned int CreateComputeProgram(const std::string& computeShader) {
+    GLCALL(unsigned int program = glCreateProgram());
+    unsigned int cs = CompileShader(GL_COMPUTE_SHADER, computeShader);
+
+    GLCALL(glAttachShader(program, cs));
+    GLCALL(glLinkProgram(program));
+    GLCALL(glDeleteShader(cs));
+    return program;
+}
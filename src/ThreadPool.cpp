@@ -0,0 +1,92 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned int threadCount) : job(nullptr), generation(0), remaining(0), stopping(false) {
+    if(threadCount == 0) {
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for(unsigned int i = 0; i < threadCount; ++i) {
+        queues.push_back(std::make_unique<WorkQueue>());
+    }
+    for(unsigned int i = 0; i < threadCount; ++i) {
+        workers.emplace_back(&ThreadPool::WorkerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for(auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t)>& task) {
+    if(count == 0) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &task;
+        remaining = count;
+        // consecutive indices go to different workers, neighbouring tiles tend to cost the same
+        for(size_t i = 0; i < count; ++i) {
+            WorkQueue& queue = *queues[i % queues.size()];
+            std::lock_guard<std::mutex> queueLock(queue.mutex);
+            queue.indices.push_back(i);
+        }
+        generation++;
+    }
+    wake.notify_all();
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [this] { return remaining == 0; });
+    job = nullptr;
+}
+
+bool ThreadPool::TakeIndex(size_t worker, size_t& index) {
+    {
+        WorkQueue& own = *queues[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if(!own.indices.empty()) {
+            index = own.indices.back();
+            own.indices.pop_back();
+            return true;
+        }
+    }
+    for(size_t offset = 1; offset < queues.size(); ++offset) {
+        WorkQueue& victim = *queues[(worker + offset) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if(!victim.indices.empty()) {
+            index = victim.indices.front();
+            victim.indices.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::WorkerLoop(size_t worker) {
+    uint64_t seenGeneration = 0;
+    while(true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || generation != seenGeneration; });
+            if(stopping) {
+                return;
+            }
+            seenGeneration = generation;
+        }
+        size_t index;
+        while(TakeIndex(worker, index)) {
+            (*job.load())(index);
+            if(remaining.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(mutex);
+                finished.notify_all();
+            }
+        }
+    }
+}
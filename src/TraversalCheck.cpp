@@ -0,0 +1,143 @@
+#include "TraversalCheck.h"
+#include "Intersection.h"
+
+#include <algorithm>
+
+#define FROM_PARENT 0
+#define FROM_SIBLING 1
+#define FROM_CHILD 2
+
+std::vector<int> ParentSiblingLinks(const std::vector<BoundingBox>& boundingBoxes) {
+    std::vector<int> links(boundingBoxes.size() * 2, -1);
+    for(size_t i = 0; i < boundingBoxes.size(); ++i) {
+        const auto& box = boundingBoxes[i];
+        if(box.IsLeaf() || box.leftChildIndex <= 0) {
+            continue;
+        }
+        links[box.leftChildIndex * 2] = static_cast<int>(i);
+        links[box.leftChildIndex * 2 + 1] = box.rightChildIndex;
+        links[box.rightChildIndex * 2] = static_cast<int>(i);
+        links[box.rightChildIndex * 2 + 1] = box.leftChildIndex;
+    }
+    return links;
+}
+
+// hitBoundingBox of the shader followed by the test against the nearest hit so far
+static bool EntersBox(const BoundingBox& box, const SimdRay& ray, float tLimit) {
+    float tmin = -INFINITY;
+    float tmax = INFINITY;
+    for(int axis = 0; axis < 3; ++axis) {
+        float t0 = (box.mini[axis] - ray.origin[axis]) * ray.invDirection[axis];
+        float t1 = (box.maxi[axis] - ray.origin[axis]) * ray.invDirection[axis];
+        tmin = std::max(tmin, std::min(t0, t1));
+        tmax = std::min(tmax, std::max(t0, t1));
+    }
+    return tmax >= std::max(tmin, 0.0f) && tmin < tLimit;
+}
+
+static int NearChild(const BoundingBox& box, const SimdRay& ray) {
+    return ray.direction[std::max(box.splitAxis, 0)] >= 0.0f ? box.leftChildIndex : box.rightChildIndex;
+}
+
+static void HitLeaf(const BvhTree& tree, const BoundingBox& box, const SimdRay& ray, QueryHit& hit) {
+    const std::vector<int>& references = tree.GetTriangleReferences();
+    for(int slot = box.triangleStartIndex; slot < box.triangleStartIndex + box.triangleCount; ++slot) {
+        int index = references.empty() ? slot : references[slot];
+        const Tri& triangle = tree.GetTriangles()[index];
+        float t;
+        Vector3f outwardNormal;
+        if(HitPrimitive(triangle, ray.origin, ray.direction, ray.invDirection, t, outwardNormal) && hit.t > t) {
+            hit = {t, index, triangle.materialsIndex, outwardNormal};
+        }
+    }
+}
+
+static QueryHit StackHit(const BvhTree& tree, const SimdRay& ray, long long& nodeTests) {
+    QueryHit hit{INFINITY, -1, -1, Vector3f(0, 0, 0)};
+    const std::vector<BoundingBox>& boxes = tree.GetBoundingBoxes();
+    int stack[MAX_BVH_DEPTH + 1];
+    int stackptr = 0;
+    if(!boxes.empty()) {
+        stack[stackptr++] = 0;
+    }
+    while(stackptr > 0) {
+        const BoundingBox& box = boxes[stack[--stackptr]];
+        nodeTests++;
+        if(!EntersBox(box, ray, hit.t)) {
+            continue;
+        }
+        if(box.triangleCount > 0 && box.triangleStartIndex >= 0) {
+            HitLeaf(tree, box, ray, hit);
+            continue;
+        }
+        int nearChild = NearChild(box, ray);
+        stack[stackptr++] = nearChild == box.leftChildIndex ? box.rightChildIndex : box.leftChildIndex;
+        stack[stackptr++] = nearChild;
+    }
+    return hit;
+}
+
+static QueryHit StacklessHit(const BvhTree& tree, const std::vector<int>& links, const SimdRay& ray, long long& nodeTests) {
+    QueryHit hit{INFINITY, -1, -1, Vector3f(0, 0, 0)};
+    const std::vector<BoundingBox>& boxes = tree.GetBoundingBoxes();
+    int current = 0;
+    int state = FROM_PARENT;
+    while(!boxes.empty()) {
+        if(state == FROM_CHILD) {
+            if(current == 0) {
+                break;
+            }
+            int parent = links[current * 2];
+            if(current == NearChild(boxes[parent], ray)) {
+                current = links[current * 2 + 1];
+                state = FROM_SIBLING;
+            } else {
+                current = parent;
+            }
+            continue;
+        }
+        const BoundingBox& box = boxes[current];
+        nodeTests++;
+        bool entered = EntersBox(box, ray, hit.t);
+        if(entered && box.triangleCount > 0) {
+            HitLeaf(tree, box, ray, hit);
+        } else if(entered) {
+            current = NearChild(box, ray);
+            state = FROM_PARENT;
+            continue;
+        }
+        if(current == 0) {
+            break;
+        }
+        if(state == FROM_PARENT) {
+            current = links[current * 2 + 1];
+            state = FROM_SIBLING;
+        } else {
+            current = links[current * 2];
+            state = FROM_CHILD;
+        }
+    }
+    return hit;
+}
+
+TraversalCheckReport CompareTraversals(const BvhTree& tree, const std::vector<QueryRay>& rays) {
+    TraversalCheckReport report;
+    report.rays = rays.size();
+    std::vector<int> links = ParentSiblingLinks(tree.GetBoundingBoxes());
+    for(size_t i = 0; i < rays.size(); ++i) {
+        const QueryRay& query = rays[i];
+        Vector3f invDirection(1.0f / query.direction.x, 1.0f / query.direction.y, 1.0f / query.direction.z);
+        SimdRay ray{query.origin, query.direction, invDirection, query.rayType};
+        QueryHit stack = StackHit(tree, ray, report.stackNodeTests);
+        QueryHit stackless = StacklessHit(tree, links, ray, report.stacklessNodeTests);
+        // misses are INFINITY in both, so comparing the distances exactly also covers them
+        if(stack.triangle == stackless.triangle && stack.t == stackless.t) {
+            continue;
+        }
+        report.mismatches++;
+        if(report.examples.size() < TRAVERSAL_CHECK_EXAMPLES) {
+            report.examples.push_back({i, stack, stackless});
+        }
+    }
+    return report;
+}
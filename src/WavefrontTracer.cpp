@@ -0,0 +1,223 @@
+#include "WavefrontTracer.h"
+#include "Shader.h"
+#include "Renderer.h"
+
+static const char* KERNEL_DEFINES[] = {
+    "KERNEL_GENERATE",
+    "KERNEL_EXTEND",
+    "KERNEL_SHADE_OPAQUE",
+    "KERNEL_SHADE_TRANSPARENT",
+    "KERNEL_SHADOW",
+    "KERNEL_ACCUMULATE"
+};
+
+// the tracer only has scalar and vector uniforms, samplers and images count as int
+static int ComponentCount(GLenum type) {
+    switch(type) {
+        case GL_FLOAT_VEC2: case GL_INT_VEC2: case GL_UNSIGNED_INT_VEC2: case GL_BOOL_VEC2: return 2;
+        case GL_FLOAT_VEC3: case GL_INT_VEC3: case GL_UNSIGNED_INT_VEC3: case GL_BOOL_VEC3: return 3;
+        case GL_FLOAT_VEC4: case GL_INT_VEC4: case GL_UNSIGNED_INT_VEC4: case GL_BOOL_VEC4: return 4;
+        default: return 1;
+    }
+}
+
+static bool IsFloatType(GLenum type) {
+    return type == GL_FLOAT || type == GL_FLOAT_VEC2 || type == GL_FLOAT_VEC3 || type == GL_FLOAT_VEC4;
+}
+
+static bool IsUnsignedType(GLenum type) {
+    return type == GL_UNSIGNED_INT || type == GL_UNSIGNED_INT_VEC2 || type == GL_UNSIGNED_INT_VEC3 || type == GL_UNSIGNED_INT_VEC4;
+}
+
+static void SetUniform(GLuint program, GLint location, int components, const GLfloat* values) {
+    switch(components) {
+        case 1: glProgramUniform1fv(program, location, 1, values); break;
+        case 2: glProgramUniform2fv(program, location, 1, values); break;
+        case 3: glProgramUniform3fv(program, location, 1, values); break;
+        default: glProgramUniform4fv(program, location, 1, values); break;
+    }
+}
+
+static void SetUniform(GLuint program, GLint location, int components, const GLuint* values) {
+    switch(components) {
+        case 1: glProgramUniform1uiv(program, location, 1, values); break;
+        case 2: glProgramUniform2uiv(program, location, 1, values); break;
+        case 3: glProgramUniform3uiv(program, location, 1, values); break;
+        default: glProgramUniform4uiv(program, location, 1, values); break;
+    }
+}
+
+static void SetUniform(GLuint program, GLint location, int components, const GLint* values) {
+    switch(components) {
+        case 1: glProgramUniform1iv(program, location, 1, values); break;
+        case 2: glProgramUniform2iv(program, location, 1, values); break;
+        case 3: glProgramUniform3iv(program, location, 1, values); break;
+        default: glProgramUniform4iv(program, location, 1, values); break;
+    }
+}
+
+WavefrontTracer::WavefrontTracer(const std::string& tracerShaderPath, const std::vector<std::string>& shaderDefines)
+    : megakernel(tracerShaderPath, shaderDefines), capacity(0), target(0) {
+    std::string source = ParseComputeShader(tracerShaderPath);
+    for(int kernel = 0; kernel < KERNEL_COUNT; ++kernel) {
+        std::vector<std::string> defines = shaderDefines;
+        defines.push_back("WAVEFRONT");
+        defines.push_back(KERNEL_DEFINES[kernel]);
+        programs[kernel] = CreateComputeProgram(InjectShaderDefines(source, defines));
+        traceRectLocations[kernel] = glGetUniformLocation(programs[kernel], "u_TraceRect");
+        pathCountLocations[kernel] = glGetUniformLocation(programs[kernel], "u_PathCount");
+        extendQueueLocations[kernel] = glGetUniformLocation(programs[kernel], "u_ExtendQueue");
+    }
+    FindSharedUniforms();
+    GLCALL(glGenBuffers(1, &paths));
+    GLCALL(glGenBuffers(1, &queues));
+}
+
+WavefrontTracer::~WavefrontTracer() {
+    for(GLuint program : programs) {
+        glDeleteProgram(program);
+    }
+    glDeleteBuffers(1, &paths);
+    glDeleteBuffers(1, &queues);
+}
+
+void WavefrontTracer::FindSharedUniforms() {
+    GLuint source = megakernel.GetProgramId();
+    GLint uniformCount = 0;
+    glGetProgramiv(source, GL_ACTIVE_UNIFORMS, &uniformCount);
+    for(GLint i = 0; i < uniformCount; ++i) {
+        char name[256];
+        GLsizei length;
+        GLint size;
+        SharedUniform uniform;
+        glGetActiveUniform(source, i, sizeof(name), &length, &size, &uniform.type, name);
+        uniform.source = glGetUniformLocation(source, name);
+        if(uniform.source < 0) { // a member of FrameConstants, which every kernel reads from the same buffer
+            continue;
+        }
+        bool shared = false;
+        for(int kernel = 0; kernel < KERNEL_COUNT; ++kernel) {
+            uniform.locations[kernel] = glGetUniformLocation(programs[kernel], name);
+            shared |= uniform.locations[kernel] >= 0;
+        }
+        if(shared) {
+            sharedUniforms.push_back(uniform);
+        }
+    }
+}
+
+void WavefrontTracer::CopySharedUniforms() {
+    GLuint source = megakernel.GetProgramId();
+    for(const SharedUniform& uniform : sharedUniforms) {
+        int components = ComponentCount(uniform.type);
+        GLfloat floats[4];
+        GLuint uints[4];
+        GLint ints[4];
+        if(IsFloatType(uniform.type)) {
+            glGetUniformfv(source, uniform.source, floats);
+        } else if(IsUnsignedType(uniform.type)) {
+            glGetUniformuiv(source, uniform.source, uints);
+        } else {
+            glGetUniformiv(source, uniform.source, ints);
+        }
+        for(int kernel = 0; kernel < KERNEL_COUNT; ++kernel) {
+            if(uniform.locations[kernel] < 0) {
+                continue;
+            }
+            if(IsFloatType(uniform.type)) {
+                SetUniform(programs[kernel], uniform.locations[kernel], components, floats);
+            } else if(IsUnsignedType(uniform.type)) {
+                SetUniform(programs[kernel], uniform.locations[kernel], components, uints);
+            } else {
+                SetUniform(programs[kernel], uniform.locations[kernel], components, ints);
+            }
+        }
+    }
+}
+
+void WavefrontTracer::SetTarget(GLuint texture) {
+    target = texture;
+}
+
+void WavefrontTracer::Reserve(unsigned int pathCount) {
+    if(pathCount <= capacity) {
+        return;
+    }
+    capacity = pathCount;
+    GLCALL(glBindBuffer(GL_SHADER_STORAGE_BUFFER, paths));
+    GLCALL(glBufferData(GL_SHADER_STORAGE_BUFFER, size_t(capacity) * WAVEFRONT_PATH_SIZE, nullptr, GL_DYNAMIC_COPY));
+    GLCALL(glBindBuffer(GL_SHADER_STORAGE_BUFFER, queues));
+    GLCALL(glBufferData(GL_SHADER_STORAGE_BUFFER, QUEUE_COUNT * (QUEUE_HEADER_SIZE + size_t(capacity) * sizeof(uint32_t)), nullptr, GL_DYNAMIC_COPY));
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void WavefrontTracer::ResetQueue(unsigned int queue) {
+    const uint32_t empty[4] = {0, 1, 1, 0};
+    GLCALL(glBufferSubData(GL_DISPATCH_INDIRECT_BUFFER, queue * QUEUE_HEADER_SIZE, sizeof(empty), empty));
+}
+
+void WavefrontTracer::Dispatch(Kernel kernel, unsigned int groups) {
+    GLCALL(glUseProgram(programs[kernel]));
+    GLCALL(glDispatchCompute(groups, 1, 1));
+    // the next kernel reads the paths and queues, the queues are reset, read back or dispatched from
+    GLCALL(glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT));
+}
+
+void WavefrontTracer::DispatchIndirect(Kernel kernel, unsigned int queue) {
+    GLCALL(glUseProgram(programs[kernel]));
+    GLCALL(glDispatchComputeIndirect(queue * QUEUE_HEADER_SIZE));
+    GLCALL(glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT));
+}
+
+void WavefrontTracer::Trace(const TraceRect& rect, uint32_t bounceLimit, uint64_t uniformRevision) {
+    if(rect.width == 0 || rect.height == 0) {
+        return;
+    }
+    unsigned int groups = ComputeTracer::TilesAcross(rect.width) * ComputeTracer::TilesAcross(rect.height);
+    unsigned int pathCount = groups * WAVEFRONT_GROUP_SIZE;
+    Reserve(pathCount);
+    if(copiedRevision != uniformRevision) {
+        CopySharedUniforms();
+        copiedRevision = uniformRevision;
+    }
+    for(int kernel = 0; kernel < KERNEL_COUNT; ++kernel) {
+        glProgramUniform4ui(programs[kernel], traceRectLocations[kernel], rect.x, rect.y, rect.width, rect.height);
+        glProgramUniform1ui(programs[kernel], pathCountLocations[kernel], pathCount);
+    }
+    GLCALL(glBindImageTexture(ACCUMULATION_IMAGE_UNIT, target, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F));
+    GLCALL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PATHS_BINDING, paths));
+    GLCALL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, QUEUES_BINDING, queues));
+    GLCALL(glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, queues));
+
+    ResetQueue(QUEUE_EXTEND);
+    Dispatch(GENERATE, groups);
+    unsigned int extend = QUEUE_EXTEND;
+    for(unsigned int pass = 0; pass < WAVEFRONT_MAX_PASSES; ++pass) {
+        // every bounce takes a pass, only glass bounces that do not count keep paths running past the bounce limit
+        if(pass > bounceLimit) {
+            uint32_t length;
+            GLCALL(glGetBufferSubData(GL_DISPATCH_INDIRECT_BUFFER, extend * QUEUE_HEADER_SIZE + 3 * sizeof(uint32_t), sizeof(length), &length));
+            if(length == 0) {
+                break;
+            }
+        }
+        unsigned int next = extend == QUEUE_EXTEND ? QUEUE_EXTEND + 1 : QUEUE_EXTEND;
+        ResetQueue(next);
+        ResetQueue(QUEUE_SHADE_OPAQUE);
+        ResetQueue(QUEUE_SHADE_TRANSPARENT);
+        ResetQueue(QUEUE_SHADOW);
+        for(Kernel kernel : {EXTEND, SHADE_OPAQUE, SHADE_TRANSPARENT}) {
+            glProgramUniform1ui(programs[kernel], extendQueueLocations[kernel], extend);
+        }
+        DispatchIndirect(EXTEND, extend);
+        DispatchIndirect(SHADE_OPAQUE, QUEUE_SHADE_OPAQUE);
+        DispatchIndirect(SHADE_TRANSPARENT, QUEUE_SHADE_TRANSPARENT);
+        DispatchIndirect(SHADOW, QUEUE_SHADOW);
+        extend = next;
+    }
+    Dispatch(ACCUMULATE, groups);
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+    // the next frame loads the pixels again, the bloom passes sample them and the blits read the framebuffer
+    GLCALL(glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT));
+    GLCALL(glUseProgram(megakernel.GetProgramId()));
+}
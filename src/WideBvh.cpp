@@ -0,0 +1,680 @@
+#include "WideBvh.h"
+#include "ObjectLoader.h"
+#include "Intersection.h"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// the kernels pass GCC vector types between inlined helpers, the ABI note about passing them in registers of an
+// extension the caller may lack does not apply
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+// no fused multiply adds in the AVX2 kernels: the watertight test relies on the edge functions of a shared edge
+// rounding the same from both triangles, and on the hits matching the scalar test of Intersection.cpp
+#pragma GCC optimize("fp-contract=off")
+
+#define WIDE_STACK_SIZE (MAX_BVH_DEPTH * WIDE_BVH_WIDTH) // every level pops one node and pushes at most eight
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_TARGET(isa) __attribute__((target(isa), flatten))
+#else
+#define SIMD_TARGET(isa) __attribute__((flatten))
+#endif
+
+SimdLevel DetectSimdLevel() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return SimdLevel::AVX2;
+    }
+    return SimdLevel::SSE2;
+#else
+    return SimdLevel::NONE;
+#endif
+}
+
+const char* SimdLevelName(SimdLevel level) {
+    switch(level) {
+        case SimdLevel::SSE2: return "sse2";
+        case SimdLevel::AVX2: return "avx2";
+        default: return "off";
+    }
+}
+
+int PacketWidth(SimdLevel level) {
+    return level == SimdLevel::AVX2 ? 8 : 4;
+}
+
+int WideBvh::CountTriangles(const std::vector<BoundingBox>& boxes, int node, std::vector<int>& counts) const {
+    const BoundingBox& box = boxes[node];
+    if(box.IsLeaf()) {
+        counts[node] = box.triangleCount;
+    } else {
+        counts[node] = CountTriangles(boxes, box.leftChildIndex, counts) + CountTriangles(boxes, box.rightChildIndex, counts);
+    }
+    return counts[node];
+}
+
+void WideBvh::GatherTriangles(const BvhTree& tree, int binaryNode, std::vector<int>& gathered) const {
+    const BoundingBox& box = tree.GetBoundingBoxes()[binaryNode];
+    if(!box.IsLeaf()) {
+        GatherTriangles(tree, box.leftChildIndex, gathered);
+        GatherTriangles(tree, box.rightChildIndex, gathered);
+        return;
+    }
+    const std::vector<int>& references = tree.GetTriangleReferences();
+    for(int slot = box.triangleStartIndex; slot < box.triangleStartIndex + box.triangleCount; ++slot) {
+        gathered.push_back(references.empty() ? slot : references[slot]);
+    }
+}
+
+int WideBvh::BuildLeaf(const BvhTree& tree, int binaryNode, const std::vector<uint32_t>* objectVisibility) {
+    std::vector<int> gathered;
+    GatherTriangles(tree, binaryNode, gathered);
+    auto visibilityOf = [&](const Tri& triangle) {
+        return objectVisibility != nullptr && size_t(triangle.materialsIndex) < objectVisibility->size() ? (*objectVisibility)[triangle.materialsIndex] : RAY_ALL;
+    };
+    WideLeaf leaf{int(blocks.size()), 0, int(primitives.size()), 0};
+    int lane = TRIANGLE_BLOCK_WIDTH;
+    for(int index : gathered) {
+        const Tri& triangle = (*triangles)[index];
+        if(triangle.primitive != Primitive::TRIANGLE) {
+            primitives.push_back(index);
+            primitiveVisibility.push_back(visibilityOf(triangle));
+            leaf.primitiveCount++;
+            continue;
+        }
+        if(lane == TRIANGLE_BLOCK_WIDTH) {
+            TriangleBlock& block = blocks.emplace_back();
+            std::memset(&block, 0, sizeof(TriangleBlock));
+            std::fill(std::begin(block.triangle), std::end(block.triangle), -1);
+            leaf.blockCount++;
+            lane = 0;
+        }
+        TriangleBlock& block = blocks.back();
+        Vector3f second = watertight ? triangle.pos2 : triangle.pos2 - triangle.pos1;
+        Vector3f third = watertight ? triangle.pos3 : triangle.pos3 - triangle.pos1;
+        for(int axis = 0; axis < 3; ++axis) {
+            block.v0[axis][lane] = triangle.pos1[axis];
+            block.second[axis][lane] = second[axis];
+            block.third[axis][lane] = third[axis];
+        }
+        block.triangle[lane] = index;
+        block.visibility[lane] = visibilityOf(triangle);
+        lane++;
+    }
+    leaves.push_back(leaf);
+    return leaves.size() - 1;
+}
+
+int WideBvh::BuildNode(const BvhTree& tree, const std::vector<int>& counts, int binaryNode, const std::vector<uint32_t>* objectVisibility) {
+    const std::vector<BoundingBox>& boxes = tree.GetBoundingBoxes();
+    auto area = [&](int node) {
+        Vector3f extent = boxes[node].maxi - boxes[node].mini;
+        return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+    };
+    auto opens = [&](int node) { return !boxes[node].IsLeaf() && counts[node] > TRIANGLE_BLOCK_WIDTH; };
+    // open the largest child until the node is full, the ones the rays are most likely to enter sit closest to the root
+    std::vector<int> children = {boxes[binaryNode].leftChildIndex, boxes[binaryNode].rightChildIndex};
+    while(children.size() < WIDE_BVH_WIDTH) {
+        int largest = -1;
+        for(size_t i = 0; i < children.size(); ++i) {
+            if(opens(children[i]) && (largest < 0 || area(children[i]) > area(children[largest]))) {
+                largest = i;
+            }
+        }
+        if(largest < 0) {
+            break;
+        }
+        int opened = children[largest];
+        children[largest] = boxes[opened].leftChildIndex;
+        children.push_back(boxes[opened].rightChildIndex);
+    }
+
+    int wideNode = nodes.size();
+    nodes.emplace_back();
+    for(size_t slot = 0; slot < WIDE_BVH_WIDTH; ++slot) {
+        WideBvhNode& node = nodes[wideNode];
+        if(slot >= children.size()) {
+            node.minX[slot] = node.minY[slot] = node.minZ[slot] = INFINITY;
+            node.maxX[slot] = node.maxY[slot] = node.maxZ[slot] = -INFINITY;
+            node.child[slot] = EMPTY_CHILD;
+            continue;
+        }
+        const BoundingBox& box = boxes[children[slot]];
+        node.minX[slot] = box.mini.x;
+        node.minY[slot] = box.mini.y;
+        node.minZ[slot] = box.mini.z;
+        node.maxX[slot] = box.maxi.x;
+        node.maxY[slot] = box.maxi.y;
+        node.maxZ[slot] = box.maxi.z;
+        // nodes grows while the children are built, so the slot is written through the index afterwards
+        int child = opens(children[slot]) ? BuildNode(tree, counts, children[slot], objectVisibility) : ~BuildLeaf(tree, children[slot], objectVisibility);
+        nodes[wideNode].child[slot] = child;
+    }
+    return wideNode;
+}
+
+void WideBvh::Build(const BvhTree& tree, const std::vector<uint32_t>* objectVisibility, bool watertight) {
+    this->watertight = watertight;
+    nodes.clear();
+    leaves.clear();
+    blocks.clear();
+    primitives.clear();
+    primitiveVisibility.clear();
+    triangles = &tree.GetTriangles();
+    const std::vector<BoundingBox>& boxes = tree.GetBoundingBoxes();
+    if(boxes.empty()) {
+        return;
+    }
+    std::vector<int> counts(boxes.size(), 0);
+    CountTriangles(boxes, 0, counts);
+    if(counts[0] > TRIANGLE_BLOCK_WIDTH && !boxes[0].IsLeaf()) {
+        BuildNode(tree, counts, 0, objectVisibility);
+        return;
+    }
+    // a root small enough to be a leaf still gets a node above it, the kernels start at node 0
+    WideBvhNode& root = nodes.emplace_back();
+    for(int slot = 0; slot < WIDE_BVH_WIDTH; ++slot) {
+        root.minX[slot] = root.minY[slot] = root.minZ[slot] = INFINITY;
+        root.maxX[slot] = root.maxY[slot] = root.maxZ[slot] = -INFINITY;
+        root.child[slot] = EMPTY_CHILD;
+    }
+    root.minX[0] = boxes[0].mini.x;
+    root.minY[0] = boxes[0].mini.y;
+    root.minZ[0] = boxes[0].mini.z;
+    root.maxX[0] = boxes[0].maxi.x;
+    root.maxY[0] = boxes[0].maxi.y;
+    root.maxZ[0] = boxes[0].maxi.z;
+    root.child[0] = ~BuildLeaf(tree, 0, objectVisibility);
+}
+
+/**
+ * the traversal written once over GCC vector types of W lanes and compiled for each SimdLevel by the entry points at
+ * the bottom, which inline everything into functions carrying the target's instruction set
+ */
+struct WideBvhKernels {
+    template<int W>
+    struct Lanes {
+        typedef float Float __attribute__((vector_size(W * sizeof(float))));
+        typedef int32_t Int __attribute__((vector_size(W * sizeof(int32_t))));
+    };
+
+    template<typename V>
+    static V Load(const void* source) {
+        V value;
+        std::memcpy(&value, source, sizeof(V));
+        return value;
+    }
+
+    // lanes of a where mask is set, of b elsewhere. Written with bit operations because GCC splits the ?: of vectors
+    // into scalar compares on SSE2, which has no blend
+    template<typename V, typename M>
+    static V Select(M mask, V a, V b) {
+        M bitsA, bitsB;
+        std::memcpy(&bitsA, &a, sizeof(V));
+        std::memcpy(&bitsB, &b, sizeof(V));
+        M selected = (bitsA & mask) | (bitsB & ~mask);
+        V result;
+        std::memcpy(&result, &selected, sizeof(V));
+        return result;
+    }
+
+    template<typename V>
+    static V Min(V a, V b) {
+        return Select(a < b, a, b);
+    }
+
+    template<typename V>
+    static V Max(V a, V b) {
+        return Select(a > b, a, b);
+    }
+
+    template<int W, typename M>
+    static uint32_t Bits(M mask) {
+        uint32_t bits = 0;
+#if defined(__SSE2__)
+        // movmskps per quarter register, SSE2 is part of every x86-64 target so it is usable in all the kernels
+        for(int quad = 0; quad < W / 4; ++quad) {
+            __m128 lanes;
+            std::memcpy(&lanes, reinterpret_cast<const char*>(&mask) + quad * sizeof(__m128), sizeof(__m128));
+            bits |= uint32_t(_mm_movemask_ps(lanes)) << (quad * 4);
+        }
+#else
+        for(int lane = 0; lane < W; ++lane) {
+            bits |= (mask[lane] != 0 ? 1u : 0u) << lane;
+        }
+#endif
+        return bits;
+    }
+
+    // smallest lane, halving the register until one SSE register is left
+    template<int W>
+    static float ReduceMin(typename Lanes<W>::Float v) {
+        if constexpr(W > 4) {
+            typename Lanes<W / 2>::Float low, high;
+            std::memcpy(&low, &v, sizeof(low));
+            std::memcpy(&high, reinterpret_cast<const char*>(&v) + sizeof(low), sizeof(high));
+            return ReduceMin<W / 2>(Min(low, high));
+        } else {
+            return std::min(std::min(v[0], v[1]), std::min(v[2], v[3]));
+        }
+    }
+
+    // one ray against the eight children of node in registers of L lanes, returns the children whose box it enters
+    // before tBest
+    template<int L>
+    static uint32_t HitChildren(const WideBvhNode& node, const SimdRay& ray, float tBest, float* tNear) {
+        typedef typename Lanes<L>::Float F;
+        typedef typename Lanes<L>::Int I;
+        uint32_t bits = 0;
+        for(int first = 0; first < WIDE_BVH_WIDTH; first += L) {
+            F tx0 = (Load<F>(node.minX + first) - ray.origin.x) * ray.invDirection.x;
+            F tx1 = (Load<F>(node.maxX + first) - ray.origin.x) * ray.invDirection.x;
+            F ty0 = (Load<F>(node.minY + first) - ray.origin.y) * ray.invDirection.y;
+            F ty1 = (Load<F>(node.maxY + first) - ray.origin.y) * ray.invDirection.y;
+            F tz0 = (Load<F>(node.minZ + first) - ray.origin.z) * ray.invDirection.z;
+            F tz1 = (Load<F>(node.maxZ + first) - ray.origin.z) * ray.invDirection.z;
+            F tmin = Max(Max(Min(tx0, tx1), Min(ty0, ty1)), Min(tz0, tz1));
+            F tmax = Min(Min(Max(tx0, tx1), Max(ty0, ty1)), Max(tz0, tz1));
+            F zero = F{} + 0.0f;
+            // the inverted bounds of unused slots still pass along axes the ray runs backwards on
+            I used = Load<I>(node.child + first) != EMPTY_CHILD;
+            I hit = (tmax >= Max(tmin, zero)) & (tmin < tBest) & used;
+            std::memcpy(tNear + first, &tmin, sizeof(F));
+            bits |= Bits<L>(hit) << first;
+        }
+        return bits;
+    }
+
+    // one ray against the eight triangles of a block in registers of L lanes, keeps the closest hit before t
+    template<int L>
+    static void HitBlock(const TriangleBlock& block, const SimdRay& ray, float& t, int& hit) {
+        typedef typename Lanes<L>::Float F;
+        typedef typename Lanes<L>::Int I;
+        for(int first = 0; first < TRIANGLE_BLOCK_WIDTH && block.triangle[first] >= 0; first += L) {
+            F e1x = Load<F>(block.second[0] + first), e1y = Load<F>(block.second[1] + first), e1z = Load<F>(block.second[2] + first);
+            F e2x = Load<F>(block.third[0] + first), e2y = Load<F>(block.third[1] + first), e2z = Load<F>(block.third[2] + first);
+            // h = d x e2
+            F hx = ray.direction.y * e2z - ray.direction.z * e2y;
+            F hy = ray.direction.z * e2x - ray.direction.x * e2z;
+            F hz = ray.direction.x * e2y - ray.direction.y * e2x;
+            F det = e1x * hx + e1y * hy + e1z * hz;
+            F invDet = 1.0f / det;
+            F sx = ray.origin.x - Load<F>(block.v0[0] + first);
+            F sy = ray.origin.y - Load<F>(block.v0[1] + first);
+            F sz = ray.origin.z - Load<F>(block.v0[2] + first);
+            F u = invDet * (sx * hx + sy * hy + sz * hz);
+            // q = s x e1
+            F qx = sy * e1z - sz * e1y;
+            F qy = sz * e1x - sx * e1z;
+            F qz = sx * e1y - sy * e1x;
+            F v = invDet * (ray.direction.x * qx + ray.direction.y * qy + ray.direction.z * qz);
+            F distance = invDet * (e2x * qx + e2y * qy + e2z * qz);
+            I visible = (Load<I>(block.visibility + first) & int32_t(ray.rayType)) != 0;
+            F absDet = Max(det, -det);
+            I mask = (absDet >= 1e-8f) & (u >= 0.0f) & (u <= 1.0f) & (v >= 0.0f) & (u + v <= 1.0f)
+                   & (distance >= RAY_EPSILON) & (distance < t) & visible;
+            uint32_t bits = Bits<L>(mask);
+            while(bits != 0) {
+                int lane = __builtin_ctz(bits);
+                bits &= bits - 1;
+                if(distance[lane] < t) {
+                    t = distance[lane];
+                    hit = block.triangle[first + lane];
+                }
+            }
+        }
+    }
+
+    // the watertight test of Intersection.cpp for one ray against the eight triangles of a block, the vertices are
+    // taken in the axis order of the shear
+    template<int L>
+    static void HitBlockWatertight(const TriangleBlock& block, const SimdRay& ray, const WatertightShear& shear, float& t, int& hit) {
+        typedef typename Lanes<L>::Float F;
+        typedef typename Lanes<L>::Int I;
+        for(int first = 0; first < TRIANGLE_BLOCK_WIDTH && block.triangle[first] >= 0; first += L) {
+            F az = Load<F>(block.v0[shear.kz] + first) - ray.origin[shear.kz];
+            F bz = Load<F>(block.second[shear.kz] + first) - ray.origin[shear.kz];
+            F cz = Load<F>(block.third[shear.kz] + first) - ray.origin[shear.kz];
+            F ax = (Load<F>(block.v0[shear.kx] + first) - ray.origin[shear.kx]) - shear.x * az;
+            F ay = (Load<F>(block.v0[shear.ky] + first) - ray.origin[shear.ky]) - shear.y * az;
+            F bx = (Load<F>(block.second[shear.kx] + first) - ray.origin[shear.kx]) - shear.x * bz;
+            F by = (Load<F>(block.second[shear.ky] + first) - ray.origin[shear.ky]) - shear.y * bz;
+            F cx = (Load<F>(block.third[shear.kx] + first) - ray.origin[shear.kx]) - shear.x * cz;
+            F cy = (Load<F>(block.third[shear.ky] + first) - ray.origin[shear.ky]) - shear.y * cz;
+            F u = cx * by - cy * bx;
+            F v = ax * cy - ay * cx;
+            F w = bx * ay - by * ax;
+            F det = u + v + w;
+            F distance = (u * az + v * bz + w * cz) * shear.z / det;
+            I outside = ((u < 0.0f) | (v < 0.0f) | (w < 0.0f)) & ((u > 0.0f) | (v > 0.0f) | (w > 0.0f));
+            I visible = (Load<I>(block.visibility + first) & int32_t(ray.rayType)) != 0;
+            I mask = ~outside & (det != 0.0f) & (distance >= RAY_EPSILON) & (distance < t) & visible;
+            uint32_t bits = Bits<L>(mask);
+            while(bits != 0) {
+                int lane = __builtin_ctz(bits);
+                bits &= bits - 1;
+                if(distance[lane] < t) {
+                    t = distance[lane];
+                    hit = block.triangle[first + lane];
+                }
+            }
+        }
+    }
+
+    template<int L>
+    static void HitLeaf(const WideBvh& bvh, const WideLeaf& leaf, const SimdRay& ray, const WatertightShear& shear, float& t, int& hit,
+                        PrimitiveDistance primitiveDistance) {
+        for(int block = leaf.firstBlock; block < leaf.firstBlock + leaf.blockCount; ++block) {
+            if(bvh.watertight) {
+                HitBlockWatertight<L>(bvh.blocks[block], ray, shear, t, hit);
+            } else {
+                HitBlock<L>(bvh.blocks[block], ray, t, hit);
+            }
+        }
+        for(int i = leaf.firstPrimitive; i < leaf.firstPrimitive + leaf.primitiveCount; ++i) {
+            if((bvh.primitiveVisibility[i] & ray.rayType) == 0) {
+                continue;
+            }
+            float distance = primitiveDistance((*bvh.triangles)[bvh.primitives[i]], ray);
+            if(distance < t) {
+                t = distance;
+                hit = bvh.primitives[i];
+            }
+        }
+    }
+
+    // t holds the distance hits have to be closer than on entry, an any hit traversal stops at the first leaf it hits
+    template<int L, bool ANY_HIT>
+    static int Intersect(const WideBvh& bvh, const SimdRay& ray, float& t, PrimitiveDistance primitiveDistance) {
+        struct Entry {
+            int child;
+            float tNear;
+        };
+        Entry stack[WIDE_STACK_SIZE];
+        int stackptr = 0;
+        int hit = -1;
+        int node = 0;
+        WatertightShear shear = bvh.watertight ? MakeWatertightShear(ray.direction) : WatertightShear{};
+        while(true) {
+            float tNear[WIDE_BVH_WIDTH];
+            uint32_t bits = HitChildren<L>(bvh.nodes[node], ray, t, tNear);
+            // push far to near so the nearest child is popped first
+            Entry entered[WIDE_BVH_WIDTH];
+            int count = 0;
+            while(bits != 0) {
+                int slot = __builtin_ctz(bits);
+                bits &= bits - 1;
+                Entry entry{bvh.nodes[node].child[slot], tNear[slot]};
+                int i = count++;
+                for(; i > 0 && entered[i - 1].tNear < entry.tNear; --i) {
+                    entered[i] = entered[i - 1];
+                }
+                entered[i] = entry;
+            }
+            for(int i = 0; i < count; ++i) {
+                stack[stackptr++] = entered[i];
+            }
+            node = -1;
+            while(stackptr > 0) {
+                Entry entry = stack[--stackptr];
+                if(entry.tNear >= t) {
+                    continue;
+                }
+                if(entry.child >= 0) {
+                    node = entry.child;
+                    break;
+                }
+                HitLeaf<L>(bvh, bvh.leaves[~entry.child], ray, shear, t, hit, primitiveDistance);
+                if(ANY_HIT && hit >= 0) {
+                    return hit;
+                }
+            }
+            if(node < 0) {
+                return hit;
+            }
+        }
+    }
+
+    // the WatertightShear of every ray of a packet, the rays may project onto different axes so each axis of the
+    // order is a lane mask of whether it is x or y, z elsewhere
+    template<int W>
+    struct PacketShear {
+        typename Lanes<W>::Int isX[3];
+        typename Lanes<W>::Int isY[3];
+        typename Lanes<W>::Float origin[3]; // in the order kx, ky, kz
+        typename Lanes<W>::Float shear[3];
+    };
+
+    // coordinate axis of a vertex in the order of the rays
+    template<int W>
+    static typename Lanes<W>::Float Permute(const PacketShear<W>& shear, int axis, float x, float y, float z) {
+        typedef typename Lanes<W>::Float F;
+        return Select(shear.isX[axis], F{} + x, Select(shear.isY[axis], F{} + y, F{} + z));
+    }
+
+    // W rays against one leaf, triangle by triangle with the rays across the lanes
+    template<int W>
+    static void PacketLeaf(const WideBvh& bvh, const WideLeaf& leaf, const SimdRay* rays, int count, typename Lanes<W>::Float ox,
+                           typename Lanes<W>::Float oy, typename Lanes<W>::Float oz, typename Lanes<W>::Float dx, typename Lanes<W>::Float dy,
+                           typename Lanes<W>::Float dz, const PacketShear<W>& shear, typename Lanes<W>::Int rayTypes, typename Lanes<W>::Float& t,
+                           typename Lanes<W>::Int& hits, PrimitiveDistance primitiveDistance) {
+        typedef typename Lanes<W>::Float F;
+        typedef typename Lanes<W>::Int I;
+        for(int b = leaf.firstBlock; b < leaf.firstBlock + leaf.blockCount; ++b) {
+            const TriangleBlock& block = bvh.blocks[b];
+            for(int lane = 0; lane < TRIANGLE_BLOCK_WIDTH && block.triangle[lane] >= 0; ++lane) {
+                I visible = (rayTypes & int32_t(block.visibility[lane])) != 0;
+                if(bvh.watertight) {
+                    auto vertex = [&](const float (&vertices)[3][TRIANGLE_BLOCK_WIDTH], int axis) {
+                        return Permute<W>(shear, axis, vertices[0][lane], vertices[1][lane], vertices[2][lane]) - shear.origin[axis];
+                    };
+                    F az = vertex(block.v0, 2), bz = vertex(block.second, 2), cz = vertex(block.third, 2);
+                    F ax = vertex(block.v0, 0) - shear.shear[0] * az;
+                    F ay = vertex(block.v0, 1) - shear.shear[1] * az;
+                    F bx = vertex(block.second, 0) - shear.shear[0] * bz;
+                    F by = vertex(block.second, 1) - shear.shear[1] * bz;
+                    F cx = vertex(block.third, 0) - shear.shear[0] * cz;
+                    F cy = vertex(block.third, 1) - shear.shear[1] * cz;
+                    F u = cx * by - cy * bx;
+                    F v = ax * cy - ay * cx;
+                    F w = bx * ay - by * ax;
+                    F det = u + v + w;
+                    F distance = (u * az + v * bz + w * cz) * shear.shear[2] / det;
+                    I outside = ((u < 0.0f) | (v < 0.0f) | (w < 0.0f)) & ((u > 0.0f) | (v > 0.0f) | (w > 0.0f));
+                    I mask = ~outside & (det != 0.0f) & (distance >= RAY_EPSILON) & (distance < t) & visible;
+                    t = Select(mask, distance, t);
+                    hits = Select(mask, I{} + block.triangle[lane], hits);
+                    continue;
+                }
+                float e1x = block.second[0][lane], e1y = block.second[1][lane], e1z = block.second[2][lane];
+                float e2x = block.third[0][lane], e2y = block.third[1][lane], e2z = block.third[2][lane];
+                F hx = dy * e2z - dz * e2y;
+                F hy = dz * e2x - dx * e2z;
+                F hz = dx * e2y - dy * e2x;
+                F det = e1x * hx + e1y * hy + e1z * hz;
+                F invDet = 1.0f / det;
+                F sx = ox - block.v0[0][lane];
+                F sy = oy - block.v0[1][lane];
+                F sz = oz - block.v0[2][lane];
+                F u = invDet * (sx * hx + sy * hy + sz * hz);
+                F qx = sy * e1z - sz * e1y;
+                F qy = sz * e1x - sx * e1z;
+                F qz = sx * e1y - sy * e1x;
+                F v = invDet * (dx * qx + dy * qy + dz * qz);
+                F distance = invDet * (e2x * qx + e2y * qy + e2z * qz);
+                F absDet = Max(det, -det);
+                I mask = (absDet >= 1e-8f) & (u >= 0.0f) & (u <= 1.0f) & (v >= 0.0f) & (u + v <= 1.0f)
+                       & (distance >= RAY_EPSILON) & (distance < t) & visible;
+                t = Select(mask, distance, t);
+                hits = Select(mask, I{} + block.triangle[lane], hits);
+            }
+        }
+        for(int i = leaf.firstPrimitive; i < leaf.firstPrimitive + leaf.primitiveCount; ++i) {
+            const Tri& primitive = (*bvh.triangles)[bvh.primitives[i]];
+            for(int ray = 0; ray < count; ++ray) {
+                if((bvh.primitiveVisibility[i] & rays[ray].rayType) == 0) {
+                    continue;
+                }
+                float distance = primitiveDistance(primitive, rays[ray]);
+                if(distance < t[ray]) {
+                    t[ray] = distance;
+                    hits[ray] = bvh.primitives[i];
+                }
+            }
+        }
+    }
+
+    // count <= W rays traced as one packet: a node is entered when any of its rays enters it
+    template<int W>
+    static void IntersectPacket(const WideBvh& bvh, const SimdRay* rays, int count, float* tOut, int* hitsOut, PrimitiveDistance primitiveDistance) {
+        typedef typename Lanes<W>::Float F;
+        typedef typename Lanes<W>::Int I;
+        F ox{}, oy{}, oz{}, dx{}, dy{}, dz{}, ix{}, iy{}, iz{};
+        I rayTypes{};
+        F t = F{} + INFINITY;
+        I hits = I{} - 1;
+        PacketShear<W> shear{};
+        for(int ray = 0; ray < W; ++ray) {
+            const SimdRay& source = rays[std::min(ray, count - 1)]; // idle lanes repeat the last ray
+            if(bvh.watertight) {
+                WatertightShear rayShear = MakeWatertightShear(source.direction);
+                int order[3] = {rayShear.kx, rayShear.ky, rayShear.kz};
+                for(int axis = 0; axis < 3; ++axis) {
+                    shear.isX[axis][ray] = order[axis] == 0 ? -1 : 0;
+                    shear.isY[axis][ray] = order[axis] == 1 ? -1 : 0;
+                    shear.origin[axis][ray] = source.origin[order[axis]];
+                }
+                shear.shear[0][ray] = rayShear.x;
+                shear.shear[1][ray] = rayShear.y;
+                shear.shear[2][ray] = rayShear.z;
+            }
+            ox[ray] = source.origin.x;
+            oy[ray] = source.origin.y;
+            oz[ray] = source.origin.z;
+            dx[ray] = source.direction.x;
+            dy[ray] = source.direction.y;
+            dz[ray] = source.direction.z;
+            ix[ray] = source.invDirection.x;
+            iy[ray] = source.invDirection.y;
+            iz[ray] = source.invDirection.z;
+            rayTypes[ray] = source.rayType;
+        }
+        F zero = F{} + 0.0f;
+        int stack[WIDE_STACK_SIZE];
+        int stackptr = 0;
+        stack[stackptr++] = 0;
+        while(stackptr > 0) {
+            int entry = stack[--stackptr];
+            if(entry < 0) {
+                PacketLeaf<W>(bvh, bvh.leaves[~entry], rays, count, ox, oy, oz, dx, dy, dz, shear, rayTypes, t, hits, primitiveDistance);
+                continue;
+            }
+            const WideBvhNode& node = bvh.nodes[entry];
+            // nearest first by the closest entry of any ray
+            int entered[WIDE_BVH_WIDTH];
+            float nearest[WIDE_BVH_WIDTH];
+            int enteredCount = 0;
+            for(int slot = 0; slot < WIDE_BVH_WIDTH && node.child[slot] != EMPTY_CHILD; ++slot) {
+                F tx0 = (node.minX[slot] - ox) * ix, tx1 = (node.maxX[slot] - ox) * ix;
+                F ty0 = (node.minY[slot] - oy) * iy, ty1 = (node.maxY[slot] - oy) * iy;
+                F tz0 = (node.minZ[slot] - oz) * iz, tz1 = (node.maxZ[slot] - oz) * iz;
+                F tmin = Max(Max(Min(tx0, tx1), Min(ty0, ty1)), Min(tz0, tz1));
+                F tmax = Min(Min(Max(tx0, tx1), Max(ty0, ty1)), Max(tz0, tz1));
+                I hit = (tmax >= Max(tmin, zero)) & (tmin < t);
+                if(Bits<W>(hit) == 0) {
+                    continue;
+                }
+                float closest = ReduceMin<W>(Select(hit, tmin, F{} + INFINITY));
+                int i = enteredCount++;
+                for(; i > 0 && nearest[i - 1] < closest; --i) {
+                    entered[i] = entered[i - 1];
+                    nearest[i] = nearest[i - 1];
+                }
+                entered[i] = node.child[slot];
+                nearest[i] = closest;
+            }
+            for(int i = 0; i < enteredCount; ++i) {
+                stack[stackptr++] = entered[i];
+            }
+        }
+        for(int ray = 0; ray < count; ++ray) {
+            tOut[ray] = t[ray];
+            hitsOut[ray] = hits[ray];
+        }
+    }
+};
+
+SIMD_TARGET("sse2")
+static int IntersectSse2(const WideBvh& bvh, const SimdRay& ray, float& t, PrimitiveDistance primitiveDistance) {
+    return WideBvhKernels::Intersect<4, false>(bvh, ray, t, primitiveDistance);
+}
+
+SIMD_TARGET("sse2")
+static int OccludedSse2(const WideBvh& bvh, const SimdRay& ray, float& t, PrimitiveDistance primitiveDistance) {
+    return WideBvhKernels::Intersect<4, true>(bvh, ray, t, primitiveDistance);
+}
+
+SIMD_TARGET("avx2,fma")
+static int IntersectAvx2(const WideBvh& bvh, const SimdRay& ray, float& t, PrimitiveDistance primitiveDistance) {
+    return WideBvhKernels::Intersect<8, false>(bvh, ray, t, primitiveDistance);
+}
+
+SIMD_TARGET("avx2,fma")
+static int OccludedAvx2(const WideBvh& bvh, const SimdRay& ray, float& t, PrimitiveDistance primitiveDistance) {
+    return WideBvhKernels::Intersect<8, true>(bvh, ray, t, primitiveDistance);
+}
+
+SIMD_TARGET("sse2")
+static void IntersectPacketSse2(const WideBvh& bvh, const SimdRay* rays, int count, float* t, int* hits, PrimitiveDistance primitiveDistance) {
+    WideBvhKernels::IntersectPacket<4>(bvh, rays, count, t, hits, primitiveDistance);
+}
+
+SIMD_TARGET("avx2,fma")
+static void IntersectPacketAvx2(const WideBvh& bvh, const SimdRay* rays, int count, float* t, int* hits, PrimitiveDistance primitiveDistance) {
+    WideBvhKernels::IntersectPacket<8>(bvh, rays, count, t, hits, primitiveDistance);
+}
+
+int WideBvh::Intersect(SimdLevel level, const SimdRay& ray, float& t, PrimitiveDistance primitiveDistance, float tMax) const {
+    t = tMax;
+    if(nodes.empty()) {
+        return -1;
+    }
+    switch(level) {
+        case SimdLevel::AVX2: return IntersectAvx2(*this, ray, t, primitiveDistance);
+        default: return IntersectSse2(*this, ray, t, primitiveDistance);
+    }
+}
+
+bool WideBvh::Occluded(SimdLevel level, const SimdRay& ray, float tMax, PrimitiveDistance primitiveDistance) const {
+    if(nodes.empty()) {
+        return false;
+    }
+    float t = tMax;
+    switch(level) {
+        case SimdLevel::AVX2: return OccludedAvx2(*this, ray, t, primitiveDistance) >= 0;
+        default: return OccludedSse2(*this, ray, t, primitiveDistance) >= 0;
+    }
+}
+
+void WideBvh::IntersectPacket(SimdLevel level, const SimdRay* rays, int count, float* t, int* hits, PrimitiveDistance primitiveDistance) const {
+    if(nodes.empty()) {
+        std::fill(t, t + count, INFINITY);
+        std::fill(hits, hits + count, -1);
+        return;
+    }
+    int width = PacketWidth(level);
+    for(int first = 0; first < count; first += width) {
+        int packet = std::min(width, count - first);
+        switch(level) {
+            case SimdLevel::AVX2: IntersectPacketAvx2(*this, rays + first, packet, t + first, hits + first, primitiveDistance); break;
+            default: IntersectPacketSse2(*this, rays + first, packet, t + first, hits + first, primitiveDistance); break;
+        }
+    }
+}
@@ -1,6 +1,8 @@
 #include <iostream>
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include "Math3D.h"
 #include <fstream>
 #include <sstream>
@@ -9,6 +11,9 @@
 #include <chrono>
 #include <cstdlib>
 #include <queue>
+#include <optional>
+#include <cstdio>
+#include <cmath>
 
 #include "Renderer.h"
 #include "VertexBuffer.h"
@@ -20,7 +25,11 @@
 #include "KeyEventNotifier.h"
 #include "ConfigParser.hpp"
 #include "InfoPrinter.h"
+#include "ObjectEditManager.h"
 #include "Recorder.h"
+#include "RenderSettings.h"
+#include "ComputeTracer.h"
+#include "WavefrontTracer.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -30,15 +39,38 @@
 
 #define TIME_PER_FRAME_MS 5000
 
+#define HEADLESS_DEFAULT_SAMPLES 256
+#define HEADLESS_DEFAULT_OUTPUT "render.png"
+#define NOISE_TEXTURE_PATH "./Textures/Noise/rgbNoiseSquareLarge.png"
+#define DISPLAY_GAMMA 1.61803f // as finalFragment.glsl applies before the bloom is added
+
 /* keys state array */
 bool keys[350] = {false};
 
-static Scene CreateScene(std::vector<unsigned int> shaderProgramIds)
+// what the command line asks for, the camera keeps its defaults for anything not given
+struct LaunchOptions {
+    std::string configPath = "RayTracer.ini";
+    bool headless = false;
+    unsigned int width = SCREEN_WIDTH;
+    unsigned int height = SCREEN_HEIGHT;
+    unsigned int samples = HEADLESS_DEFAULT_SAMPLES; // frames accumulated, each adds RAY_COUNT samples per pixel
+    std::optional<unsigned int> bounceLimit;
+    std::optional<Vector3f> position;
+    std::optional<Vector3f> facing;
+    std::optional<float> fovDegrees;
+    std::string outputPath = HEADLESS_DEFAULT_OUTPUT;
+    std::vector<std::pair<std::string, int>> edits; // --add (object file, -1) and --remove ("", object id) in order
+};
+
+static Scene CreateScene(std::vector<unsigned int> shaderProgramIds, const RenderSettings& settings, unsigned int width = SCREEN_WIDTH, unsigned int height = SCREEN_HEIGHT)
 {
     auto screenResolutionUniformLocation = glGetUniformLocation(shaderProgramIds[0], "screenResolution");
-    glUniform2f(screenResolutionUniformLocation, SCREEN_WIDTH, SCREEN_HEIGHT);
+    glUniform2f(screenResolutionUniformLocation, width, height);
     
-    Scene scene(std::move(shaderProgramIds));
+    Scene scene(std::move(shaderProgramIds), settings);
+    if(CpuTracer* cpuTracer = scene.GetCpuTracer()) {
+        cpuTracer->SetResolution(width, height);
+    }
     return scene;
 }
 
@@ -113,16 +145,87 @@ static void LoadNoiseTexture(unsigned int shaderProgramId, std::string noiseText
     stbi_image_free(data);
 }
 
+// the CPU backend samples the same skybox and noise images as the shader
+static void LoadCpuTracerTextures(Scene& scene, const std::string& skyBoxPath)
+{
+    CpuTracer* cpuTracer = scene.GetCpuTracer();
+    if(cpuTracer == nullptr) {
+        return;
+    }
+    if(!cpuTracer->LoadSkybox(skyBoxPath)) {
+        std::cout << "the CPU tracer is missing skybox faces in " << skyBoxPath << std::endl;
+    }
+    if(!cpuTracer->LoadNoise(NOISE_TEXTURE_PATH)) {
+        std::cout << "the CPU tracer has no noise texture at " << NOISE_TEXTURE_PATH << std::endl;
+    }
+}
+
+// the fragment program of the tracer, or with Backend = compute or wavefront the program of the tracer it creates
+static unsigned int CreateTracerProgram(const std::string& vertexShaderPath, const std::string& fragmentShaderPath, const RenderSettings& settings,
+                                        std::unique_ptr<ComputeTracer>& computeTracer, std::unique_ptr<WavefrontTracer>& wavefrontTracer)
+{
+    if(settings.backend == TracerBackend::COMPUTE) {
+        computeTracer = std::make_unique<ComputeTracer>(fragmentShaderPath, settings.ShaderDefines());
+        std::cout << "tracing with the compute shader in " << TRACER_TILE_SIZE << "x" << TRACER_TILE_SIZE << " tiles" << std::endl;
+        return computeTracer->GetProgramId();
+    }
+    if(settings.backend == TracerBackend::WAVEFRONT) {
+        wavefrontTracer = std::make_unique<WavefrontTracer>(fragmentShaderPath, settings.ShaderDefines());
+        std::cout << "tracing with the wavefront kernels" << std::endl;
+        return wavefrontTracer->GetProgramId();
+    }
+    ShaderProgramSource source = ParseShader(vertexShaderPath, fragmentShaderPath);
+    source.FragmentSource = InjectShaderDefines(source.FragmentSource, settings.ShaderDefines());
+    return CreateShaderProgram(source.VertexSource, source.FragmentSource);
+}
+
+// the framebuffer the tracer draws into, its colour texture on unit 0 is read back as u_Accumulation
+static unsigned int CreateAccumulationFramebuffer(unsigned int shaderProgramId, unsigned int width, unsigned int height, unsigned int& colorBufferTex)
+{
+    unsigned int fbo;
+    GLCALL(glGenFramebuffers(1, &fbo));
+    GLCALL(glBindFramebuffer(GL_FRAMEBUFFER, fbo));
+
+    // Color texture to accumulate
+    GLCALL(glGenTextures(1, &colorBufferTex));  
+    GLCALL(glActiveTexture(GL_TEXTURE0));                                                                 // create a colour buffer texture
+    GLCALL(glBindTexture(GL_TEXTURE_2D, colorBufferTex));                                                        // bind the colour buffer texture to GL_TEXTURE_2D
+    GLCALL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, NULL)); // define the currently bound colour buffer texture
+    int accumLocation = glGetUniformLocation(shaderProgramId, "u_Accumulation");
+    GLCALL(glUniform1i(accumLocation, 0)); // Bind to texture unit 0
+    GLCALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+    GLCALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+    GLCALL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorBufferTex, 0)); // attach the texture to the framebuffer
+    return fbo;
+}
+
+// the fragment tracer samples the accumulation texture while it is attached to the framebuffer it draws into. Every
+// fragment only reads its own texel, so a texture barrier between the draws is all it takes for each one to read what
+// the last one wrote, which memory barriers do not cover for framebuffer writes
+static void AccumulationBarrier()
+{
+    if(glTextureBarrier != nullptr) {
+        glTextureBarrier();
+    } else if(glTextureBarrierNV != nullptr) {
+        glTextureBarrierNV();
+    } else {
+        glFinish();
+    }
+}
+
 static void RenderScene(std::unique_ptr<GLFWwindow, decltype(&glfwDestroyWindow)> window,
                         const std::string &vertexShaderPath,
                         const std::string &fragmentShaderPath,
                         const std::string &skyBoxPath,
-                        const std::vector<std::string>& objectPaths)
+                        const std::vector<std::string>& objectPaths,
+                        const std::vector<std::string>& editObjectPaths,
+                        const RenderSettings& settings)
 {
     TextureUnitManager::ResetTextureUnits();
     
-    ShaderProgramSource source = ParseShader(vertexShaderPath, fragmentShaderPath);
-    unsigned int shaderProgramId = CreateShaderProgram(source.VertexSource, source.FragmentSource);
+    std::unique_ptr<ComputeTracer> computeTracer;
+    std::unique_ptr<WavefrontTracer> wavefrontTracer;
+    unsigned int shaderProgramId = CreateTracerProgram(vertexShaderPath, fragmentShaderPath, settings, computeTracer, wavefrontTracer);
     GLCALL(glUseProgram(shaderProgramId));
 
     Vector2f vertices[6] = {
@@ -141,21 +244,14 @@ static void RenderScene(std::unique_ptr<GLFWwindow, decltype(&glfwDestroyWindow)
     layout.Push<float>(2);
     va.AddBuffer(vertexBuffer, layout);
 
-    unsigned int fbo;
-    GLCALL(glGenFramebuffers(1, &fbo));
-    GLCALL(glBindFramebuffer(GL_FRAMEBUFFER, fbo));
-
-    // Color texture to accumulate
     unsigned int colorBufferTex;
-    GLCALL(glGenTextures(1, &colorBufferTex));  
-    GLCALL(glActiveTexture(GL_TEXTURE0));                                                                 // create a colour buffer texture
-    GLCALL(glBindTexture(GL_TEXTURE_2D, colorBufferTex));                                                        // bind the colour buffer texture to GL_TEXTURE_2D
-    GLCALL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, SCREEN_WIDTH, SCREEN_HEIGHT, 0, GL_RGBA, GL_FLOAT, NULL)); // define the currently bound colour buffer texture
-    int accumLocation = glGetUniformLocation(shaderProgramId, "u_Accumulation");
-    GLCALL(glUniform1i(accumLocation, 0)); // Bind to texture unit 0
-    GLCALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
-    GLCALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
-    GLCALL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorBufferTex, 0)); // attach the texture to the framebuffer
+    unsigned int fbo = CreateAccumulationFramebuffer(shaderProgramId, SCREEN_WIDTH, SCREEN_HEIGHT, colorBufferTex);
+    if(computeTracer) {
+        computeTracer->SetTarget(colorBufferTex);
+    }
+    if(wavefrontTracer) {
+        wavefrontTracer->SetTarget(colorBufferTex);
+    }
 
     // bloom sources and additional shaders
     ShaderProgramSource finalProgramSource = ParseShader("./src/shaders/finalVertex.glsl", "./src/shaders/finalFragment.glsl");
@@ -172,11 +268,12 @@ static void RenderScene(std::unique_ptr<GLFWwindow, decltype(&glfwDestroyWindow)
 
 
     GLCALL(glUseProgram(shaderProgramId));
-    Scene scene = CreateScene({shaderProgramId, finalProgramId});
+    Scene scene = CreateScene({shaderProgramId, finalProgramId}, settings);
     /** code for Skybox  */
     LoadSkybox(shaderProgramId, skyBoxPath);
     /** rng noise textures */
-    LoadNoiseTexture(shaderProgramId, "./Textures/Noise/rgbNoiseSquareLarge.png", "u_RgbNoise");
+    LoadNoiseTexture(shaderProgramId, NOISE_TEXTURE_PATH, "u_RgbNoise");
+    LoadCpuTracerTextures(scene, skyBoxPath);
 
     scene.LoadObjects(objectPaths);
 
@@ -219,18 +316,34 @@ static void RenderScene(std::unique_ptr<GLFWwindow, decltype(&glfwDestroyWindow)
     // loop initialisation logic
     GLCALL(glClear(GL_COLOR_BUFFER_BIT));
 
+    // the bloom passes set these every frame, so they are looked up once here
+    GLint thresholdImageLocation = glGetUniformLocation(thresholdProgramId, "u_Image");
+    GLint bloomImageLocation = glGetUniformLocation(bloomProgramId, "u_Image");
+    GLint bloomImageResolutionLocation = glGetUniformLocation(bloomProgramId, "u_ImageResolution");
+
     Recorder recorder(scene.GetCamera(), tmpTexture, SCREEN_WIDTH, SCREEN_HEIGHT);
     InfoPrinter infoPrinter(scene.GetCamera());
+    ObjectEditManager objectEditManager(scene, editObjectPaths);
     while (!glfwWindowShouldClose(window.get()))
     {
         GLCALL(glUseProgram(shaderProgramId));
         glfwPollEvents();
         recorder.Tick();
         infoPrinter.Tick();
+        scene.SetCurrentFps(infoPrinter.GetFps());
         scene.Tick();
-        // Render raytrace to framebuffer
+        // Render raytrace to framebuffer, the CPU backend traced the frame in Tick and only hands over its image
         GLCALL(glBindFramebuffer(GL_FRAMEBUFFER, fbo));
-        GLCALL(glDrawArrays(GL_TRIANGLES, 0, 6));
+        if(CpuTracer* cpuTracer = scene.GetCpuTracer()) {
+            GLCALL(glTextureSubImage2D(colorBufferTex, 0, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, GL_RGBA, GL_FLOAT, cpuTracer->GetImage().data()));
+        } else if(computeTracer) {
+            computeTracer->Trace({0, 0, SCREEN_WIDTH, SCREEN_HEIGHT});
+        } else if(wavefrontTracer) {
+            wavefrontTracer->Trace({0, 0, SCREEN_WIDTH, SCREEN_HEIGHT}, scene.GetBounceLimit(), scene.GetUniformRevision());
+        } else {
+            AccumulationBarrier();
+            GLCALL(glDrawArrays(GL_TRIANGLES, 0, 6));
+        }
 
         if(keys[GLFW_KEY_B] == true || scene.GetInBoxHitView()) {
             GLCALL(glBlitNamedFramebuffer(
@@ -248,13 +361,13 @@ static void RenderScene(std::unique_ptr<GLFWwindow, decltype(&glfwDestroyWindow)
                     GL_COLOR_BUFFER_BIT, GL_NEAREST));
 
                 GLCALL(glUseProgram(thresholdProgramId)); // get the bright parts of the screen using the threshold program and draw onto the images buffer texture
-                GLCALL(glUniform1i(glGetUniformLocation(thresholdProgramId, "u_Image"), tmpTextureId));
+                GLCALL(glUniform1i(thresholdImageLocation, tmpTextureId));
                 GLCALL(glBindFramebuffer(GL_FRAMEBUFFER, bufferTextures[i][0]));
                 GLCALL(glDrawArrays(GL_TRIANGLES, 0, 6));
                 
                 GLCALL(glUseProgram(bloomProgramId)); // apply bloom to the buffer texture and place it back into tmp
-                GLCALL(glUniform1i(glGetUniformLocation(bloomProgramId, "u_Image"), bufferTextures[i][2]));
-                GLCALL(glUniform2f(glGetUniformLocation(bloomProgramId, "u_ImageResolution"), SCREEN_WIDTH/downSamplingAmounts.at(i), SCREEN_HEIGHT/downSamplingAmounts.at(i)));
+                GLCALL(glUniform1i(bloomImageLocation, bufferTextures[i][2]));
+                GLCALL(glUniform2f(bloomImageResolutionLocation, SCREEN_WIDTH/downSamplingAmounts.at(i), SCREEN_HEIGHT/downSamplingAmounts.at(i)));
                 GLCALL(glBindFramebuffer(GL_FRAMEBUFFER, tmpBuffer)); 
                 GLCALL(glDrawArrays(GL_TRIANGLES, 0, 6));
 
@@ -277,10 +390,141 @@ static void RenderScene(std::unique_ptr<GLFWwindow, decltype(&glfwDestroyWindow)
 
         glfwSwapBuffers(window.get());
     }
-    GLCALL(glDeleteProgram(shaderProgramId));
+    if(!computeTracer && !wavefrontTracer) { // the compute tracers delete their own programs
+        GLCALL(glDeleteProgram(shaderProgramId));
+    }
     glDisableVertexAttribArray(0);
 };
 
+// writes the accumulated linear image, .hdr keeps it as it is and anything else is gamma corrected into an 8 bit png.
+// The rows are flipped since GL reads them bottom up
+static bool WriteImage(const std::string& path, const std::vector<float>& rgb, unsigned int width, unsigned int height)
+{
+    stbi_flip_vertically_on_write(1);
+    if(path.ends_with(".hdr")) {
+        return stbi_write_hdr(path.c_str(), width, height, 3, rgb.data()) != 0;
+    }
+    std::vector<unsigned char> bytes(rgb.size());
+    for(size_t i = 0; i < rgb.size(); ++i) {
+        float value = std::pow(std::max(rgb[i], 0.0f), 1.0f / DISPLAY_GAMMA);
+        bytes[i] = static_cast<unsigned char>(std::min(value, 1.0f) * 255.0f + 0.5f);
+    }
+    return stbi_write_png(path.c_str(), width, height, 3, bytes.data(), width * 3) != 0;
+}
+
+// accumulates options.samples frames into the accumulation framebuffer and writes it to options.outputPath, nothing
+// is presented so no window is needed. The bloom passes only exist for the display and are skipped
+static bool RenderHeadless(const LaunchOptions& options,
+                           const std::string &vertexShaderPath,
+                           const std::string &fragmentShaderPath,
+                           const std::string &skyBoxPath,
+                           const std::vector<std::string>& objectPaths,
+                           const RenderSettings& settings)
+{
+    TextureUnitManager::ResetTextureUnits();
+
+    std::unique_ptr<ComputeTracer> computeTracer;
+    std::unique_ptr<WavefrontTracer> wavefrontTracer;
+    unsigned int shaderProgramId = CreateTracerProgram(vertexShaderPath, fragmentShaderPath, settings, computeTracer, wavefrontTracer);
+    ShaderProgramSource finalProgramSource = ParseShader("./src/shaders/finalVertex.glsl", "./src/shaders/finalFragment.glsl");
+    unsigned int finalProgramId = CreateShaderProgram(finalProgramSource.VertexSource, finalProgramSource.FragmentSource);
+    GLCALL(glUseProgram(shaderProgramId));
+
+    Vector2f vertices[6] = {
+        Vector2f(1.0, 1.0),
+        Vector2f(-1.0, -1.0),
+        Vector2f(1.0, -1.0),
+        Vector2f(1.0, 1.0),
+        Vector2f(-1.0, 1.0),
+        Vector2f(-1.0, -1.0),
+    };
+
+    VertexArray va;
+    va.Bind();
+    VertexBuffer vertexBuffer(vertices, sizeof(vertices));
+    VertexBufferLayout layout;
+    layout.Push<float>(2);
+    va.AddBuffer(vertexBuffer, layout);
+
+    unsigned int colorBufferTex;
+    unsigned int fbo = CreateAccumulationFramebuffer(shaderProgramId, options.width, options.height, colorBufferTex);
+    if(computeTracer) {
+        computeTracer->SetTarget(colorBufferTex);
+    }
+    if(wavefrontTracer) {
+        wavefrontTracer->SetTarget(colorBufferTex);
+    }
+    GLCALL(glViewport(0, 0, options.width, options.height)); // a surfaceless context starts with an empty viewport
+
+    Scene scene = CreateScene({shaderProgramId, finalProgramId}, settings, options.width, options.height);
+    LoadSkybox(shaderProgramId, skyBoxPath);
+    LoadNoiseTexture(shaderProgramId, NOISE_TEXTURE_PATH, "u_RgbNoise");
+    LoadCpuTracerTextures(scene, skyBoxPath);
+    scene.LoadObjects(objectPaths);
+    for(const auto& [objectPath, objectId] : options.edits) {
+        if(objectPath.empty()) {
+            scene.RemoveObject(objectId);
+        } else {
+            scene.AddObject(objectPath);
+        }
+    }
+
+    Camera& camera = scene.GetCamera();
+    if(options.position) {
+        camera.SetPosition(*options.position);
+    }
+    if(options.facing) {
+        camera.SetFacing(*options.facing);
+    }
+    if(options.fovDegrees) {
+        float fov = *options.fovDegrees * M_PI / 180.0;
+        camera.SetFov(fov);
+        camera.SetViewportWidth(2.0 * camera.GetViewportDistance() * tan(fov / 2.0));
+    }
+    if(options.bounceLimit) {
+        scene.SetBounceLimit(*options.bounceLimit);
+    }
+
+    GLCALL(glUseProgram(shaderProgramId));
+    GLCALL(glBindFramebuffer(GL_FRAMEBUFFER, fbo));
+    auto start = std::chrono::steady_clock::now();
+    for(unsigned int frame = 0; frame < options.samples; ++frame) {
+        scene.Tick();
+        if(computeTracer) {
+            computeTracer->Trace({0, 0, options.width, options.height});
+        } else if(wavefrontTracer) {
+            wavefrontTracer->Trace({0, 0, options.width, options.height}, scene.GetBounceLimit(), scene.GetUniformRevision());
+        } else if(scene.GetCpuTracer() == nullptr) {
+            GLCALL(glDrawArrays(GL_TRIANGLES, 0, 6));
+            AccumulationBarrier(); // the next frame reads this one back
+        }
+    }
+
+    std::vector<float> pixels(size_t(options.width) * options.height * 3);
+    if(CpuTracer* cpuTracer = scene.GetCpuTracer()) {
+        const std::vector<float>& image = cpuTracer->GetImage();
+        for(size_t i = 0; i < pixels.size() / 3; ++i) {
+            std::copy_n(&image[i * 4], 3, &pixels[i * 3]);
+        }
+    } else {
+        GLCALL(glPixelStorei(GL_PACK_ALIGNMENT, 1));
+        GLCALL(glReadPixels(0, 0, options.width, options.height, GL_RGB, GL_FLOAT, pixels.data()));
+    }
+    auto elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "rendered " << options.samples << " frames at " << options.width << "x" << options.height << " in " << elapsedMs << " ms" << std::endl;
+
+    if(!computeTracer && !wavefrontTracer) {
+        GLCALL(glDeleteProgram(shaderProgramId));
+    }
+    GLCALL(glDeleteProgram(finalProgramId));
+    if(!WriteImage(options.outputPath, pixels, options.width, options.height)) {
+        std::cerr << "failed to write " << options.outputPath << std::endl;
+        return false;
+    }
+    std::cout << "wrote " << options.outputPath << std::endl;
+    return true;
+}
+
 static void error_callback(int error, const char *description)
 {
     std::cerr << "[GLFW Erro] (" << description << ")" << std::endl;
@@ -307,6 +551,107 @@ bool InitialiseGlew() {
 }
 #include <functional>
 
+// a surfaceless EGL context on the default device, Mesa's llvmpipe serves it when there is no GPU. The tracer only
+// draws into its own framebuffer so it needs neither a window nor a config
+bool InitialiseHeadlessContext() {
+    EGLDisplay display = eglGetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    if (display == EGL_NO_DISPLAY) {
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+    EGLint major, minor;
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor) || !eglBindAPI(EGL_OPENGL_API)) {
+        std::cerr << "[EGL Error] (no display, 0x" << std::hex << eglGetError() << std::dec << ")" << std::endl;
+        return false;
+    }
+    // 4.3 for the storage buffers the tracer reads
+    EGLint contextAttributes[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE};
+    EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, contextAttributes);
+    if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        std::cerr << "[EGL Error] (no OpenGL 4.3 core context, 0x" << std::hex << eglGetError() << std::dec << ")" << std::endl;
+        return false;
+    }
+    // GLEW looks for a GLX display after loading the entry points, there is none without a window system
+    GLenum err = glewInit();
+    if (err != GLEW_OK && err != GLEW_ERROR_NO_GLX_DISPLAY)
+    {
+        std::cerr << "[GLEW Error] (" << glewGetErrorString(err) << ")" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static void PrintUsage(const char* program) {
+    std::cerr << "usage: " << program << " [--config path.ini] [--headless [--size WxH] [--samples N] [--bounces N]\n"
+              << "       [--position x,y,z] [--facing x,y,z] [--fov degrees] [--add object] [--remove id] [--output image.png|image.hdr]]\n"
+              << "       --add and --remove edit the loaded scene in the order given, objects are read from [Objects] DirectoryPath" << std::endl;
+}
+
+static bool ParseVector3f(const std::string& text, Vector3f& vector) {
+    char trailing;
+    return std::sscanf(text.c_str(), "%f,%f,%f%c", &vector.x, &vector.y, &vector.z, &trailing) == 3;
+}
+
+// false on an unknown flag or a value that does not parse
+static bool ParseLaunchOptions(int argc, char **argv, LaunchOptions& options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string flag = argv[i];
+        if (flag == "--headless") {
+            options.headless = true;
+            continue;
+        }
+        if (i + 1 == argc) {
+            return false;
+        }
+        std::string value = argv[++i];
+        char trailing;
+        Vector3f parsed;
+        unsigned int number;
+        float degrees;
+        if (flag == "--config") {
+            options.configPath = value;
+        } else if (flag == "--output") {
+            options.outputPath = value;
+        } else if (flag == "--size") {
+            if (std::sscanf(value.c_str(), "%ux%u%c", &options.width, &options.height, &trailing) != 2 || options.width == 0 || options.height == 0) {
+                return false;
+            }
+        } else if (flag == "--samples" || flag == "--bounces") {
+            if (std::sscanf(value.c_str(), "%u%c", &number, &trailing) != 1) {
+                return false;
+            }
+            if (flag == "--samples") {
+                options.samples = number;
+            } else {
+                options.bounceLimit = number;
+            }
+        } else if (flag == "--position" || flag == "--facing") {
+            if (!ParseVector3f(value, parsed)) {
+                return false;
+            }
+            (flag == "--position" ? options.position : options.facing) = parsed;
+        } else if (flag == "--fov") {
+            if (std::sscanf(value.c_str(), "%f%c", &degrees, &trailing) != 1 || degrees <= 0.0f || degrees >= 180.0f) {
+                return false;
+            }
+            options.fovDegrees = degrees;
+        } else if (flag == "--add") {
+            options.edits.emplace_back(value, -1);
+        } else if (flag == "--remove") {
+            if (std::sscanf(value.c_str(), "%u%c", &number, &trailing) != 1) {
+                return false;
+            }
+            options.edits.emplace_back("", number);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
 bool InitialiseGLFW(GLFWerrorfun errorCallbackFunc) {
     glfwSetErrorCallback(errorCallbackFunc);
     if (!glfwInit())
@@ -336,8 +681,12 @@ std::unique_ptr<GLFWwindow, void(*)(GLFWwindow*)> GLFWWindowFactory(unsigned int
 
 int main(int argc, char **argv)
 {
-    std::string ConfigPath = "RayTracer.ini";
-    ConfigParser parser = ConfigParser(ConfigPath);
+    LaunchOptions options;
+    if(!ParseLaunchOptions(argc, argv, options)) {
+        PrintUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    ConfigParser parser = ConfigParser(options.configPath);
 
     std::string vertexShaderPath = parser.aConfig<std::string>("ShaderPaths", "TracerVert");
     std::string fragmentShaderPath = parser.aConfig<std::string>("ShaderPaths", "TracerFrag");
@@ -347,6 +696,26 @@ int main(int argc, char **argv)
     for(auto& s : objects) {
         s = objectDir + "/" + s;
     }
+    std::vector<std::string> editObjects;
+    if(parser.hasConfig("Objects", "EditFilenames")) {
+        editObjects = parser.aConfigVec<std::string>("Objects", "EditFilenames");
+    }
+    for(auto& s : editObjects) {
+        s = objectDir + "/" + s;
+    }
+    for(auto& [objectPath, objectId] : options.edits) {
+        if(!objectPath.empty()) {
+            objectPath = objectDir + "/" + objectPath;
+        }
+    }
+    RenderSettings settings = RenderSettings::FromConfig(parser);
+    if(options.headless) {
+        if(!InitialiseHeadlessContext()) {
+            std::cerr << "failed to create a headless OpenGL context" << std::endl;
+            return EXIT_FAILURE;
+        }
+        return RenderHeadless(options, vertexShaderPath, fragmentShaderPath, skyboxPath, objects, settings) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
     if(!InitialiseGLFW(error_callback)) {
         std::cerr << "failed to initialise GLFW" << std::endl;
         return EXIT_FAILURE;
@@ -361,7 +730,7 @@ int main(int argc, char **argv)
         std::cerr << "failed to initialise Glew" << std::endl;
         return EXIT_FAILURE;
     };
-    RenderScene(std::move(window), vertexShaderPath, fragmentShaderPath, skyboxPath, objects);
+    RenderScene(std::move(window), vertexShaderPath, fragmentShaderPath, skyboxPath, objects, editObjects, settings);
 
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -1,33 +1,46 @@
 #version 430 core
 
+#if defined(WAVEFRONT)
+// one invocation per path, WAVEFRONT_GROUP_SIZE in WavefrontTracer.h
+layout(local_size_x = 64) in;
+#elif defined(COMPUTE_TRACER)
+// one invocation per pixel of a tile, TRACER_TILE_SIZE in ComputeTracer.h
+layout(local_size_x = 8, local_size_y = 8) in;
+#else
 out vec3 color;
+#endif
 
 #define RAY_COUNT 1
 #define FOG_DENSITY 0.00
 #define FOG_HEIGHT 32.0
 #define AIR_REFRACT 1.0003
-#define MAX_STACK_SIZE 64
+#define MAX_STACK_SIZE 64 // >= MAX_BVH_DEPTH in BvhTree.h
 #define INF 1.0/0.0
-#define MAX_HITTABLE_COUNT 4
-#define MAX_MATERIALS_COUNT 16
-#define SPHERE 0
+// tags of the analytic primitives in position.w of their B_Triangles slot, PRIMITIVE_TAG_BASE + Primitive in Tri.h
+#define PRIMITIVE_SPHERE 2
+#define PRIMITIVE_BOX 3
+#define PRIMITIVE_DISC 4
+// ray types objects can be hidden from, RAY_* in ObjectLoader.h
+#define RAY_CAMERA 1u
+#define RAY_REFLECTION 2u
+#define RAY_DIFFUSE 4u
+#define RAY_SHADOW 8u
 
+// std430 layout of FlatMaterial in Scene.h
 struct Material {
     vec3 colour;
-    vec3 specularColour;
     float roughness;
+    vec3 specularColour;
     float metallic;
     float transparency;
     float refractionIndex;
     bool isLight;
+    uint visibility; // RAY_* bits of the object the material belongs to
 };
 
-struct Hittable { // are things like spheres and triangles
-    uint type;
-    vec3 position;
-    vec3 direction;
-    float scale;   
-    Material material;
+layout(std430, binding = 5) buffer B_Materials
+{
+    Material materialsBuffer[]; // by object id, which u_MaterialsIndex gives for every triangle
 };
 
 struct Sphere {
@@ -35,10 +48,12 @@ struct Sphere {
     float scale;
 };
 
+// the unit normal is packed into the w components of the edges and watertight layouts, analytic primitives keep their
+// parameters here in every layout (see Primitive in Tri.h) and are told apart by position.w
 struct Triangle {
-    vec3 position;
-    vec3 position2;
-    vec3 position3;
+    vec4 position;
+    vec4 position2; // e1 = v1 - v0 for the edges layout
+    vec4 position3; // e2 = v2 - v0 for the edges layout
 };
 
 layout(std430, binding = 0) buffer B_Triangles
@@ -46,18 +61,49 @@ layout(std430, binding = 0) buffer B_Triangles
     Triangle trianglesBuffer[];
 };
 
+#ifdef TRIANGLE_REFERENCES
+layout(std430, binding = 3) buffer B_TriangleReferences
+{
+    int triangleReferences[]; // leaves index these with pre-splitting or BvhBuild = gpu, each names a triangle in B_Triangles
+};
+#endif
+
+struct BvhNode {
+    vec3 maxi;
+    int triangleCount; // > 0 for leaves, -(split axis + 1) for interior nodes
+    vec3 mini;
+    int index;         // leaf: first triangle, interior: left child, the right child is index + 1
+};
+
+layout(std430, binding = 1) buffer B_BoundingBoxes
+{
+    BvhNode boundingBoxesBuffer[];
+};
+
+#ifdef VISIBILITY_MASKS
+layout(std430, binding = 4) buffer B_BoundingBoxMasks
+{
+    uint boundingBoxMasks[]; // ray types some object below the node is visible to in bits 0-7, every object in bits 8-15
+};
+#endif
+
 struct BoundingBox {
     vec3 maxi;
     vec3 mini;
     int triangleCount;
     int triangleStartIndex;
+    int leftChildIndex;
     int rightChildIndex;
+    int splitAxis;
+#ifdef VISIBILITY_MASKS
+    uint visibility;
+#endif
 };
 
 struct Camera {
     vec3 position;
-    vec3 facing;
     float fov;
+    vec3 facing;
     float viewportWidth;
     float viewportDistance;
 };
@@ -67,29 +113,113 @@ struct Ray {
     vec3 direction;
     vec3 invDirection;
     float magnitude;
+#ifdef TRIANGLE_LAYOUT_WATERTIGHT
+    ivec3 k;     // axis permutation so that k.z is the dominant direction axis
+    vec3 shear;  // shear constants of the watertight triangle test
+#endif
 };
 
 uniform vec2 screenResolution;
-uniform uint u_BounceLimit;
-uniform Camera u_Camera;
-uniform Hittable u_Hittable[MAX_HITTABLE_COUNT];
-uniform uint u_HittablesCount;
-
-// for progressive rendering
-uniform uint u_FrameIndex;
-uniform vec3 u_RandSeed;
+
+// everything that changes from frame to frame, written in one go by Scene::UploadFrameConstants (FrameConstants in Scene.h)
+layout(std140, binding = 0) uniform FrameConstants
+{
+    Camera u_Camera;
+    vec3 u_RandSeed;
+    uint u_FrameIndex; // for progressive rendering
+    uint u_BounceLimit;
+};
+
+#if defined(COMPUTE_TRACER) || defined(WAVEFRONT)
+// rgb is the mean of the samples so far and alpha their count, so neighbouring tiles may take different sample counts
+layout(rgba32f, binding = 0) uniform image2D u_AccumulationImage;
+uniform uvec4 u_TraceRect; // x, y, width and height of the pixels a dispatch traces
+#endif
+#if defined(WAVEFRONT)
+// queues of WavefrontTracer.h: the extend kernel pops one of the two extend queues and the shade kernels push the next
+// bounce onto the other, the extend kernel sorts the hits into one shade queue per kind of scattering
+#define QUEUE_EXTEND 0u
+#define QUEUE_SHADE_OPAQUE 2u
+#define QUEUE_SHADE_TRANSPARENT 3u
+#define QUEUE_SHADOW 4u // shadow rays of the light samples the opaque shade kernel takes
+#define QUEUE_COUNT 5
+
+// the state a path carries from kernel to kernel, one per pixel of u_TraceRect
+struct Path {
+    vec3 origin;
+    int root;          // of the tree the ray traces
+    vec3 direction;
+    int depth;         // bounces so far, the i of RayColour
+    vec3 throughput;   // the rayColour of RayColour
+    uint rayType;
+    vec3 radiance;     // what the path brought back so far, the sampled lights while it runs
+    int material;      // object id of the hit the shade kernels scatter off
+    vec3 hitPoint;
+    bool frontFace;
+    vec3 normal;
+    float lobePdf;     // of the opaque bounce the ray left, 0 after mirrors and glass
+    vec3 shadowOrigin; // the shadow ray of the light sample of this bounce and what it adds if it is not occluded
+    float shadowDistance;
+    vec3 shadowDirection;
+    float padding;
+    vec3 shadowRadiance;
+    float padding2;
+};
+
+layout(std430, binding = 6) buffer B_Paths
+{
+    Path paths[];
+};
+
+// per queue the work groups of an indirect dispatch in xyz and the path count in w, then the paths of every queue,
+// u_PathCount apart
+layout(std430, binding = 7) buffer B_Queues
+{
+    uvec4 queueHeaders[QUEUE_COUNT];
+    uint queueItems[];
+};
+
+uniform uint u_PathCount;
+uniform uint u_ExtendQueue; // the extend queue of this pass, QUEUE_EXTEND or QUEUE_EXTEND + 1
+#elif defined(COMPUTE_TRACER)
+uniform uint u_TileSamples; // samples of every pixel, 0 reads the count of its tile from B_TileSamples
+// samples by tile of u_TraceRect, row by row from the bottom, tiles with 0 are left as they are
+layout(std430, binding = 6) readonly buffer B_TileSamples
+{
+    uint tileSamples[];
+};
+#else
 uniform sampler2D u_Accumulation;
+#endif
 uniform sampler2D u_RgbNoise;
 uniform vec2 u_RgbNoiseResolution;
 
 uniform isamplerBuffer  u_MaterialsIndex; // int
 
-uniform samplerBuffer u_BoundingBoxes; // r32f
 uniform uint u_BoundingBoxesCount;
 
-uniform Material u_Materials[MAX_MATERIALS_COUNT];
 uniform uint u_MaterialsCount;
 
+// Russian roulette, from bounce u_RouletteDepth on a path survives with the brightest channel of its throughput
+uniform uint u_RouletteDepth;
+uniform float u_RouletteMinSurvival; // bounds the weight survivors take on, 1 / u_RouletteMinSurvival
+
+// emitting triangles for next event estimation, 3 texels each: (v0, area of the lights up to this one), (edge 1,
+// object id), (edge 2, 0)
+uniform samplerBuffer u_Lights;
+uniform uint u_LightsCount;
+uniform float u_LightArea; // of all of them, lights are picked in proportion to their area
+
+#ifdef LOD_PROXIES
+// decimated stand-ins of the objects, stored behind the scene in the same buffers with their own root, for diffuse
+// rays from u_ProxyBounce bounces on or off surfaces at least u_ProxyRoughness rough
+uniform int u_ProxyRoot;
+uniform uint u_ProxyBoundingBoxesCount;
+uniform uint u_ProxyBounce;
+uniform float u_ProxyRoughness;
+uniform samplerBuffer u_ProxySkinDistances; // by object id, how far its proxy may lie from it, proxy rays leaving it start this far out
+#endif
+
 // skybox
 uniform samplerCube u_Skybox;
 
@@ -138,9 +268,24 @@ Ray MakeRay(vec3 origin, vec3 direction, float magnitude) {
     new.direction = direction;
     new.invDirection = 1.0 / direction;
     new.magnitude = magnitude;
+#ifdef TRIANGLE_LAYOUT_WATERTIGHT
+    vec3 absDirection = abs(direction);
+    int kz = absDirection.x > absDirection.y ? (absDirection.x > absDirection.z ? 0 : 2) : (absDirection.y > absDirection.z ? 1 : 2);
+    int kx = (kz + 1) % 3;
+    int ky = (kx + 1) % 3;
+    if(direction[kz] < 0.0) { // keep the winding of the projected triangle
+        int tmp = kx;
+        kx = ky;
+        ky = tmp;
+    }
+    new.k = ivec3(kx, ky, kz);
+    new.shear = vec3(direction[kx], direction[ky], 1.0) / direction[kz];
+#endif
     return new;
 };
 
+vec2 fragCoord; // gl_FragCoord.xy, the compute tracer sets it from the invocation
+
 vec3 directionToViewport(vec2 randOffset) {
     float viewportHeight = u_Camera.viewportWidth * (screenResolution.y / screenResolution.x);
 
@@ -149,8 +294,8 @@ vec3 directionToViewport(vec2 randOffset) {
 
     vec3 initialRay = u_Camera.position 
         + u_Camera.viewportDistance * u_Camera.facing 
-        + u_Camera.viewportWidth * (-0.5 + (gl_FragCoord.x - 0.5 + randOffset.x) / screenResolution.x) * viewportUdir 
-        + viewportHeight * (-0.5 + (gl_FragCoord.y - 0.5 + randOffset.y) / screenResolution.y) * viewportVdir;
+        + u_Camera.viewportWidth * (-0.5 + (fragCoord.x - 0.5 + randOffset.x) / screenResolution.x) * viewportUdir 
+        + viewportHeight * (-0.5 + (fragCoord.y - 0.5 + randOffset.y) / screenResolution.y) * viewportVdir;
 
     return normalize(initialRay - u_Camera.position);
 }
@@ -174,9 +319,9 @@ bool hitSphere(Sphere sphere, Ray r, inout HitRecord hitRecord) {
     if (discriminant < 0)
         return false;
     float root = (-b - sqrt(discriminant) ) / (2.0*a);
-    if (root < 0.0) {
+    if (root < 0.0001) { // the same margin as the triangles so bounces do not hit the surface they leave
         root = (-b + sqrt(discriminant) ) / (2.0*a);
-        if(root < 0.0)
+        if(root < 0.0001)
             return false;
     }
 
@@ -184,33 +329,129 @@ bool hitSphere(Sphere sphere, Ray r, inout HitRecord hitRecord) {
     hitRecord.hitPoint = RayAt(r, hitRecord.t);
     vec3 outwardNormal = (hitRecord.hitPoint - center) / radius;
     SetFaceNormal(hitRecord, r, outwardNormal);
-    hitRecord.index = -1;
     return true;
 };
 
+bool hitBox(vec3 mini, vec3 maxi, Ray r, inout HitRecord hitRecord) {
+    vec3 t0s = (mini - r.origin) * r.invDirection;
+    vec3 t1s = (maxi - r.origin) * r.invDirection;
+    vec3 tsmaller = min(t0s, t1s);
+    vec3 tbigger = max(t0s, t1s);
+    float tmin = max(max(tsmaller.x, tsmaller.y), tsmaller.z);
+    float tmax = min(min(tbigger.x, tbigger.y), tbigger.z);
+    if(tmax < max(tmin, 0.0001))
+        return false;
+    // from inside the box the ray leaves through the far face
+    bool inside = tmin < 0.0001;
+    float t = inside ? tmax : tmin;
+    vec3 faces = inside ? vec3(equal(tbigger, vec3(t))) : vec3(equal(tsmaller, vec3(t)));
+    vec3 outwardNormal = faces * (inside ? sign(r.direction) : -sign(r.direction));
+
+    hitRecord.t = t;
+    hitRecord.hitPoint = RayAt(r, t);
+    SetFaceNormal(hitRecord, r, normalize(outwardNormal));
+    return true;
+}
+
+bool hitDisc(vec3 center, vec3 normal, float radius, Ray r, inout HitRecord hitRecord) {
+    float denominator = dot(normal, r.direction);
+    if(abs(denominator) < 1e-8)
+        return false;
+    float t = dot(center - r.origin, normal) / denominator;
+    if(t < 0.0001)
+        return false;
+    vec3 hitPoint = RayAt(r, t);
+    vec3 offset = hitPoint - center;
+    if(dot(offset, offset) > radius * radius)
+        return false;
+
+    hitRecord.t = t;
+    hitRecord.hitPoint = hitPoint;
+    SetFaceNormal(hitRecord, r, normal);
+    return true;
+}
+
+bool hitPrimitive(Triangle slot, Ray r, inout HitRecord hitRecord) {
+    int tag = int(slot.position.w);
+    if(tag == PRIMITIVE_SPHERE)
+        return hitSphere(Sphere(slot.position.xyz, slot.position2.x), r, hitRecord);
+    if(tag == PRIMITIVE_BOX)
+        return hitBox(slot.position.xyz, slot.position2.xyz, r, hitRecord);
+    return hitDisc(slot.position.xyz, slot.position2.xyz, slot.position3.x, r, hitRecord);
+}
+
 Triangle getTriangle(int index) {
     return trianglesBuffer[index];
 }
 
 BoundingBox getBoundingBox(int index) {
+    BvhNode node = boundingBoxesBuffer[index];
     BoundingBox box;
-    int bufferIndex = index * 2;
-    vec4 first = texelFetch(u_BoundingBoxes, bufferIndex + 0);
-    vec4 second = texelFetch(u_BoundingBoxes, bufferIndex + 1);
-    box.maxi = first.xyz;
-    box.mini = vec3(first.w, second.xy);
-    box.triangleCount = int(second.z);
-    second.z >= 1 ? box.triangleStartIndex = int(second.w) : box.rightChildIndex = int(second.w);
+    box.maxi = node.maxi;
+    box.mini = node.mini;
+    box.triangleCount = node.triangleCount;
+    box.triangleStartIndex = node.index;
+    box.leftChildIndex = node.index;
+    box.rightChildIndex = node.index + 1;
+    box.splitAxis = -node.triangleCount - 1;
+#ifdef VISIBILITY_MASKS
+    box.visibility = boundingBoxMasks[index];
+#endif
     return box;
 }
 
+#if defined(TRIANGLE_LAYOUT_WATERTIGHT)
+// watertight ray/triangle test (Woop, Benthin, Wald 2013): the ray is sheared onto +z once in MakeRay
+// so shared edges are classified identically from both sides and no ray slips between neighbours
+bool hitTriangle(inout Triangle triangle, Ray r, inout HitRecord hitrecord) {
+    vec3 a = triangle.position.xyz - r.origin;
+    vec3 b = triangle.position2.xyz - r.origin;
+    vec3 c = triangle.position3.xyz - r.origin;
+
+    float az = a[r.k.z];
+    float bz = b[r.k.z];
+    float cz = c[r.k.z];
+    float ax = a[r.k.x] - r.shear.x * az;
+    float ay = a[r.k.y] - r.shear.y * az;
+    float bx = b[r.k.x] - r.shear.x * bz;
+    float by = b[r.k.y] - r.shear.y * bz;
+    float cx = c[r.k.x] - r.shear.x * cz;
+    float cy = c[r.k.y] - r.shear.y * cz;
+
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float w = bx * ay - by * ax;
+    if ((u < 0.0 || v < 0.0 || w < 0.0) && (u > 0.0 || v > 0.0 || w > 0.0))
+        return false;
+
+    float det = u + v + w;
+    if (det == 0.0)
+        return false;
+
+    float t = (u * az + v * bz + w * cz) * r.shear.z / det;
+    if (t < 0.0001)
+        return false;
+
+    hitrecord.t = t;
+    hitrecord.hitPoint = RayAt(r, t);
+    vec3 normal = vec3(triangle.position.w, triangle.position2.w, triangle.position3.w);
+    SetFaceNormal(hitrecord, r, normal);
+    return true;
+}
+#else
 bool hitTriangle(inout Triangle triangle, Ray r, inout HitRecord hitrecord) {
-    vec3 v0 = triangle.position;
-    vec3 v1 = triangle.position2;
-    vec3 v2 = triangle.position3;
+#ifdef TRIANGLE_LAYOUT_EDGES
+    vec3 v0 = triangle.position.xyz;
+    vec3 e1 = triangle.position2.xyz;
+    vec3 e2 = triangle.position3.xyz;
+#else
+    vec3 v0 = triangle.position.xyz;
+    vec3 v1 = triangle.position2.xyz;
+    vec3 v2 = triangle.position3.xyz;
 
     vec3 e1 = v1 - v0;
     vec3 e2 = v2 - v0;
+#endif
     vec3 h = cross(r.direction, e2);
     float det = dot(e1, h);
 
@@ -234,10 +475,15 @@ bool hitTriangle(inout Triangle triangle, Ray r, inout HitRecord hitrecord) {
 
     hitrecord.t = t;
     hitrecord.hitPoint = RayAt(r, t);
+#ifdef TRIANGLE_LAYOUT_EDGES
+    vec3 normal = vec3(triangle.position.w, triangle.position2.w, triangle.position3.w);
+#else
     vec3 normal = normalize(cross(e1, e2));
+#endif
     SetFaceNormal(hitrecord, r, normal);
     return true;
 }
+#endif
 
 bool hitBoundingBox(const Ray ray, const BoundingBox aabb, out HitRecord hitRecord) {
     vec3 t0s = (aabb.mini - ray.origin) * ray.invDirection;
@@ -262,69 +508,256 @@ bool hitBoundingBox(const Ray ray, const BoundingBox aabb, out HitRecord hitReco
     return hitRecord.hitAnything;
 }
 
-bool HitHittableList(Ray ray, inout HitRecord hitRecord) {
+void HitLeaf(Ray ray, BoundingBox aabb, uint rayType, inout HitRecord hitRecord) {
+    HitRecord hitRecordTmp;
+#ifdef VISIBILITY_MASKS
+    // only leaves that mix objects hidden from this ray type with visible ones look up the object of each triangle
+    bool filtered = ((aabb.visibility >> 8) & rayType) == 0u;
+#endif
+    for(int i=aabb.triangleStartIndex; i<aabb.triangleStartIndex + aabb.triangleCount; ++i) {
+#ifdef TRIANGLE_REFERENCES
+        int triangleIndex = triangleReferences[i];
+#else
+        int triangleIndex = i;
+#endif
+#ifdef VISIBILITY_MASKS
+        if(filtered && (materialsBuffer[texelFetch(u_MaterialsIndex, triangleIndex).x].visibility & rayType) == 0u) {
+            continue;
+        }
+#endif
+        Triangle triangle = getTriangle(triangleIndex);
+        // triangle normals never reach the primitive tags
+        bool hit = triangle.position.w > 1.5 ? hitPrimitive(triangle, ray, hitRecordTmp) : hitTriangle(triangle, ray, hitRecordTmp);
+        if(hit) {
+            if(hitRecord.t > hitRecordTmp.t) {
+                hitRecord = hitRecordTmp;
+                hitRecord.index = triangleIndex;
+                hitRecord.material = materialsBuffer[texelFetch(u_MaterialsIndex, triangleIndex).x];
+                hitRecord.hitAnything = true;  
+            }
+        }
+    }
+}
+
+// whether an object of the leaf visible to shadow rays lies nearer than tMax
+bool OccludedLeaf(Ray ray, BoundingBox aabb, float tMax) {
+    HitRecord hitRecordTmp;
+#ifdef VISIBILITY_MASKS
+    bool filtered = ((aabb.visibility >> 8) & RAY_SHADOW) == 0u;
+#endif
+    for(int i=aabb.triangleStartIndex; i<aabb.triangleStartIndex + aabb.triangleCount; ++i) {
+#ifdef TRIANGLE_REFERENCES
+        int triangleIndex = triangleReferences[i];
+#else
+        int triangleIndex = i;
+#endif
+#ifdef VISIBILITY_MASKS
+        if(filtered && (materialsBuffer[texelFetch(u_MaterialsIndex, triangleIndex).x].visibility & RAY_SHADOW) == 0u) {
+            continue;
+        }
+#endif
+        Triangle triangle = getTriangle(triangleIndex);
+        bool hit = triangle.position.w > 1.5 ? hitPrimitive(triangle, ray, hitRecordTmp) : hitTriangle(triangle, ray, hitRecordTmp);
+        if(hit && hitRecordTmp.t < tMax) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// false when no object below the node is visible to the ray type, so the whole subtree is skipped
+bool VisibleTo(BoundingBox aabb, uint rayType) {
+#ifdef VISIBILITY_MASKS
+    return (aabb.visibility & rayType) != 0u;
+#else
+    return true;
+#endif
+}
+
+int NearChild(Ray ray, BoundingBox aabb) {
+    // the left child holds the centroids below the split so it is the near child when the ray heads up the split axis
+    return ray.direction[aabb.splitAxis] >= 0.0 ? aabb.leftChildIndex : aabb.rightChildIndex;
+}
+
+void ShowTraversalCost(int iterationsCount, inout HitRecord hitRecord) {
+    // Color is white if iterationsCount is below threshold, otherwise gets more red as iterationsCount increases
+    int threshold1 = 64;
+    int threshold2 = 128;
+    if (iterationsCount < threshold1) {
+        hitRecord.material.colour = (vec3(1.0)/threshold1)*iterationsCount;
+    } else if(iterationsCount < threshold2) {
+        hitRecord.material.colour =  vec3(1.0) - (vec3(0.0,1.0,1.0)/threshold1)*(iterationsCount - threshold1);
+    } else {
+        hitRecord.material.colour = vec3(1.0, 0.0, 0) - (vec3(1.0, 0, 0)/(threshold2-threshold1))*(iterationsCount - threshold2);
+    }
+}
+
+#ifdef BVH_STACKLESS
+#define FROM_PARENT 0
+#define FROM_SIBLING 1
+#define FROM_CHILD 2
+
+layout(std430, binding = 2) buffer B_BoundingBoxLinks
+{
+    ivec2 boundingBoxLinks[]; // parent, sibling
+};
+
+// stackless traversal (Hapala et al. 2011): the parent and sibling links replace the stack, the state records
+// which way the current node was reached so every subtree is entered near child first and left exactly once
+bool HitHittableList(Ray ray, int root, uint rayType, inout HitRecord hitRecord) {
     hitRecord.t = INF;
     hitRecord.hitAnything = false;
     hitRecord.index = -1;
 
+    int iterationsCount = 0;
+    int current = root;
+    int state = FROM_PARENT;
+    while(u_BoundingBoxesCount > 0) {
+        if(state == FROM_CHILD) {
+            if(current == root) {
+                break;
+            }
+            ivec2 links = boundingBoxLinks[current];
+            if(current == NearChild(ray, getBoundingBox(links.x))) {
+                current = links.y;
+                state = FROM_SIBLING;
+            } else {
+                current = links.x;
+            }
+            continue;
+        }
+        BoundingBox aabb = getBoundingBox(current);
+        HitRecord hitRecordTmp;
+        iterationsCount += 1;
+        bool entered = VisibleTo(aabb, rayType) && hitBoundingBox(ray, aabb, hitRecordTmp) && hitRecordTmp.t < hitRecord.t;
+        if(entered && aabb.triangleCount > 0) {
+            HitLeaf(ray, aabb, rayType, hitRecord);
+        } else if(entered) {
+            current = NearChild(ray, aabb);
+            state = FROM_PARENT;
+            continue;
+        }
+        if(current == root) {
+            break;
+        }
+        if(state == FROM_PARENT) {
+            current = boundingBoxLinks[current].y;
+            state = FROM_SIBLING;
+        } else {
+            current = boundingBoxLinks[current].x;
+            state = FROM_CHILD;
+        }
+    }
+    if (u_BounceLimit == 0) {
+        ShowTraversalCost(iterationsCount, hitRecord);
+    }
+    return hitRecord.hitAnything;
+};
+
+// any hit walk of the scene tree for shadow rays, it stops at the first object visible to them nearer than tMax
+bool Occluded(Ray ray, float tMax) {
+    int current = 0;
+    int state = FROM_PARENT;
+    while(u_BoundingBoxesCount > 0) {
+        if(state == FROM_CHILD) {
+            if(current == 0) {
+                break;
+            }
+            ivec2 links = boundingBoxLinks[current];
+            if(current == NearChild(ray, getBoundingBox(links.x))) {
+                current = links.y;
+                state = FROM_SIBLING;
+            } else {
+                current = links.x;
+            }
+            continue;
+        }
+        BoundingBox aabb = getBoundingBox(current);
+        HitRecord hitRecordTmp;
+        bool entered = VisibleTo(aabb, RAY_SHADOW) && hitBoundingBox(ray, aabb, hitRecordTmp) && hitRecordTmp.t < tMax;
+        if(entered && aabb.triangleCount > 0) {
+            if(OccludedLeaf(ray, aabb, tMax)) {
+                return true;
+            }
+        } else if(entered) {
+            current = NearChild(ray, aabb);
+            state = FROM_PARENT;
+            continue;
+        }
+        if(current == 0) {
+            break;
+        }
+        if(state == FROM_PARENT) {
+            current = boundingBoxLinks[current].y;
+            state = FROM_SIBLING;
+        } else {
+            current = boundingBoxLinks[current].x;
+            state = FROM_CHILD;
+        }
+    }
+    return false;
+}
+#else
+bool HitHittableList(Ray ray, int root, uint rayType, inout HitRecord hitRecord) {
+    hitRecord.t = INF;
+    hitRecord.hitAnything = false;
+    hitRecord.index = -1;
+
+    // every level pops one node and pushes two, BvhTree keeps the depth within MAX_BVH_DEPTH so the stack cannot overflow
     int stack[MAX_STACK_SIZE];
     int stackptr = 0;
     if(u_BoundingBoxesCount > 0) 
-        stack[stackptr++] = 0;
-    int leafhitNum = 0;
+        stack[stackptr++] = root;
     int iterationsCount = 0;
     while(stackptr > 0) {
         int indexBB = stack[--stackptr];
         BoundingBox aabb = getBoundingBox(indexBB);
         HitRecord hitRecordTmp;
         iterationsCount += 1;
-        if(!hitBoundingBox(ray, aabb, hitRecordTmp) || hitRecordTmp.t >= hitRecord.t) { 
+        if(!VisibleTo(aabb, rayType) || !hitBoundingBox(ray, aabb, hitRecordTmp) || hitRecordTmp.t >= hitRecord.t) { 
             continue;
         }
         if(aabb.triangleCount > 0 && aabb.triangleStartIndex >= 0){ // is leaf
-            for(int i=aabb.triangleStartIndex; i<aabb.triangleStartIndex + aabb.triangleCount; ++i) {
-                Triangle triangle = getTriangle(i);
-                if(hitTriangle(triangle, ray, hitRecordTmp)) {
-                    if(hitRecord.t > hitRecordTmp.t) {
-                        hitRecord = hitRecordTmp;
-                        hitRecord.index = i;
-                        hitRecord.material = u_Materials[texelFetch(u_MaterialsIndex, i).x];
-                        hitRecord.hitAnything = true;  
-                    }
-                }
-            }
+            HitLeaf(ray, aabb, rayType, hitRecord);
         } else{
-            // push the closer child on first
-            BoundingBox leftBox = getBoundingBox(indexBB + 1);
-            BoundingBox rightBox = getBoundingBox(aabb.rightChildIndex);
-            HitRecord hitLeftRecord;
-            HitRecord hitRightRecord;
-            hitBoundingBox(ray, leftBox, hitLeftRecord);
-            hitBoundingBox(ray, rightBox, hitRightRecord);
-            if(hitLeftRecord.t < hitRightRecord.t) {
-                if(hitRightRecord.hitAnything && hitRightRecord.t < hitRecord.t) stack[stackptr++] = aabb.rightChildIndex;
-                if(hitLeftRecord.hitAnything && hitLeftRecord.t < hitRecord.t) stack[stackptr++] = indexBB + 1;
-            } else {
-                if(hitLeftRecord.hitAnything && hitLeftRecord.t < hitRecord.t) stack[stackptr++] = indexBB + 1;
-                if(hitRightRecord.hitAnything && hitRightRecord.t < hitRecord.t) stack[stackptr++] = aabb.rightChildIndex;
-            }
+            // push the far child first and leave the culling to the slab test when each child is popped
+            int nearChild = NearChild(ray, aabb);
+            stack[stackptr++] = nearChild == aabb.leftChildIndex ? aabb.rightChildIndex : aabb.leftChildIndex;
+            stack[stackptr++] = nearChild;
         }
     }
-    // Color is white if iterationsCount is below threshold, otherwise gets more red as iterationsCount increases
     if (u_BounceLimit == 0) {
-        int threshold1 = 64;
-        int threshold2 = 128;
-        if (iterationsCount < threshold1) {
-            hitRecord.material.colour = (vec3(1.0)/threshold1)*iterationsCount;
-        } else if(iterationsCount < threshold2) {
-            hitRecord.material.colour =  vec3(1.0) - (vec3(0.0,1.0,1.0)/threshold1)*(iterationsCount - threshold1);
-        } else {
-            hitRecord.material.colour = vec3(1.0, 0.0, 0) - (vec3(1.0, 0, 0)/(threshold2-threshold1))*(iterationsCount - threshold2);
-        }
+        ShowTraversalCost(iterationsCount, hitRecord);
     }
     return hitRecord.hitAnything;
 };
 
+// any hit traversal of the scene tree for shadow rays, it stops at the first object visible to them nearer than tMax
+bool Occluded(Ray ray, float tMax) {
+    int stack[MAX_STACK_SIZE];
+    int stackptr = 0;
+    if(u_BoundingBoxesCount > 0) 
+        stack[stackptr++] = 0;
+    while(stackptr > 0) {
+        BoundingBox aabb = getBoundingBox(stack[--stackptr]);
+        HitRecord hitRecordTmp;
+        if(!VisibleTo(aabb, RAY_SHADOW) || !hitBoundingBox(ray, aabb, hitRecordTmp) || hitRecordTmp.t >= tMax) { 
+            continue;
+        }
+        if(aabb.triangleCount > 0 && aabb.triangleStartIndex >= 0) {
+            if(OccludedLeaf(ray, aabb, tMax)) {
+                return true;
+            }
+        } else {
+            int nearChild = NearChild(ray, aabb);
+            stack[stackptr++] = nearChild == aabb.leftChildIndex ? aabb.rightChildIndex : aabb.leftChildIndex;
+            stack[stackptr++] = nearChild;
+        }
+    }
+    return false;
+}
+#endif
+
 vec3 TransparentScatter(inout HitRecord hitRecord, inout Material material, inout Ray ray) {
     float ri = hitRecord.frontFace ? AIR_REFRACT/material.refractionIndex : material.refractionIndex/AIR_REFRACT;
     float cos_theta = min(dot(-ray.direction, hitRecord.normal), 1.0);
@@ -377,21 +810,221 @@ bool VolumetricScatter(inout HitRecord hitRecord, inout Ray ray, inout vec3 colo
     return scattered;
 }
 
-vec3 RayColour(Ray ray, vec3 lastColour, out vec3 albedo, out vec3 normal, int iRayCountSeed) {
+vec3 SkyboxColour(vec3 direction) {
+    return texture(u_Skybox, RotateAroundAxis(direction, vec3(1,0,0), -3.1415/2)).rgb;
+}
+
+// noise texture coordinates of bounce i of a path, the origin and direction decorrelate neighbouring pixels
+vec2 BounceSeed(Ray ray, int i, int iRayCountSeed) {
+    return mod(vec2(
+        Hashf(ray.origin.x + ray.direction.y) + Hash(i) + Hash(iRayCountSeed) + Hash(u_FrameIndex) + Hashf(u_RandSeed.x * u_BounceLimit),
+        Hashf(ray.origin.y + ray.direction.z) + Hash(i+69) + Hash(iRayCountSeed) + Hashf(u_RandSeed.y * u_BounceLimit)
+    ), vec2(u_RgbNoiseResolution.x, u_RgbNoiseResolution.y))/vec2(u_RgbNoiseResolution.x, u_RgbNoiseResolution.y);
+}
+
+// the integer state the seed of BounceSeed is made of, before the conversion to float rounds away most of its bits
+uint BounceHash(Ray ray, int i, int iRayCountSeed) {
+    uint x = Hashf(ray.origin.x + ray.direction.y) + Hash(i) + Hash(iRayCountSeed) + Hash(u_FrameIndex) + Hashf(u_RandSeed.x * u_BounceLimit);
+    uint y = Hashf(ray.origin.y + ray.direction.z) + Hash(i+69) + Hash(iRayCountSeed) + Hashf(u_RandSeed.y * u_BounceLimit);
+    return Hash(x ^ Hash(y));
+}
+
+// uniform in [0, 1) from the BounceHash of a bounce, for the roulette and the light samples: the filtered lookups into
+// u_RgbNoise at the rounded seed are not spread evenly enough for draws that are compared against a probability
+float UniformRandom(uint state, uint salt) {
+    return float(Hash(state + salt) >> 8) / 16777216.0;
+}
+
+// below the transparency of the material the ray refracts, otherwise it scatters off the surface
+float TransparencyRng(vec2 seed) {
+    return texture(u_RgbNoise, seed+vec2(0.01534, 0.183)).x;
+}
+
+vec3 UniformSphere(uint state) {
+    float z = 1.0 - 2.0 * UniformRandom(state, 1u);
+    float phi = 6.2831853 * UniformRandom(state, 2u);
+    float r = sqrt(max(0.0, 1.0 - z * z));
+    return vec3(r * cos(phi), r * sin(phi), z);
+}
+
+// solid angle pdf of the diffuse lobe of ScatterOpaque, normalize(normal + roughness * s) with s uniform on the unit
+// sphere. A direction crosses the sphere of radius roughness around the normal at the roots t of
+// t^2 - 2ct + 1 - roughness^2, each contributing t^2 / (4 pi roughness sqrt(discriminant)). cos / pi at roughness 1
+float DiffusePdf(vec3 normal, float roughness, vec3 direction) {
+    float c = dot(normal, direction);
+    float discriminant = c * c - 1.0 + roughness * roughness;
+    if(c <= 0.0 || discriminant <= 0.0 || roughness <= 0.0) {
+        return 0.0;
+    }
+    return (4.0 * c * c - 2.0 * (1.0 - roughness * roughness)) / (4.0 * 3.14159265 * roughness * sqrt(discriminant));
+}
+
+// solid angle pdf of the specular lobe of ScatterOpaque, (1 - roughness) * reflected + roughness * d with d from the
+// diffuse lobe. A direction crosses the sphere of radius roughness around centre = (1 - roughness) * reflected at the
+// roots t of t^2 - 2t dot(centre, direction) + |centre|^2 - roughness^2, each contributing the DiffusePdf of the d it
+// passes through times t^2 / (roughness sqrt(discriminant)). 0 for mirrors, whose lobe is a single direction
+float GlossyPdf(vec3 normal, float roughness, vec3 reflected, vec3 direction) {
+    vec3 centre = (1.0 - roughness) * reflected;
+    float b = dot(centre, direction);
+    float discriminant = b * b - dot(centre, centre) + roughness * roughness;
+    if(discriminant <= 0.0 || roughness <= 0.0) {
+        return 0.0;
+    }
+    float root = sqrt(discriminant);
+    float pdf = 0.0;
+    for(int k = 0; k < 2; ++k) {
+        float t = k == 0 ? b - root : b + root;
+        if(t > 0.0) {
+            pdf += DiffusePdf(normal, roughness, (t * direction - centre) / roughness) * t * t / (roughness * root);
+        }
+    }
+    return pdf;
+}
+
+// direction of the ray leaving an opaque surface, specular or diffuse as its roughness decides, and its tint
+vec3 ScatterOpaque(HitRecord hitRecord, Material material, Ray ray, vec2 seed, uint state, inout vec3 rayColour, out bool diffuse) {
+    vec3 diffuseDir = normalize(hitRecord.normal + UniformSphere(state)*material.roughness);
+    vec3 specularDir = reflect(ray.direction, hitRecord.normal);
+    bool isSpecular = texture(u_RgbNoise, seed).y < (1-material.roughness);
+    specularDir = mix(specularDir, diffuseDir, material.roughness);
+    diffuse = !isSpecular;
+    rayColour *= isSpecular ? mix(material.specularColour, material.colour, material.metallic) : material.colour;
+    return isSpecular ? specularDir : diffuseDir;
+}
+
+// solid angle pdf of the lobe ScatterOpaque picked sending a ray that came in along incoming towards direction
+float LobePdf(HitRecord hitRecord, Material material, vec3 incoming, bool diffuse, vec3 direction) {
+    direction = normalize(direction); // the specular directions are not normalized
+    if(diffuse) {
+        return DiffusePdf(hitRecord.normal, material.roughness, direction);
+    }
+    return GlossyPdf(hitRecord.normal, material.roughness, reflect(incoming, hitRecord.normal), direction);
+}
+
+// the ray bounce i sends towards nextDirection, with the tree it traces and its ray type
+Ray NextRay(HitRecord hitRecord, Material material, vec3 nextDirection, bool diffuse, int i, out int root, out uint rayType) {
+    Ray ray = MakeRay(hitRecord.hitPoint + 1e-4 * nextDirection, nextDirection, 1);
+    rayType = diffuse ? RAY_DIFFUSE : RAY_REFLECTION;
+    root = 0;
+#ifdef LOD_PROXIES
+    // rough diffuse bounces blur away the detail the proxies drop, primary and mirror-like rays keep the full meshes
+    bool proxyRay = diffuse && (i + 1 >= u_ProxyBounce || material.roughness >= u_ProxyRoughness) && u_ProxyBoundingBoxesCount > 0;
+    root = proxyRay ? u_ProxyRoot : 0;
+    if(proxyRay) { // past the proxy of the object it leaves so the ray does not hit that again straight away
+        ray.origin += texelFetch(u_ProxySkinDistances, texelFetch(u_MaterialsIndex, hitRecord.index).x).x * nextDirection;
+    }
+#endif
+    return ray;
+}
+
+// Russian roulette after bounce i: a path that carries little light ends with the probability it does not survive, and
+// a survivor's throughput is divided by the survival probability, so the mean stays the same
+bool SurvivesRoulette(int i, uint state, inout vec3 rayColour) {
+    if(i + 1 < int(u_RouletteDepth)) {
+        return true;
+    }
+    float survival = clamp(max(rayColour.r, max(rayColour.g, rayColour.b)), u_RouletteMinSurvival, 1.0);
+    if(UniformRandom(state, 6u) >= survival) {
+        return false;
+    }
+    rayColour /= survival;
+    return true;
+}
+
+// a point picked uniformly over the area of u_Lights, as seen from point: the direction and distance to it, the solid
+// angle pdf of picking it and the light it emits. False when there are no lights or the point sees one edge on
+bool SampleLight(vec3 point, uint state, out vec3 direction, out float distance, out float lightPdf, out vec3 emission) {
+    if(u_LightsCount == 0u) {
+        return false;
+    }
+    // the first light whose running area passes the target
+    float target = UniformRandom(state, 3u) * u_LightArea;
+    int low = 0;
+    int high = int(u_LightsCount) - 1;
+    while(low < high) {
+        int middle = (low + high) / 2;
+        if(texelFetch(u_Lights, 3 * middle).w <= target) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    vec3 v0 = texelFetch(u_Lights, 3 * low).xyz;
+    vec4 e1 = texelFetch(u_Lights, 3 * low + 1);
+    vec3 e2 = texelFetch(u_Lights, 3 * low + 2).xyz;
+    vec2 uv = vec2(UniformRandom(state, 4u), UniformRandom(state, 5u));
+    if(uv.x + uv.y > 1.0) { // folded back into the triangle
+        uv = 1.0 - uv;
+    }
+    vec3 toLight = v0 + uv.x * e1.xyz + uv.y * e2 - point;
+    float distanceSquared = dot(toLight, toLight);
+    distance = sqrt(distanceSquared);
+    direction = toLight / distance;
+    vec3 lightNormal = cross(e1.xyz, e2);
+    float cosLight = abs(dot(lightNormal, direction)) / length(lightNormal); // lights emit from both faces
+    if(cosLight < 1e-6) {
+        return false;
+    }
+    lightPdf = distanceSquared / (cosLight * u_LightArea);
+    Material light = materialsBuffer[int(e1.w)];
+    emission = light.colour * light.transparency;
+    return true;
+}
+
+// next event estimation at an opaque bounce, diffuse or glossy: the light of a sampled point on a light, weighted by the
+// balance heuristic against the lobe the bounce picked finding the same point, and the shadow ray that has to reach it
+// unoccluded. False when the sample adds nothing
+bool SampleDirectLight(HitRecord hitRecord, Material material, vec3 incoming, bool diffuse, uint state, out Ray shadowRay, out float tMax, out vec3 radiance) {
+    vec3 direction;
+    float distance;
+    float lightPdf;
+    vec3 emission;
+    if(!SampleLight(hitRecord.hitPoint, state, direction, distance, lightPdf, emission)) {
+        return false;
+    }
+    float lobePdf = LobePdf(hitRecord, material, incoming, diffuse, direction);
+    if(lobePdf == 0.0) {
+        return false;
+    }
+    shadowRay = MakeRay(hitRecord.hitPoint + 1e-4 * direction, direction, 1);
+    tMax = (distance - 1e-4) * 0.999; // short of the light itself
+    radiance = emission * lobePdf / (lobePdf + lightPdf);
+    return true;
+}
+
+// balance heuristic weight of a light a bounce found by itself. Mirror and glass bounces do not sample the lights, lobePdf
+// is 0 after them, and lights the list leaves out are never sampled, so those keep all of their light
+float EmissionWeight(float lobePdf, Ray ray, HitRecord hitRecord) {
+    if(lobePdf == 0.0 || u_LightsCount == 0u || trianglesBuffer[hitRecord.index].position.w > 1.5) {
+        return 1.0;
+    }
+#ifdef VISIBILITY_MASKS
+    if((hitRecord.material.visibility & RAY_SHADOW) == 0u) {
+        return 1.0;
+    }
+#endif
+    float distance = hitRecord.t * length(ray.direction); // t is in lengths of the direction, which glossy rays do not normalize
+    float lightPdf = distance * distance / (abs(dot(hitRecord.normal, normalize(ray.direction))) * u_LightArea);
+    return lobePdf / (lobePdf + lightPdf);
+}
+
+vec3 RayColour(Ray ray, out vec3 albedo, out vec3 normal, int iRayCountSeed) {
     HitRecord hitRecord;
     vec3 rayColour = vec3(1.0);
     const float maxFogTravel = 1.0/FOG_DENSITY;
+    int root = 0; // of the tree the next ray traces
+    uint rayType = RAY_CAMERA;
+    vec3 radiance = vec3(0.0); // of the lights the bounces sampled so far
+    float lobePdf = 0.0; // of the opaque bounce the ray left, 0 after mirrors and glass
     for(int i=0; i<=u_BounceLimit; ++i) {
-        bool hitAnything = HitHittableList(ray, hitRecord);
+        bool hitAnything = HitHittableList(ray, root, rayType, hitRecord);
         if (u_BounceLimit == 0)
             return vec3(hitRecord.material.colour);
         if (u_BounceLimit == 1)
             return vec3(abs(hitRecord.normal));
 
-        vec2 seed = mod(vec2(
-            Hashf(ray.origin.x + ray.direction.y) + Hash(i) + Hash(iRayCountSeed) + Hash(u_FrameIndex) + Hashf(u_RandSeed.x * u_BounceLimit),
-            Hashf(ray.origin.y + ray.direction.z) + Hash(i+69) + Hash(iRayCountSeed) + Hashf(u_RandSeed.y * u_BounceLimit)
-        ), vec2(u_RgbNoiseResolution.x, u_RgbNoiseResolution.y))/vec2(u_RgbNoiseResolution.x, u_RgbNoiseResolution.y);
+        vec2 seed = BounceSeed(ray, i, iRayCountSeed);
+        uint state = BounceHash(ray, i, iRayCountSeed);
 
         if (VolumetricScatter(hitRecord, ray, rayColour, seed-vec2(0.31), maxFogTravel)) {
            continue;
@@ -403,86 +1036,279 @@ vec3 RayColour(Ray ray, vec3 lastColour, out vec3 albedo, out vec3 normal, int i
                 albedo = hitRecord.material.colour;
                 normal = hitRecord.normal;
             } else {
-                albedo = texture(u_Skybox, RotateAroundAxis(ray.direction, vec3(1,0,0), -3.1415/2)).rgb; 
+                albedo = SkyboxColour(ray.direction); 
             }
         }
 
         if(!hitAnything) {
-            vec3 skybox_texture = texture(u_Skybox, RotateAroundAxis(ray.direction, vec3(1,0,0), -3.1415/2)).rgb;
-            return rayColour*skybox_texture;
+            return radiance + rayColour*SkyboxColour(ray.direction);
         } 
         Material material = hitRecord.material;
         if (material.isLight) {
             float luminance = material.transparency;
-            return rayColour * material.colour * luminance;
+            return radiance + rayColour * material.colour * luminance * EmissionWeight(lobePdf, ray, hitRecord);
         }
         vec3 nextDirection;
-        float transparencyRng = texture(u_RgbNoise, seed+vec2(0.01534, 0.183)).x;
-        if(transparencyRng < material.transparency) {
+        bool diffuse = false; // refracted rays count as reflection rays
+        float transparencyRng = TransparencyRng(seed);
+        bool opaque = transparencyRng >= material.transparency;
+        if(!opaque) {
             nextDirection = TransparentScatter(hitRecord, material, ray);
             if(transparencyRng < 0.5)
                 i--;
         } else {
-            vec3 diffuseDir = normalize(hitRecord.normal + (2*texture(u_RgbNoise, seed-vec2(0.062, 0.0345)).xyz-1)*material.roughness);
-            vec3 specularDir = reflect(ray.direction, hitRecord.normal);
-            bool isSpecular = texture(u_RgbNoise, seed).y < (1-material.roughness);
-            specularDir = mix(specularDir, diffuseDir, material.roughness);
-            nextDirection = isSpecular ? specularDir : diffuseDir;
-            rayColour *= isSpecular ? mix(material.specularColour, material.colour, material.metallic) : material.colour;
+            nextDirection = ScatterOpaque(hitRecord, material, ray, seed, state, rayColour, diffuse);
         }
-        ray = MakeRay(hitRecord.hitPoint + 1e-4 * nextDirection, nextDirection, 1);
-        
-        vec3 diff = abs(rayColour - lastColour);
-        float distance = diff.x + diff.y + diff.z;
-        int inc = int(clamp(u_BounceLimit/4, 0, u_BounceLimit));
-        if(distance < 1) {
-            i += inc;
+        lobePdf = 0.0;
+        if(opaque && material.roughness > 0.0) { // a mirror reflects into one direction no light sample can pick
+            Ray shadowRay;
+            float tMax;
+            vec3 direct;
+            // the ray of the last bounce is never traced, so its light is not sampled either and paths keep their length
+            if(i < int(u_BounceLimit) && SampleDirectLight(hitRecord, material, ray.direction, diffuse, state, shadowRay, tMax, direct) && !Occluded(shadowRay, tMax)) {
+                radiance += rayColour * direct;
+            }
+            lobePdf = LobePdf(hitRecord, material, ray.direction, diffuse, nextDirection);
         }
-        if(distance < 0.4) {
-            i += inc;
-        } 
-        if(distance < 0.2) {
-            i += inc;
+        ray = NextRay(hitRecord, material, nextDirection, diffuse, i, root, rayType);
+        if(!SurvivesRoulette(i, state, rayColour)) {
+            return radiance;
         }
     }
-    return vec3(0);
+    return radiance;
 }
 
-void main()
+// mean of sampleCount camera rays through fragCoord
+vec3 TracePixel(int sampleCount)
 {
     vec3 rgb = vec3(0.0);
-    vec2 uv = gl_FragCoord.xy / screenResolution;
-    vec3 previous = texture(u_Accumulation, uv).rgb;
-    int iterationsDid = 0;
-    vec3 albedo = vec3(0.0);
     vec3 normals = vec3(0.0);
-    for(int i=0; i<RAY_COUNT; ++i)
+    for(int i=0; i<sampleCount; ++i)
     { 
         vec2 randOffset = texture(u_RgbNoise, u_RandSeed.yz + vec2(0.007*i)).xy;
         Ray initialRay = MakeRay(u_Camera.position, directionToViewport(randOffset), 1.0);
         
-        vec3 albedoTmp;
-        vec3 newRgb = RayColour(initialRay, previous, albedoTmp, normals, i);
-        
-        vec3 diff = abs(rgb - newRgb);
-        float distance = diff.x + diff.y + diff.z;
-        if(i > 0) {
-            if(distance < 0.5) {
-                i += 1;
-            }
-            if(distance < 0.2) {
-                i += 1;
-            }
-            if(distance < 0.1) {
-                i += 1;
-            }
+        vec3 albedo;
+        rgb += RayColour(initialRay, albedo, normals, i);
+    }
+    return rgb / float(sampleCount);
+}
+
+#if defined(WAVEFRONT)
+// paths are numbered tile by tile so that every work group of the generate and accumulate kernels covers one tile
+bool PathPixel(uint path, out ivec2 pixel) {
+    uint tilesAcross = (u_TraceRect.z + 7u) / 8u;
+    uint tile = path / 64u;
+    uvec2 offset = uvec2(tile % tilesAcross, tile / tilesAcross) * 8u + uvec2(path % 8u, path % 64u / 8u);
+    pixel = ivec2(u_TraceRect.xy + offset);
+    return all(lessThan(offset, u_TraceRect.zw)) && all(lessThan(pixel, ivec2(screenResolution)));
+}
+
+void PushPath(uint queue, uint path) {
+    uint slot = atomicAdd(queueHeaders[queue].w, 1u);
+    if(slot % 64u == 0u) { // the first path of every group of 64 adds the group to the indirect dispatch
+        atomicAdd(queueHeaders[queue].x, 1u);
+    }
+    queueItems[queue * u_PathCount + slot] = path;
+}
+
+bool PopPath(uint queue, out uint path) {
+    uint slot = gl_GlobalInvocationID.x;
+    if(slot >= queueHeaders[queue].w) {
+        return false;
+    }
+    path = queueItems[queue * u_PathCount + slot];
+    return true;
+}
+
+// the end of a bounce: the path goes on to the extend kernel of the next pass unless it ran out of bounces
+void ContinuePath(uint index, Path path) {
+    path.depth++;
+    if(path.depth <= int(u_BounceLimit)) {
+        PushPath(u_ExtendQueue == QUEUE_EXTEND ? QUEUE_EXTEND + 1u : QUEUE_EXTEND, index);
+    }
+    paths[index] = path;
+}
+
+#if defined(KERNEL_GENERATE)
+// the camera ray of every pixel, the first sample of TracePixel
+void main()
+{
+    ivec2 pixel;
+    if(!PathPixel(gl_GlobalInvocationID.x, pixel)) {
+        return;
+    }
+    fragCoord = vec2(pixel) + 0.5;
+    vec2 randOffset = texture(u_RgbNoise, u_RandSeed.yz).xy;
+    Path path;
+    path.origin = u_Camera.position;
+    path.direction = directionToViewport(randOffset);
+    path.root = 0;
+    path.depth = 0;
+    path.throughput = vec3(1.0);
+    path.rayType = RAY_CAMERA;
+    path.radiance = vec3(0.0);
+    path.lobePdf = 0.0;
+    paths[gl_GlobalInvocationID.x] = path;
+    PushPath(QUEUE_EXTEND, gl_GlobalInvocationID.x);
+}
+#elif defined(KERNEL_EXTEND)
+// traces the ray of every path in the queue, ends the paths that leave the scene or find a light and sorts the others
+// by how they scatter
+void main()
+{
+    uint index;
+    if(!PopPath(u_ExtendQueue, index)) {
+        return;
+    }
+    Path path = paths[index];
+    Ray ray = MakeRay(path.origin, path.direction, 1);
+    HitRecord hitRecord;
+    bool hitAnything = HitHittableList(ray, path.root, path.rayType, hitRecord);
+    if (u_BounceLimit == 0) {
+        paths[index].radiance = vec3(hitRecord.material.colour);
+        return;
+    }
+    if (u_BounceLimit == 1) {
+        paths[index].radiance = vec3(abs(hitRecord.normal));
+        return;
+    }
+    vec2 seed = BounceSeed(ray, path.depth, 0);
+    if (VolumetricScatter(hitRecord, ray, path.throughput, seed-vec2(0.31), 1.0/FOG_DENSITY)) {
+        path.origin = ray.origin;
+        path.direction = ray.direction;
+        ContinuePath(index, path);
+        return;
+    }
+    if(!hitAnything) {
+        paths[index].radiance = path.radiance + path.throughput*SkyboxColour(ray.direction);
+        return;
+    }
+    Material material = hitRecord.material;
+    if (material.isLight) {
+        float luminance = material.transparency;
+        paths[index].radiance = path.radiance + path.throughput * material.colour * luminance * EmissionWeight(path.lobePdf, ray, hitRecord);
+        return;
+    }
+    path.hitPoint = hitRecord.hitPoint;
+    path.normal = hitRecord.normal;
+    path.frontFace = hitRecord.frontFace;
+    path.material = texelFetch(u_MaterialsIndex, hitRecord.index).x;
+    paths[index] = path;
+    PushPath(TransparencyRng(seed) < material.transparency ? QUEUE_SHADE_TRANSPARENT : QUEUE_SHADE_OPAQUE, index);
+}
+#elif defined(KERNEL_SHADE_OPAQUE) || defined(KERNEL_SHADE_TRANSPARENT)
+// scatters every path of one shade queue, so the invocations of a group all take the same branch of RayColour
+void main()
+{
+    uint index;
+#if defined(KERNEL_SHADE_TRANSPARENT)
+    bool popped = PopPath(QUEUE_SHADE_TRANSPARENT, index);
+#else
+    bool popped = PopPath(QUEUE_SHADE_OPAQUE, index);
+#endif
+    if(!popped) {
+        return;
+    }
+    Path path = paths[index];
+    Ray ray = MakeRay(path.origin, path.direction, 1);
+    HitRecord hitRecord;
+    hitRecord.hitPoint = path.hitPoint;
+    hitRecord.normal = path.normal;
+    hitRecord.frontFace = path.frontFace;
+    hitRecord.hitAnything = true;
+    hitRecord.material = materialsBuffer[path.material];
+    Material material = hitRecord.material;
+    vec2 seed = BounceSeed(ray, path.depth, 0);
+    uint state = BounceHash(ray, path.depth, 0);
+    int i = path.depth;
+    bool diffuse = false; // refracted rays count as reflection rays
+#if defined(KERNEL_SHADE_TRANSPARENT)
+    vec3 nextDirection = TransparentScatter(hitRecord, material, ray);
+    if(TransparencyRng(seed) < 0.5)
+        i--;
+#else
+    vec3 nextDirection = ScatterOpaque(hitRecord, material, ray, seed, state, path.throughput, diffuse);
+#endif
+    path.lobePdf = 0.0;
+#if defined(KERNEL_SHADE_OPAQUE)
+    if(material.roughness > 0.0) {
+        Ray shadowRay;
+        vec3 direct;
+        if(i < int(u_BounceLimit) && SampleDirectLight(hitRecord, material, ray.direction, diffuse, state, shadowRay, path.shadowDistance, direct)) {
+            path.shadowOrigin = shadowRay.origin;
+            path.shadowDirection = shadowRay.direction;
+            path.shadowRadiance = path.throughput * direct;
+            PushPath(QUEUE_SHADOW, index);
         }
-        rgb += newRgb;
-        albedo += albedoTmp;
-        iterationsDid++;
+        path.lobePdf = LobePdf(hitRecord, material, ray.direction, diffuse, nextDirection);
+    }
+#endif
+    ray = NextRay(hitRecord, material, nextDirection, diffuse, i, path.root, path.rayType);
+    if(!SurvivesRoulette(i, state, path.throughput)) {
+        paths[index] = path; // the shadow kernel may still add the light sample
+        return;
+    }
+    path.origin = ray.origin;
+    path.direction = ray.direction;
+    path.depth = i;
+    ContinuePath(index, path);
+}
+#elif defined(KERNEL_SHADOW)
+// traces the shadow rays of the light samples and adds the light of the ones that reach it
+void main()
+{
+    uint index;
+    if(!PopPath(QUEUE_SHADOW, index)) {
+        return;
     }
-    float iInv = 1.0 / iterationsDid;
-    rgb *= iInv;
-    albedo *= iInv;
+    Path path = paths[index];
+    if(!Occluded(MakeRay(path.shadowOrigin, path.shadowDirection, 1), path.shadowDistance)) {
+        paths[index].radiance = path.radiance + path.shadowRadiance;
+    }
+}
+#elif defined(KERNEL_ACCUMULATE)
+// blends the radiance every path brought back into its pixel like the compute main does with one sample
+void main()
+{
+    ivec2 pixel;
+    if(!PathPixel(gl_GlobalInvocationID.x, pixel)) {
+        return;
+    }
+    vec4 previous = imageLoad(u_AccumulationImage, pixel);
+    float previousCount = u_FrameIndex == 0 ? 0.0 : previous.a; // the first frame after a change starts over
+    vec3 rgb = paths[gl_GlobalInvocationID.x].radiance;
+    float count = previousCount + 1.0;
+    imageStore(u_AccumulationImage, pixel, vec4(previousCount == 0.0 ? rgb : mix(previous.rgb, rgb, 1.0 / count), count));
+}
+#endif
+#elif defined(COMPUTE_TRACER)
+void main()
+{
+    uvec2 offset = gl_GlobalInvocationID.xy;
+    ivec2 pixel = ivec2(u_TraceRect.xy + offset);
+    if(any(greaterThanEqual(offset, u_TraceRect.zw)) || any(greaterThanEqual(pixel, ivec2(screenResolution)))) {
+        return;
+    }
+    uint samples = u_TileSamples > 0 ? u_TileSamples : tileSamples[gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x];
+    if(samples == 0) {
+        return;
+    }
+    fragCoord = vec2(pixel) + 0.5;
+    vec4 previous = imageLoad(u_AccumulationImage, pixel);
+    float previousCount = u_FrameIndex == 0 ? 0.0 : previous.a; // the first frame after a change starts over
+    // TracePixel traces exactly samples camera rays, so the count of the pixel goes up by as many
+    vec3 rgb = TracePixel(int(samples));
+    float count = previousCount + float(samples);
+    imageStore(u_AccumulationImage, pixel, vec4(previousCount == 0.0 ? rgb : mix(previous.rgb, rgb, float(samples) / count), count));
+}
+#else
+void main()
+{
+    fragCoord = gl_FragCoord.xy;
+    vec2 uv = gl_FragCoord.xy / screenResolution;
+    vec3 previous = texture(u_Accumulation, uv).rgb;
+    vec3 rgb = TracePixel(RAY_COUNT);
     color = mix(previous, rgb, 1.0 / float(u_FrameIndex + 1));
 }
+#endif